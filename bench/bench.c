@@ -0,0 +1,994 @@
+/* Headless benchmarks of listing, decoding, uploading, moving and swiping, on corpora it generates.
+ * Each result is one JSON object per line, appended to the output file so runs can be compared over time */
+
+/* nftw() */
+#define _GNU_SOURCE
+
+#include "analyze.h"
+#include "decode.h"
+#include "files.h"
+#include "loader.h"
+#include "meta.h"
+#include "mover.h"
+#include "sniff.h"
+#include "textures.h"
+#include "tiles.h"
+#include "types.h"
+#include "wake.h"
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Listing entries are hard links to a few seed files, each kept under the filesystem link limit */
+#define LINKS_PER_SEED 50000
+
+#define MAX_ENTRY_SIZES 8
+#define MAX_FORMATS     3
+
+/* Window the swipes are decoded and drawn for */
+#define VIEW_WIDTH  1280
+#define VIEW_HEIGHT 720
+
+/* Move threads of the batch mode, and moves queued ahead per thread */
+#define BATCH_THREADS 8
+#define MOVE_IN_FLIGHT(threads) ((threads) * 4)
+
+#define BENCH_LIST    0x01
+#define BENCH_DECODE  0x02
+#define BENCH_MOVE    0x04
+#define BENCH_SWIPE   0x08
+#define BENCH_INDEX   0x10
+#define BENCH_ANALYZE 0x20
+#define BENCH_ALL     0x3f
+
+typedef struct {
+    const char *name;
+    const char *extension;
+} FormatInfo;
+
+static const FormatInfo format_infos[MAX_FORMATS] = {{"jpeg", "jpg"}, {"png", "png"}, {"bmp", "bmp"}};
+
+typedef struct {
+    char dir[MAX_PATH]; /* Corpora are generated here */
+    int temporary;      /* dir was created for this run and is removed at exit */
+    int entries[MAX_ENTRY_SIZES];
+    int entry_count;
+    int formats[MAX_FORMATS]; /* Index into format_infos */
+    int format_count;
+    int images; /* Per format */
+    int width;
+    int height;
+    int moves;
+    int repeat;
+    int think_ms;
+    unsigned only; /* BENCH_* */
+    char output[MAX_PATH];
+    char label[128];
+} Bench;
+
+static FILE *results;
+static long run_time;
+
+static double seconds_since(Uint64 start)
+{
+    return (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Percentile of count values, sorts them */
+static double percentile(double *values, int count, int percent)
+{
+    if (count == 0)
+        return 0.0;
+    qsort(values, count, sizeof(double), compare_doubles);
+    return values[(count - 1) * percent / 100];
+}
+
+/* Start a result line, the caller adds its fields and ends it with result_end() */
+static void result_begin(const Bench *bench, const char *name)
+{
+    fprintf(results, "{\"bench\":\"%s\",\"label\":\"", name);
+    for (const char *c = bench->label; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', results);
+        if ((unsigned char)*c >= ' ')
+            fputc(*c, results);
+    }
+    fprintf(results, "\",\"time\":%ld", run_time);
+}
+
+static void result_end(void)
+{
+    fprintf(results, "}\n");
+    fflush(results);
+}
+
+/* Format a corpus path into out (MAX_PATH), returns -1 if it does not fit */
+__attribute__((format(printf, 2, 3))) static int corpus_path(char *out, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(out, MAX_PATH, format, args);
+    va_end(args);
+    if (length < 0 || length >= MAX_PATH) {
+        fprintf(stderr, "Error: Path too long in '%s'\n", out);
+        return -1;
+    }
+    return 0;
+}
+
+static int make_dir(const char *path)
+{
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    if (remove(path) != 0)
+        fprintf(stderr, "Warning: Cannot remove '%s': %s\n", path, strerror(errno));
+    return 0;
+}
+
+static void remove_tree(const char *path)
+{
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Gradients under a checkerboard and noise, deterministic for a seed: compresses more like a photo than a flat
+ * color does */
+static SDL_Surface *synthetic_surface(int width, int height, Uint32 seed)
+{
+    SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 24, SDL_PIXELFORMAT_RGB24);
+    if (!surface)
+        return NULL;
+    Uint32 state = seed * 2654435761u + 1;
+    for (int y = 0; y < height; y++) {
+        Uint8 *row = (Uint8 *)surface->pixels + (size_t)y * surface->pitch;
+        for (int x = 0; x < width; x++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            int check = ((x / 97 + y / 97 + (int)seed) & 1) * 64;
+            row[x * 3 + 0] = (Uint8)(x * 191 / width + check);
+            row[x * 3 + 1] = (Uint8)(y * 191 / height + (state & 31));
+            row[x * 3 + 2] = (Uint8)(((x + y) * 127 / (width + height)) + check + (state >> 27));
+        }
+    }
+    return surface;
+}
+
+static int save_image(SDL_Surface *surface, int format, const char *path)
+{
+    int result;
+    if (format == 0)
+        result = IMG_SaveJPG(surface, path, 90);
+    else if (format == 1)
+        result = IMG_SavePNG(surface, path);
+    else
+        result = SDL_SaveBMP(surface, path);
+    if (result != 0)
+        fprintf(stderr, "Error: Cannot write '%s': %s\n", path, SDL_GetError());
+    return result;
+}
+
+/* Images of each format in dir/<extension>, kept when they exist from an earlier run */
+static int make_image_corpus(const Bench *bench, const char *dir)
+{
+    if (make_dir(dir) != 0)
+        return -1;
+    for (int f = 0; f < bench->format_count; f++) {
+        const FormatInfo *info = &format_infos[bench->formats[f]];
+        char sub[MAX_PATH];
+        if (corpus_path(sub, "%s/%s", dir, info->extension) != 0 || make_dir(sub) != 0)
+            return -1;
+        for (int i = 0; i < bench->images; i++) {
+            char path[MAX_PATH];
+            struct stat st;
+            if (corpus_path(path, "%s/img_%04d.%s", sub, i, info->extension) != 0)
+                return -1;
+            if (stat(path, &st) == 0 && st.st_size > 0)
+                continue;
+            SDL_Surface *surface = synthetic_surface(bench->width, bench->height, (Uint32)i);
+            if (!surface)
+                return -1;
+            int result = save_image(surface, bench->formats[f], path);
+            SDL_FreeSurface(surface);
+            if (result != 0)
+                return -1;
+        }
+        fprintf(stderr, "Corpus: %d %s images of %dx%d in %s\n", bench->images, info->name, bench->width,
+            bench->height, sub);
+    }
+    return 0;
+}
+
+/* count entries named img_<n>.jpg in dir, hard links to small JPEG seeds in <dir>_seeds */
+static int make_link_corpus(const char *dir, int count)
+{
+    char seed_dir[MAX_PATH];
+    if (corpus_path(seed_dir, "%s_seeds", dir) != 0 || make_dir(dir) != 0 || make_dir(seed_dir) != 0)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        char seed[MAX_PATH], path[MAX_PATH];
+        if (corpus_path(seed, "%s/seed_%04d.jpg", seed_dir, i / LINKS_PER_SEED) != 0)
+            return -1;
+        if (i % LINKS_PER_SEED == 0 && access(seed, F_OK) != 0) {
+            SDL_Surface *surface = synthetic_surface(32, 24, (Uint32)i);
+            int result = surface ? save_image(surface, 0, seed) : -1;
+            SDL_FreeSurface(surface);
+            if (result != 0)
+                return -1;
+        }
+        if (corpus_path(path, "%s/img_%07d.jpg", dir, i) != 0)
+            return -1;
+        if (link(seed, path) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Cannot link '%s': %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* load_image_list() on directories of each size, warm cache, median of the repeats */
+static int bench_list(const Bench *bench)
+{
+    for (int e = 0; e < bench->entry_count; e++) {
+        int count = bench->entries[e];
+        char dir[MAX_PATH];
+        if (corpus_path(dir, "%s/list_%d", bench->dir, count) != 0)
+            return -1;
+        fprintf(stderr, "List: creating %d entries in %s\n", count, dir);
+        if (make_link_corpus(dir, count) != 0)
+            return -1;
+
+        double *seconds = malloc(sizeof(double) * (bench->repeat + 1));
+        if (!seconds)
+            return -1;
+        int found = 0;
+        for (int r = 0; r <= bench->repeat; r++) {
+            ImageList list;
+            Uint64 start = SDL_GetPerformanceCounter();
+            if (load_image_list(dir, 0, NULL, 0, &list) != 0) {
+                free(seconds);
+                return -1;
+            }
+            seconds[r] = seconds_since(start);
+            found = list.count;
+            free_image_list(&list);
+        }
+
+        /* The first run only warms the cache */
+        double best = seconds[1];
+        for (int r = 2; r <= bench->repeat; r++) {
+            best = SDL_min(best, seconds[r]);
+        }
+        double median = percentile(seconds + 1, bench->repeat, 50);
+        free(seconds);
+        fprintf(stderr, "List: %d entries in %.3f s (%.0f entries/s)\n", found, median, found / median);
+        result_begin(bench, "list");
+        fprintf(results, ",\"entries\":%d,\"found\":%d,\"repeat\":%d", count, found, bench->repeat);
+        fprintf(results, ",\"median_s\":%.6f,\"min_s\":%.6f", median, best);
+        fprintf(results, ",\"entries_per_s\":%.0f", median > 0 ? found / median : 0.0);
+        result_end();
+    }
+    return 0;
+}
+
+/* meta_index_build() of the --sort/--filter index on the list directories, stat only and with the headers, warm
+ * cache, median of the repeats */
+static int bench_index(const Bench *bench)
+{
+    static const struct {
+        const char *name;
+        unsigned fields;
+    } passes[] = {{"stat", META_FIELD_STAT}, {"header", META_FIELD_STAT | META_FIELD_IMAGE}};
+
+    for (int e = 0; e < bench->entry_count; e++) {
+        int count = bench->entries[e];
+        char dir[MAX_PATH];
+        if (corpus_path(dir, "%s/list_%d", bench->dir, count) != 0)
+            return -1;
+        fprintf(stderr, "Index: creating %d entries in %s\n", count, dir);
+        ImageList list;
+        if (make_link_corpus(dir, count) != 0 || load_image_list(dir, 0, NULL, 0, &list) != 0)
+            return -1;
+
+        double *seconds = malloc(sizeof(double) * (bench->repeat + 1));
+        if (!seconds) {
+            free_image_list(&list);
+            return -1;
+        }
+        for (int p = 0; p < 2; p++) {
+            for (int r = 0; r <= bench->repeat; r++) {
+                MetaIndex index;
+                Uint64 start = SDL_GetPerformanceCounter();
+                if (meta_index_build(&index, &list, 0, passes[p].fields) != 0) {
+                    free(seconds);
+                    free_image_list(&list);
+                    return -1;
+                }
+                seconds[r] = seconds_since(start);
+                meta_index_free(&index);
+            }
+
+            /* The first run only warms the cache */
+            double median = percentile(seconds + 1, bench->repeat, 50);
+            fprintf(stderr, "Index: %d images, %s, in %.3f s (%.0f images/s)\n", list.count, passes[p].name,
+                median, list.count / median);
+            result_begin(bench, "index");
+            fprintf(results, ",\"entries\":%d,\"images\":%d", count, list.count);
+            fprintf(results, ",\"fields\":\"%s\",\"repeat\":%d", passes[p].name, bench->repeat);
+            fprintf(results, ",\"median_s\":%.6f,\"images_per_s\":%.0f", median,
+                median > 0 ? list.count / median : 0.0);
+            result_end();
+        }
+        free(seconds);
+        free_image_list(&list);
+    }
+    return 0;
+}
+
+/* The queued moves of one mover, as the batch mode queues them */
+static int run_moves(const char *src, const Config *config, int count, int threads, int *failed)
+{
+    Mover *mover = mover_create(src, config, threads);
+    if (!mover)
+        return -1;
+    int in_flight = 0;
+    MoveResult result;
+    *failed = 0;
+    for (int i = 0; i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "img_%07d.jpg", i);
+        while (in_flight >= MOVE_IN_FLIGHT(threads) && mover_wait(mover, &result)) {
+            in_flight--;
+            *failed += result.result != 0;
+        }
+        if (mover_queue(mover, name, (Destination)(i % config->dest_count), 0, i) < 0)
+            (*failed)++;
+        else
+            in_flight++;
+    }
+    while (mover_wait(mover, &result)) {
+        *failed += result.result != 0;
+    }
+    mover_destroy(mover);
+    return 0;
+}
+
+/* Journaled moves into two destinations, with the interactive mode's one thread and the batch mode's threads */
+static int bench_move(const Bench *bench)
+{
+    Config config;
+    memset(&config, 0, sizeof(config));
+    config.dest_count = 2;
+    char src[MAX_PATH];
+    if (corpus_path(config.dest_dirs[0], "%s/move_left", bench->dir) != 0 ||
+        corpus_path(config.dest_dirs[1], "%s/move_right", bench->dir) != 0 ||
+        corpus_path(src, "%s/move_source", bench->dir) != 0)
+        return -1;
+
+    static const int thread_counts[] = {1, BATCH_THREADS};
+    for (int t = 0; t < (int)(sizeof(thread_counts) / sizeof(thread_counts[0])); t++) {
+        int threads = thread_counts[t];
+        double *seconds = malloc(sizeof(double) * bench->repeat);
+        if (!seconds)
+            return -1;
+        int failed = 0;
+        for (int r = 0; r < bench->repeat; r++) {
+            remove_tree(src);
+            remove_tree(config.dest_dirs[0]);
+            remove_tree(config.dest_dirs[1]);
+            if (make_link_corpus(src, bench->moves) != 0 || make_dir(config.dest_dirs[0]) != 0 ||
+                make_dir(config.dest_dirs[1]) != 0) {
+                free(seconds);
+                return -1;
+            }
+            Uint64 start = SDL_GetPerformanceCounter();
+            int run_failed;
+            if (run_moves(src, &config, bench->moves, threads, &run_failed) != 0) {
+                free(seconds);
+                return -1;
+            }
+            seconds[r] = seconds_since(start);
+            failed += run_failed;
+        }
+        double median = percentile(seconds, bench->repeat, 50);
+        free(seconds);
+        fprintf(stderr, "Move: %d files on %d threads in %.3f s (%.0f files/s)\n", bench->moves, threads, median,
+            bench->moves / median);
+        result_begin(bench, "move");
+        fprintf(results, ",\"files\":%d,\"threads\":%d,\"repeat\":%d,\"median_s\":%.6f,\"files_per_s\":%.0f",
+            bench->moves, threads, bench->repeat, median, median > 0 ? bench->moves / median : 0.0);
+        fprintf(results, ",\"failed\":%d", failed);
+        result_end();
+    }
+    remove_tree(src);
+    remove_tree(config.dest_dirs[0]);
+    remove_tree(config.dest_dirs[1]);
+    return 0;
+}
+
+static double milliseconds_since(Uint64 start)
+{
+    return seconds_since(start) * 1000.0;
+}
+
+/* Decode at full resolution and for the window as the viewer does, then upload the window sized one */
+static int bench_decode(const Bench *bench, TexturePool *pool)
+{
+    double *full_ms = malloc(sizeof(double) * bench->images);
+    double *fit_ms = malloc(sizeof(double) * bench->images);
+    double *upload_ms = malloc(sizeof(double) * bench->images);
+    if (!full_ms || !fit_ms || !upload_ms) {
+        free(full_ms);
+        free(fit_ms);
+        free(upload_ms);
+        return -1;
+    }
+
+    /* Decoded straight into the format the textures take, as the loader does */
+    Uint32 pixel_format = texture_pool_format(pool);
+    for (int f = 0; f < bench->format_count; f++) {
+        const FormatInfo *format_info = &format_infos[bench->formats[f]];
+        double total_bytes = 0.0, full_total = 0.0, fit_total = 0.0, upload_total = 0.0;
+        int decoded = 0;
+        for (int i = 0; i < bench->images; i++) {
+            char path[MAX_PATH];
+            MappedFile file;
+            if (corpus_path(path, "%s/images_%dx%d/%s/img_%04d.%s", bench->dir, bench->width, bench->height,
+                    format_info->extension, i, format_info->extension) != 0)
+                continue;
+            if (map_file(path, &file) != 0) {
+                fprintf(stderr, "Error: Cannot map '%s'\n", path);
+                continue;
+            }
+            ImageFormat format = sniff_format(file.data, file.size);
+
+            DecodedImage image;
+            Uint64 start = SDL_GetPerformanceCounter();
+            if (decode_image(path, &file, format, 0, 0, pixel_format, &image) != 0) {
+                fprintf(stderr, "Decode error: %s: %s\n", path, SDL_GetError());
+                unmap_file(&file);
+                continue;
+            }
+            full_ms[decoded] = milliseconds_since(start);
+            SDL_FreeSurface(image.surface);
+
+            start = SDL_GetPerformanceCounter();
+            if (decode_image(path, &file, format, VIEW_WIDTH, VIEW_HEIGHT, pixel_format, &image) != 0) {
+                unmap_file(&file);
+                continue;
+            }
+            fit_ms[decoded] = milliseconds_since(start);
+
+            SDL_Texture *texture;
+            TilePyramid *tiles;
+            start = SDL_GetPerformanceCounter();
+            int uploaded = upload_image(pool, image.surface, &texture, &tiles);
+            upload_ms[decoded] = milliseconds_since(start);
+            if (uploaded == 0) {
+                texture_release(pool, texture);
+                tiles_destroy(tiles);
+            }
+            SDL_FreeSurface(image.surface);
+
+            total_bytes += (double)file.size;
+            full_total += full_ms[decoded];
+            fit_total += fit_ms[decoded];
+            upload_total += upload_ms[decoded];
+            decoded++;
+            unmap_file(&file);
+        }
+        if (decoded == 0)
+            continue;
+
+        double megabytes = total_bytes / (1024.0 * 1024.0);
+        double megapixels = (double)bench->width * bench->height * decoded / 1e6;
+        double per_second = decoded / ((fit_total + upload_total) / 1000.0);
+        fprintf(stderr, "Decode %s: %.1f ms full, %.1f ms for the window + %.1f ms upload (%.1f images/s)\n",
+            format_info->name, percentile(full_ms, decoded, 50), percentile(fit_ms, decoded, 50),
+            percentile(upload_ms, decoded, 50), per_second);
+        result_begin(bench, "decode");
+        fprintf(results, ",\"format\":\"%s\",\"width\":%d,\"height\":%d,\"images\":%d,\"mb\":%.2f",
+            format_info->name, bench->width, bench->height, decoded, megabytes);
+        double full_seconds = full_total / 1000.0;
+        fprintf(results, ",\"full_p50_ms\":%.3f,\"full_mb_s\":%.1f,\"full_mpx_s\":%.1f",
+            percentile(full_ms, decoded, 50), megabytes / full_seconds, megapixels / full_seconds);
+        fprintf(results, ",\"fit_p50_ms\":%.3f,\"upload_p50_ms\":%.3f", percentile(fit_ms, decoded, 50),
+            percentile(upload_ms, decoded, 50));
+        fprintf(results, ",\"upload_p99_ms\":%.3f,\"images_per_s\":%.1f", percentile(upload_ms, decoded, 99),
+            per_second);
+        result_end();
+    }
+
+    free(full_ms);
+    free(fit_ms);
+    free(upload_ms);
+    return 0;
+}
+
+/* analyze_surface() on one thread, then on the analyzer threads, on a generated image of --size in the texture
+ * format. The first run only warms up, median of the others */
+static int bench_analyze(const Bench *bench, TexturePool *pool)
+{
+    SDL_Surface *generated = synthetic_surface(bench->width, bench->height, 1);
+    SDL_Surface *surface = generated ? SDL_ConvertSurfaceFormat(generated, texture_pool_format(pool), 0) : NULL;
+    SDL_FreeSurface(generated);
+    Analyzer *analyzer = analyzer_create();
+    double *single_ms = malloc(sizeof(double) * (bench->repeat + 1));
+    double *threads_ms = malloc(sizeof(double) * (bench->repeat + 1));
+    int result = surface && analyzer && single_ms && threads_ms ? 0 : -1;
+
+    for (int r = 0; result == 0 && r <= bench->repeat; r++) {
+        Analysis analysis;
+        Uint64 start = SDL_GetPerformanceCounter();
+        result = analyze_surface(surface, 1, &analysis);
+        single_ms[r] = milliseconds_since(start);
+        if (result != 0)
+            break;
+        analysis_free(&analysis);
+
+        /* Another index every run, the analyzer keeps what it did */
+        SDL_Event event;
+        start = SDL_GetPerformanceCounter();
+        analyzer_request(analyzer, r, surface);
+        while (!analyzer_get(analyzer, r)) {
+            if (SDL_WaitEventTimeout(&event, 100) && event.type == wake_event_type())
+                wake_ack(&event);
+        }
+        threads_ms[r] = milliseconds_since(start);
+    }
+
+    if (result == 0) {
+        double single = percentile(single_ms + 1, bench->repeat, 50);
+        double threads = percentile(threads_ms + 1, bench->repeat, 50);
+        double megapixels = (double)bench->width * bench->height / 1e6;
+        fprintf(stderr, "Analyze: %.1f MP in %.1f ms on one thread (%s), %.1f ms on the analyzer threads\n",
+            megapixels, single, analyze_kernels(), threads);
+        result_begin(bench, "analyze");
+        fprintf(results, ",\"width\":%d,\"height\":%d,\"kernels\":\"%s\",\"repeat\":%d", bench->width,
+            bench->height, analyze_kernels(), bench->repeat);
+        fprintf(results, ",\"single_p50_ms\":%.3f,\"threads_p50_ms\":%.3f,\"threads_mpx_s\":%.1f", single,
+            threads, threads > 0 ? megapixels / (threads / 1000.0) : 0.0);
+        result_end();
+    } else {
+        fprintf(stderr, "Error: Cannot analyze a %dx%d image\n", bench->width, bench->height);
+    }
+    free(threads_ms);
+    free(single_ms);
+    analyzer_destroy(analyzer);
+    SDL_FreeSurface(surface);
+    return result;
+}
+
+/* Wait for the decoders and draw the current image like the viewer, LOAD_FAILED when it cannot be shown */
+static LoadStatus show_current(Loader *loader, const ImageList *list, SDL_Renderer *renderer, TexturePool *pool)
+{
+    loader_update(loader, list, 0, 0);
+    DecodedImage decoded;
+    LoadStatus status;
+    SDL_Event event;
+    while ((status = loader_get(loader, list->current, 0, &decoded)) == LOAD_PENDING) {
+        if (SDL_WaitEventTimeout(&event, 100) && event.type == wake_event_type())
+            wake_ack(&event);
+    }
+    if (status == LOAD_FAILED)
+        return status;
+
+    SDL_Texture *texture;
+    TilePyramid *tiles;
+    if (upload_image(pool, decoded.surface, &texture, &tiles) != 0)
+        return LOAD_FAILED;
+    SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
+    SDL_RenderClear(renderer);
+    float scale = SDL_min((float)VIEW_WIDTH / decoded.full_width, (float)VIEW_HEIGHT / decoded.full_height);
+    SDL_Rect dest = {0, 0, (int)(decoded.full_width * scale), (int)(decoded.full_height * scale)};
+    if (tiles) {
+        SDL_Rect viewport = {0, 0, VIEW_WIDTH, VIEW_HEIGHT};
+        tiles_render(tiles, renderer, &dest, &viewport);
+    } else {
+        SDL_RenderCopy(renderer, texture, NULL, &dest);
+    }
+    SDL_RenderPresent(renderer);
+    texture_release(pool, texture);
+    tiles_destroy(tiles);
+    return status;
+}
+
+/* Scripted skip keys through the event queue over the images of every format, from the key event to the next
+ * image presented. Once as fast as the images come, once with think_ms between keys so the prefetch can run
+ * ahead */
+static int bench_swipe(const Bench *bench, SDL_Renderer *renderer, TexturePool *pool)
+{
+    char dir[MAX_PATH];
+    ImageList list;
+    if (corpus_path(dir, "%s/images_%dx%d", bench->dir, bench->width, bench->height) != 0)
+        return -1;
+    if (load_image_list(dir, 1, NULL, 0, &list) != 0)
+        return -1;
+    if (list.count < 2) {
+        free_image_list(&list);
+        return 0;
+    }
+
+    double *latency = malloc(sizeof(double) * list.count);
+    if (!latency) {
+        free_image_list(&list);
+        return -1;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        int think_ms = pass ? bench->think_ms : 0;
+        Loader *loader = loader_create(DEFAULT_PREFETCH, 1, texture_pool_format(pool));
+        if (!loader) {
+            free(latency);
+            free_image_list(&list);
+            return -1;
+        }
+        loader_set_target(loader, VIEW_WIDTH, VIEW_HEIGHT);
+        list.current = 0;
+        show_current(loader, &list, renderer, pool);
+
+        int swipes = 0, failed = 0;
+        Uint64 pass_start = SDL_GetPerformanceCounter();
+        for (int i = 1; i < list.count; i++) {
+            if (think_ms > 0)
+                SDL_Delay((Uint32)think_ms);
+            SDL_Event event;
+            memset(&event, 0, sizeof(event));
+            event.type = SDL_KEYDOWN;
+            event.key.keysym.sym = SDLK_DOWN;
+            Uint64 start = SDL_GetPerformanceCounter();
+            SDL_PushEvent(&event);
+            while (SDL_WaitEvent(&event) && event.type != SDL_KEYDOWN) {
+                if (event.type == wake_event_type())
+                    wake_ack(&event);
+            }
+            list.current = i;
+            if (show_current(loader, &list, renderer, pool) == LOAD_FAILED) {
+                failed++;
+                continue;
+            }
+            latency[swipes++] = milliseconds_since(start);
+        }
+        double elapsed = seconds_since(pass_start);
+        loader_destroy(loader);
+
+        double p50 = percentile(latency, swipes, 50);
+        double p99 = percentile(latency, swipes, 99);
+        double max = swipes ? latency[swipes - 1] : 0.0;
+        fprintf(stderr, "Swipe (%d ms between keys): p50 %.1f ms, p99 %.1f ms, max %.1f ms over %d swipes\n",
+            think_ms, p50, p99, max, swipes);
+        result_begin(bench, "swipe");
+        fprintf(results, ",\"think_ms\":%d,\"swipes\":%d,\"failed\":%d,\"prefetch\":%d", think_ms, swipes, failed,
+            DEFAULT_PREFETCH);
+        fprintf(results, ",\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"swipes_per_s\":%.1f", p50, p99, max,
+            elapsed > 0 ? swipes / elapsed : 0.0);
+        result_end();
+    }
+
+    free(latency);
+    free_image_list(&list);
+    return 0;
+}
+
+static void print_help(const char *prog_name)
+{
+    printf("Usage: %s [options]\n\n", prog_name);
+    printf("Benchmarks on generated images. Results are appended to the output as one JSON object per line.\n");
+    printf("Run with SDL_VIDEODRIVER=dummy to benchmark without a display (make bench does).\n\n");
+    printf("Options:\n");
+    printf("  --dir=<path>         Generate the corpora in path and keep them for the next run\n");
+    printf("                       (default: a temporary directory removed at exit)\n");
+    printf("  --entries=<n,...>    Directory sizes listed (default: 10000,100000,1000000)\n");
+    printf("  --formats=<f,...>    Image formats decoded: jpeg, png, bmp (default: all)\n");
+    printf("  --images=<n>         Images per format (default: 16)\n");
+    printf("  --size=<w>x<h>       Image size (default: 4000x3000)\n");
+    printf("  --moves=<n>          Files moved per run (default: 20000)\n");
+    printf("  --repeat=<n>         Runs of the listing and move benchmarks, the median is kept (default: 3)\n");
+    printf("  --think=<ms>         Time between keys of the paced swipe run (default: 150)\n");
+    printf("  --only=<b,...>       Benchmarks to run: list, decode, move, swipe, index,\n");
+    printf("                       analyze (default: all)\n");
+    printf("  --output=<file>      Append the results to file (default: standard output)\n");
+    printf("  --label=<text>       Stored with every result, e.g. the commit\n");
+    printf("  -h, --help           Show this help message and exit\n");
+}
+
+static int parse_number(const char *text, const char *option, int min, int max, int *out)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || value < min || value > max) {
+        fprintf(stderr, "Error: %s must be a number between %d and %d\n", option, min, max);
+        return -1;
+    }
+    *out = (int)value;
+    return 0;
+}
+
+/* Split a comma separated list in place, calling parse on each item */
+static int parse_list(char *text, int (*parse)(Bench *, const char *), Bench *bench)
+{
+    for (char *item = strtok(text, ","); item; item = strtok(NULL, ",")) {
+        if (parse(bench, item) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int parse_entries(Bench *bench, const char *item)
+{
+    if (bench->entry_count == MAX_ENTRY_SIZES) {
+        fprintf(stderr, "Error: At most %d --entries sizes\n", MAX_ENTRY_SIZES);
+        return -1;
+    }
+    return parse_number(item, "--entries", 1, 100000000, &bench->entries[bench->entry_count++]);
+}
+
+static int parse_format(Bench *bench, const char *item)
+{
+    for (int i = 0; i < MAX_FORMATS; i++) {
+        if (strcmp(item, format_infos[i].name) == 0) {
+            for (int f = 0; f < bench->format_count; f++) {
+                if (bench->formats[f] == i)
+                    return 0;
+            }
+            bench->formats[bench->format_count++] = i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: Unknown format '%s', expected jpeg, png or bmp\n", item);
+    return -1;
+}
+
+static int parse_only(Bench *bench, const char *item)
+{
+    static const char *names[] = {"list", "decode", "move", "swipe", "index", "analyze"};
+    for (int i = 0; i < 6; i++) {
+        if (strcmp(item, names[i]) == 0) {
+            bench->only |= 1u << i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: Unknown benchmark '%s', expected list, decode, move, swipe, index or analyze\n", item);
+    return -1;
+}
+
+static int parse_bench_args(int argc, char *argv[], Bench *bench)
+{
+    memset(bench, 0, sizeof(Bench));
+    bench->images = 16;
+    bench->width = 4000;
+    bench->height = 3000;
+    bench->moves = 20000;
+    bench->repeat = 3;
+    bench->think_ms = 150;
+
+    static struct option long_options[] = {{"dir", required_argument, 0, 'd'},
+        {"entries", required_argument, 0, 'e'}, {"formats", required_argument, 0, 'f'},
+        {"images", required_argument, 0, 'i'}, {"size", required_argument, 0, 's'},
+        {"moves", required_argument, 0, 'm'}, {"repeat", required_argument, 0, 'r'},
+        {"think", required_argument, 0, 't'}, {"only", required_argument, 0, 'o'},
+        {"output", required_argument, 0, 'O'}, {"label", required_argument, 0, 'l'}, {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                strncpy(bench->dir, optarg, MAX_PATH - 1);
+                break;
+            case 'e':
+                if (parse_list(optarg, parse_entries, bench) != 0)
+                    return -1;
+                break;
+            case 'f':
+                if (parse_list(optarg, parse_format, bench) != 0)
+                    return -1;
+                break;
+            case 'i':
+                if (parse_number(optarg, "--images", 1, 100000, &bench->images) != 0)
+                    return -1;
+                break;
+            case 's': {
+                char *x = strchr(optarg, 'x');
+                if (!x) {
+                    fprintf(stderr, "Error: --size must be <width>x<height>\n");
+                    return -1;
+                }
+                *x = '\0';
+                if (parse_number(optarg, "--size width", 1, 65535, &bench->width) != 0 ||
+                    parse_number(x + 1, "--size height", 1, 65535, &bench->height) != 0)
+                    return -1;
+                break;
+            }
+            case 'm':
+                if (parse_number(optarg, "--moves", 1, 100000000, &bench->moves) != 0)
+                    return -1;
+                break;
+            case 'r':
+                if (parse_number(optarg, "--repeat", 1, 1000, &bench->repeat) != 0)
+                    return -1;
+                break;
+            case 't':
+                if (parse_number(optarg, "--think", 0, 60000, &bench->think_ms) != 0)
+                    return -1;
+                break;
+            case 'o':
+                if (parse_list(optarg, parse_only, bench) != 0)
+                    return -1;
+                break;
+            case 'O':
+                strncpy(bench->output, optarg, MAX_PATH - 1);
+                break;
+            case 'l':
+                strncpy(bench->label, optarg, sizeof(bench->label) - 1);
+                break;
+            case 'h':
+                print_help(argv[0]);
+                exit(0);
+            default:
+                fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+                return -1;
+        }
+    }
+    if (optind < argc) {
+        fprintf(stderr, "Error: Unexpected argument '%s'\n", argv[optind]);
+        return -1;
+    }
+
+    if (bench->entry_count == 0) {
+        bench->entries[0] = 10000;
+        bench->entries[1] = 100000;
+        bench->entries[2] = 1000000;
+        bench->entry_count = 3;
+    }
+    if (bench->format_count == 0) {
+        for (int i = 0; i < MAX_FORMATS; i++) {
+            bench->formats[bench->format_count++] = i;
+        }
+    }
+    if (bench->only == 0)
+        bench->only = BENCH_ALL;
+    return 0;
+}
+
+/* SDL, a hidden window and its renderer for the decode and swipe benchmarks */
+static int open_renderer(SDL_Window **window, SDL_Renderer **renderer, SDL_RendererInfo *info)
+{
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
+        return -1;
+    }
+    if (wake_init() != 0)
+        fprintf(stderr, "Warning: SDL_RegisterEvents Error: %s\n", SDL_GetError());
+    int img_flags = IMG_INIT_PNG | IMG_INIT_JPG;
+    if ((IMG_Init(img_flags) & img_flags) != img_flags) {
+        fprintf(stderr, "IMG_Init Error: %s\n", IMG_GetError());
+        return -1;
+    }
+    *window = SDL_CreateWindow("Image Sorter Bench", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, VIEW_WIDTH,
+        VIEW_HEIGHT, SDL_WINDOW_HIDDEN);
+    if (!*window) {
+        fprintf(stderr, "SDL_CreateWindow Error: %s\n", SDL_GetError());
+        return -1;
+    }
+    *renderer = SDL_CreateRenderer(*window, -1, 0);
+    if (!*renderer) {
+        fprintf(stderr, "SDL_CreateRenderer Error: %s\n", SDL_GetError());
+        return -1;
+    }
+    if (SDL_GetRendererInfo(*renderer, info) != 0)
+        memset(info, 0, sizeof(SDL_RendererInfo));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    Bench bench;
+    if (parse_bench_args(argc, argv, &bench) != 0)
+        return 1;
+
+    if (bench.dir[0] == '\0') {
+        const char *tmp = getenv("TMPDIR");
+        if (corpus_path(bench.dir, "%s/image_swipe_sorter_bench.XXXXXX", tmp && *tmp ? tmp : "/tmp") != 0)
+            return 1;
+        if (!mkdtemp(bench.dir)) {
+            fprintf(stderr, "Error: Cannot create a directory for the corpora: %s\n", strerror(errno));
+            return 1;
+        }
+        bench.temporary = 1;
+    } else if (make_dir(bench.dir) != 0) {
+        return 1;
+    }
+
+    /* What the modules print as they work ("Found n images", every move) is not a result, results go to a copy
+     * of standard output */
+    if (bench.output[0] != '\0')
+        results = fopen(bench.output, "a");
+    else
+        results = fdopen(dup(STDOUT_FILENO), "w");
+    if (!results) {
+        fprintf(stderr, "Error: Cannot write the results: %s\n", strerror(errno));
+        return 1;
+    }
+    if (!freopen("/dev/null", "w", stdout))
+        fprintf(stderr, "Warning: Cannot silence standard output\n");
+    run_time = (long)time(NULL);
+
+    SDL_Window *window = NULL;
+    SDL_Renderer *renderer = NULL;
+    SDL_RendererInfo info;
+    memset(&info, 0, sizeof(info));
+    TexturePool *pool = NULL;
+    int result = open_renderer(&window, &renderer, &info);
+    if (result == 0 && !(pool = texture_pool_create(renderer))) {
+        fprintf(stderr, "Error: Cannot create the texture pool\n");
+        result = -1;
+    }
+    if (result == 0) {
+        SDL_version linked;
+        SDL_GetVersion(&linked);
+        result_begin(&bench, "run");
+        fprintf(results, ",\"cpus\":%d,\"sdl\":\"%d.%d.%d\"", SDL_GetCPUCount(), linked.major, linked.minor,
+            linked.patch);
+        fprintf(results, ",\"video\":\"%s\",\"renderer\":\"%s\"", SDL_GetCurrentVideoDriver(),
+            info.name ? info.name : "");
+        fprintf(results, ",\"texture_format\":\"%s\"", SDL_GetPixelFormatName(texture_pool_format(pool)));
+        result_end();
+
+        char images_dir[MAX_PATH];
+        if (corpus_path(images_dir, "%s/images_%dx%d", bench.dir, bench.width, bench.height) != 0)
+            result = -1;
+        else if ((bench.only & (BENCH_DECODE | BENCH_SWIPE)) && make_image_corpus(&bench, images_dir) != 0)
+            result = -1;
+    }
+
+    if (result == 0 && (bench.only & BENCH_LIST))
+        result = bench_list(&bench);
+    if (result == 0 && (bench.only & BENCH_INDEX))
+        result = bench_index(&bench);
+    if (result == 0 && (bench.only & BENCH_DECODE))
+        result = bench_decode(&bench, pool);
+    if (result == 0 && (bench.only & BENCH_MOVE))
+        result = bench_move(&bench);
+    if (result == 0 && (bench.only & BENCH_SWIPE))
+        result = bench_swipe(&bench, renderer, pool);
+    if (result == 0 && (bench.only & BENCH_ANALYZE))
+        result = bench_analyze(&bench, pool);
+
+    texture_pool_destroy(pool);
+    if (renderer)
+        SDL_DestroyRenderer(renderer);
+    if (window)
+        SDL_DestroyWindow(window);
+    IMG_Quit();
+    SDL_Quit();
+    fclose(results);
+    if (bench.temporary)
+        remove_tree(bench.dir);
+    return result == 0 ? 0 : 1;
+}
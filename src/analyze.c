@@ -0,0 +1,705 @@
+#include "analyze.h"
+
+#include "decode.h"
+#include "wake.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+/* AVX2 kernels are compiled for their functions only and picked when the CPU has it */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define HAVE_AVX2_KERNELS
+    #include <immintrin.h>
+#endif
+
+/* Rows analyzed at a time, the analyzer threads claim bands of them */
+#define BAND_ROWS 64
+
+/* Histograms and the mask are taken on a grid of at most this many pixels, the clipped counts and the sharpness
+ * from every pixel: scattered increments do not vectorize, and the mask is never shown larger than the window */
+#define SAMPLE_PIXELS (2 * 1024 * 1024)
+
+#define ANALYZER_MAX_THREADS 8
+
+/* Mask colors, ARGB8888 */
+#define MASK_HIGHLIGHT 0xffff2020u
+#define MASK_SHADOW    0xff2060ffu
+
+/* Where the channels are in a pixel of the surface */
+typedef struct {
+    int red; /* Shifts */
+    int green;
+    int blue;
+    uint32_t colors;  /* The three channel masks */
+    uint32_t weights; /* Luma weight of each byte of a pixel, in memory order (x86 kernels only) */
+} Layout;
+
+/* A surface being analyzed */
+typedef struct {
+    const SDL_Surface *surface;
+    Layout layout;
+    int step;          /* Histograms and the mask take every step-th pixel of every step-th row */
+    SDL_Surface *mask; /* NULL for none */
+} Job;
+
+/* What a band adds to an analysis */
+typedef struct {
+    uint32_t histogram[ANALYSIS_CHANNELS][256];
+    uint64_t clipped[2]; /* Highlights and shadows */
+    int64_t laplacian_sum;
+    uint64_t laplacian_squares;
+    uint64_t laplacian_count;
+} Tally;
+
+typedef struct {
+    const char *name;
+    /* Luma of a row, counting (and with a mask, marking) its clipped pixels */
+    void (*scan)(const uint32_t *pixels, int width, const Layout *layout, uint8_t *luma, uint32_t *mask,
+        uint64_t *clipped);
+    /* Sum and sum of squares of the Laplacian of row, from x = 1 to width - 2 */
+    void (*laplacian)(const uint8_t *above, const uint8_t *row, const uint8_t *below, int width, Tally *tally);
+} Kernels;
+
+typedef struct {
+    int index; /* -1 for an empty entry */
+    unsigned used;
+    Analysis analysis;
+} Kept;
+
+struct Analyzer {
+    SDL_Thread *threads[ANALYZER_MAX_THREADS];
+    int thread_count;
+    SDL_mutex *lock;
+    SDL_cond *work;
+    int quit;
+    const Kernels *kernels;
+    /* The analysis in flight, its bands are claimed by the threads */
+    int index;            /* -1 when idle */
+    SDL_Surface *surface; /* Referenced until the analysis is collected */
+    Job job;
+    Tally total;
+    int serial; /* Bumped for every analysis, each thread joins it once */
+    int band_count;
+    SDL_atomic_t next_band;
+    int working; /* Threads on the analysis */
+    int mask_made;
+    int done;
+    int failed_index; /* Ran out of memory, not retried until another image was requested */
+    /* Requested while another image was analyzed */
+    int pending_index;
+    SDL_Surface *pending;
+    /* Main thread only */
+    Kept kept[ANALYZER_KEEP];
+    unsigned uses;
+};
+
+static void start_job(const SDL_Surface *surface, Job *out)
+{
+    const SDL_PixelFormat *format = surface->format;
+    out->surface = surface;
+    out->layout.red = format->Rshift;
+    out->layout.green = format->Gshift;
+    out->layout.blue = format->Bshift;
+    out->layout.colors = format->Rmask | format->Gmask | format->Bmask;
+    out->layout.weights = 38u << format->Rshift | 75u << format->Gshift | 15u << format->Bshift;
+    out->step = 1;
+    while ((uint64_t)((surface->w + out->step - 1) / out->step) * ((surface->h + out->step - 1) / out->step) >
+           SAMPLE_PIXELS) {
+        out->step++;
+    }
+    out->mask = NULL;
+}
+
+/* A pixel of the mask per pixel of the sampling grid */
+static SDL_Surface *create_mask(const Job *job)
+{
+    int width = (job->surface->w + job->step - 1) / job->step;
+    int height = (job->surface->h + job->step - 1) / job->step;
+    return SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+}
+
+/* Plain C scan from x on, the tail of the vector kernels */
+static void scan_pixels(const uint32_t *pixels, int x, int width, const Layout *layout, uint8_t *luma,
+    uint32_t *mask, uint64_t *clipped)
+{
+    for (; x < width; x++) {
+        uint32_t p = pixels[x];
+        int r = (p >> layout->red) & 0xff;
+        int g = (p >> layout->green) & 0xff;
+        int b = (p >> layout->blue) & 0xff;
+        luma[x] = (uint8_t)((r * 38 + g * 75 + b * 15) >> 7);
+        int high = r == 255 || g == 255 || b == 255;
+        int low = !high && (r == 0 || g == 0 || b == 0);
+        clipped[0] += high;
+        clipped[1] += low;
+        if (mask)
+            mask[x] = high ? MASK_HIGHLIGHT : low ? MASK_SHADOW : 0;
+    }
+}
+
+static void laplacian_pixels(const uint8_t *above, const uint8_t *row, const uint8_t *below, int x, int width,
+    Tally *tally)
+{
+    for (; x < width - 1; x++) {
+        int l = 4 * row[x] - row[x - 1] - row[x + 1] - above[x] - below[x];
+        tally->laplacian_sum += l;
+        tally->laplacian_squares += (uint64_t)(l * l);
+    }
+}
+
+static void scan_row_c(const uint32_t *pixels, int width, const Layout *layout, uint8_t *luma, uint32_t *mask,
+    uint64_t *clipped)
+{
+    scan_pixels(pixels, 0, width, layout, luma, mask, clipped);
+}
+
+static void laplacian_row_c(const uint8_t *above, const uint8_t *row, const uint8_t *below, int width,
+    Tally *tally)
+{
+    laplacian_pixels(above, row, below, 1, width, tally);
+}
+
+#ifdef __SSE2__
+/* 16 pixels at a time: luma with 16-bit multiplies, clipped lanes from byte compares against the color bytes */
+static void scan_row_sse2(const uint32_t *pixels, int width, const Layout *layout, uint8_t *luma, uint32_t *mask,
+    uint64_t *clipped)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi32(-1);
+    const __m128i colors = _mm_set1_epi32((int)layout->colors);
+    const __m128i highlight = _mm_set1_epi32((int)MASK_HIGHLIGHT);
+    const __m128i shadow = _mm_set1_epi32((int)MASK_SHADOW);
+    uint32_t w = layout->weights;
+    const __m128i weights = _mm_setr_epi16((short)(w & 0xff), (short)(w >> 8 & 0xff), (short)(w >> 16 & 0xff),
+        (short)(w >> 24), (short)(w & 0xff), (short)(w >> 8 & 0xff), (short)(w >> 16 & 0xff), (short)(w >> 24));
+    __m128i highs = zero, lows = zero;
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i sums[4];
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(pixels + x + k * 4));
+            /* Two partial sums per pixel, added */
+            __m128 low = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weights));
+            __m128 high = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weights));
+            __m128i even = _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i odd = _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1)));
+            sums[k] = _mm_srli_epi32(_mm_add_epi32(even, odd), 7);
+
+            /* All ones in the lanes without a color byte at 255, then at 0 */
+            __m128i unclipped = _mm_cmpeq_epi32(_mm_and_si128(_mm_cmpeq_epi8(v, ones), colors), zero);
+            __m128i lit = _mm_cmpeq_epi32(_mm_and_si128(_mm_cmpeq_epi8(v, zero), colors), zero);
+            __m128i is_high = _mm_xor_si128(unclipped, ones);
+            __m128i is_low = _mm_andnot_si128(lit, unclipped);
+            highs = _mm_sub_epi32(highs, is_high);
+            lows = _mm_sub_epi32(lows, is_low);
+            if (mask) {
+                __m128i marks = _mm_or_si128(_mm_and_si128(is_high, highlight), _mm_and_si128(is_low, shadow));
+                _mm_storeu_si128((__m128i *)(mask + x + k * 4), marks);
+            }
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]), _mm_packs_epi32(sums[2], sums[3]));
+        _mm_storeu_si128((__m128i *)(luma + x), packed);
+    }
+    uint32_t counts[8];
+    _mm_storeu_si128((__m128i *)counts, highs);
+    _mm_storeu_si128((__m128i *)(counts + 4), lows);
+    clipped[0] += (uint64_t)counts[0] + counts[1] + counts[2] + counts[3];
+    clipped[1] += (uint64_t)counts[4] + counts[5] + counts[6] + counts[7];
+    scan_pixels(pixels, x, width, layout, luma, mask, clipped);
+}
+
+/* 16 pixels at a time in 16-bit lanes, squares summed in 64-bit ones */
+static void laplacian_row_sse2(const uint8_t *above, const uint8_t *row, const uint8_t *below, int width,
+    Tally *tally)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i pairs = _mm_set1_epi16(1);
+    __m128i sums = zero, squares = zero;
+    int x = 1;
+    for (; x + 16 <= width - 1; x += 16) {
+        __m128i center = _mm_loadu_si128((const __m128i *)(row + x));
+        __m128i left = _mm_loadu_si128((const __m128i *)(row + x - 1));
+        __m128i right = _mm_loadu_si128((const __m128i *)(row + x + 1));
+        __m128i up = _mm_loadu_si128((const __m128i *)(above + x));
+        __m128i down = _mm_loadu_si128((const __m128i *)(below + x));
+        for (int half = 0; half < 2; half++) {
+            __m128i c = half ? _mm_unpackhi_epi8(center, zero) : _mm_unpacklo_epi8(center, zero);
+            __m128i l = half ? _mm_unpackhi_epi8(left, zero) : _mm_unpacklo_epi8(left, zero);
+            __m128i r = half ? _mm_unpackhi_epi8(right, zero) : _mm_unpacklo_epi8(right, zero);
+            __m128i u = half ? _mm_unpackhi_epi8(up, zero) : _mm_unpacklo_epi8(up, zero);
+            __m128i d = half ? _mm_unpackhi_epi8(down, zero) : _mm_unpacklo_epi8(down, zero);
+            __m128i lap =
+                _mm_sub_epi16(_mm_slli_epi16(c, 2), _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+            sums = _mm_add_epi32(sums, _mm_madd_epi16(lap, pairs));
+            __m128i square = _mm_madd_epi16(lap, lap);
+            squares = _mm_add_epi64(squares,
+                _mm_add_epi64(_mm_unpacklo_epi32(square, zero), _mm_unpackhi_epi32(square, zero)));
+        }
+    }
+    int32_t sum[4];
+    uint64_t square[2];
+    _mm_storeu_si128((__m128i *)sum, sums);
+    _mm_storeu_si128((__m128i *)square, squares);
+    tally->laplacian_sum += (int64_t)sum[0] + sum[1] + sum[2] + sum[3];
+    tally->laplacian_squares += square[0] + square[1];
+    laplacian_pixels(above, row, below, x, width, tally);
+}
+#endif
+
+#ifdef HAVE_AVX2_KERNELS
+/* 32 pixels at a time: luma from byte multiplies, packed back into pixel order after the in-lane packs */
+__attribute__((target("avx2"))) static void scan_row_avx2(const uint32_t *pixels, int width, const Layout *layout,
+    uint8_t *luma, uint32_t *mask, uint64_t *clipped)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256i colors = _mm256_set1_epi32((int)layout->colors);
+    const __m256i weights = _mm256_set1_epi32((int)layout->weights);
+    const __m256i pairs = _mm256_set1_epi16(1);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const __m256i highlight = _mm256_set1_epi32((int)MASK_HIGHLIGHT);
+    const __m256i shadow = _mm256_set1_epi32((int)MASK_SHADOW);
+    __m256i highs = zero, lows = zero;
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i sums[4];
+        for (int k = 0; k < 4; k++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(pixels + x + k * 8));
+            sums[k] = _mm256_srli_epi32(_mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), pairs), 7);
+
+            __m256i unclipped = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_cmpeq_epi8(v, ones), colors), zero);
+            __m256i lit = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_cmpeq_epi8(v, zero), colors), zero);
+            __m256i is_high = _mm256_xor_si256(unclipped, ones);
+            __m256i is_low = _mm256_andnot_si256(lit, unclipped);
+            highs = _mm256_sub_epi32(highs, is_high);
+            lows = _mm256_sub_epi32(lows, is_low);
+            if (mask) {
+                __m256i marks =
+                    _mm256_or_si256(_mm256_and_si256(is_high, highlight), _mm256_and_si256(is_low, shadow));
+                _mm256_storeu_si256((__m256i *)(mask + x + k * 8), marks);
+            }
+        }
+        __m256i packed =
+            _mm256_packus_epi16(_mm256_packs_epi32(sums[0], sums[1]), _mm256_packs_epi32(sums[2], sums[3]));
+        _mm256_storeu_si256((__m256i *)(luma + x), _mm256_permutevar8x32_epi32(packed, order));
+    }
+    uint32_t counts[16];
+    _mm256_storeu_si256((__m256i *)counts, highs);
+    _mm256_storeu_si256((__m256i *)(counts + 8), lows);
+    for (int i = 0; i < 8; i++) {
+        clipped[0] += counts[i];
+        clipped[1] += counts[8 + i];
+    }
+    scan_pixels(pixels, x, width, layout, luma, mask, clipped);
+}
+
+/* 32 pixels at a time, widened in-lane: the order of the terms does not matter to the sums */
+__attribute__((target("avx2"))) static void laplacian_row_avx2(const uint8_t *above, const uint8_t *row,
+    const uint8_t *below, int width, Tally *tally)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i pairs = _mm256_set1_epi16(1);
+    __m256i sums = zero, squares = zero;
+    int x = 1;
+    for (; x + 32 <= width - 1; x += 32) {
+        __m256i center = _mm256_loadu_si256((const __m256i *)(row + x));
+        __m256i left = _mm256_loadu_si256((const __m256i *)(row + x - 1));
+        __m256i right = _mm256_loadu_si256((const __m256i *)(row + x + 1));
+        __m256i up = _mm256_loadu_si256((const __m256i *)(above + x));
+        __m256i down = _mm256_loadu_si256((const __m256i *)(below + x));
+        for (int half = 0; half < 2; half++) {
+            __m256i c = half ? _mm256_unpackhi_epi8(center, zero) : _mm256_unpacklo_epi8(center, zero);
+            __m256i l = half ? _mm256_unpackhi_epi8(left, zero) : _mm256_unpacklo_epi8(left, zero);
+            __m256i r = half ? _mm256_unpackhi_epi8(right, zero) : _mm256_unpacklo_epi8(right, zero);
+            __m256i u = half ? _mm256_unpackhi_epi8(up, zero) : _mm256_unpacklo_epi8(up, zero);
+            __m256i d = half ? _mm256_unpackhi_epi8(down, zero) : _mm256_unpacklo_epi8(down, zero);
+            __m256i lap = _mm256_sub_epi16(_mm256_slli_epi16(c, 2),
+                _mm256_add_epi16(_mm256_add_epi16(l, r), _mm256_add_epi16(u, d)));
+            sums = _mm256_add_epi32(sums, _mm256_madd_epi16(lap, pairs));
+            __m256i square = _mm256_madd_epi16(lap, lap);
+            squares = _mm256_add_epi64(squares,
+                _mm256_add_epi64(_mm256_unpacklo_epi32(square, zero), _mm256_unpackhi_epi32(square, zero)));
+        }
+    }
+    int32_t sum[8];
+    uint64_t square[4];
+    _mm256_storeu_si256((__m256i *)sum, sums);
+    _mm256_storeu_si256((__m256i *)square, squares);
+    for (int i = 0; i < 8; i++) {
+        tally->laplacian_sum += sum[i];
+    }
+    tally->laplacian_squares += square[0] + square[1] + square[2] + square[3];
+    laplacian_pixels(above, row, below, x, width, tally);
+}
+#endif
+
+static const Kernels *pick_kernels(void)
+{
+    static const Kernels plain = {"c", scan_row_c, laplacian_row_c};
+#ifdef HAVE_AVX2_KERNELS
+    static const Kernels avx2 = {"avx2", scan_row_avx2, laplacian_row_avx2};
+    if (SDL_HasAVX2())
+        return &avx2;
+#endif
+#ifdef __SSE2__
+    static const Kernels sse2 = {"sse2", scan_row_sse2, laplacian_row_sse2};
+    if (SDL_HasSSE2())
+        return &sse2;
+#endif
+    return &plain;
+}
+
+/* Histograms of a row, from its pixels and the luma the scan computed. Scattered increments do not vectorize */
+static void count_row(const uint32_t *pixels, const uint8_t *luma, int width, int step, const Layout *layout,
+    uint32_t (*histogram)[256])
+{
+    uint32_t *red = histogram[ANALYSIS_RED];
+    uint32_t *green = histogram[ANALYSIS_GREEN];
+    uint32_t *blue = histogram[ANALYSIS_BLUE];
+    uint32_t *lumas = histogram[ANALYSIS_LUMA];
+    /* In locals, the counts could alias the layout */
+    int red_shift = layout->red, green_shift = layout->green, blue_shift = layout->blue;
+    for (int x = 0; x < width; x += step) {
+        uint32_t p = pixels[x];
+        red[(p >> red_shift) & 0xff]++;
+        green[(p >> green_shift) & 0xff]++;
+        blue[(p >> blue_shift) & 0xff]++;
+        lumas[luma[x]]++;
+    }
+}
+
+/* Histograms, clipping and mask of the rows of band, and the Laplacian of those inside the image. The luma of
+ * the rows around the band is computed again for it. scratch holds a row of marks, then three rows of luma */
+static void analyze_band(const Kernels *kernels, const Job *job, int band, uint32_t *scratch, Tally *tally)
+{
+    const SDL_Surface *surface = job->surface;
+    int width = surface->w;
+    int height = surface->h;
+    int step = job->step;
+    uint8_t *rows = (uint8_t *)(scratch + width);
+    int top = band * BAND_ROWS;
+    int bottom = SDL_min(top + BAND_ROWS, height);
+    for (int y = SDL_max(top - 1, 0); y <= SDL_min(bottom, height - 1); y++) {
+        const uint32_t *pixels = (const uint32_t *)((const uint8_t *)surface->pixels + (size_t)y * surface->pitch);
+        uint8_t *luma = rows + (size_t)(y % 3) * width;
+        if (y < top || y >= bottom) {
+            uint64_t ignored[2];
+            kernels->scan(pixels, width, &job->layout, luma, NULL, ignored);
+        } else if (y % step != 0) {
+            kernels->scan(pixels, width, &job->layout, luma, NULL, tally->clipped);
+        } else {
+            uint32_t *marks = NULL;
+            if (job->mask)
+                marks = (uint32_t *)((uint8_t *)job->mask->pixels + (size_t)(y / step) * job->mask->pitch);
+            kernels->scan(pixels, width, &job->layout, luma, step > 1 && marks ? scratch : marks, tally->clipped);
+            count_row(pixels, luma, width, step, &job->layout, tally->histogram);
+            for (int x = 0; step > 1 && marks && x < job->mask->w; x++) {
+                marks[x] = scratch[x * step];
+            }
+        }
+        /* The row above is complete once this one has its luma */
+        if (y - 1 >= SDL_max(top, 1) && width >= 3) {
+            const uint8_t *above = rows + (size_t)((y - 2) % 3) * width;
+            const uint8_t *center = rows + (size_t)((y - 1) % 3) * width;
+            kernels->laplacian(above, center, luma, width, tally);
+            tally->laplacian_count += (uint64_t)(width - 2);
+        }
+    }
+}
+
+static void add_tally(Tally *total, const Tally *tally)
+{
+    for (int c = 0; c < ANALYSIS_CHANNELS; c++) {
+        for (int i = 0; i < 256; i++) {
+            total->histogram[c][i] += tally->histogram[c][i];
+        }
+    }
+    total->clipped[0] += tally->clipped[0];
+    total->clipped[1] += tally->clipped[1];
+    total->laplacian_sum += tally->laplacian_sum;
+    total->laplacian_squares += tally->laplacian_squares;
+    total->laplacian_count += tally->laplacian_count;
+}
+
+static void finish_analysis(const Tally *total, Analysis *out)
+{
+    memcpy(out->histogram, total->histogram, sizeof(out->histogram));
+    out->highlights = total->clipped[0];
+    out->shadows = total->clipped[1];
+    out->sharpness = 0.0;
+    if (total->laplacian_count > 0) {
+        double mean = (double)total->laplacian_sum / total->laplacian_count;
+        out->sharpness = (double)total->laplacian_squares / total->laplacian_count - mean * mean;
+    }
+}
+
+int analyze_surface(SDL_Surface *surface, int make_mask, Analysis *out)
+{
+    memset(out, 0, sizeof(Analysis));
+    SDL_Surface *source = surface;
+    if (!IS_PIXELFORMAT_8888(surface->format->format)) {
+        source = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+        if (!source)
+            return -1;
+    }
+
+    Job job;
+    start_job(source, &job);
+    if (make_mask)
+        job.mask = create_mask(&job);
+    Tally *tally = calloc(1, sizeof(Tally));
+    uint32_t *scratch = malloc((size_t)source->w * 7 + 4);
+    int result = -1;
+    if (tally && scratch && (!make_mask || job.mask)) {
+        const Kernels *kernels = pick_kernels();
+        for (int band = 0; band * BAND_ROWS < source->h; band++) {
+            analyze_band(kernels, &job, band, scratch, tally);
+        }
+        out->width = source->w;
+        out->height = source->h;
+        out->mask = job.mask;
+        finish_analysis(tally, out);
+        result = 0;
+    } else {
+        SDL_FreeSurface(job.mask);
+    }
+    free(scratch);
+    free(tally);
+    if (source != surface)
+        SDL_FreeSurface(source);
+    return result;
+}
+
+const char *analyze_kernels(void)
+{
+    return pick_kernels()->name;
+}
+
+void analysis_free(Analysis *analysis)
+{
+    SDL_FreeSurface(analysis->mask);
+    analysis->mask = NULL;
+}
+
+static int analyze_thread(void *data)
+{
+    Analyzer *analyzer = data;
+    Tally *tally = malloc(sizeof(Tally));
+    uint32_t *scratch = NULL;
+    int scratch_width = 0;
+    int joined = 0;
+
+    SDL_LockMutex(analyzer->lock);
+    while (!analyzer->quit) {
+        if (analyzer->index < 0 || analyzer->done || analyzer->serial == joined) {
+            SDL_CondWait(analyzer->work, analyzer->lock);
+            continue;
+        }
+        joined = analyzer->serial;
+        /* The first thread in makes the mask, a failure only leaves it out */
+        if (!analyzer->mask_made) {
+            analyzer->mask_made = 1;
+            analyzer->job.mask = create_mask(&analyzer->job);
+        }
+        analyzer->working++;
+        Job job = analyzer->job;
+        int band_count = analyzer->band_count;
+        SDL_UnlockMutex(analyzer->lock);
+
+        /* Without memory for its scratch rows a thread leaves the bands to the others */
+        int width = job.surface->w;
+        if (width > scratch_width) {
+            free(scratch);
+            scratch = malloc((size_t)width * 7);
+            scratch_width = scratch ? width : 0;
+        }
+        int ready = tally && scratch;
+        if (ready) {
+            memset(tally, 0, sizeof(Tally));
+            int band;
+            while ((band = SDL_AtomicAdd(&analyzer->next_band, 1)) < band_count) {
+                analyze_band(analyzer->kernels, &job, band, scratch, tally);
+            }
+        }
+
+        SDL_LockMutex(analyzer->lock);
+        if (ready)
+            add_tally(&analyzer->total, tally);
+        /* Every band was claimed when a thread with scratch rows gets here, the last one out finishes */
+        if (--analyzer->working == 0) {
+            analyzer->done = 1;
+            wake_main(WAKE_ANALYZED);
+        }
+    }
+    SDL_UnlockMutex(analyzer->lock);
+    free(scratch);
+    free(tally);
+    return 0;
+}
+
+Analyzer *analyzer_create(void)
+{
+    Analyzer *analyzer = calloc(1, sizeof(Analyzer));
+    if (!analyzer)
+        return NULL;
+    analyzer->index = -1;
+    analyzer->failed_index = -1;
+    for (int i = 0; i < ANALYZER_KEEP; i++) {
+        analyzer->kept[i].index = -1;
+    }
+    analyzer->kernels = pick_kernels();
+    analyzer->lock = SDL_CreateMutex();
+    analyzer->work = SDL_CreateCond();
+    if (!analyzer->lock || !analyzer->work) {
+        analyzer_destroy(analyzer);
+        return NULL;
+    }
+
+    /* Leave one core to the UI thread */
+    int threads = SDL_min(SDL_GetCPUCount() - 1, ANALYZER_MAX_THREADS);
+    if (threads < 1)
+        threads = 1;
+    for (int i = 0; i < threads; i++) {
+        analyzer->threads[i] = SDL_CreateThread(analyze_thread, "analyzer", analyzer);
+        if (!analyzer->threads[i]) {
+            fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+            break;
+        }
+        analyzer->thread_count++;
+    }
+    if (analyzer->thread_count == 0) {
+        analyzer_destroy(analyzer);
+        return NULL;
+    }
+    return analyzer;
+}
+
+void analyzer_destroy(Analyzer *analyzer)
+{
+    if (!analyzer)
+        return;
+
+    if (analyzer->lock) {
+        SDL_LockMutex(analyzer->lock);
+        analyzer->quit = 1;
+        SDL_CondBroadcast(analyzer->work);
+        SDL_UnlockMutex(analyzer->lock);
+    }
+    for (int i = 0; i < analyzer->thread_count; i++) {
+        SDL_WaitThread(analyzer->threads[i], NULL);
+    }
+
+    SDL_FreeSurface(analyzer->job.mask);
+    SDL_FreeSurface(analyzer->surface);
+    SDL_FreeSurface(analyzer->pending);
+    for (int i = 0; i < ANALYZER_KEEP; i++) {
+        analysis_free(&analyzer->kept[i].analysis);
+    }
+    SDL_DestroyCond(analyzer->work);
+    SDL_DestroyMutex(analyzer->lock);
+    free(analyzer);
+}
+
+/* Hand surface (referenced already) to the threads. Called with the lock held */
+static void start_analysis(Analyzer *analyzer, int index, SDL_Surface *surface)
+{
+    analyzer->index = index;
+    analyzer->surface = surface;
+    start_job(surface, &analyzer->job);
+    memset(&analyzer->total, 0, sizeof(Tally));
+    analyzer->band_count = (surface->h + BAND_ROWS - 1) / BAND_ROWS;
+    SDL_AtomicSet(&analyzer->next_band, 0);
+    analyzer->mask_made = 0;
+    analyzer->done = 0;
+    analyzer->serial++;
+    SDL_CondBroadcast(analyzer->work);
+}
+
+/* Keep the analysis the threads finished and start the one requested behind it. Called with the lock held */
+static void collect_analysis(Analyzer *analyzer)
+{
+    if (analyzer->index < 0 || !analyzer->done)
+        return;
+
+    if (SDL_AtomicGet(&analyzer->next_band) < analyzer->band_count) {
+        /* No thread had memory for its scratch rows */
+        fprintf(stderr, "Warning: Out of memory analyzing image %d\n", analyzer->index);
+        SDL_FreeSurface(analyzer->job.mask);
+        analyzer->failed_index = analyzer->index;
+    } else {
+        Kept *oldest = &analyzer->kept[0];
+        for (int i = 1; i < ANALYZER_KEEP; i++) {
+            if (analyzer->kept[i].used < oldest->used)
+                oldest = &analyzer->kept[i];
+        }
+        analysis_free(&oldest->analysis);
+        oldest->index = analyzer->index;
+        oldest->used = ++analyzer->uses;
+        oldest->analysis.width = analyzer->surface->w;
+        oldest->analysis.height = analyzer->surface->h;
+        oldest->analysis.mask = analyzer->job.mask;
+        finish_analysis(&analyzer->total, &oldest->analysis);
+    }
+    analyzer->job.mask = NULL;
+    SDL_FreeSurface(analyzer->surface);
+    analyzer->surface = NULL;
+    analyzer->index = -1;
+
+    if (analyzer->pending) {
+        start_analysis(analyzer, analyzer->pending_index, analyzer->pending);
+        analyzer->pending = NULL;
+    }
+}
+
+static Kept *find_kept(Analyzer *analyzer, int index)
+{
+    for (int i = 0; i < ANALYZER_KEEP; i++) {
+        if (analyzer->kept[i].index == index)
+            return &analyzer->kept[i];
+    }
+    return NULL;
+}
+
+int analyzer_request(Analyzer *analyzer, int index, SDL_Surface *surface)
+{
+    if (!IS_PIXELFORMAT_8888(surface->format->format))
+        return -1;
+
+    SDL_LockMutex(analyzer->lock);
+    collect_analysis(analyzer);
+    if (index == analyzer->failed_index) {
+        SDL_UnlockMutex(analyzer->lock);
+        return -1;
+    }
+    analyzer->failed_index = -1;
+    int queued = analyzer->pending && index == analyzer->pending_index;
+    if (index != analyzer->index && !queued && !find_kept(analyzer, index)) {
+        surface->refcount++;
+        if (analyzer->index < 0) {
+            start_analysis(analyzer, index, surface);
+        } else {
+            SDL_FreeSurface(analyzer->pending);
+            analyzer->pending_index = index;
+            analyzer->pending = surface;
+        }
+    }
+    SDL_UnlockMutex(analyzer->lock);
+    return 0;
+}
+
+const Analysis *analyzer_get(Analyzer *analyzer, int index)
+{
+    SDL_LockMutex(analyzer->lock);
+    collect_analysis(analyzer);
+    SDL_UnlockMutex(analyzer->lock);
+
+    Kept *kept = find_kept(analyzer, index);
+    if (!kept)
+        return NULL;
+    kept->used = ++analyzer->uses;
+    return &kept->analysis;
+}
@@ -0,0 +1,58 @@
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+
+/* Finished analyses kept for images coming back (undo, second pass) */
+#define ANALYZER_KEEP 4
+
+typedef enum {
+    ANALYSIS_RED = 0,
+    ANALYSIS_GREEN,
+    ANALYSIS_BLUE,
+    ANALYSIS_LUMA, /* (38 R + 75 G + 15 B) / 128 */
+    ANALYSIS_CHANNELS,
+} AnalysisChannel;
+
+/* Exposure and focus of a decoded image */
+typedef struct {
+    uint32_t histogram[ANALYSIS_CHANNELS][256]; /* Of a grid of at most 2 megapixels over the image */
+    int width; /* Of the surface analyzed, the decode the image is shown with */
+    int height;
+    uint64_t highlights; /* Pixels with a color channel at 255 */
+    uint64_t shadows;    /* Pixels with a color channel at 0, and none at 255 */
+    double sharpness;    /* Variance of the Laplacian of luma, comparable between decodes of the same size */
+    SDL_Surface *mask;   /* ARGB8888 on the same grid: highlights red, shadows blue, transparent elsewhere */
+} Analysis;
+
+/* Analyze surface on the calling thread, with the best of AVX2, SSE2 and plain C the CPU has. With make_mask,
+ * also the clipping mask. Returns 0 on success, -1 on allocation failure */
+int analyze_surface(SDL_Surface *surface, int make_mask, Analysis *out);
+
+/* Kernels analyze_surface() and the analyzer use on this CPU: "avx2", "sse2" or "c" */
+const char *analyze_kernels(void);
+
+/* Free the mask of an analysis */
+void analysis_free(Analysis *analysis);
+
+typedef struct Analyzer Analyzer;
+
+/* Start threads that analyze the image on screen on every core but one, rows split between them */
+Analyzer *analyzer_create(void);
+
+/* Stop the threads and free the analyses kept */
+void analyzer_destroy(Analyzer *analyzer);
+
+/* Analyze surface, the decode of image index, unless it is done or in flight already. An analysis of another
+ * image still running finishes first, a request queued behind it is replaced. The surface gets a reference
+ * until the analysis is done. Returns -1 when surface is not in an IS_PIXELFORMAT_8888 format or the last
+ * analysis of index ran out of memory (it is tried again once another image was requested), 0 otherwise.
+ * Main thread only: surface reference counts are not atomic */
+int analyzer_request(Analyzer *analyzer, int index, SDL_Surface *surface);
+
+/* The finished analysis of index, NULL while it runs or was never requested. Valid until the next call to the
+ * analyzer. Main thread only */
+const Analysis *analyzer_get(Analyzer *analyzer, int index);
+
+#endif /* ANALYZE_H */
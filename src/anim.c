@@ -0,0 +1,650 @@
+#include "anim.h"
+
+#include "decode.h"
+#include "files.h"
+#include "wake.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_WEBPDEMUX
+#include <webp/demux.h>
+#endif
+
+/* GIF LZW codes are at most 12 bits */
+#define LZW_CODES 4096
+
+/* Browsers play shorter delays (often 0 in old GIFs) at 100 ms */
+#define MIN_FRAME_DELAY_MS     20
+#define DEFAULT_FRAME_DELAY_MS 100
+
+typedef struct {
+    SDL_Surface *surface;
+    int delay_ms; /* Time it stays on screen */
+} Frame;
+
+/* Animation being decoded, only touched by the decode thread */
+typedef struct {
+    int width; /* Canvas size */
+    int height;
+    /* GIF: a cursor over the file and the canvas frames are drawn onto */
+    const SDL_PixelFormat *format;
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    size_t first_frame;  /* First block after the header, where a loop restarts */
+    Uint32 palette[256]; /* Global color table in the output format */
+    Uint32 *canvas;
+    Uint32 *previous;    /* Canvas before a frame disposed of by restoring it */
+    SDL_Rect dispose;    /* Area of the last frame, cleared or restored before the next */
+    int disposal;
+    Uint16 prefix[LZW_CODES];
+    Uint8 suffix[LZW_CODES];
+    Uint8 stack[LZW_CODES + 1];
+#ifdef HAVE_WEBPDEMUX
+    WebPAnimDecoder *webp;
+    int webp_time; /* End of the last frame decoded, in ms from the start */
+#endif
+} Source;
+
+struct Animation {
+    char path[MAX_PATH];
+    ImageFormat format;
+    Uint32 pixel_format;
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *work;
+    SDL_atomic_t cancelled; /* Set by anim_destroy(), the decoder checks it between rows */
+    SDL_atomic_t exited;    /* The thread is done with everything but returning */
+    /* Ring of decoded frames, under lock */
+    Frame frames[ANIM_MAX_FRAMES];
+    int frame_count; /* Ring size, 0 until the decoder made it */
+    int head;        /* Oldest decoded frame, on screen once handed out */
+    int queued;      /* Decoded frames from head on */
+    int shown;       /* Frame at head was handed out, given back on the next poll */
+    int still;
+    int started;
+    Uint32 due; /* When the frame after the one on screen is due */
+};
+
+/* Animations destroyed while their thread was still running, freed once it exited and all of them at
+ * shutdown. Main thread only */
+static Animation **orphans;
+static int orphan_count;
+static int orphan_capacity;
+
+static void free_animation(Animation *anim)
+{
+    for (int i = 0; i < ANIM_MAX_FRAMES; i++)
+        SDL_FreeSurface(anim->frames[i].surface);
+    if (anim->work)
+        SDL_DestroyCond(anim->work);
+    if (anim->lock)
+        SDL_DestroyMutex(anim->lock);
+    free(anim);
+}
+
+/* Frames decoded ahead within the budget, next to the canvas and its saved copy. 0 when two do not fit */
+static int ring_size(const Animation *anim, int width, int height)
+{
+    size_t frame_bytes = (size_t)width * (size_t)height * 4;
+    size_t fit = frame_bytes > 0 ? ANIM_FRAME_BUDGET / frame_bytes : 0;
+    if (fit < 4) {
+        fprintf(stderr, "Warning: %s: %dx%d animation is over the frame memory budget, showing its first frame\n",
+            anim->path, width, height);
+        return 0;
+    }
+    return (int)SDL_min(fit - 2, ANIM_MAX_FRAMES);
+}
+
+static int skip_sub_blocks(Source *gif)
+{
+    while (gif->pos < gif->size) {
+        int length = gif->data[gif->pos++];
+        if (length == 0)
+            return 0;
+        gif->pos += length;
+    }
+    gif->pos = gif->size;
+    return -1;
+}
+
+/* Color table of 2 << (packed & 7) RGB entries, the rest is opaque black */
+static int read_palette(Source *gif, int packed, Uint32 *palette)
+{
+    int entries = 2 << (packed & 7);
+    if (gif->pos + (size_t)entries * 3 > gif->size)
+        return -1;
+    const unsigned char *rgb = gif->data + gif->pos;
+    for (int i = 0; i < 256; i++) {
+        palette[i] = i < entries ? SDL_MapRGBA(gif->format, rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2], 255)
+                                 : SDL_MapRGBA(gif->format, 0, 0, 0, 255);
+    }
+    gif->pos += (size_t)entries * 3;
+    return 0;
+}
+
+/* Image descriptors from the current position on, up to limit, without decoding them */
+static int gif_count_frames(Source *gif, int limit)
+{
+    size_t pos = gif->pos;
+    int count = 0;
+    while (count < limit && gif->pos < gif->size) {
+        int block = gif->data[gif->pos++];
+        if (block == 0x21 && gif->pos < gif->size) {
+            gif->pos++;
+            if (skip_sub_blocks(gif) != 0)
+                break;
+        } else if (block == 0x2C && gif->pos + 9 <= gif->size) {
+            /* Descriptor, local color table, LZW code size and data, a truncated frame still shows */
+            int packed = gif->data[gif->pos + 8];
+            gif->pos += 9 + ((packed & 0x80) ? (size_t)(2 << (packed & 7)) * 3 : 0) + 1;
+            count++;
+            if (gif->pos > gif->size || skip_sub_blocks(gif) != 0)
+                break;
+        } else {
+            break;
+        }
+    }
+    gif->pos = pos;
+    return count;
+}
+
+static int gif_open(Animation *anim, Source *gif, const MappedFile *file)
+{
+    const unsigned char *data = file->data;
+    if (file->size < 13 || memcmp(data, "GIF8", 4) != 0)
+        return 0;
+    gif->data = data;
+    gif->size = file->size;
+    gif->pos = 13;
+    gif->width = data[6] | data[7] << 8;
+    gif->height = data[8] | data[9] << 8;
+    int packed = data[10];
+    if (packed & 0x80) {
+        if (read_palette(gif, packed, gif->palette) != 0)
+            return 0;
+    } else {
+        for (int i = 0; i < 256; i++)
+            gif->palette[i] = SDL_MapRGBA(gif->format, 0, 0, 0, 255);
+    }
+    gif->first_frame = gif->pos;
+    if (gif_count_frames(gif, 2) < 2)
+        return 0;
+
+    int count = ring_size(anim, gif->width, gif->height);
+    if (count == 0)
+        return 0;
+    /* Transparent to start with, as browsers do rather than the background color */
+    gif->canvas = calloc((size_t)gif->width * gif->height, sizeof(Uint32));
+    gif->previous = malloc((size_t)gif->width * gif->height * sizeof(Uint32));
+    return gif->canvas && gif->previous ? count : 0;
+}
+
+/* Next byte of the image data sub-blocks, -1 at their end. block_left is -1 once the terminator is read */
+static int data_byte(Source *gif, int *block_left)
+{
+    if (*block_left == 0) {
+        if (gif->pos >= gif->size)
+            return -1;
+        *block_left = gif->data[gif->pos++];
+        if (*block_left == 0) {
+            *block_left = -1;
+            return -1;
+        }
+    }
+    if (*block_left < 0 || gif->pos >= gif->size)
+        return -1;
+    (*block_left)--;
+    return gif->data[gif->pos++];
+}
+
+/* Row after y in a frame of height rows, interlaced frames store every 8th row, then the 4th, 2nd and the rest */
+static int next_row(int y, int height, int interlaced, int *pass)
+{
+    static const int starts[] = {0, 4, 2, 1};
+    static const int steps[] = {8, 8, 4, 2};
+    if (!interlaced)
+        return y + 1;
+    y += steps[*pass];
+    while (y >= height && *pass < 3) {
+        (*pass)++;
+        y = starts[*pass];
+    }
+    return y;
+}
+
+/* Decompress the LZW data of a frame onto the canvas. A corrupt or truncated frame stops where its data does.
+ * Returns -1 when cancelled */
+static int gif_decode(Animation *anim, Source *gif, const SDL_Rect *rect, int interlaced, const Uint32 *palette,
+    int transparent)
+{
+    int min_size = gif->pos < gif->size ? gif->data[gif->pos++] : 0;
+    int block_left = 0;
+    if (min_size >= 1 && min_size <= 8 && rect->w > 0 && rect->h > 0) {
+        int clear = 1 << min_size;
+        int code_size = min_size + 1;
+        int next = clear + 2;
+        int prev = -1;
+        int first = 0;
+        Uint32 bits = 0;
+        int bit_count = 0;
+        int x = 0, y = 0, pass = 0;
+        for (int i = 0; i < clear; i++)
+            gif->suffix[i] = (Uint8)i;
+
+        while (y < rect->h) {
+            /* Codes are packed least significant bit first, across sub-blocks */
+            while (bit_count < code_size) {
+                int byte = data_byte(gif, &block_left);
+                if (byte < 0)
+                    break;
+                bits |= (Uint32)byte << bit_count;
+                bit_count += 8;
+            }
+            if (bit_count < code_size)
+                break;
+            int code = (int)(bits & ((1u << code_size) - 1));
+            bits >>= code_size;
+            bit_count -= code_size;
+
+            if (code == clear) {
+                code_size = min_size + 1;
+                next = clear + 2;
+                prev = -1;
+                continue;
+            }
+            if (code == clear + 1 || (prev < 0 && code > clear) || code > next)
+                break;
+
+            /* Walk the string of code back to its first byte, a code not in the table yet is prev + its first */
+            int sp = 0;
+            int c = code;
+            if (prev >= 0 && code == next) {
+                gif->stack[sp++] = (Uint8)first;
+                c = prev;
+            }
+            while (c >= clear) {
+                gif->stack[sp++] = gif->suffix[c];
+                c = gif->prefix[c];
+            }
+            gif->stack[sp++] = (Uint8)c;
+            first = c;
+            if (prev >= 0 && next < LZW_CODES) {
+                gif->prefix[next] = (Uint16)prev;
+                gif->suffix[next] = (Uint8)first;
+                next++;
+                if (next == 1 << code_size && code_size < 12)
+                    code_size++;
+            }
+            prev = code;
+
+            while (sp > 0 && y < rect->h) {
+                int index = gif->stack[--sp];
+                int canvas_x = rect->x + x;
+                int canvas_y = rect->y + y;
+                if (index != transparent && canvas_x < gif->width && canvas_y < gif->height)
+                    gif->canvas[canvas_y * gif->width + canvas_x] = palette[index];
+                if (++x == rect->w) {
+                    x = 0;
+                    y = next_row(y, rect->h, interlaced, &pass);
+                    if (SDL_AtomicGet(&anim->cancelled))
+                        return -1;
+                }
+            }
+        }
+    }
+
+    /* Past what is left of the data */
+    if (block_left >= 0) {
+        gif->pos = SDL_min(gif->pos + (size_t)block_left, gif->size);
+        skip_sub_blocks(gif);
+    }
+    return 0;
+}
+
+/* Clear or restore what the previous frame asked for */
+static void gif_dispose(Source *gif)
+{
+    SDL_Rect canvas = {0, 0, gif->width, gif->height};
+    SDL_Rect area;
+    if (gif->disposal == 2 && SDL_IntersectRect(&gif->dispose, &canvas, &area)) {
+        for (int y = area.y; y < area.y + area.h; y++)
+            memset(gif->canvas + (size_t)y * gif->width + area.x, 0, (size_t)area.w * sizeof(Uint32));
+    } else if (gif->disposal == 3) {
+        memcpy(gif->canvas, gif->previous, (size_t)gif->width * gif->height * sizeof(Uint32));
+    }
+    gif->disposal = 0;
+}
+
+/* Draw the next frame onto the canvas. Returns 1 for a frame, 0 after the last one, -1 when cancelled */
+static int gif_next_frame(Animation *anim, Source *gif, int *delay_ms)
+{
+    int disposal = 0;
+    int transparent = -1;
+    int delay = 0;
+    while (gif->pos < gif->size) {
+        int block = gif->data[gif->pos++];
+        if (block == 0x21 && gif->pos < gif->size) {
+            /* Graphic control: disposal and transparency flags, delay in 1/100 s and the transparent index */
+            int label = gif->data[gif->pos++];
+            if (label == 0xF9 && gif->pos + 5 <= gif->size && gif->data[gif->pos] == 4) {
+                const unsigned char *control = gif->data + gif->pos + 1;
+                disposal = (control[0] >> 2) & 7;
+                transparent = (control[0] & 1) ? control[3] : -1;
+                delay = (control[1] | control[2] << 8) * 10;
+            }
+            if (skip_sub_blocks(gif) != 0)
+                return 0;
+            continue;
+        }
+        /* Anything but a frame ends the animation (the trailer, or garbage after the last frame) */
+        if (block != 0x2C || gif->pos + 9 > gif->size)
+            return 0;
+
+        const unsigned char *descriptor = gif->data + gif->pos;
+        SDL_Rect rect = {descriptor[0] | descriptor[1] << 8, descriptor[2] | descriptor[3] << 8,
+            descriptor[4] | descriptor[5] << 8, descriptor[6] | descriptor[7] << 8};
+        int packed = descriptor[8];
+        gif->pos += 9;
+        Uint32 local[256];
+        const Uint32 *palette = gif->palette;
+        if (packed & 0x80) {
+            if (read_palette(gif, packed, local) != 0)
+                return 0;
+            palette = local;
+        }
+
+        gif_dispose(gif);
+        if (disposal == 3)
+            memcpy(gif->previous, gif->canvas, (size_t)gif->width * gif->height * sizeof(Uint32));
+        if (gif_decode(anim, gif, &rect, packed & 0x40, palette, transparent) != 0)
+            return -1;
+        gif->dispose = rect;
+        gif->disposal = disposal;
+        *delay_ms = delay;
+        return 1;
+    }
+    return 0;
+}
+
+static void gif_rewind(Source *gif)
+{
+    gif->pos = gif->first_frame;
+    gif->disposal = 0;
+    memset(gif->canvas, 0, (size_t)gif->width * gif->height * sizeof(Uint32));
+}
+
+#ifdef HAVE_WEBPDEMUX
+static int webp_open(Animation *anim, Source *source, const MappedFile *file)
+{
+    /* Canvas size and frame count from the container, before the decoder allocates its canvases */
+    WebPData data = {file->data, file->size};
+    WebPDemuxer *demux = WebPDemux(&data);
+    if (!demux)
+        return 0;
+    source->width = (int)WebPDemuxGetI(demux, WEBP_FF_CANVAS_WIDTH);
+    source->height = (int)WebPDemuxGetI(demux, WEBP_FF_CANVAS_HEIGHT);
+    int frames = (int)WebPDemuxGetI(demux, WEBP_FF_FRAME_COUNT);
+    WebPDemuxDelete(demux);
+    if (frames < 2)
+        return 0;
+
+    int count = ring_size(anim, source->width, source->height);
+    WebPAnimDecoderOptions options;
+    if (count == 0 || !WebPAnimDecoderOptionsInit(&options))
+        return 0;
+    options.color_mode = MODE_RGBA;
+    options.use_threads = 0;
+    source->webp = WebPAnimDecoderNew(&data, &options);
+    return source->webp ? count : 0;
+}
+
+static int webp_next_frame(Animation *anim, Source *source, SDL_Surface *frame, int *delay_ms)
+{
+    if (!WebPAnimDecoderHasMoreFrames(source->webp)) {
+        WebPAnimDecoderReset(source->webp);
+        source->webp_time = 0;
+        return 0;
+    }
+    /* A WebP frame cannot be abandoned halfway, at least do not start one */
+    if (SDL_AtomicGet(&anim->cancelled))
+        return -1;
+    uint8_t *pixels;
+    int timestamp;
+    if (!WebPAnimDecoderGetNext(source->webp, &pixels, &timestamp) || SDL_AtomicGet(&anim->cancelled))
+        return -1;
+    *delay_ms = timestamp - source->webp_time;
+    source->webp_time = timestamp;
+    SDL_ConvertPixels(source->width, source->height, SDL_PIXELFORMAT_RGBA32, pixels, source->width * 4,
+        anim->pixel_format, frame->pixels, frame->pitch);
+    return 1;
+}
+#endif
+
+/* Parse the file and set up decoding. Returns the number of frames to decode ahead, 0 to keep the still */
+static int source_open(Animation *anim, Source *source, const MappedFile *file)
+{
+#ifdef HAVE_WEBPDEMUX
+    if (anim->format == FORMAT_WEBP)
+        return webp_open(anim, source, file);
+#endif
+    return gif_open(anim, source, file);
+}
+
+/* Decode the next frame into frame. Returns 1 for a frame, 0 after the last one (the next call starts over),
+ * -1 on error or when cancelled */
+static int source_next_frame(Animation *anim, Source *source, SDL_Surface *frame, int *delay_ms)
+{
+#ifdef HAVE_WEBPDEMUX
+    if (source->webp)
+        return webp_next_frame(anim, source, frame, delay_ms);
+#endif
+    int result = gif_next_frame(anim, source, delay_ms);
+    if (result == 0)
+        gif_rewind(source);
+    if (result == 1)
+        SDL_ConvertPixels(source->width, source->height, anim->pixel_format, source->canvas,
+            source->width * (int)sizeof(Uint32), anim->pixel_format, frame->pixels, frame->pitch);
+    return result;
+}
+
+static void source_close(Source *source)
+{
+    free(source->canvas);
+    free(source->previous);
+#ifdef HAVE_WEBPDEMUX
+    if (source->webp)
+        WebPAnimDecoderDelete(source->webp);
+#endif
+}
+
+static int anim_thread(void *data)
+{
+    Animation *anim = data;
+    Source *source = calloc(1, sizeof(Source));
+    SDL_PixelFormat *format = SDL_AllocFormat(anim->pixel_format);
+    MappedFile file;
+    memset(&file, 0, sizeof(MappedFile));
+    int count = 0;
+    if (source && format && map_file(anim->path, &file) == 0) {
+        source->format = format;
+        count = source_open(anim, source, &file);
+    }
+
+    /* Frame surfaces are made once and refilled as playback loops */
+    for (int i = 0; i < count; i++) {
+        anim->frames[i].surface =
+            SDL_CreateRGBSurfaceWithFormat(0, source->width, source->height, 32, anim->pixel_format);
+        if (!anim->frames[i].surface)
+            count = 0;
+    }
+    SDL_LockMutex(anim->lock);
+    anim->frame_count = count;
+    SDL_UnlockMutex(anim->lock);
+
+    int decoded = 0; /* Since the last loop */
+    while (count > 0) {
+        SDL_LockMutex(anim->lock);
+        while (anim->queued == count && !SDL_AtomicGet(&anim->cancelled))
+            SDL_CondWait(anim->work, anim->lock);
+        Frame *frame = &anim->frames[(anim->head + anim->queued) % count];
+        SDL_UnlockMutex(anim->lock);
+        if (SDL_AtomicGet(&anim->cancelled))
+            break;
+
+        /* The frame is not in the ring yet, the main thread does not look at it */
+        int delay_ms = 0;
+        int result = source_next_frame(anim, source, frame->surface, &delay_ms);
+        if (result == 0 && decoded > 0) {
+            decoded = 0;
+            continue;
+        }
+        if (result <= 0)
+            break;
+        decoded++;
+        frame->delay_ms = delay_ms < MIN_FRAME_DELAY_MS ? DEFAULT_FRAME_DELAY_MS : delay_ms;
+
+        SDL_LockMutex(anim->lock);
+        anim->queued++;
+        SDL_UnlockMutex(anim->lock);
+        wake_main(WAKE_FRAME);
+    }
+    if (source)
+        source_close(source);
+    free(source);
+    unmap_file(&file);
+    if (format)
+        SDL_FreeFormat(format);
+
+    /* Stopped on its own: the main loop keeps the frame on screen until it destroys the animation */
+    SDL_LockMutex(anim->lock);
+    if (!SDL_AtomicGet(&anim->cancelled)) {
+        anim->still = 1;
+        wake_main(WAKE_FRAME);
+    }
+    while (!SDL_AtomicGet(&anim->cancelled))
+        SDL_CondWait(anim->work, anim->lock);
+    SDL_UnlockMutex(anim->lock);
+
+    /* Destroyed: the frames are no longer looked at, the rest is freed once the thread is joined */
+    for (int i = 0; i < ANIM_MAX_FRAMES; i++) {
+        SDL_FreeSurface(anim->frames[i].surface);
+        anim->frames[i].surface = NULL;
+    }
+    SDL_AtomicSet(&anim->exited, 1);
+    return 0;
+}
+
+Animation *anim_create(const char *path, ImageFormat format, Uint32 pixel_format)
+{
+#ifdef HAVE_WEBPDEMUX
+    if (format != FORMAT_GIF && format != FORMAT_WEBP)
+        return NULL;
+#else
+    if (format != FORMAT_GIF)
+        return NULL;
+#endif
+    Animation *anim = calloc(1, sizeof(Animation));
+    if (!anim)
+        return NULL;
+    snprintf(anim->path, MAX_PATH, "%s", path);
+    anim->format = format;
+    anim->pixel_format = pixel_format;
+    anim->lock = SDL_CreateMutex();
+    anim->work = SDL_CreateCond();
+    if (!anim->lock || !anim->work) {
+        free_animation(anim);
+        return NULL;
+    }
+    anim->thread = SDL_CreateThread(anim_thread, "anim", anim);
+    if (!anim->thread) {
+        fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+        free_animation(anim);
+        return NULL;
+    }
+    return anim;
+}
+
+/* Join the threads of destroyed animations that exited, or all of them with wait, and free the animations */
+static void reap_orphans(int wait)
+{
+    int kept = 0;
+    for (int i = 0; i < orphan_count; i++) {
+        Animation *anim = orphans[i];
+        if (wait || SDL_AtomicGet(&anim->exited)) {
+            SDL_WaitThread(anim->thread, NULL);
+            free_animation(anim);
+        } else {
+            orphans[kept++] = anim;
+        }
+    }
+    orphan_count = kept;
+}
+
+void anim_destroy(Animation *anim)
+{
+    if (!anim)
+        return;
+    SDL_LockMutex(anim->lock);
+    SDL_AtomicSet(&anim->cancelled, 1);
+    SDL_CondSignal(anim->work);
+    SDL_UnlockMutex(anim->lock);
+
+    /* Joined later, so a frame being decoded never holds up the main thread */
+    reap_orphans(0);
+    if (array_grow((void **)&orphans, &orphan_capacity, orphan_count + 1, sizeof(Animation *)) != 0) {
+        SDL_WaitThread(anim->thread, NULL);
+        free_animation(anim);
+        return;
+    }
+    orphans[orphan_count++] = anim;
+}
+
+void anim_shutdown(void)
+{
+    reap_orphans(1);
+    free(orphans);
+    orphans = NULL;
+    orphan_capacity = 0;
+}
+
+AnimStatus anim_poll(Animation *anim, Uint32 now, SDL_Surface **frame)
+{
+    *frame = NULL;
+    SDL_LockMutex(anim->lock);
+    /* The frame handed out last time is uploaded by now */
+    if (anim->shown) {
+        anim->head = (anim->head + 1) % anim->frame_count;
+        anim->queued--;
+        anim->shown = 0;
+        SDL_CondSignal(anim->work);
+    }
+
+    AnimStatus status = anim->still ? ANIM_STILL : ANIM_WAIT;
+    if (status == ANIM_WAIT && anim->queued > 0 && (!anim->started || SDL_TICKS_PASSED(now, anim->due))) {
+        Frame *next = &anim->frames[anim->head];
+        /* Behind by more than a frame (slow decode, grid shown): go on from now rather than catching up */
+        int late = anim->started && SDL_TICKS_PASSED(now, anim->due + (Uint32)next->delay_ms);
+        anim->due = (anim->started && !late ? anim->due : now) + (Uint32)next->delay_ms;
+        anim->started = 1;
+        anim->shown = 1;
+        *frame = next->surface;
+        status = ANIM_FRAME;
+    }
+    SDL_UnlockMutex(anim->lock);
+    return status;
+}
+
+int anim_wait_ms(Animation *anim, Uint32 now)
+{
+    int wait = -1;
+    SDL_LockMutex(anim->lock);
+    if (anim->still)
+        wait = 0;
+    else if (anim->queued > anim->shown)
+        wait = !anim->started || SDL_TICKS_PASSED(now, anim->due) ? 0 : (int)(anim->due - now);
+    SDL_UnlockMutex(anim->lock);
+    return wait;
+}
@@ -0,0 +1,40 @@
+#ifndef ANIM_H
+#define ANIM_H
+
+#include "types.h"
+
+#include <SDL2/SDL.h>
+
+/* Memory an animation may hold in decoded frames, compositing canvases included. Larger animations only
+ * show their first frame */
+#define ANIM_FRAME_BUDGET (64 * 1024 * 1024)
+
+/* Frames decoded ahead of the one on screen, at most */
+#define ANIM_MAX_FRAMES 8
+
+typedef enum {
+    ANIM_WAIT,  /* No new frame is due yet */
+    ANIM_FRAME, /* The next frame is due */
+    ANIM_STILL, /* Not animated, over the budget or undecodable: keep the first frame */
+} AnimStatus;
+
+typedef struct Animation Animation;
+
+/* Start playing the animated GIF (or WebP with libwebpdemux) at path on a thread of its own, frames are
+ * decoded a few ahead into pixel_format (an IS_PIXELFORMAT_8888 one) and looped. NULL for other formats */
+Animation *anim_create(const char *path, ImageFormat format, Uint32 pixel_format);
+
+/* Stop playing without waiting: a GIF frame being decoded is abandoned at the next row, a WebP frame is
+ * finished first. The thread is joined once it exited, at the latest by anim_shutdown() */
+void anim_destroy(Animation *anim);
+
+/* Wait for the threads of destroyed animations, before SDL_Quit() */
+void anim_shutdown(void);
+
+/* Get the next frame once it is due at now (SDL_GetTicks()). The frame is valid until the next call */
+AnimStatus anim_poll(Animation *anim, Uint32 now, SDL_Surface **frame);
+
+/* Milliseconds until a decoded frame is due, -1 when waiting on the decoder (it wakes the main loop) */
+int anim_wait_ms(Animation *anim, Uint32 now);
+
+#endif /* ANIM_H */
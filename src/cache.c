@@ -0,0 +1,216 @@
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    int index;
+    int target_width; /* Decode scale, 0x0 for full resolution */
+    int target_height;
+    DecodedImage image;    /* Surface entries */
+    CachedTexture texture; /* Texture entries, texture.texture is NULL for a surface */
+    size_t bytes;
+    Uint32 last_used;
+} Entry;
+
+struct Cache {
+    TexturePool *pool;
+    size_t limit;
+    size_t bytes;
+    Entry *entries;
+    int count;
+    int capacity;
+    Uint32 uses; /* Clock of last_used */
+    int current;
+    int keep;
+    CacheStats stats;
+};
+
+Cache *cache_create(int limit_mb, TexturePool *pool)
+{
+    if (limit_mb <= 0)
+        return NULL;
+    Cache *cache = calloc(1, sizeof(Cache));
+    if (!cache)
+        return NULL;
+    cache->pool = pool;
+    cache->limit = (size_t)limit_mb * 1024 * 1024;
+    cache->keep = -1;
+    return cache;
+}
+
+static void drop(Cache *cache, int i)
+{
+    Entry *entry = &cache->entries[i];
+    if (entry->texture.texture)
+        texture_release(cache->pool, entry->texture.texture);
+    SDL_FreeSurface(entry->image.surface);
+    cache->bytes -= entry->bytes;
+    cache->entries[i] = cache->entries[--cache->count];
+}
+
+void cache_destroy(Cache *cache)
+{
+    if (!cache)
+        return;
+    while (cache->count > 0)
+        drop(cache, cache->count - 1);
+    free(cache->entries);
+    free(cache);
+}
+
+void cache_set_focus(Cache *cache, int current, int keep)
+{
+    if (!cache)
+        return;
+    cache->current = current;
+    cache->keep = keep;
+}
+
+static int near_focus(const Cache *cache, int index)
+{
+    return abs(index - cache->current) <= CACHE_NEIGHBOURS ||
+           (cache->keep >= 0 && abs(index - cache->keep) <= CACHE_NEIGHBOURS);
+}
+
+/* Least recently used entry away from the focus, or near it once there is none */
+static int victim(const Cache *cache)
+{
+    int best = -1;
+    int best_near = 0;
+    for (int i = 0; i < cache->count; i++) {
+        int near = near_focus(cache, cache->entries[i].index);
+        if (best < 0 || near < best_near ||
+            (near == best_near && cache->entries[i].last_used < cache->entries[best].last_used)) {
+            best = i;
+            best_near = near;
+        }
+    }
+    return best;
+}
+
+static int find(const Cache *cache, int index, int target_width, int target_height, int texture)
+{
+    for (int i = 0; i < cache->count; i++) {
+        const Entry *entry = &cache->entries[i];
+        if (entry->index == index && entry->target_width == target_width &&
+            entry->target_height == target_height && (entry->texture.texture != NULL) == texture)
+            return i;
+    }
+    return -1;
+}
+
+/* Make room for bytes and add an entry for index, NULL when it does not fit at all */
+static Entry *add(Cache *cache, int index, int target_width, int target_height, int texture, size_t bytes)
+{
+    int existing = find(cache, index, target_width, target_height, texture);
+    if (existing >= 0)
+        drop(cache, existing);
+    if (bytes > cache->limit)
+        return NULL;
+    while (cache->bytes + bytes > cache->limit && cache->count > 0)
+        drop(cache, victim(cache));
+
+    if (cache->count == cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity * 2 : 16;
+        Entry *entries = realloc(cache->entries, sizeof(Entry) * capacity);
+        if (!entries)
+            return NULL;
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    Entry *entry = &cache->entries[cache->count++];
+    memset(entry, 0, sizeof(Entry));
+    entry->index = index;
+    entry->target_width = target_width;
+    entry->target_height = target_height;
+    entry->bytes = bytes;
+    entry->last_used = ++cache->uses;
+    cache->bytes += bytes;
+    return entry;
+}
+
+int cache_put_surface(Cache *cache, int index, int target_width, int target_height, const DecodedImage *image)
+{
+    if (!cache)
+        return 0;
+    size_t bytes = (size_t)image->surface->pitch * image->surface->h;
+    Entry *entry = add(cache, index, target_width, target_height, 0, bytes);
+    if (!entry)
+        return 0;
+    entry->image = *image;
+    return 1;
+}
+
+int cache_take_surface(Cache *cache, int index, int target_width, int target_height, DecodedImage *out)
+{
+    if (!cache)
+        return 0;
+    int i = find(cache, index, target_width, target_height, 0);
+    if (i < 0) {
+        cache->stats.surface_misses++;
+        return 0;
+    }
+    *out = cache->entries[i].image;
+    cache->entries[i].image.surface = NULL;
+    drop(cache, i);
+    cache->stats.surface_hits++;
+    return 1;
+}
+
+int cache_put_texture(Cache *cache, int index, int target_width, int target_height, const CachedTexture *texture)
+{
+    if (!cache)
+        return 0;
+    size_t bytes = (size_t)texture->width * texture->height * 4;
+    Entry *entry = add(cache, index, target_width, target_height, 1, bytes);
+    if (!entry)
+        return 0;
+    entry->texture = *texture;
+    texture_detach(cache->pool, texture->texture);
+    return 1;
+}
+
+int cache_has_texture(const Cache *cache, int index, int target_width, int target_height)
+{
+    return cache && find(cache, index, target_width, target_height, 1) >= 0;
+}
+
+int cache_take_texture(Cache *cache, int index, int target_width, int target_height, CachedTexture *out)
+{
+    if (!cache)
+        return 0;
+    int i = find(cache, index, target_width, target_height, 1);
+    if (i < 0) {
+        cache->stats.texture_misses++;
+        return 0;
+    }
+    *out = cache->entries[i].texture;
+    cache->entries[i].texture.texture = NULL;
+    drop(cache, i);
+    cache->stats.texture_hits++;
+    return 1;
+}
+
+void cache_stats(const Cache *cache, CacheStats *out)
+{
+    memset(out, 0, sizeof(CacheStats));
+    if (!cache)
+        return;
+    *out = cache->stats;
+    out->entries = cache->count;
+    out->bytes = cache->bytes;
+}
+
+void cache_print_stats(const Cache *cache)
+{
+    CacheStats stats;
+    cache_stats(cache, &stats);
+    int textures = stats.texture_hits + stats.texture_misses;
+    int surfaces = stats.surface_hits + stats.surface_misses;
+    if (textures == 0 && surfaces == 0)
+        return;
+    printf("Cache: %d of %d images shown from a kept texture, %d of %d decodes saved, %.1f MB held\n",
+        stats.texture_hits, textures, stats.surface_hits, surfaces, stats.bytes / (1024.0 * 1024.0));
+}
@@ -0,0 +1,69 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "decode.h"
+#include "textures.h"
+
+#include <SDL2/SDL.h>
+
+#define DEFAULT_CACHE_MB 256
+#define MAX_CACHE_MB     65536
+
+/* Images this close to the current one, or to the one the next undo brings back, are evicted last */
+#define CACHE_NEIGHBOURS 2
+
+/* Texture an image was shown with */
+typedef struct {
+    SDL_Texture *texture;
+    int width; /* Texture size, may be a reduced resolution decode */
+    int height;
+    int full_width; /* Image size at full resolution */
+    int full_height;
+    int reduced;
+} CachedTexture;
+
+typedef struct {
+    int texture_hits;
+    int texture_misses;
+    int surface_hits;
+    int surface_misses;
+    int entries;
+    size_t bytes;
+} CacheStats;
+
+typedef struct Cache Cache;
+
+/* Keep the decoded surfaces and textures of images that are no longer needed, up to limit_mb of pixels, for
+ * when they come back (undo, second pass). Evicted textures go back to pool. NULL with a limit of 0, every
+ * function accepts a NULL cache. Main thread only */
+Cache *cache_create(int limit_mb, TexturePool *pool);
+
+/* Free every surface and texture held, before destroying the pool */
+void cache_destroy(Cache *cache);
+
+/* Evict the least recently used entries first, those near current or keep (-1 for none) last */
+void cache_set_focus(Cache *cache, int current, int keep);
+
+/* Hold a decode of index for the target size (0x0 for full resolution). Returns 1 when the cache took the
+ * surface, 0 when the caller keeps it (larger than the limit) */
+int cache_put_surface(Cache *cache, int index, int target_width, int target_height, const DecodedImage *image);
+
+/* Take back a surface held for index and the target size. Returns 1 on a hit */
+int cache_take_surface(Cache *cache, int index, int target_width, int target_height, DecodedImage *out);
+
+/* Hold the texture index was shown with for the target size. Returns 1 when the cache took it */
+int cache_put_texture(Cache *cache, int index, int target_width, int target_height, const CachedTexture *texture);
+
+/* Whether a texture is held for index and the target size, without counting a hit or miss */
+int cache_has_texture(const Cache *cache, int index, int target_width, int target_height);
+
+/* Take back a texture held for index and the target size. Returns 1 on a hit */
+int cache_take_texture(Cache *cache, int index, int target_width, int target_height, CachedTexture *out);
+
+/* Hit and miss counters and what is held */
+void cache_stats(const Cache *cache, CacheStats *out);
+
+/* Print the hit rates */
+void cache_print_stats(const Cache *cache);
+
+#endif /* CACHE_H */
@@ -0,0 +1,244 @@
+#include "decisions.h"
+
+#include "files.h"
+#include "mover.h"
+
+#include <SDL2/SDL.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Renames are metadata operations: a few threads keep the filesystem busy without thrashing it, and the
+ * queue is only kept a few moves deep per thread instead of holding every move of the file */
+#define APPLY_THREADS   8
+#define APPLY_IN_FLIGHT (APPLY_THREADS * 4)
+
+/* Missing images reported by name, the rest only counted */
+#define MAX_MISSING_WARNINGS 10
+
+#define UNDECIDED -2
+
+typedef struct {
+    const char *name;
+    int index;
+} NameIndex;
+
+typedef struct {
+    int moved;
+    int failed;
+    int skipped;
+    int missing; /* Named in the file, not in the source directory */
+    int invalid; /* Lines that are not a decision */
+} ApplyStats;
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(((const NameIndex *)a)->name, ((const NameIndex *)b)->name);
+}
+
+/* Destination of a decision word, DECISION_SKIP, or UNDECIDED when it is not one */
+static int parse_decision(const char *word, const Config *config)
+{
+    int dest;
+    if (strcmp(word, "skip") == 0)
+        return DECISION_SKIP;
+    if (strcmp(word, "left") == 0)
+        dest = DEST_LEFT;
+    else if (strcmp(word, "right") == 0)
+        dest = DEST_RIGHT;
+    else if (word[0] >= '1' && word[0] <= '9' && word[1] == '\0')
+        dest = word[0] - '1';
+    else
+        return UNDECIDED;
+    return dest < config->dest_count ? dest : UNDECIDED;
+}
+
+/* Read the decisions file into decided, one entry per image of list. Returns 0 on success */
+static int read_decisions(const char *path, const ImageList *list, const Config *config, int8_t *decided,
+    ApplyStats *stats)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot read decisions '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* Names sorted once, each line is a binary search */
+    NameIndex *names = malloc(sizeof(NameIndex) * (list->count > 0 ? list->count : 1));
+    if (!names) {
+        fclose(f);
+        return -1;
+    }
+    for (int i = 0; i < list->count; i++) {
+        names[i].name = image_name(list, i);
+        names[i].index = i;
+    }
+    qsort(names, list->count, sizeof(NameIndex), compare_names);
+
+    size_t dir_len = strlen(list->dir);
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    int line_number = 0;
+    while ((len = getline(&line, &capacity, f)) >= 0) {
+        line_number++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        /* The decision follows the last tab, names may contain tabs */
+        char *tab = strrchr(line, '\t');
+        int dest = tab ? parse_decision(tab + 1, config) : UNDECIDED;
+        if (dest == UNDECIDED) {
+            fprintf(stderr, "Warning: %s:%d: expected <name><TAB><left|right|skip|1-%d>\n", path, line_number,
+                config->dest_count);
+            stats->invalid++;
+            continue;
+        }
+        *tab = '\0';
+
+        /* Full paths into the source directory are accepted too */
+        NameIndex key = {line, 0};
+        if (strncmp(line, list->dir, dir_len) == 0 && line[dir_len] == '/')
+            key.name = line + dir_len + 1;
+        const NameIndex *found = bsearch(&key, names, list->count, sizeof(NameIndex), compare_names);
+        if (found) {
+            decided[found->index] = (int8_t)dest;
+        } else if (dest != DECISION_SKIP) {
+            if (stats->missing++ < MAX_MISSING_WARNINGS)
+                fprintf(stderr, "Warning: '%s' is not in '%s'\n", key.name, list->dir);
+        }
+    }
+
+    free(line);
+    free(names);
+    fclose(f);
+    return 0;
+}
+
+static void count_result(const MoveResult *result, ApplyStats *stats)
+{
+    if (result->result == 0)
+        stats->moved++;
+    else
+        stats->failed++;
+}
+
+static double seconds_since(Uint64 start)
+{
+    return (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+}
+
+int decisions_apply(const Config *config)
+{
+    ImageList list;
+    DirId excluded[MAX_DESTS];
+    int excluded_count = dest_dir_ids(config, excluded);
+    if (load_image_list(config->source_dir, config->recursive, excluded, excluded_count, &list) != 0)
+        return -1;
+
+    ApplyStats stats;
+    memset(&stats, 0, sizeof(stats));
+    int8_t *decided = malloc(list.count > 0 ? list.count : 1);
+    if (!decided) {
+        free_image_list(&list);
+        return -1;
+    }
+    memset(decided, UNDECIDED, list.count);
+    if (read_decisions(config->apply_path, &list, config, decided, &stats) != 0) {
+        free(decided);
+        free_image_list(&list);
+        return -1;
+    }
+
+    /* Every move is journaled, a crash halfway is settled by the next run like an interactive one */
+    Mover *mover = mover_create(list.dir, config, APPLY_THREADS);
+    if (!mover) {
+        free(decided);
+        free_image_list(&list);
+        return -1;
+    }
+
+    int total = 0;
+    for (int i = 0; i < list.count; i++) {
+        total += decided[i] >= 0;
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    double next_report = 1.0;
+    int in_flight = 0;
+    MoveResult result;
+    for (int i = 0; i < list.count; i++) {
+        if (decided[i] == DECISION_SKIP)
+            stats.skipped++;
+        if (decided[i] < 0)
+            continue;
+
+        while (in_flight >= APPLY_IN_FLIGHT && mover_wait(mover, &result)) {
+            in_flight--;
+            count_result(&result, &stats);
+        }
+        if (mover_queue(mover, image_name(&list, i), decided[i], 0, i) < 0)
+            stats.failed++;
+        else
+            in_flight++;
+
+        double elapsed = seconds_since(start);
+        if (elapsed >= next_report) {
+            printf("Moved %d/%d (%.0f files/s)\n", stats.moved, total, stats.moved / elapsed);
+            next_report = elapsed + 1.0;
+        }
+    }
+    while (mover_wait(mover, &result)) {
+        count_result(&result, &stats);
+    }
+    mover_destroy(mover);
+
+    double elapsed = seconds_since(start);
+    double rate = elapsed > 0 ? stats.moved / elapsed : 0.0;
+    printf("Applied %d moves in %.2f s (%.0f files/s), %d skipped, %d failed, %d not found, %d invalid lines\n",
+        stats.moved, elapsed, rate, stats.skipped, stats.failed, stats.missing, stats.invalid);
+
+    free(decided);
+    free_image_list(&list);
+    return stats.failed || stats.missing || stats.invalid ? -1 : 0;
+}
+
+FILE *decisions_open(const char *path)
+{
+    FILE *file = fopen(path, "a");
+    if (!file) {
+        fprintf(stderr, "Warning: Cannot record decisions to '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+    /* Every decision reaches the file even if the run does not end cleanly */
+    setvbuf(file, NULL, _IOLBF, 0);
+    return file;
+}
+
+void decisions_write(FILE *file, const char *name, int dest)
+{
+    if (!file)
+        return;
+    if (strchr(name, '\n')) {
+        fprintf(stderr, "Warning: Cannot record '%s', its name has a line break\n", name);
+        return;
+    }
+    if (dest == DECISION_SKIP)
+        fprintf(file, "%s\tskip\n", name);
+    else if (dest == DEST_LEFT)
+        fprintf(file, "%s\tleft\n", name);
+    else if (dest == DEST_RIGHT)
+        fprintf(file, "%s\tright\n", name);
+    else
+        fprintf(file, "%s\t%d\n", name, dest + 1);
+}
+
+void decisions_close(FILE *file)
+{
+    if (file)
+        fclose(file);
+}
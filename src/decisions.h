@@ -0,0 +1,25 @@
+#ifndef DECISIONS_H
+#define DECISIONS_H
+
+#include "types.h"
+
+#include <stdio.h>
+
+/* Decisions file: one "<name>\t<decision>" line per image, the name relative to the source directory
+ * and the decision left, right, skip or a destination number (1 to 9). A later line for the same name
+ * replaces the earlier ones, lines starting with # are comments */
+#define DECISION_SKIP -1
+
+/* Move the images of the source directory as the decisions file of config decides, without a window,
+ * on parallel move threads. Returns 0 when every decision was applied */
+int decisions_apply(const Config *config);
+
+/* Open path to append the decisions made in this run. NULL (after a warning) when it cannot be written */
+FILE *decisions_open(const char *path);
+
+/* Record the decision for name: a destination or DECISION_SKIP. Does nothing without a file */
+void decisions_write(FILE *file, const char *name, int dest);
+
+void decisions_close(FILE *file);
+
+#endif /* DECISIONS_H */
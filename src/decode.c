@@ -0,0 +1,358 @@
+#include "decode.h"
+
+#include "exif.h"
+#include "sniff.h"
+
+#include <SDL2/SDL_image.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+/* jpeglib.h needs FILE and size_t declared first */
+#include <jpeglib.h>
+
+#ifdef JCS_ALPHA_EXTENSIONS
+    #define JPEG_COLOR_SPACE JCS_EXT_RGBA
+    #define JPEG_PIXEL_FORMAT SDL_PIXELFORMAT_RGBA32
+#else
+    #define JPEG_COLOR_SPACE JCS_RGB
+    #define JPEG_PIXEL_FORMAT SDL_PIXELFORMAT_RGB24
+#endif
+
+/* libjpeg-turbo writes the byte orders of the 8888 formats directly, others are converted after decoding */
+static J_COLOR_SPACE jpeg_color_space(Uint32 pixel_format, Uint32 *surface_format)
+{
+#ifdef JCS_ALPHA_EXTENSIONS
+    static const struct {
+        Uint32 pixel_format;
+        J_COLOR_SPACE color_space;
+    } byte_orders[] = {{SDL_PIXELFORMAT_RGBA32, JCS_EXT_RGBA}, {SDL_PIXELFORMAT_BGRA32, JCS_EXT_BGRA},
+        {SDL_PIXELFORMAT_ARGB32, JCS_EXT_ARGB}, {SDL_PIXELFORMAT_ABGR32, JCS_EXT_ABGR}};
+    for (size_t i = 0; i < sizeof(byte_orders) / sizeof(byte_orders[0]); i++) {
+        if (byte_orders[i].pixel_format == pixel_format) {
+            *surface_format = pixel_format;
+            return byte_orders[i].color_space;
+        }
+    }
+#else
+    (void)pixel_format;
+#endif
+    *surface_format = JPEG_PIXEL_FORMAT;
+    return JPEG_COLOR_SPACE;
+}
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    JpegError *err = (JpegError *)cinfo->err;
+    longjmp(err->jump, 1);
+}
+
+static void jpeg_silent(j_common_ptr cinfo)
+{
+    (void)cinfo;
+}
+
+struct jpeg_error_mgr *quiet_jpeg_errors(JpegError *err)
+{
+    jpeg_std_error(&err->mgr);
+    err->mgr.error_exit = jpeg_error_exit;
+    err->mgr.output_message = jpeg_silent;
+    return &err->mgr;
+}
+
+/* Size the image is displayed at when fitted into the box, never upscaled */
+static void fit_size(int width, int height, int max_width, int max_height, int *fit_width, int *fit_height)
+{
+    float scale_x = (float)max_width / width;
+    float scale_y = (float)max_height / height;
+    float scale = (scale_x < scale_y) ? scale_x : scale_y;
+    if (max_width <= 0 || max_height <= 0 || scale > 1.0f)
+        scale = 1.0f;
+    *fit_width = (int)(width * scale);
+    *fit_height = (int)(height * scale);
+}
+
+/* Decode with libjpeg, using DCT-domain scaling (1/2, 1/4, 1/8) when the target box allows it.
+ * Returns 1 when the caller should fall back to SDL_image (e.g. CMYK), -1 on a corrupt file */
+static int decode_jpeg(const char *path, const MappedFile *file, int max_width, int max_height,
+    Uint32 pixel_format, DecodedImage *out)
+{
+    FILE *volatile f = NULL;
+    if (!file) {
+        f = fopen(path, "rb");
+        if (!f)
+            return -1;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    JpegError err;
+    SDL_Surface *volatile surface = NULL;
+    volatile int result = -1;
+
+    cinfo.err = quiet_jpeg_errors(&err);
+    if (setjmp(err.jump)) {
+        SDL_FreeSurface(surface);
+        jpeg_destroy_decompress(&cinfo);
+        if (f)
+            fclose(f);
+        return result;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    if (file)
+        jpeg_mem_src(&cinfo, file->data, file->size);
+    else
+        jpeg_stdio_src(&cinfo, f);
+    /* Keep the EXIF segment for the orientation, libjpeg ignores it */
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&cinfo, TRUE);
+
+    ExifInfo exif = {1, 0, 0, NULL, 0, "", ""};
+    for (jpeg_saved_marker_ptr marker = cinfo.marker_list; marker; marker = marker->next) {
+        if (marker->data_length > 6 && memcmp(marker->data, "Exif\0\0", 6) == 0)
+            exif_parse_tiff(marker->data + 6, marker->data_length - 6, &exif);
+    }
+
+    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+        result = 1;
+        longjmp(err.jump, 1);
+    }
+
+    int fit_width, fit_height;
+    fit_size(cinfo.image_width, cinfo.image_height, max_width, max_height, &fit_width, &fit_height);
+
+    /* Smallest DCT scale whose output still covers the displayed size */
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    for (unsigned int denom = 8; denom > 1; denom /= 2) {
+        if ((int)((cinfo.image_width + denom - 1) / denom) >= fit_width &&
+            (int)((cinfo.image_height + denom - 1) / denom) >= fit_height) {
+            cinfo.scale_denom = denom;
+            break;
+        }
+    }
+    Uint32 surface_format;
+    cinfo.out_color_space = jpeg_color_space(pixel_format, &surface_format);
+    jpeg_start_decompress(&cinfo);
+
+    surface = SDL_CreateRGBSurfaceWithFormat(0, cinfo.output_width, cinfo.output_height, 32, surface_format);
+    if (!surface)
+        longjmp(err.jump, 1);
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = (JSAMPROW)surface->pixels + (size_t)cinfo.output_scanline * surface->pitch;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+
+    out->surface = orient_surface(surface, exif.orientation);
+    out->full_width = exif.orientation >= 5 ? cinfo.image_height : cinfo.image_width;
+    out->full_height = exif.orientation >= 5 ? cinfo.image_width : cinfo.image_height;
+    out->reduced = cinfo.scale_denom > 1;
+
+    jpeg_destroy_decompress(&cinfo);
+    if (f)
+        fclose(f);
+    return 0;
+}
+
+SDL_Surface *orient_surface(SDL_Surface *surface, int orientation)
+{
+    if (orientation <= 1 || orientation > 8)
+        return surface;
+
+    SDL_Surface *src = surface;
+    if (src->format->BytesPerPixel != 3 && src->format->BytesPerPixel != 4) {
+        src = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+        if (!src)
+            return surface;
+    }
+    int bpp = src->format->BytesPerPixel;
+    int transposed = orientation >= 5;
+    int width = transposed ? src->h : src->w;
+    int height = transposed ? src->w : src->h;
+    SDL_Surface *dst = SDL_CreateRGBSurfaceWithFormat(0, width, height, bpp * 8, src->format->format);
+    if (!dst) {
+        if (src != surface)
+            SDL_FreeSurface(src);
+        return surface;
+    }
+
+    /* Destination of source pixel (x, y): (x0 + x * xx + y * xy, y0 + x * yx + y * yy) */
+    int w = src->w - 1, h = src->h - 1;
+    int x0 = 0, y0 = 0, xx = 0, xy = 0, yx = 0, yy = 0;
+    switch (orientation) {
+        case 2: /* Mirrored */
+            x0 = w, xx = -1, yy = 1;
+            break;
+        case 3: /* Upside down */
+            x0 = w, y0 = h, xx = -1, yy = -1;
+            break;
+        case 4: /* Upside down and mirrored */
+            y0 = h, xx = 1, yy = -1;
+            break;
+        case 5: /* Transposed */
+            xy = 1, yx = 1;
+            break;
+        case 6: /* Needs a quarter turn clockwise */
+            x0 = h, xy = -1, yx = 1;
+            break;
+        case 7: /* Transverse */
+            x0 = h, y0 = w, xy = -1, yx = -1;
+            break;
+        default: /* 8: Needs a quarter turn counterclockwise */
+            y0 = w, xy = 1, yx = -1;
+            break;
+    }
+    ptrdiff_t step_x = (ptrdiff_t)yx * dst->pitch + xx * bpp;
+    ptrdiff_t step_y = (ptrdiff_t)yy * dst->pitch + xy * bpp;
+    Uint8 *row_out = (Uint8 *)dst->pixels + (ptrdiff_t)y0 * dst->pitch + x0 * bpp;
+    for (int y = 0; y < src->h; y++, row_out += step_y) {
+        const Uint8 *in = (const Uint8 *)src->pixels + (size_t)y * src->pitch;
+        Uint8 *out = row_out;
+        for (int x = 0; x < src->w; x++, in += bpp, out += step_x) {
+            memcpy(out, in, bpp);
+        }
+    }
+
+    if (src != surface)
+        SDL_FreeSurface(src);
+    SDL_FreeSurface(surface);
+    return dst;
+}
+
+SDL_Surface *box_downsample(SDL_Surface *src, int factor)
+{
+    int width = src->w / factor;
+    int height = src->h / factor;
+    SDL_Surface *dst = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, src->format->format);
+    if (!dst)
+        return NULL;
+
+    int area = factor * factor;
+    for (int y = 0; y < height; y++) {
+        Uint8 *out = (Uint8 *)dst->pixels + (size_t)y * dst->pitch;
+        for (int x = 0; x < width; x++) {
+            unsigned int sum[4] = {0, 0, 0, 0};
+            for (int sy = 0; sy < factor; sy++) {
+                const Uint8 *in = (const Uint8 *)src->pixels + (size_t)(y * factor + sy) * src->pitch +
+                                  (size_t)x * factor * 4;
+                for (int sx = 0; sx < factor * 4; sx += 4) {
+                    sum[0] += in[sx];
+                    sum[1] += in[sx + 1];
+                    sum[2] += in[sx + 2];
+                    sum[3] += in[sx + 3];
+                }
+            }
+            for (int c = 0; c < 4; c++) {
+                out[x * 4 + c] = (Uint8)(sum[c] / area);
+            }
+        }
+    }
+    return dst;
+}
+
+static int decode_generic(const char *path, const MappedFile *file, ImageFormat format, int max_width,
+    int max_height, Uint32 pixel_format, DecodedImage *out)
+{
+    /* The format is known from sniffing, skip SDL_image's probe chain */
+    SDL_RWops *src = file ? SDL_RWFromConstMem(file->data, (int)file->size) : SDL_RWFromFile(path, "rb");
+    if (!src)
+        return -1;
+    SDL_Surface *surface = IMG_LoadTyped_RW(src, 1, format_type(format));
+    if (!surface)
+        return -1;
+
+    out->full_width = surface->w;
+    out->full_height = surface->h;
+    out->reduced = 0;
+
+    int fit_width, fit_height;
+    fit_size(surface->w, surface->h, max_width, max_height, &fit_width, &fit_height);
+    int factor = 1;
+    while (surface->w / (factor + 1) >= fit_width && surface->h / (factor + 1) >= fit_height) {
+        factor++;
+    }
+
+    if (factor > 1) {
+        Uint32 work_format = pixel_format ? pixel_format : SDL_PIXELFORMAT_RGBA32;
+        SDL_Surface *converted = SDL_ConvertSurfaceFormat(surface, work_format, 0);
+        SDL_Surface *small = converted ? box_downsample(converted, factor) : NULL;
+        SDL_FreeSurface(converted);
+        if (small) {
+            SDL_FreeSurface(surface);
+            surface = small;
+            out->reduced = 1;
+        }
+    }
+
+    out->surface = surface;
+    return 0;
+}
+
+int map_file(const char *path, MappedFile *out)
+{
+    memset(out, 0, sizeof(MappedFile));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    /* SDL_RWFromConstMem takes an int size, larger files go through stdio */
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > INT_MAX) {
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    /* Decoders read front to back: large readahead, and start it now rather than on first fault */
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+    out->data = data;
+    out->size = (size_t)st.st_size;
+    return 0;
+}
+
+void unmap_file(MappedFile *file)
+{
+    if (file->data)
+        munmap((void *)file->data, file->size);
+    memset(file, 0, sizeof(MappedFile));
+}
+
+int decode_image(const char *path, const MappedFile *file, ImageFormat format, int max_width, int max_height,
+    Uint32 pixel_format, DecodedImage *out)
+{
+    memset(out, 0, sizeof(DecodedImage));
+    if (file && !file->data)
+        file = NULL;
+
+    int result = 1;
+    if (format == FORMAT_JPEG) {
+        result = decode_jpeg(path, file, max_width, max_height, pixel_format, out);
+        if (result < 0)
+            SDL_SetError("Corrupt JPEG data");
+    }
+    if (result > 0)
+        result = decode_generic(path, file, format, max_width, max_height, pixel_format, out);
+
+    /* Converted here on the calling thread, uploading it is then a plain copy */
+    if (result == 0 && pixel_format && out->surface->format->format != pixel_format) {
+        SDL_Surface *converted = SDL_ConvertSurfaceFormat(out->surface, pixel_format, 0);
+        if (!converted) {
+            SDL_FreeSurface(out->surface);
+            out->surface = NULL;
+            return -1;
+        }
+        SDL_FreeSurface(out->surface);
+        out->surface = converted;
+    }
+    return result;
+}
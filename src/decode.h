@@ -0,0 +1,60 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include "types.h"
+
+#include <SDL2/SDL.h>
+#include <setjmp.h>
+#include <stdio.h>
+/* jpeglib.h needs FILE and size_t declared first */
+#include <jpeglib.h>
+
+typedef struct {
+    SDL_Surface *surface;
+    int full_width;  /* Image size at full resolution */
+    int full_height;
+    int reduced;     /* Surface is smaller than full resolution */
+} DecodedImage;
+
+/* 8 bits per channel in 4 bytes (RGBA32, ARGB8888, ...): formats box_downsample() and the tiles work in */
+#define IS_PIXELFORMAT_8888(format) \
+    (SDL_PIXELTYPE(format) == SDL_PIXELTYPE_PACKED32 && SDL_PIXELLAYOUT(format) == SDL_PACKEDLAYOUT_8888)
+
+/* libjpeg error manager that jumps back to jump instead of exiting */
+typedef struct {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+} JpegError;
+
+/* Set up err to longjmp() to err->jump on errors and print nothing, returns the manager for cinfo.err. The
+ * caller calls setjmp(err->jump) before using libjpeg */
+struct jpeg_error_mgr *quiet_jpeg_errors(JpegError *err);
+
+/* Read-only mapping of an image file, handed to the decoders without copying */
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+} MappedFile;
+
+/* Map path and ask the kernel to start reading it in. Returns 0 on success, -1 on error */
+int map_file(const char *path, MappedFile *out);
+
+/* Release a mapping from map_file(), no-op on an empty one */
+void unmap_file(MappedFile *file);
+
+/* Decode an image with the decoder for its sniffed format, from the mapping when given or
+ * through stdio from path otherwise. With max_width/max_height > 0 the image may be decoded
+ * at a reduced resolution that still covers it fitted into that box. With a pixel_format the
+ * surface is in that format (an IS_PIXELFORMAT_8888 one), 0 keeps what the decoder produces.
+ * Returns 0 on success */
+int decode_image(const char *path, const MappedFile *file, ImageFormat format, int max_width, int max_height,
+    Uint32 pixel_format, DecodedImage *out);
+
+/* Turn a decoded surface upright according to an EXIF orientation (2 to 8, other values leave it as is).
+ * Returns the new surface and frees the old one, or returns it unchanged when out of memory */
+SDL_Surface *orient_surface(SDL_Surface *surface, int orientation);
+
+/* Average factor x factor blocks of an IS_PIXELFORMAT_8888 surface into a new surface of its format */
+SDL_Surface *box_downsample(SDL_Surface *src, int factor);
+
+#endif /* DECODE_H */
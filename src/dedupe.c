@@ -0,0 +1,518 @@
+#include "dedupe.h"
+
+#include "decode.h"
+#include "files.h"
+#include "wake.h"
+
+#include <SDL2/SDL.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+/* Images are decoded at about this size for hashing, JPEGs cheaply through DCT scaling */
+#define HASH_DECODE_SIZE 64
+
+#define MAX_HASH_THREADS 16
+
+#define CACHE_MAGIC   "ISSHASH1"
+#define CACHE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} CacheHeader;
+
+/* Sorted by inode in the file */
+typedef struct {
+    uint64_t inode;
+    int64_t mtime_ns;
+    uint64_t hash;
+} CacheRecord;
+
+typedef struct {
+    int index;
+    ImageFormat format;
+    char *path;
+} HashJob;
+
+typedef struct {
+    int index;
+    uint64_t hash;
+} HashResult;
+
+/* BK-tree node: children hang off first_child, linked through next_sibling */
+typedef struct {
+    uint64_t hash;
+    int image;
+    int first_child;
+    int next_sibling;
+    int distance; /* To the parent */
+} BkNode;
+
+struct Dedupe {
+    int max_distance;
+    char cache_path[MAX_PATH];
+    void *cache_map;
+    size_t cache_map_size;
+    const CacheRecord *cached; /* Read-only, in the mapping */
+    uint32_t cached_count;
+
+    SDL_Thread *threads[MAX_HASH_THREADS];
+    int thread_count;
+    SDL_mutex *lock;
+    SDL_cond *work;
+    int quit;
+    HashJob *jobs;
+    int job_count;
+    int job_capacity;
+    int next_job;
+    HashResult *results; /* Waiting for dedupe_poll() */
+    int result_count;
+    int result_capacity;
+    CacheRecord *fresh; /* Hashed in this run, saved on exit */
+    int fresh_count;
+    int fresh_capacity;
+
+    /* Main thread only */
+    int queued; /* Images of the list already queued */
+    int *parent; /* Union-find over image indices */
+    int parent_capacity;
+    int *next; /* Members of a cluster form a ring */
+    int next_capacity;
+    BkNode *nodes;
+    int node_count;
+    int node_capacity;
+    int *stack; /* Nodes left to visit in a BK-tree query */
+    int stack_capacity;
+};
+
+/* Luma of RGBA32 pixels with weights summing to 256 */
+static void rgba_to_luma(const uint8_t *rgba, uint16_t *luma, int count)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i weights = _mm_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(rgba + i * 4));
+        /* r*77 + g*150 and b*29 + a*0 per pixel, then the two halves added */
+        __m128i low = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), weights);
+        __m128i high = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), weights);
+        low = _mm_add_epi32(low, _mm_srli_epi64(low, 32));
+        high = _mm_add_epi32(high, _mm_srli_epi64(high, 32));
+        low = _mm_shuffle_epi32(low, _MM_SHUFFLE(3, 3, 2, 0));
+        high = _mm_shuffle_epi32(high, _MM_SHUFFLE(3, 3, 2, 0));
+        __m128i sums = _mm_srli_epi32(_mm_unpacklo_epi64(low, high), 8);
+        _mm_storel_epi64((__m128i *)(luma + i), _mm_packs_epi32(sums, sums));
+    }
+#endif
+    for (; i < count; i++) {
+        const uint8_t *p = rgba + i * 4;
+        luma[i] = (uint16_t)((p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8);
+    }
+}
+
+/* dHash: average luma over a 9x8 grid, one bit per pair of horizontal neighbours */
+static int compute_hash(SDL_Surface *surface, uint64_t *out)
+{
+    SDL_Surface *rgba = surface;
+    if (surface->format->format != SDL_PIXELFORMAT_RGBA32) {
+        rgba = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+        if (!rgba)
+            return -1;
+    }
+
+    uint32_t sums[8][9] = {{0}};
+    uint32_t counts[8][9] = {{0}};
+    uint16_t *luma = malloc(sizeof(uint16_t) * rgba->w);
+    if (!luma) {
+        if (rgba != surface)
+            SDL_FreeSurface(rgba);
+        return -1;
+    }
+    for (int y = 0; y < rgba->h; y++) {
+        rgba_to_luma((const uint8_t *)rgba->pixels + (size_t)y * rgba->pitch, luma, rgba->w);
+        int cell_y = y * 8 / rgba->h;
+        for (int x = 0; x < rgba->w; x++) {
+            int cell_x = x * 9 / rgba->w;
+            sums[cell_y][cell_x] += luma[x];
+            counts[cell_y][cell_x]++;
+        }
+    }
+    free(luma);
+    if (rgba != surface)
+        SDL_FreeSurface(rgba);
+
+    uint64_t hash = 0;
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            /* Compare the averages without dividing */
+            uint64_t left = (uint64_t)sums[y][x] * counts[y][x + 1];
+            uint64_t right = (uint64_t)sums[y][x + 1] * counts[y][x];
+            hash = hash << 1 | (left < right);
+        }
+    }
+    *out = hash;
+    return 0;
+}
+
+static const CacheRecord *find_cached(const Dedupe *dedupe, uint64_t inode, int64_t mtime_ns)
+{
+    uint32_t low = 0, high = dedupe->cached_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (dedupe->cached[mid].inode < inode)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low < dedupe->cached_count && dedupe->cached[low].inode == inode &&
+        dedupe->cached[low].mtime_ns == mtime_ns)
+        return &dedupe->cached[low];
+    return NULL;
+}
+
+static int hash_thread(void *data)
+{
+    Dedupe *dedupe = data;
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    SDL_LockMutex(dedupe->lock);
+    for (;;) {
+        while (dedupe->next_job == dedupe->job_count && !dedupe->quit) {
+            SDL_CondWait(dedupe->work, dedupe->lock);
+        }
+        if (dedupe->quit)
+            break;
+        HashJob job = dedupe->jobs[dedupe->next_job++];
+        SDL_UnlockMutex(dedupe->lock);
+
+        struct stat st;
+        CacheRecord record = {0, 0, 0};
+        int ok = stat(job.path, &st) == 0;
+        if (ok) {
+            record.inode = (uint64_t)st.st_ino;
+#ifdef __APPLE__
+            record.mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+            record.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+        }
+        const CacheRecord *cached = ok ? find_cached(dedupe, record.inode, record.mtime_ns) : NULL;
+        int fresh = 0;
+        if (cached) {
+            record.hash = cached->hash;
+        } else if (ok) {
+            DecodedImage image;
+            int size = HASH_DECODE_SIZE;
+            ok = decode_image(job.path, NULL, job.format, size, size, 0, &image) == 0;
+            if (ok) {
+                ok = compute_hash(image.surface, &record.hash) == 0;
+                SDL_FreeSurface(image.surface);
+            }
+            fresh = ok;
+        }
+        free(job.path);
+
+        SDL_LockMutex(dedupe->lock);
+        if (ok && array_grow((void **)&dedupe->results, &dedupe->result_capacity, dedupe->result_count + 1,
+                      sizeof(HashResult)) == 0) {
+            dedupe->results[dedupe->result_count].index = job.index;
+            dedupe->results[dedupe->result_count++].hash = record.hash;
+            wake_main(WAKE_HASHED);
+        }
+        if (fresh && array_grow((void **)&dedupe->fresh, &dedupe->fresh_capacity, dedupe->fresh_count + 1,
+                         sizeof(CacheRecord)) == 0)
+            dedupe->fresh[dedupe->fresh_count++] = record;
+    }
+    SDL_UnlockMutex(dedupe->lock);
+    return 0;
+}
+
+static void load_cache(Dedupe *dedupe)
+{
+    int fd = open(dedupe->cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CacheHeader)) {
+        dedupe->cache_map_size = (size_t)st.st_size;
+        dedupe->cache_map = mmap(NULL, dedupe->cache_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (dedupe->cache_map == MAP_FAILED)
+            dedupe->cache_map = NULL;
+    }
+    close(fd);
+    if (!dedupe->cache_map)
+        return;
+
+    const CacheHeader *header = dedupe->cache_map;
+    if (memcmp(header->magic, CACHE_MAGIC, 8) != 0 || header->version != CACHE_VERSION ||
+        header->count > (dedupe->cache_map_size - sizeof(CacheHeader)) / sizeof(CacheRecord)) {
+        fprintf(stderr, "Warning: Ignoring invalid hash cache '%s'\n", dedupe->cache_path);
+        return;
+    }
+    dedupe->cached = (const CacheRecord *)(header + 1);
+    dedupe->cached_count = header->count;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const CacheRecord *ra = a;
+    const CacheRecord *rb = b;
+    return ra->inode < rb->inode ? -1 : ra->inode > rb->inode;
+}
+
+/* Merge the cached and fresh hashes into a new cache file, replacing the old one atomically */
+static void save_cache(Dedupe *dedupe)
+{
+    if (dedupe->fresh_count == 0)
+        return;
+
+    size_t total = (size_t)dedupe->cached_count + dedupe->fresh_count;
+    CacheRecord *records = malloc(sizeof(CacheRecord) * total);
+    if (!records)
+        return;
+    qsort(dedupe->fresh, dedupe->fresh_count, sizeof(CacheRecord), compare_records);
+    /* One record per inode: a hash made in this run replaces the one of the old content */
+    uint32_t count = 0;
+    uint32_t cached = 0;
+    for (int fresh = 0; fresh < dedupe->fresh_count || cached < dedupe->cached_count;) {
+        const CacheRecord *record;
+        if (cached == dedupe->cached_count ||
+            (fresh < dedupe->fresh_count && dedupe->fresh[fresh].inode <= dedupe->cached[cached].inode))
+            record = &dedupe->fresh[fresh++];
+        else
+            record = &dedupe->cached[cached++];
+        if (count == 0 || records[count - 1].inode != record->inode)
+            records[count++] = *record;
+    }
+
+    char tmp_path[MAX_PATH + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dedupe->cache_path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (f) {
+        CacheHeader header;
+        memcpy(header.magic, CACHE_MAGIC, 8);
+        header.version = CACHE_VERSION;
+        header.count = count;
+        int ok =
+            fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(records, sizeof(CacheRecord), count, f) == count;
+        ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmp_path, dedupe->cache_path) != 0) {
+            fprintf(stderr, "Warning: Cannot write hash cache '%s'\n", dedupe->cache_path);
+            unlink(tmp_path);
+        }
+    }
+    free(records);
+}
+
+Dedupe *dedupe_create(const char *dir, int max_distance)
+{
+    Dedupe *dedupe = calloc(1, sizeof(Dedupe));
+    if (!dedupe)
+        return NULL;
+    dedupe->max_distance = max_distance;
+    snprintf(dedupe->cache_path, MAX_PATH, "%s/%s", dir, DEDUPE_CACHE_NAME);
+    load_cache(dedupe);
+
+    dedupe->lock = SDL_CreateMutex();
+    dedupe->work = SDL_CreateCond();
+    if (!dedupe->lock || !dedupe->work) {
+        dedupe_destroy(dedupe);
+        return NULL;
+    }
+
+    /* Low priority threads on every core, decoding for display comes first */
+    int threads = SDL_GetCPUCount();
+    if (threads > MAX_HASH_THREADS)
+        threads = MAX_HASH_THREADS;
+    if (threads < 1)
+        threads = 1;
+    for (int i = 0; i < threads; i++) {
+        dedupe->threads[dedupe->thread_count] = SDL_CreateThread(hash_thread, "dedupe", dedupe);
+        if (dedupe->threads[dedupe->thread_count])
+            dedupe->thread_count++;
+    }
+    if (dedupe->thread_count == 0) {
+        fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+        dedupe_destroy(dedupe);
+        return NULL;
+    }
+    return dedupe;
+}
+
+void dedupe_update(Dedupe *dedupe, const ImageList *list)
+{
+    if (!dedupe || dedupe->queued == list->count)
+        return;
+
+    if (array_grow((void **)&dedupe->parent, &dedupe->parent_capacity, list->count, sizeof(int)) != 0 ||
+        array_grow((void **)&dedupe->next, &dedupe->next_capacity, list->count, sizeof(int)) != 0)
+        return;
+
+    SDL_LockMutex(dedupe->lock);
+    if (array_grow((void **)&dedupe->jobs, &dedupe->job_capacity, dedupe->job_count + list->count - dedupe->queued,
+            sizeof(HashJob)) == 0) {
+        for (; dedupe->queued < list->count; dedupe->queued++) {
+            int index = dedupe->queued;
+            dedupe->parent[index] = index;
+            dedupe->next[index] = index;
+            /* Images restored from the history are not in the source directory */
+            if (list->flags[index] & IMAGE_MOVED)
+                continue;
+            char path[MAX_PATH];
+            HashJob *job = &dedupe->jobs[dedupe->job_count];
+            job->index = index;
+            job->format = image_format(list, index);
+            job->path = image_path(list, index, path) ? strdup(path) : NULL;
+            if (job->path)
+                dedupe->job_count++;
+        }
+        SDL_CondBroadcast(dedupe->work);
+    }
+    SDL_UnlockMutex(dedupe->lock);
+}
+
+static int find_root(Dedupe *dedupe, int index)
+{
+    while (dedupe->parent[index] != index) {
+        dedupe->parent[index] = dedupe->parent[dedupe->parent[index]];
+        index = dedupe->parent[index];
+    }
+    return index;
+}
+
+static void join(Dedupe *dedupe, int a, int b)
+{
+    int root_a = find_root(dedupe, a);
+    int root_b = find_root(dedupe, b);
+    if (root_a == root_b)
+        return;
+    dedupe->parent[root_b] = root_a;
+    /* Swapping the successors of one member of each ring splices the rings together */
+    int next_a = dedupe->next[a];
+    dedupe->next[a] = dedupe->next[b];
+    dedupe->next[b] = next_a;
+}
+
+/* Join index with every image within max_distance of hash, then add it to the BK-tree */
+static void cluster(Dedupe *dedupe, int index, uint64_t hash)
+{
+    if (array_grow((void **)&dedupe->nodes, &dedupe->node_capacity, dedupe->node_count + 1, sizeof(BkNode)) != 0 ||
+        array_grow((void **)&dedupe->stack, &dedupe->stack_capacity, 1, sizeof(int)) != 0)
+        return;
+
+    int depth = 0;
+    if (dedupe->node_count > 0)
+        dedupe->stack[depth++] = 0;
+    while (depth > 0) {
+        const BkNode *node = &dedupe->nodes[dedupe->stack[--depth]];
+        int distance = __builtin_popcountll(node->hash ^ hash);
+        if (distance <= dedupe->max_distance)
+            join(dedupe, node->image, index);
+        /* Triangle inequality: only children at distance +- max_distance can match */
+        for (int child = node->first_child; child >= 0; child = dedupe->nodes[child].next_sibling) {
+            int d = dedupe->nodes[child].distance;
+            if (d < distance - dedupe->max_distance || d > distance + dedupe->max_distance)
+                continue;
+            if (array_grow((void **)&dedupe->stack, &dedupe->stack_capacity, depth + 1, sizeof(int)) != 0)
+                break;
+            dedupe->stack[depth++] = child;
+        }
+    }
+
+    int id = dedupe->node_count++;
+    BkNode *added = &dedupe->nodes[id];
+    added->hash = hash;
+    added->image = index;
+    added->first_child = -1;
+    added->next_sibling = -1;
+    added->distance = 0;
+    if (id == 0)
+        return;
+
+    /* Walk down to the node with no child at our distance */
+    int parent = 0;
+    for (;;) {
+        int distance = __builtin_popcountll(dedupe->nodes[parent].hash ^ hash);
+        int child = dedupe->nodes[parent].first_child;
+        while (child >= 0 && dedupe->nodes[child].distance != distance) {
+            child = dedupe->nodes[child].next_sibling;
+        }
+        if (child < 0) {
+            added->distance = distance;
+            added->next_sibling = dedupe->nodes[parent].first_child;
+            dedupe->nodes[parent].first_child = id;
+            return;
+        }
+        parent = child;
+    }
+}
+
+int dedupe_poll(Dedupe *dedupe)
+{
+    if (!dedupe)
+        return 0;
+
+    SDL_LockMutex(dedupe->lock);
+    HashResult *results = dedupe->results;
+    int count = dedupe->result_count;
+    dedupe->results = NULL;
+    dedupe->result_count = 0;
+    dedupe->result_capacity = 0;
+    SDL_UnlockMutex(dedupe->lock);
+
+    for (int i = 0; i < count; i++) {
+        cluster(dedupe, results[i].index, results[i].hash);
+    }
+    free(results);
+    return count;
+}
+
+int dedupe_next(const Dedupe *dedupe, int index)
+{
+    if (!dedupe || index >= dedupe->queued)
+        return index;
+    return dedupe->next[index];
+}
+
+void dedupe_destroy(Dedupe *dedupe)
+{
+    if (!dedupe)
+        return;
+
+    if (dedupe->lock) {
+        SDL_LockMutex(dedupe->lock);
+        dedupe->quit = 1;
+        SDL_CondBroadcast(dedupe->work);
+        SDL_UnlockMutex(dedupe->lock);
+    }
+    for (int i = 0; i < dedupe->thread_count; i++) {
+        SDL_WaitThread(dedupe->threads[i], NULL);
+    }
+    save_cache(dedupe);
+
+    for (int i = dedupe->next_job; i < dedupe->job_count; i++) {
+        free(dedupe->jobs[i].path);
+    }
+    if (dedupe->cache_map)
+        munmap(dedupe->cache_map, dedupe->cache_map_size);
+    SDL_DestroyCond(dedupe->work);
+    SDL_DestroyMutex(dedupe->lock);
+    free(dedupe->jobs);
+    free(dedupe->results);
+    free(dedupe->fresh);
+    free(dedupe->parent);
+    free(dedupe->next);
+    free(dedupe->nodes);
+    free(dedupe->stack);
+    free(dedupe);
+}
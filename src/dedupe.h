@@ -0,0 +1,29 @@
+#ifndef DEDUPE_H
+#define DEDUPE_H
+
+#include "types.h"
+
+#define DEDUPE_CACHE_NAME ".image_swipe_sorter.hashes"
+
+/* Hamming distance between the 64-bit dHashes of near-duplicates */
+#define DEFAULT_DEDUPE_DISTANCE 8
+#define MAX_DEDUPE_DISTANCE     32
+
+typedef struct Dedupe Dedupe;
+
+/* Start the hashing threads, reusing the hashes cached in dir by earlier runs */
+Dedupe *dedupe_create(const char *dir, int max_distance);
+
+/* Queue the images added to list since the last call */
+void dedupe_update(Dedupe *dedupe, const ImageList *list);
+
+/* Cluster the images hashed since the last call, returns how many */
+int dedupe_poll(Dedupe *dedupe);
+
+/* Next image in the cluster of index, index itself when it has no near-duplicate (or dedupe is NULL) */
+int dedupe_next(const Dedupe *dedupe, int index);
+
+/* Stop the threads and save the hash cache */
+void dedupe_destroy(Dedupe *dedupe);
+
+#endif /* DEDUPE_H */
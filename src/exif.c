@@ -0,0 +1,292 @@
+#include "exif.h"
+
+#include <string.h>
+
+#define TAG_NEW_SUBFILE_TYPE  0x00FE
+#define TAG_IMAGE_WIDTH       0x0100
+#define TAG_IMAGE_HEIGHT      0x0101
+#define TAG_COMPRESSION       0x0103
+#define TAG_MAKE              0x010F
+#define TAG_MODEL             0x0110
+#define TAG_STRIP_OFFSETS     0x0111
+#define TAG_ORIENTATION       0x0112
+#define TAG_STRIP_BYTE_COUNTS 0x0117
+#define TAG_DATE_TIME         0x0132
+#define TAG_SUB_IFDS          0x014A
+#define TAG_JPEG_OFFSET       0x0201
+#define TAG_JPEG_LENGTH       0x0202
+#define TAG_EXIF_IFD          0x8769
+#define TAG_DATE_ORIGINAL     0x9003
+#define TAG_MP_ENTRY          0xB002
+
+#define TYPE_ASCII 2
+#define TYPE_SHORT 3
+#define TYPE_LONG  4
+#define TYPE_IFD   13
+
+/* Compression of a TIFF strip holding a JPEG stream */
+#define COMPRESSION_OLD_JPEG 6
+#define COMPRESSION_JPEG     7
+
+/* IFDs followed per chain and sub-IFDs per file, the offsets come from the file and may loop */
+#define MAX_IFDS     8
+#define MAX_SUB_IFDS 8
+
+#define MP_ENTRY_SIZE 16
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    int big_endian;
+} Tiff;
+
+static uint16_t read_u16(const Tiff *tiff, size_t offset)
+{
+    const unsigned char *p = tiff->data + offset;
+    return tiff->big_endian ? (uint16_t)(p[0] << 8 | p[1]) : (uint16_t)(p[1] << 8 | p[0]);
+}
+
+static uint32_t read_u32(const Tiff *tiff, size_t offset)
+{
+    const unsigned char *p = tiff->data + offset;
+    if (tiff->big_endian)
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+/* Check the byte order mark, returns the offset of the first IFD or 0 */
+static uint32_t open_tiff(Tiff *tiff, const unsigned char *data, size_t size)
+{
+    tiff->data = data;
+    tiff->size = size;
+    if (size < 8)
+        return 0;
+    if (memcmp(data, "II", 2) == 0)
+        tiff->big_endian = 0;
+    else if (memcmp(data, "MM", 2) == 0)
+        tiff->big_endian = 1;
+    else
+        return 0;
+    return read_u16(tiff, 2) == 42 ? read_u32(tiff, 4) : 0;
+}
+
+/* Value of a single SHORT or LONG entry */
+static int entry_value(const Tiff *tiff, size_t entry, uint32_t *value)
+{
+    uint16_t type = read_u16(tiff, entry + 2);
+    if (read_u32(tiff, entry + 4) != 1)
+        return -1;
+    if (type == TYPE_SHORT)
+        *value = read_u16(tiff, entry + 8);
+    else if (type == TYPE_LONG || type == TYPE_IFD)
+        *value = read_u32(tiff, entry + 8);
+    else
+        return -1;
+    return 0;
+}
+
+/* Text of an ASCII entry, cut to fit out and without trailing spaces. out is left as it is otherwise */
+static void entry_text(const Tiff *tiff, size_t entry, char *out, size_t out_size)
+{
+    uint32_t count = read_u32(tiff, entry + 4);
+    if (read_u16(tiff, entry + 2) != TYPE_ASCII || count == 0)
+        return;
+    size_t at = count <= 4 ? entry + 8 : read_u32(tiff, entry + 8);
+    if (at > tiff->size || count > tiff->size - at)
+        return;
+    size_t len = 0;
+    while (len < count && len < out_size - 1 && tiff->data[at + len] != '\0') {
+        out[len] = (char)tiff->data[at + len];
+        len++;
+    }
+    while (len > 0 && out[len - 1] == ' ') {
+        len--;
+    }
+    if (len > 0)
+        out[len] = '\0';
+}
+
+/* Keep the largest JPEG stream found */
+static void offer_preview(ExifInfo *out, const Tiff *tiff, uint32_t offset, uint32_t length)
+{
+    if (offset == 0 || offset > tiff->size || length > tiff->size - offset || length < 4)
+        return;
+    const unsigned char *data = tiff->data + offset;
+    if (data[0] == 0xFF && data[1] == 0xD8 && length > out->preview_size) {
+        out->preview = data;
+        out->preview_size = length;
+    }
+}
+
+/* Read one IFD, returns the offset of the next one in the chain (0 at its end) */
+static uint32_t parse_ifd(const Tiff *tiff, uint32_t offset, int first, ExifInfo *out, uint32_t *sub_ifds,
+    int *sub_count)
+{
+    if (offset < 8 || offset > tiff->size - 2)
+        return 0;
+    uint16_t count = read_u16(tiff, offset);
+    size_t end = offset + 2 + (size_t)count * 12;
+    if (end + 4 > tiff->size)
+        return 0;
+
+    uint32_t jpeg_offset = 0, jpeg_length = 0;
+    uint32_t strip_offset = 0, strip_length = 0;
+    uint32_t compression = 0, subfile = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        size_t entry = offset + 2 + (size_t)i * 12;
+        uint16_t tag = read_u16(tiff, entry);
+        uint32_t value;
+
+        /* The capture time is in the EXIF IFD, IFD0 only has the time the file was last changed */
+        if (tag == TAG_DATE_ORIGINAL || (first && tag == TAG_DATE_TIME && out->date[0] == '\0')) {
+            entry_text(tiff, entry, out->date, sizeof(out->date));
+            continue;
+        }
+        if (first && (tag == TAG_MODEL || (tag == TAG_MAKE && out->camera[0] == '\0'))) {
+            entry_text(tiff, entry, out->camera, sizeof(out->camera));
+            continue;
+        }
+        if (tag == TAG_EXIF_IFD && first && sub_ifds && *sub_count < MAX_SUB_IFDS &&
+            entry_value(tiff, entry, &value) == 0) {
+            sub_ifds[(*sub_count)++] = value;
+            continue;
+        }
+        if (tag == TAG_SUB_IFDS && sub_ifds) {
+            uint32_t n = read_u32(tiff, entry + 4);
+            uint32_t at = n == 1 ? (uint32_t)entry + 8 : read_u32(tiff, entry + 8);
+            for (uint32_t k = 0; k < n && *sub_count < MAX_SUB_IFDS && at <= tiff->size - 4; k++, at += 4) {
+                sub_ifds[(*sub_count)++] = read_u32(tiff, at);
+            }
+            continue;
+        }
+        if (entry_value(tiff, entry, &value) != 0)
+            continue;
+        switch (tag) {
+            case TAG_ORIENTATION:
+                if (first && value >= 1 && value <= 8)
+                    out->orientation = (int)value;
+                break;
+            case TAG_IMAGE_WIDTH:
+                if (first)
+                    out->width = (int)value;
+                break;
+            case TAG_IMAGE_HEIGHT:
+                if (first)
+                    out->height = (int)value;
+                break;
+            case TAG_NEW_SUBFILE_TYPE:
+                subfile = value;
+                break;
+            case TAG_COMPRESSION:
+                compression = value;
+                break;
+            case TAG_STRIP_OFFSETS:
+                strip_offset = value;
+                break;
+            case TAG_STRIP_BYTE_COUNTS:
+                strip_length = value;
+                break;
+            case TAG_JPEG_OFFSET:
+                jpeg_offset = value;
+                break;
+            case TAG_JPEG_LENGTH:
+                jpeg_length = value;
+                break;
+        }
+    }
+
+    /* EXIF IFD1 thumbnail, or a reduced resolution copy stored as one JPEG strip (raw-derived TIFF) */
+    offer_preview(out, tiff, jpeg_offset, jpeg_length);
+    if ((subfile & 1) && (compression == COMPRESSION_OLD_JPEG || compression == COMPRESSION_JPEG))
+        offer_preview(out, tiff, strip_offset, strip_length);
+    return read_u32(tiff, end);
+}
+
+int exif_parse_tiff(const unsigned char *data, size_t size, ExifInfo *out)
+{
+    Tiff tiff;
+    uint32_t ifd = open_tiff(&tiff, data, size);
+    if (ifd == 0)
+        return -1;
+
+    uint32_t sub_ifds[MAX_SUB_IFDS];
+    int sub_count = 0;
+    for (int i = 0; ifd != 0 && i < MAX_IFDS; i++) {
+        ifd = parse_ifd(&tiff, ifd, i == 0, out, sub_ifds, &sub_count);
+    }
+    for (int i = 0; i < sub_count; i++) {
+        parse_ifd(&tiff, sub_ifds[i], 0, out, NULL, NULL);
+    }
+    return 0;
+}
+
+/* MP Format (CIPA DC-007) index in APP2: the large previews cameras append after the main image.
+ * Their offsets are relative to the MP header */
+static void parse_mpf(const unsigned char *data, size_t size, ExifInfo *out)
+{
+    Tiff tiff;
+    uint32_t ifd = open_tiff(&tiff, data, size);
+    if (ifd < 8 || ifd > size - 2)
+        return;
+    uint16_t count = read_u16(&tiff, ifd);
+    if (ifd + 2 + (size_t)count * 12 > size)
+        return;
+    for (uint16_t i = 0; i < count; i++) {
+        size_t entry = ifd + 2 + (size_t)i * 12;
+        if (read_u16(&tiff, entry) != TAG_MP_ENTRY)
+            continue;
+        uint32_t length = read_u32(&tiff, entry + 4);
+        uint32_t at = read_u32(&tiff, entry + 8);
+        if (at > size || length > size - at)
+            return;
+        /* The first entry is the main image */
+        for (uint32_t k = MP_ENTRY_SIZE; k + MP_ENTRY_SIZE <= length; k += MP_ENTRY_SIZE) {
+            offer_preview(out, &tiff, read_u32(&tiff, at + k + 8), read_u32(&tiff, at + k + 4));
+        }
+    }
+}
+
+int exif_parse(const unsigned char *data, size_t size, ImageFormat format, ExifInfo *out)
+{
+    memset(out, 0, sizeof(ExifInfo));
+    out->orientation = 1;
+    if (format == FORMAT_TIFF)
+        return exif_parse_tiff(data, size, out);
+    if (format != FORMAT_JPEG)
+        return -1;
+
+    /* Walk the marker segments up to the entropy coded data */
+    size_t pos = 2;
+    while (pos + 4 <= size && data[pos] == 0xFF) {
+        unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        if (marker == 0xD9 || marker == 0xDA)
+            break;
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            pos += 2;
+            continue;
+        }
+        size_t length = (size_t)data[pos + 2] << 8 | data[pos + 3];
+        if (length < 2 || length > size - pos - 2)
+            break;
+        const unsigned char *body = data + pos + 4;
+        size_t body_size = length - 2;
+
+        if (marker == 0xE1 && body_size > 6 && memcmp(body, "Exif\0\0", 6) == 0) {
+            exif_parse_tiff(body + 6, body_size - 6, out);
+        } else if (marker == 0xE2 && body_size > 4 && memcmp(body, "MPF\0", 4) == 0) {
+            /* MPF offsets reach past the segment, into the rest of the file */
+            parse_mpf(body + 4, size - (size_t)(body + 4 - data), out);
+        } else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC &&
+                   body_size >= 5) {
+            /* Start of frame: precision, height, width */
+            out->height = body[1] << 8 | body[2];
+            out->width = body[3] << 8 | body[4];
+        }
+        pos += 2 + length;
+    }
+    return 0;
+}
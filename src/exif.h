@@ -0,0 +1,28 @@
+#ifndef EXIF_H
+#define EXIF_H
+
+#include "types.h"
+
+/* Longest camera name kept, longer ones are cut */
+#define EXIF_CAMERA_SIZE 32
+
+/* What the sorter uses from the EXIF (or TIFF) metadata of an image */
+typedef struct {
+    int orientation; /* 1 (upright) to 8, see the EXIF Orientation tag */
+    int width;       /* Main image as stored, before orientation. 0 when unknown */
+    int height;
+    const unsigned char *preview; /* Largest embedded JPEG preview, in the parsed data. NULL when none */
+    size_t preview_size;
+    char date[20]; /* Capture time as "YYYY:MM:DD HH:MM:SS" in camera local time, empty when unknown */
+    char camera[EXIF_CAMERA_SIZE]; /* Model, or make when there is no model. Empty when unknown */
+} ExifInfo;
+
+/* Parse a TIFF structure: the body of an EXIF APP1 segment after "Exif\0\0", or a whole TIFF file.
+ * Fields that are not found are left as they are. Returns 0 on success, -1 when it is not a TIFF structure */
+int exif_parse_tiff(const unsigned char *tiff, size_t size, ExifInfo *out);
+
+/* Parse the metadata of a whole JPEG (APP1 EXIF, APP2 MPF and the frame header) or TIFF file. Fields
+ * that are not found keep their defaults. Returns 0 on success, -1 for other formats */
+int exif_parse(const unsigned char *data, size_t size, ImageFormat format, ExifInfo *out);
+
+#endif /* EXIF_H */
@@ -1,67 +1,246 @@
+/* copy_file_range() */
+#define _GNU_SOURCE
+
 #include "files.h"
 
-#include <dirent.h>
+#include "cache.h"
+#include "dedupe.h"
+#include "loader.h"
+#include "meta.h"
+#include "scan.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-
-static int is_image_file(const char *filename)
-{
-    const char *ext = strrchr(filename, '.');
-    if (!ext)
-        return 0;
-    ext++;
-
-    const char *extensions[] = {"png", "PNG", "jpg", "JPG", "jpeg", "JPEG", "bmp", "BMP", "gif", "GIF", "webp",
-        "WEBP", "tif", "TIF", "tiff", "TIFF", NULL};
-
-    for (int i = 0; extensions[i]; i++) {
-        if (strcmp(ext, extensions[i]) == 0)
-            return 1;
-    }
-    return 0;
-}
+#include <unistd.h>
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif
 
 static void print_help(const char *prog_name)
 {
-    printf("Usage: %s <source_dir> --left-dir=<path> --right-dir=<path>\n\n", prog_name);
-    printf("A simple image sorter that lets you quickly categorize images into two folders.\n\n");
+    printf("Usage: %s <source_dir> --left-dir=<path> --right-dir=<path>\n", prog_name);
+    printf("       %s <source_dir> --dest=1:<path> --dest=2:<path> ...\n\n", prog_name);
+    printf("A simple image sorter that lets you quickly categorize images into folders.\n\n");
     printf("Arguments:\n");
     printf("  <source_dir>         Directory containing images to sort\n");
-    printf("  --left-dir=<path>    Directory for left-swiped images (created if missing)\n");
-    printf("  --right-dir=<path>   Directory for right-swiped images (created if missing)\n\n");
+    printf("  --left-dir=<path>    Directory for left-swiped images (created if missing), same as --dest=1:\n");
+    printf("  --right-dir=<path>   Directory for right-swiped images (created if missing), same as --dest=2:\n");
+    printf("  --dest=<n>:<path>    Directory for images sorted with number key n, 1 to %d\n", MAX_DESTS);
+    printf("                       (created if missing)\n\n");
     printf("Options:\n");
+    printf("  --recursive          Also sort images in subdirectories of <source_dir>\n");
+    printf("  --watch              Add images written into <source_dir> while sorting, drop the ones removed\n");
+    printf("  --sort=[-]<key>      Order by name, size, mtime, date, width, height, pixels or camera, - for\n");
+    printf("                       descending. date is the EXIF capture time (mtime without one)\n");
+    printf("  --filter=<conds>     Only show images matching every condition, e.g. width>3000,\n");
+    printf("                       date>=2026-01-01, size<2M or camera=EOS. name and camera match a part\n");
+    printf("                       of the text\n");
+    printf("  --prefetch=<n>       Images decoded ahead in the background (default: %d)\n", DEFAULT_PREFETCH);
+    printf("  --cache-mb=<n>       Memory for decoded images kept for undo and the second pass (default: %d)\n",
+        DEFAULT_CACHE_MB);
+    printf("  --no-mmap            Read images through stdio instead of memory-mapping them\n");
+    printf("  --keep-history       Keep the undo history in <source_dir> for the next run\n");
+    printf("  --resume             Continue the last --resume run: undo history and skipped images are kept\n");
+    printf("  --dedupe[=<n>]       Group near-duplicates (up to n of 64 hash bits apart, default: %d)\n",
+        DEFAULT_DEDUPE_DISTANCE);
+    printf("  --apply=<file>       Apply the decisions in file (<name> TAB <left|right|skip|n> lines)\n");
+    printf("                       without a window, moving files in parallel, then exit\n");
+    printf("  --record=<file>      Append every decision made in this run to file, in the --apply format\n");
+    printf("  --trace=<file>       Write the decode, upload, move and render timings as Chrome trace JSON\n");
+    printf("                       on exit\n");
     printf("  -h, --help           Show this help message and exit\n\n");
     printf("Controls:\n");
-    printf("  LEFT arrow           Move image to left directory\n");
-    printf("  RIGHT arrow          Move image to right directory\n");
-    printf("  DOWN arrow           Skip current image\n");
+    printf("  LEFT arrow / 1       Move image to left directory (destination 1)\n");
+    printf("  RIGHT arrow / 2      Move image to right directory (destination 2)\n");
+    printf("  3 to 9               Move image to that destination\n");
+    printf("  SHIFT + arrow/number Move image and its near-duplicates (with --dedupe)\n");
+    printf("  DOWN arrow           Skip current image (offered again after the others)\n");
     printf("  SPACE                Undo last move\n");
+    printf("  R                    Redo the last undone move\n");
     printf("  Mouse wheel          Zoom in/out\n");
     printf("  Left click + drag    Pan image\n");
     printf("  Middle click         Reset zoom/pan\n");
-    printf("  ESC / Q              Quit\n");
+    printf("  G                    Show all images as a grid of thumbnails\n");
+    printf("  T                    Show the p50/p99 timings of swipes, decodes, uploads, moves and frames\n");
+    printf("  H                    Show histograms, clipped highlights (red) and shadows (blue) and sharpness\n");
+    printf("  ESC / Q              Quit\n\n");
+    printf("Grid:\n");
+    printf("  Arrows / click       Move the cursor, with SHIFT select a range, CTRL + click adds one image\n");
+    printf("  CTRL + A             Select every unsorted image\n");
+    printf("  1 to 9               Move the selection (or the image under the cursor) to that destination\n");
+    printf("  Mouse wheel          Scroll, with CTRL (or + / -) change the thumbnail size\n");
+    printf("  ENTER / double click View the image under the cursor\n");
+    printf("  G / ESC              Back to the viewer\n");
+}
+
+/* Set destination dest, labeled with label or the name of its directory */
+static int set_dest(Config *config, int dest, const char *path, const char *label)
+{
+    if (config->dest_dirs[dest][0] != '\0') {
+        fprintf(stderr, "Error: Destination %d is given twice\n", dest + 1);
+        return -1;
+    }
+    if (path[0] == '\0') {
+        fprintf(stderr, "Error: Destination %d has an empty path\n", dest + 1);
+        return -1;
+    }
+    strncpy(config->dest_dirs[dest], path, MAX_PATH - 1);
+
+    char dir[MAX_PATH];
+    if (!label) {
+        snprintf(dir, MAX_PATH, "%s", path);
+        label = basename(dir);
+    }
+    /* The bitmap font only has capitals */
+    int len = 0;
+    for (; label[len] && len < MAX_DEST_LABEL - 1; len++) {
+        config->dest_labels[dest][len] = (char)toupper((unsigned char)label[len]);
+    }
+    config->dest_labels[dest][len] = '\0';
+    return 0;
+}
+
+/* --dest=<n>:<path> */
+static int parse_dest(Config *config, const char *arg)
+{
+    char *end;
+    long number = strtol(arg, &end, 10);
+    if (end == arg || *end != ':' || number < 1 || number > MAX_DESTS) {
+        fprintf(stderr, "Error: --dest must be <n>:<path> with n between 1 and %d\n", MAX_DESTS);
+        return -1;
+    }
+    return set_dest(config, (int)number - 1, end + 1, NULL);
+}
+
+/* Create the directory of dest if it does not exist */
+static int create_dest_dir(const Config *config, int dest)
+{
+    const char *path = config->dest_dirs[dest];
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        if (mkdir(path, 0755) != 0) {
+            fprintf(stderr, "Error: Cannot create directory '%s' for destination %d\n", path, dest + 1);
+            return -1;
+        }
+        printf("Created directory: %s\n", path);
+    } else if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: '%s' exists but is not a directory\n", path);
+        return -1;
+    }
+    return 0;
 }
 
 int parse_args(int argc, char *argv[], Config *config)
 {
     memset(config, 0, sizeof(Config));
+    config->prefetch = DEFAULT_PREFETCH;
+    config->cache_mb = DEFAULT_CACHE_MB;
+    config->use_mmap = 1;
+    config->dedupe = -1;
 
     static struct option long_options[] = {{"left-dir", required_argument, 0, 'l'},
-        {"right-dir", required_argument, 0, 'r'}, {"help", no_argument, 0, 'h'}, {0, 0, 0, 0}};
+        {"right-dir", required_argument, 0, 'r'}, {"prefetch", required_argument, 0, 'p'},
+        {"recursive", no_argument, 0, 'R'}, {"no-mmap", no_argument, 0, 'M'},
+        {"keep-history", no_argument, 0, 'H'}, {"resume", no_argument, 0, 'S'},
+        {"dedupe", optional_argument, 0, 'D'}, {"dest", required_argument, 0, 'd'},
+        {"apply", required_argument, 0, 'A'}, {"record", required_argument, 0, 'W'},
+        {"trace", required_argument, 0, 'T'}, {"cache-mb", required_argument, 0, 'C'},
+        {"watch", no_argument, 0, 'w'}, {"sort", required_argument, 0, 'O'},
+        {"filter", required_argument, 0, 'F'}, {"help", no_argument, 0, 'h'}, {0, 0, 0, 0}};
 
     int opt;
     while ((opt = getopt_long(argc, argv, "hl:r:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'l':
-                strncpy(config->left_dir, optarg, MAX_PATH - 1);
+                if (set_dest(config, DEST_LEFT, optarg, "LEFT") != 0)
+                    return -1;
                 break;
             case 'r':
-                strncpy(config->right_dir, optarg, MAX_PATH - 1);
+                if (set_dest(config, DEST_RIGHT, optarg, "RIGHT") != 0)
+                    return -1;
+                break;
+            case 'd':
+                if (parse_dest(config, optarg) != 0)
+                    return -1;
+                break;
+            case 'p': {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || value < 0 || value > MAX_PREFETCH) {
+                    fprintf(stderr, "Error: --prefetch must be a number between 0 and %d\n", MAX_PREFETCH);
+                    return -1;
+                }
+                config->prefetch = (int)value;
+                break;
+            }
+            case 'C': {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || value < 0 || value > MAX_CACHE_MB) {
+                    fprintf(stderr, "Error: --cache-mb must be a number between 0 and %d\n", MAX_CACHE_MB);
+                    return -1;
+                }
+                config->cache_mb = (int)value;
+                break;
+            }
+            case 'R':
+                config->recursive = 1;
+                break;
+            case 'w':
+                config->watch = 1;
+                break;
+            case 'M':
+                config->use_mmap = 0;
+                break;
+            case 'H':
+                config->keep_history = 1;
+                break;
+            case 'S':
+                config->resume = 1;
+                config->keep_history = 1;
+                break;
+            case 'D': {
+                config->dedupe = DEFAULT_DEDUPE_DISTANCE;
+                if (!optarg)
+                    break;
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || value < 0 || value > MAX_DEDUPE_DISTANCE) {
+                    fprintf(stderr, "Error: --dedupe must be a number between 0 and %d\n", MAX_DEDUPE_DISTANCE);
+                    return -1;
+                }
+                config->dedupe = (int)value;
                 break;
+            }
+            case 'A':
+                strncpy(config->apply_path, optarg, MAX_PATH - 1);
+                break;
+            case 'W':
+                strncpy(config->record_path, optarg, MAX_PATH - 1);
+                break;
+            case 'T':
+                strncpy(config->trace_path, optarg, MAX_PATH - 1);
+                break;
+            case 'O':
+                strncpy(config->sort, optarg, sizeof(config->sort) - 1);
+                break;
+            case 'F': {
+                /* Repeated filters add up */
+                size_t len = strlen(config->filter);
+                if (len + 1 + strlen(optarg) >= sizeof(config->filter)) {
+                    fprintf(stderr, "Error: --filter is too long\n");
+                    return -1;
+                }
+                snprintf(config->filter + len, sizeof(config->filter) - len, "%s%s", len ? "," : "", optarg);
+                break;
+            }
             case 'h':
                 print_help(argv[0]);
                 exit(0);
@@ -81,10 +260,26 @@ int parse_args(int argc, char *argv[], Config *config)
 
     strncpy(config->source_dir, argv[optind], MAX_PATH - 1);
 
-    if (config->left_dir[0] == '\0' || config->right_dir[0] == '\0') {
-        fprintf(stderr, "Error: Both --left-dir and --right-dir are required\n");
+    MetaQuery query;
+    if (meta_query_parse(config->sort, config->filter, &query) != 0)
+        return -1;
+
+    /* Number keys follow each other, a missing one would be a key that silently does nothing */
+    for (int i = 0; i < MAX_DESTS; i++) {
+        if (config->dest_dirs[i][0] != '\0')
+            config->dest_count = i + 1;
+    }
+    if (config->dest_count == 0) {
+        fprintf(stderr, "Error: --left-dir and --right-dir (or --dest=<n>:<path>) are required\n");
         return -1;
     }
+    for (int i = 0; i < config->dest_count; i++) {
+        if (config->dest_dirs[i][0] == '\0') {
+            fprintf(stderr, "Error: Destination %d is missing, destinations are numbered from 1 without gaps\n",
+                i + 1);
+            return -1;
+        }
+    }
 
     /* Verify source directory exists */
     struct stat st;
@@ -93,96 +288,394 @@ int parse_args(int argc, char *argv[], Config *config)
         return -1;
     }
 
-    /* Create left/right directories if they don't exist */
-    if (stat(config->left_dir, &st) != 0) {
-        if (mkdir(config->left_dir, 0755) != 0) {
-            fprintf(stderr, "Error: Cannot create left directory '%s'\n", config->left_dir);
+    /* Create the destination directories if they don't exist */
+    for (int i = 0; i < config->dest_count; i++) {
+        if (create_dest_dir(config, i) != 0)
             return -1;
-        }
-        printf("Created directory: %s\n", config->left_dir);
-    } else if (!S_ISDIR(st.st_mode)) {
-        fprintf(stderr, "Error: '%s' exists but is not a directory\n", config->left_dir);
-        return -1;
     }
 
-    if (stat(config->right_dir, &st) != 0) {
-        if (mkdir(config->right_dir, 0755) != 0) {
-            fprintf(stderr, "Error: Cannot create right directory '%s'\n", config->right_dir);
+    return 0;
+}
+
+int image_list_add(ImageList *list, const char *name, size_t len, ImageFormat format)
+{
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 1024;
+        uint32_t *offsets = realloc(list->offsets, sizeof(uint32_t) * capacity);
+        if (!offsets)
             return -1;
+        list->offsets = offsets;
+        uint8_t *formats = realloc(list->formats, capacity);
+        if (!formats)
+            return -1;
+        list->formats = formats;
+        uint8_t *flags = realloc(list->flags, capacity);
+        if (!flags)
+            return -1;
+        list->flags = flags;
+        list->capacity = capacity;
+    }
+    if (list->names_size + len + 1 > list->names_capacity) {
+        size_t capacity = list->names_capacity ? list->names_capacity * 2 : 64 * 1024;
+        while (capacity < list->names_size + len + 1) {
+            capacity *= 2;
         }
-        printf("Created directory: %s\n", config->right_dir);
-    } else if (!S_ISDIR(st.st_mode)) {
-        fprintf(stderr, "Error: '%s' exists but is not a directory\n", config->right_dir);
-        return -1;
+        if (capacity > UINT32_MAX)
+            return -1;
+        char *names = realloc(list->names, capacity);
+        if (!names)
+            return -1;
+        list->names = names;
+        list->names_capacity = capacity;
     }
 
+    list->formats[list->count] = (uint8_t)format;
+    list->flags[list->count] = 0;
+    list->offsets[list->count++] = (uint32_t)list->names_size;
+    memcpy(list->names + list->names_size, name, len);
+    list->names[list->names_size + len] = '\0';
+    list->names_size += len + 1;
     return 0;
 }
 
-int load_image_list(const char *dir_path, ImageList *list)
+const char *image_name(const ImageList *list, int index)
+{
+    return list->names + list->offsets[index];
+}
+
+ImageFormat image_format(const ImageList *list, int index)
+{
+    return (ImageFormat)list->formats[index];
+}
+
+int seek_image(const ImageList *list, int index, int *pass, int scanning)
 {
-    DIR *dir = opendir(dir_path);
-    if (!dir) {
-        fprintf(stderr, "Error: Cannot open directory '%s'\n", dir_path);
+    for (;;) {
+        uint8_t passed = *pass ? IMAGE_MOVED | IMAGE_GONE : IMAGE_MOVED | IMAGE_SKIPPED | IMAGE_GONE;
+        while (index < list->count && (list->flags[index] & passed)) {
+            index++;
+        }
+        if (index < list->count || *pass || scanning)
+            return index;
+        *pass = 1;
+        index = 0;
+    }
+}
+
+char *image_path(const ImageList *list, int index, char *buf)
+{
+    int length = snprintf(buf, MAX_PATH, "%s/%s", list->dir, image_name(list, index));
+    return length >= 0 && length < MAX_PATH ? buf : NULL;
+}
+
+int image_list_keep(ImageList *list, int first, const int *order, int count)
+{
+    /* Names stay where they are in the arena, only their offsets move */
+    uint32_t *offsets = malloc(sizeof(uint32_t) * ((size_t)count + 1));
+    uint8_t *bytes = malloc((size_t)count * 2 + 1);
+    if (!offsets || !bytes) {
+        free(offsets);
+        free(bytes);
         return -1;
     }
+    for (int i = 0; i < count; i++) {
+        offsets[i] = list->offsets[order[i]];
+        bytes[i] = list->formats[order[i]];
+        bytes[count + i] = list->flags[order[i]];
+    }
+    memcpy(list->offsets + first, offsets, sizeof(uint32_t) * count);
+    memcpy(list->formats + first, bytes, count);
+    memcpy(list->flags + first, bytes + count, count);
+    list->count = first + count;
+    list->gone = 0;
+    for (int i = 0; i < list->count; i++) {
+        list->gone += (list->flags[i] & IMAGE_GONE) != 0;
+    }
+    free(offsets);
+    free(bytes);
+    return 0;
+}
 
-    list->paths = malloc(sizeof(char *) * MAX_IMAGES);
-    list->count = 0;
-    list->current = 0;
+void image_set_gone(ImageList *list, int index, int gone)
+{
+    if (!(list->flags[index] & IMAGE_GONE) == !gone)
+        return;
+    if (gone) {
+        list->flags[index] = (uint8_t)((list->flags[index] | IMAGE_GONE) & ~IMAGE_SELECTED);
+        list->gone++;
+    } else {
+        list->flags[index] &= (uint8_t)~IMAGE_GONE;
+        list->gone--;
+    }
+}
 
-    const struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL && list->count < MAX_IMAGES) {
-        if (entry->d_name[0] == '.')
-            continue;
-        if (!is_image_file(entry->d_name))
-            continue;
+int array_grow(void **array, int *capacity, int needed, size_t size)
+{
+    if (needed <= *capacity)
+        return 0;
+    int grown = *capacity ? *capacity : 256;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    void *data = realloc(*array, size * grown);
+    if (!data)
+        return -1;
+    *array = data;
+    *capacity = grown;
+    return 0;
+}
 
-        char full_path[MAX_PATH];
-        snprintf(full_path, MAX_PATH, "%s/%s", dir_path, entry->d_name);
+void image_list_init(ImageList *list, const char *dir_path)
+{
+    memset(list, 0, sizeof(ImageList));
+    snprintf(list->dir, MAX_PATH, "%s", dir_path);
 
-        list->paths[list->count] = strdup(full_path);
-        list->count++;
+    /* Keep joined paths free of a double slash */
+    size_t len = strlen(list->dir);
+    while (len > 1 && list->dir[len - 1] == '/') {
+        list->dir[--len] = '\0';
+    }
+}
+
+int load_image_list(const char *dir_path, int recursive, const DirId *excluded, int excluded_count,
+    ImageList *list)
+{
+    image_list_init(list, dir_path);
+
+    Scanner *scanner = scanner_start(list->dir, recursive, excluded, excluded_count);
+    if (!scanner)
+        return -1;
+    scanner_wait(scanner);
+    int result = scanner_poll(scanner, list);
+    scanner_destroy(scanner);
+    if (result != 0) {
+        fprintf(stderr, "Error: Out of memory while listing '%s'\n", dir_path);
+        free_image_list(list);
+        return -1;
     }
 
-    closedir(dir);
     printf("Found %d images\n", list->count);
     return 0;
 }
 
 void free_image_list(ImageList *list)
 {
-    for (int i = 0; i < list->count; i++) {
-        free(list->paths[i]);
+    free(list->names);
+    free(list->offsets);
+    free(list->formats);
+    free(list->flags);
+    list->names = NULL;
+    list->offsets = NULL;
+    list->formats = NULL;
+    list->flags = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    list->gone = 0;
+    list->names_size = 0;
+    list->names_capacity = 0;
+}
+
+const char *dest_dir(const Config *config, Destination dest)
+{
+    return config->dest_dirs[dest];
+}
+
+int dest_dir_ids(const Config *config, DirId out[MAX_DESTS])
+{
+    int count = 0;
+    for (int i = 0; i < config->dest_count; i++) {
+        struct stat st;
+        if (stat(config->dest_dirs[i], &st) == 0) {
+            out[count].dev = st.st_dev;
+            out[count++].ino = st.st_ino;
+        }
     }
-    free(list->paths);
+    return count;
 }
 
-int move_file(const char *src, const char *dest_dir, char *out_dest_path)
+int dir_id_match(const DirId *ids, int count, const struct stat *st)
 {
-    char *src_copy = strdup(src);
-    const char *filename = basename(src_copy);
+    for (int i = 0; i < count; i++) {
+        if (ids[i].dev == st->st_dev && ids[i].ino == st->st_ino)
+            return 1;
+    }
+    return 0;
+}
 
-    char dest_path[MAX_PATH];
-    snprintf(dest_path, MAX_PATH, "%s/%s", dest_dir, filename);
+void dest_path_for(const char *src, const char *dest_dir, char *out_dest_path)
+{
+    const char *filename = strrchr(src, '/');
+    filename = filename ? filename + 1 : src;
+    snprintf(out_dest_path, MAX_PATH, "%s/%s", dest_dir, filename);
+}
 
-    if (rename(src, dest_path) != 0) {
-        fprintf(stderr, "Error: Failed to move '%s' to '%s'\n", src, dest_path);
-        free(src_copy);
+/* Make the directory entry of path (relative to dir, or AT_FDCWD) durable */
+static void sync_parent(int dir, const char *path)
+{
+    if (dir != AT_FDCWD) {
+        fsync(dir);
+        return;
+    }
+    char parent[MAX_PATH];
+    snprintf(parent, MAX_PATH, "%s", path);
+    int dir_fd = open(dirname(parent), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+/* Rename without replacing an existing dest, fails with EEXIST */
+static int rename_noreplace(int src_dir, const char *src, int dest_dir, const char *dest)
+{
+#ifdef RENAME_NOREPLACE
+    if (renameat2(src_dir, src, dest_dir, dest, RENAME_NOREPLACE) == 0)
+        return 0;
+    if (errno != EINVAL && errno != ENOSYS)
+        return -1;
+#endif
+    /* No atomic check on this system or filesystem, only another program can slip a file in between */
+    struct stat st;
+    if (fstatat(dest_dir, dest, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        errno = EEXIST;
         return -1;
     }
+    return renameat(src_dir, src, dest_dir, dest);
+}
+
+int partial_path(const char *dest, char *out)
+{
+    const char *name = strrchr(dest, '/');
+    int dir_len = name ? (int)(name + 1 - dest) : 0;
+    int len = snprintf(out, MAX_PATH, "%.*s.%s.partial", dir_len, dest, dest + dir_len);
+    return len >= 0 && len < MAX_PATH ? 0 : -1;
+}
+
+/* Copy src to a new dest, durably (data and directory entry synced), keeping mode and mtime */
+static int copy_file(int src_dir, const char *src, int dest_dir, const char *dest)
+{
+    int in = openat(src_dir, src, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return -1;
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        close(in);
+        return -1;
+    }
+    int out = openat(dest_dir, dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 0777);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    off_t remaining = st.st_size;
+#ifdef __linux__
+    /* In-kernel copy (reflink or server-side copy when the filesystems support it) */
+    while (remaining > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, (size_t)remaining, 0);
+        if (n <= 0)
+            break;
+        remaining -= n;
+    }
+    while (remaining > 0) {
+        ssize_t n = sendfile(out, in, NULL, (size_t)remaining);
+        if (n <= 0)
+            break;
+        remaining -= n;
+    }
+#endif
+    if (remaining > 0 && lseek(in, st.st_size - remaining, SEEK_SET) >= 0) {
+        char buf[256 * 1024];
+        ssize_t n;
+        while (remaining > 0 && (n = read(in, buf, sizeof(buf))) > 0) {
+            if (write(out, buf, (size_t)n) != n)
+                break;
+            remaining -= n;
+        }
+    }
+
+#ifdef __APPLE__
+    struct timespec times[2] = {st.st_atimespec, st.st_mtimespec};
+#else
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+#endif
+    int result = remaining == 0 && futimens(out, times) == 0 && fsync(out) == 0 ? 0 : -1;
+    close(in);
+    if (close(out) != 0)
+        result = -1;
+
+    if (result == 0)
+        sync_parent(dest_dir, dest);
+    else
+        unlinkat(dest_dir, dest, 0);
+    return result;
+}
+
+int move_at(int src_dir, const char *src, int dest_dir, const char *dest)
+{
+    /* rename() silently replaces, and recursive sources easily share file names. Checked first so that a copy
+     * across filesystems is not made for nothing */
+    struct stat st;
+    if (fstatat(dest_dir, dest, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        errno = EEXIST;
+    else if (rename_noreplace(src_dir, src, dest_dir, dest) == 0)
+        return 0;
+    if (errno == EEXIST) {
+        fprintf(stderr, "Error: '%s' already exists, not moving '%s'\n", dest, src);
+        return -1;
+    }
+    if (errno != EXDEV) {
+        fprintf(stderr, "Error: Failed to move '%s' to '%s': %s\n", src, dest, strerror(errno));
+        return -1;
+    }
+
+    /* Destination on another filesystem: copy under a temporary name, rename it into place once it is
+     * durable, then remove the source. After a crash only the temporary file is removed */
+    char partial[MAX_PATH];
+    if (partial_path(dest, partial) != 0) {
+        fprintf(stderr, "Error: Path too long to copy '%s' to '%s'\n", src, dest);
+        return -1;
+    }
+    if (copy_file(src_dir, src, dest_dir, partial) != 0) {
+        fprintf(stderr, "Error: Failed to copy '%s' to '%s': %s\n", src, dest, strerror(errno));
+        return -1;
+    }
+    if (rename_noreplace(dest_dir, partial, dest_dir, dest) != 0) {
+        fprintf(stderr, "Error: Failed to move '%s' to '%s': %s\n", src, dest, strerror(errno));
+        unlinkat(dest_dir, partial, 0);
+        return -1;
+    }
+    sync_parent(dest_dir, dest);
+    if (unlinkat(src_dir, src, 0) != 0) {
+        fprintf(stderr, "Error: Copied '%s' but cannot remove it: %s\n", src, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int move_path(const char *src, const char *dest)
+{
+    return move_at(AT_FDCWD, src, AT_FDCWD, dest);
+}
+
+int move_file(const char *src, const char *dest_dir, char *out_dest_path)
+{
+    char dest_path[MAX_PATH];
+    dest_path_for(src, dest_dir, dest_path);
+
+    if (move_path(src, dest_path) != 0)
+        return -1;
 
-    printf("Moved: %s -> %s\n", filename, dest_dir);
+    printf("Moved: %s -> %s\n", strrchr(dest_path, '/') + 1, dest_dir);
     if (out_dest_path) {
         snprintf(out_dest_path, MAX_PATH, "%s", dest_path);
     }
-    free(src_copy);
     return 0;
 }
 
 int undo_move_file(const char *dest_path, const char *src_path)
 {
-    if (rename(dest_path, src_path) != 0) {
+    if (move_path(dest_path, src_path) != 0) {
         fprintf(stderr, "Error: Failed to undo move '%s'\n", dest_path);
         return -1;
     }
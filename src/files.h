@@ -3,15 +3,70 @@
 
 #include "types.h"
 
+#include <sys/stat.h>
+
 /* Parse command line arguments and populate config */
 int parse_args(int argc, char *argv[], Config *config);
 
-/* Load list of image files from directory */
-int load_image_list(const char *dir_path, ImageList *list);
+/* Start an empty image list for dir_path */
+void image_list_init(ImageList *list, const char *dir_path);
+
+/* Load list of image files from directory (and its subdirectories with recursive, but not the excluded ones) */
+int load_image_list(const char *dir_path, int recursive, const DirId *excluded, int excluded_count,
+    ImageList *list);
 
 /* Free image list memory */
 void free_image_list(ImageList *list);
 
+/* Append a name (relative to list->dir) to the list, returns 0 on success */
+int image_list_add(ImageList *list, const char *name, size_t len, ImageFormat format);
+
+/* Flag index as gone from the source directory (or back in it), keeping list->gone up to date */
+void image_set_gone(ImageList *list, int index, int gone);
+
+/* Grow an array of capacity elements of size bytes (doubling, from 256) to hold at least needed of them.
+ * Returns 0 on success, -1 on allocation failure with the array left as it was */
+int array_grow(void **array, int *capacity, int needed, size_t size);
+
+/* Keep the images order lists (count indices of images from first on) in that order after the images before
+ * first, and drop the others. Returns 0 on success */
+int image_list_keep(ImageList *list, int first, const int *order, int count);
+
+/* Name of an image relative to list->dir. Invalidated when the list grows */
+const char *image_name(const ImageList *list, int index);
+
+/* Format sniffed from the image content during the scan */
+ImageFormat image_format(const ImageList *list, int index);
+
+/* First image to show at or after index: the unseen ones, then a second pass (*pass set to 1) over the skipped
+ * ones once the whole list is known. The second pass also shows images added after the first one went past */
+int seek_image(const ImageList *list, int index, int *pass, int scanning);
+
+/* Write the full path of an image to buf (MAX_PATH bytes) and return buf, NULL when it does not fit */
+char *image_path(const ImageList *list, int index, char *buf);
+
+/* Directory of a destination */
+const char *dest_dir(const Config *config, Destination dest);
+
+/* Identity of each destination directory that exists, written to out. Returns how many */
+int dest_dir_ids(const Config *config, DirId out[MAX_DESTS]);
+
+/* Whether st is the directory of one of the count ids */
+int dir_id_match(const DirId *ids, int count, const struct stat *st);
+
+/* Path src gets when moved into dest_dir (MAX_PATH bytes) */
+void dest_path_for(const char *src, const char *dest_dir, char *out_dest_path);
+
+/* Temporary name a copy across filesystems to dest is made under before it is renamed into place: a hidden
+ * .<name>.partial next to it, which the scanner and the watcher skip. Returns -1 when it does not fit */
+int partial_path(const char *dest, char *out);
+
+/* Move src to dest without replacing an existing file, copying across filesystems */
+int move_path(const char *src, const char *dest);
+
+/* move_path() with src and dest relative to the open directories src_dir and dest_dir (or AT_FDCWD) */
+int move_at(int src_dir, const char *src, int dest_dir, const char *dest);
+
 /* Move file to destination directory, returns dest path in out_dest_path */
 int move_file(const char *src, const char *dest_dir, char *out_dest_path);
 
@@ -0,0 +1,245 @@
+#include "grid.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Window space above the grid (progress bar) and below it (instructions) */
+#define GRID_TOP    20
+#define GRID_BOTTOM 40
+#define GRID_SIDE   10
+
+#define CELL_PADDING 4
+#define ZOOM_STEP    16
+
+/* Thumbnail textures kept before the ones far from view are dropped, about 50 MB at THUMB_SIZE */
+#define MAX_GRID_TEXTURES 1024
+
+void grid_init(Grid *grid, const char *dir)
+{
+    memset(grid, 0, sizeof(Grid));
+    snprintf(grid->dir, MAX_PATH, "%s", dir);
+    grid->cell = DEFAULT_GRID_CELL;
+    grid->columns = 1;
+    grid->last_visible = -1;
+}
+
+void grid_free(Grid *grid)
+{
+    for (int i = 0; i < grid->texture_capacity; i++) {
+        if (grid->textures[i])
+            SDL_DestroyTexture(grid->textures[i]);
+    }
+    free(grid->textures);
+    thumbs_destroy(grid->thumbs);
+    grid->textures = NULL;
+    grid->texture_capacity = 0;
+    grid->texture_count = 0;
+    grid->thumbs = NULL;
+}
+
+int grid_open(Grid *grid, int index)
+{
+    if (!grid->thumbs && !(grid->thumbs = thumbs_create(grid->dir)))
+        return -1;
+    grid->cursor = index;
+    grid->anchor = index;
+    grid->reveal = 1;
+    return 0;
+}
+
+static int grow_textures(Grid *grid, int needed)
+{
+    if (needed <= grid->texture_capacity)
+        return 0;
+    int grown = grid->texture_capacity ? grid->texture_capacity : 256;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    SDL_Texture **textures = realloc(grid->textures, sizeof(SDL_Texture *) * grown);
+    if (!textures)
+        return -1;
+    memset(textures + grid->texture_capacity, 0, sizeof(SDL_Texture *) * (grown - grid->texture_capacity));
+    grid->textures = textures;
+    grid->texture_capacity = grown;
+    return 0;
+}
+
+/* Drop the textures further than a screen from the visible ones, they are made again from the cache */
+static void evict_textures(Grid *grid)
+{
+    int span = grid->last_visible - grid->first_visible + 1;
+    for (int i = 0; i < grid->texture_capacity && grid->texture_count > MAX_GRID_TEXTURES / 2; i++) {
+        if (grid->textures[i] && (i < grid->first_visible - span || i > grid->last_visible + span)) {
+            SDL_DestroyTexture(grid->textures[i]);
+            grid->textures[i] = NULL;
+            grid->texture_count--;
+            thumbs_release(grid->thumbs, i);
+        }
+    }
+}
+
+int grid_update(Grid *grid, SDL_Renderer *renderer, const ImageList *list, int win_width, int win_height)
+{
+    if (!grid->thumbs)
+        return 0;
+
+    grid->columns = SDL_max(1, (win_width - GRID_SIDE * 2) / grid->cell);
+    grid->origin_x = (win_width - grid->columns * grid->cell) / 2;
+    grid->view_height = SDL_max(grid->cell, win_height - GRID_TOP - GRID_BOTTOM);
+
+    /* Bring the cursor into view, then keep the scroll inside the grid */
+    int rows = (list->count + grid->columns - 1) / grid->columns;
+    if (grid->reveal) {
+        int top = grid->cursor / grid->columns * grid->cell;
+        if (top < grid->scroll)
+            grid->scroll = top;
+        else if (top + grid->cell > grid->scroll + grid->view_height)
+            grid->scroll = top + grid->cell - grid->view_height;
+        grid->reveal = 0;
+    }
+    grid->scroll = SDL_min(grid->scroll, rows * grid->cell - grid->view_height);
+    grid->scroll = SDL_max(grid->scroll, 0);
+
+    grid->first_visible = grid->scroll / grid->cell * grid->columns;
+    grid->last_visible = (grid->scroll + grid->view_height + grid->cell - 1) / grid->cell * grid->columns - 1;
+    grid->last_visible = SDL_min(grid->last_visible, list->count - 1);
+
+    /* The next screen is made while this one is looked at */
+    int visible = grid->last_visible - grid->first_visible + 1;
+    thumbs_want(grid->thumbs, list, grid->first_visible, grid->last_visible + visible);
+
+    int changed = 0;
+    int index;
+    SDL_Surface *surface;
+    while (thumbs_poll(grid->thumbs, &index, &surface)) {
+        if (surface && grow_textures(grid, list->count) == 0 && !grid->textures[index]) {
+            grid->textures[index] = SDL_CreateTextureFromSurface(renderer, surface);
+            if (grid->textures[index]) {
+                grid->texture_count++;
+                changed |= index >= grid->first_visible && index <= grid->last_visible;
+            }
+        }
+        SDL_FreeSurface(surface);
+    }
+    if (grid->texture_count > MAX_GRID_TEXTURES)
+        evict_textures(grid);
+    return changed;
+}
+
+void grid_render(const Grid *grid, SDL_Renderer *renderer, const ImageList *list, int win_width)
+{
+    SDL_Rect view = {0, GRID_TOP, win_width, grid->view_height};
+    SDL_RenderSetClipRect(renderer, &view);
+
+    for (int i = grid->first_visible; i <= grid->last_visible; i++) {
+        SDL_Rect cell = {grid->origin_x + i % grid->columns * grid->cell,
+            GRID_TOP + i / grid->columns * grid->cell - grid->scroll, grid->cell, grid->cell};
+        SDL_Rect inner = {cell.x + CELL_PADDING, cell.y + CELL_PADDING, cell.w - CELL_PADDING * 2,
+            cell.h - CELL_PADDING * 2};
+
+        if (list->flags[i] & IMAGE_SELECTED) {
+            SDL_SetRenderDrawColor(renderer, 60, 90, 140, 255);
+            SDL_RenderFillRect(renderer, &cell);
+        }
+
+        SDL_Texture *texture = i < grid->texture_capacity ? grid->textures[i] : NULL;
+        if (texture) {
+            int width, height;
+            SDL_QueryTexture(texture, NULL, NULL, &width, &height);
+            float scale = SDL_min((float)inner.w / width, (float)inner.h / height);
+            SDL_Rect dest = {0, 0, (int)(width * scale), (int)(height * scale)};
+            dest.x = inner.x + (inner.w - dest.w) / 2;
+            dest.y = inner.y + (inner.h - dest.h) / 2;
+            /* Sorted and vanished images stay in place, dimmed */
+            Uint8 shade = (list->flags[i] & (IMAGE_MOVED | IMAGE_GONE)) ? 70 : 255;
+            SDL_SetTextureColorMod(texture, shade, shade, shade);
+            SDL_RenderCopy(renderer, texture, NULL, &dest);
+        } else if (!(list->flags[i] & (IMAGE_MOVED | IMAGE_GONE))) {
+            SDL_SetRenderDrawColor(renderer, 45, 45, 45, 255);
+            SDL_RenderFillRect(renderer, &inner);
+        }
+
+        if (list->flags[i] & IMAGE_SKIPPED) {
+            SDL_Rect mark = {inner.x + 2, inner.y + 2, 8, 8};
+            SDL_SetRenderDrawColor(renderer, 220, 190, 80, 255);
+            SDL_RenderFillRect(renderer, &mark);
+        }
+
+        if (i == grid->cursor) {
+            SDL_SetRenderDrawColor(renderer, 230, 230, 230, 255);
+            SDL_RenderDrawRect(renderer, &cell);
+            SDL_Rect thick = {cell.x + 1, cell.y + 1, cell.w - 2, cell.h - 2};
+            SDL_RenderDrawRect(renderer, &thick);
+        }
+    }
+
+    SDL_RenderSetClipRect(renderer, NULL);
+}
+
+int grid_index_at(const Grid *grid, const ImageList *list, int x, int y)
+{
+    if (y < GRID_TOP || y >= GRID_TOP + grid->view_height || x < grid->origin_x)
+        return -1;
+    int column = (x - grid->origin_x) / grid->cell;
+    if (column >= grid->columns)
+        return -1;
+    int index = (y - GRID_TOP + grid->scroll) / grid->cell * grid->columns + column;
+    return index < list->count ? index : -1;
+}
+
+int grid_clear_selection(ImageList *list)
+{
+    int count = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (list->flags[i] & IMAGE_SELECTED) {
+            list->flags[i] &= (uint8_t)~IMAGE_SELECTED;
+            count++;
+        }
+    }
+    return count;
+}
+
+void grid_select(Grid *grid, ImageList *list, int index, GridSelect how)
+{
+    if (index < 0 || index >= list->count)
+        return;
+
+    /* Sorted and vanished images cannot be selected, only looked at */
+    if (how == GRID_SELECT_ONE) {
+        grid_clear_selection(list);
+        grid->anchor = index;
+    } else if (how == GRID_SELECT_TOGGLE) {
+        if (!(list->flags[index] & (IMAGE_MOVED | IMAGE_GONE)))
+            list->flags[index] ^= IMAGE_SELECTED;
+        grid->anchor = index;
+    } else {
+        grid_clear_selection(list);
+        int from = SDL_min(grid->anchor, index);
+        int to = SDL_max(grid->anchor, index);
+        for (int i = from; i <= to && i < list->count; i++) {
+            if (!(list->flags[i] & (IMAGE_MOVED | IMAGE_GONE)))
+                list->flags[i] |= IMAGE_SELECTED;
+        }
+    }
+    grid->cursor = index;
+    grid->reveal = 1;
+}
+
+void grid_scroll(Grid *grid, int pixels)
+{
+    /* Clamped on the next grid_update() */
+    grid->scroll = SDL_max(grid->scroll + pixels, 0);
+}
+
+void grid_zoom(Grid *grid, int steps)
+{
+    int cell = SDL_max(SDL_min(grid->cell + steps * ZOOM_STEP, MAX_GRID_CELL), MIN_GRID_CELL);
+    if (cell == grid->cell)
+        return;
+    int width = grid->columns * grid->cell + grid->origin_x * 2;
+    int columns = SDL_max(1, (width - GRID_SIDE * 2) / cell);
+    int screen_y = grid->cursor / grid->columns * grid->cell - grid->scroll;
+    grid->scroll = SDL_max(grid->cursor / columns * cell - screen_y, 0);
+    grid->cell = cell;
+}
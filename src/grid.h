@@ -0,0 +1,68 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "thumbs.h"
+#include "types.h"
+
+#include <SDL2/SDL.h>
+
+#define DEFAULT_GRID_CELL 112
+#define MIN_GRID_CELL     48
+#define MAX_GRID_CELL     208
+
+/* How a click or a cursor key changes the selection */
+typedef enum {
+    GRID_SELECT_ONE,    /* Only the image under the cursor */
+    GRID_SELECT_TOGGLE, /* Add or remove the image, keep the rest */
+    GRID_SELECT_RANGE,  /* From the last image picked to this one */
+} GridSelect;
+
+/* Contact sheet of the image list, thumbnails come from the cache or the thumbnail threads */
+typedef struct {
+    Thumbs *thumbs; /* Started the first time the grid is shown */
+    char dir[MAX_PATH];
+    SDL_Texture **textures; /* Thumbnail of each image, NULL until it is ready */
+    int texture_capacity;
+    int texture_count;
+    int cursor;
+    int anchor; /* Start of a range selection */
+    int cell;   /* Cell size in pixels */
+    int scroll; /* Pixels scrolled down */
+    int reveal; /* Scroll the cursor into view on the next grid_update() */
+    int columns; /* Layout of the last grid_update() */
+    int origin_x;
+    int view_height;
+    int first_visible;
+    int last_visible;
+} Grid;
+
+void grid_init(Grid *grid, const char *dir);
+
+/* Destroy the textures and stop the thumbnail threads, before destroying the renderer */
+void grid_free(Grid *grid);
+
+/* Show the grid with the cursor on index. Returns 0 on success, -1 when the thumbnail threads cannot start */
+int grid_open(Grid *grid, int index);
+
+/* Lay the grid out for the window, ask for the thumbnails in view (and the next screen) and upload
+ * the ones that are ready. Returns 1 when the grid needs to be drawn again */
+int grid_update(Grid *grid, SDL_Renderer *renderer, const ImageList *list, int win_width, int win_height);
+
+/* Draw the visible cells, moved images dimmed, skipped ones marked */
+void grid_render(const Grid *grid, SDL_Renderer *renderer, const ImageList *list, int win_width);
+
+/* Image under a window position, -1 for none */
+int grid_index_at(const Grid *grid, const ImageList *list, int x, int y);
+
+/* Move the cursor to index, scrolling it into view, and update the selection */
+void grid_select(Grid *grid, ImageList *list, int index, GridSelect how);
+
+/* Clear IMAGE_SELECTED from every image, returns how many were selected */
+int grid_clear_selection(ImageList *list);
+
+void grid_scroll(Grid *grid, int pixels);
+
+/* Change the cell size by steps of 16 pixels, keeping the cursor row in place */
+void grid_zoom(Grid *grid, int steps);
+
+#endif /* GRID_H */
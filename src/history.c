@@ -1,30 +1,263 @@
 #include "history.h"
 
+#include "files.h"
+#include "sniff.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+
+/* Log records, NUL-terminated: an operation, a destination digit and the image name (empty for undo and
+ * redo). Names keep the log valid across runs, where image indices change */
+#define LOG_PUSH   'M'
+#define LOG_GROUP  'G' /* Push made in the same keypress as the previous one */
+#define LOG_UNDO   'U'
+#define LOG_REDO   'R'
+#define LOG_REMOVE 'F'
+#define LOG_KEEP   'K' /* An undone move whose undo failed is done again */
+
+#define ENTRY_INDEX(e) ((int)((e) >> HISTORY_INDEX_SHIFT))
+#define ENTRY_DEST(e)  ((Destination)((e) & ((1u << HISTORY_DEST_BITS) - 1)))
+
+/* Destination flag of grouped moves while replaying the log */
+#define REPLAY_GROUPED 0x80
 
 void history_init(MoveHistory *h)
 {
-    h->head = 0;
-    h->count = 0;
+    memset(h, 0, sizeof(MoveHistory));
 }
 
-void history_push(MoveHistory *h, const char *src, const char *dest, int index, int direction)
+void history_free(MoveHistory *h)
 {
-    strncpy(h->entries[h->head].src_path, src, MAX_PATH - 1);
-    strncpy(h->entries[h->head].dest_path, dest, MAX_PATH - 1);
-    h->entries[h->head].image_index = index;
-    h->entries[h->head].direction = direction;
-    h->head = (h->head + 1) % HISTORY_SIZE;
-    if (h->count < HISTORY_SIZE)
-        h->count++;
+    if (h->log)
+        fclose(h->log);
+    free(h->entries);
+    history_init(h);
+}
+
+static void log_record(MoveHistory *h, char op, Destination dest, int index)
+{
+    if (!h->log)
+        return;
+    const char *name = index >= 0 ? image_name(h->list, index) : "";
+    fprintf(h->log, "%c%c%s%c", op, '0' + dest, name, '\0');
+    fflush(h->log);
+}
+
+static int insert_entry(MoveHistory *h, int index, Destination dest, int grouped)
+{
+    if (h->count == h->capacity) {
+        int capacity = h->capacity ? h->capacity * 2 : 1024;
+        uint32_t *entries = realloc(h->entries, sizeof(uint32_t) * capacity);
+        if (!entries)
+            return -1;
+        h->entries = entries;
+        h->capacity = capacity;
+    }
+    h->entries[h->count++] = (uint32_t)index << HISTORY_INDEX_SHIFT | (grouped ? HISTORY_GROUPED : 0) | dest;
+    h->top = h->count;
+    h->done[dest]++;
+    return 0;
+}
+
+int history_push(MoveHistory *h, int index, Destination dest, int grouped)
+{
+    h->count = h->top;
+    grouped = grouped && h->top > 0;
+    if (insert_entry(h, index, dest, grouped) != 0)
+        return -1;
+    log_record(h, grouped ? LOG_GROUP : LOG_PUSH, dest, index);
+    return 0;
+}
+
+int history_undo(MoveHistory *h, int *index, Destination *dest, int *more)
+{
+    if (h->top == 0)
+        return -1;
+    uint32_t entry = h->entries[--h->top];
+    *index = ENTRY_INDEX(entry);
+    *dest = ENTRY_DEST(entry);
+    if (more)
+        *more = (entry & HISTORY_GROUPED) && h->top > 0;
+    h->done[*dest]--;
+    log_record(h, LOG_UNDO, 0, -1);
+    return 0;
 }
 
-int history_pop(MoveHistory *h, MoveEntry *out)
+int history_redo(MoveHistory *h, int *index, Destination *dest, int *more)
 {
-    if (h->count == 0)
+    if (h->top == h->count)
         return -1;
-    h->head = (h->head - 1 + HISTORY_SIZE) % HISTORY_SIZE;
-    h->count--;
-    *out = h->entries[h->head];
+    uint32_t entry = h->entries[h->top++];
+    *index = ENTRY_INDEX(entry);
+    *dest = ENTRY_DEST(entry);
+    if (more)
+        *more = h->top < h->count && (h->entries[h->top] & HISTORY_GROUPED);
+    h->done[*dest]++;
+    log_record(h, LOG_REDO, 0, -1);
     return 0;
 }
+
+int history_remove(MoveHistory *h, int index, Destination *dest)
+{
+    for (int i = h->top - 1; i >= 0; i--) {
+        if (ENTRY_INDEX(h->entries[i]) != index)
+            continue;
+        *dest = ENTRY_DEST(h->entries[i]);
+        h->done[*dest]--;
+        log_record(h, LOG_REMOVE, *dest, index);
+        /* The rest of its keypress stays together */
+        if (!(h->entries[i] & HISTORY_GROUPED) && i + 1 < h->count)
+            h->entries[i + 1] &= ~HISTORY_GROUPED;
+        memmove(h->entries + i, h->entries + i + 1, sizeof(uint32_t) * (h->count - i - 1));
+        h->count--;
+        h->top--;
+        return 0;
+    }
+    return -1;
+}
+
+int history_keep(MoveHistory *h, int index, Destination *dest)
+{
+    for (int i = h->top; i < h->count; i++) {
+        uint32_t entry = h->entries[i];
+        if (ENTRY_INDEX(entry) != index)
+            continue;
+        *dest = ENTRY_DEST(entry);
+        h->done[*dest]++;
+        log_record(h, LOG_KEEP, *dest, index);
+        /* Done on its own, the rest of its keypress stays together in the redo list */
+        if (!(entry & HISTORY_GROUPED) && i + 1 < h->count)
+            h->entries[i + 1] &= ~HISTORY_GROUPED;
+        memmove(h->entries + h->top + 1, h->entries + h->top, sizeof(uint32_t) * (i - h->top));
+        h->entries[h->top++] = entry & ~HISTORY_GROUPED;
+        return 0;
+    }
+    return -1;
+}
+
+/* Replay the log into names (the moves still done at the end of the log) and their destinations,
+ * with REPLAY_GROUPED set on grouped moves */
+static int replay_log(const char *data, size_t size, ImageList *names, uint8_t **dests)
+{
+    int top = 0;
+    int capacity = 0;
+    size_t pos = 0;
+    while (pos + 2 < size) {
+        char op = data[pos];
+        int dest = data[pos + 1] - '0';
+        const char *name = data + pos + 2;
+        const char *end = memchr(name, '\0', size - pos - 2);
+        if (!end || dest < 0 || dest >= MAX_DESTS)
+            break; /* Torn or corrupted tail */
+        size_t len = (size_t)(end - name);
+        pos = (size_t)(end - data) + 1;
+
+        if ((op == LOG_PUSH || op == LOG_GROUP) && len > 0) {
+            names->count = top; /* Drops the moves that could be redone */
+            if (top == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                uint8_t *grown = realloc(*dests, capacity);
+                if (!grown)
+                    return -1;
+                *dests = grown;
+            }
+            if (image_list_add(names, name, len, FORMAT_UNKNOWN) != 0)
+                return -1;
+            (*dests)[top++] = (uint8_t)(dest | (op == LOG_GROUP ? REPLAY_GROUPED : 0));
+        } else if (op == LOG_UNDO && top > 0) {
+            top--;
+        } else if (op == LOG_REDO && top < names->count) {
+            top++;
+        } else if (op == LOG_REMOVE) {
+            for (int i = top - 1; i >= 0; i--) {
+                if (strcmp(image_name(names, i), name) == 0) {
+                    memmove(names->offsets + i, names->offsets + i + 1, sizeof(uint32_t) * (names->count - i - 1));
+                    memmove(*dests + i, *dests + i + 1, names->count - i - 1);
+                    names->count--;
+                    top--;
+                    break;
+                }
+            }
+        } else if (op == LOG_KEEP) {
+            for (int i = top; i < names->count; i++) {
+                if (strcmp(image_name(names, i), name) == 0) {
+                    uint32_t offset = names->offsets[i];
+                    uint8_t kept = (*dests)[i];
+                    if (!(kept & REPLAY_GROUPED) && i + 1 < names->count)
+                        (*dests)[i + 1] &= (uint8_t)~REPLAY_GROUPED;
+                    memmove(names->offsets + top + 1, names->offsets + top, sizeof(uint32_t) * (i - top));
+                    memmove(*dests + top + 1, *dests + top, i - top);
+                    names->offsets[top] = offset;
+                    (*dests)[top++] = kept & (uint8_t)~REPLAY_GROUPED;
+                    break;
+                }
+            }
+        }
+    }
+    /* Undone images are back in the source directory and get listed by the scan */
+    names->count = top;
+    return 0;
+}
+
+int history_open(MoveHistory *h, const char *path, ImageList *list, const Config *config)
+{
+    h->list = list;
+
+    ImageList logged;
+    image_list_init(&logged, list->dir);
+    uint8_t *dests = NULL;
+
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        char *data = NULL;
+        size_t size = 0;
+        if (fseek(f, 0, SEEK_END) == 0 && (size = (size_t)ftell(f)) > 0 && (data = malloc(size))) {
+            fseek(f, 0, SEEK_SET);
+            if (fread(data, 1, size, f) != size || replay_log(data, size, &logged, &dests) != 0) {
+                fprintf(stderr, "Warning: Cannot read undo history '%s'\n", path);
+                logged.count = 0;
+            }
+        }
+        free(data);
+        fclose(f);
+    }
+
+    /* The log is rewritten with only the moves restored, so it does not grow across runs */
+    h->log = fopen(path, "wb");
+    if (!h->log)
+        fprintf(stderr, "Warning: Cannot write undo history '%s'\n", path);
+
+    /* Keep the moves still in place: image in the destination and not back in the source */
+    int restored = 0;
+    for (int i = 0; i < logged.count; i++) {
+        const char *name = image_name(&logged, i);
+        char src_path[MAX_PATH], dest_path[MAX_PATH];
+        Destination dest = (Destination)(dests[i] & ~REPLAY_GROUPED);
+        if ((int)dest >= config->dest_count || snprintf(src_path, MAX_PATH, "%s/%s", list->dir, name) >= MAX_PATH)
+            continue;
+        dest_path_for(src_path, dest_dir(config, dest), dest_path);
+
+        struct stat st;
+        if (lstat(src_path, &st) == 0 || lstat(dest_path, &st) != 0)
+            continue;
+        ImageFormat format = sniff_file(AT_FDCWD, dest_path);
+        if (format == FORMAT_UNKNOWN)
+            continue;
+        if (image_list_add(list, name, strlen(name), format) != 0)
+            break;
+        /* In a destination either way, only undoing it needs the history */
+        list->flags[list->count - 1] = IMAGE_MOVED;
+        if (history_push(h, list->count - 1, dest, dests[i] & REPLAY_GROUPED) != 0)
+            break;
+        restored++;
+    }
+    list->current = list->count;
+
+    if (restored > 0)
+        printf("Restored %d moves to undo\n", restored);
+    free(dests);
+    free_image_list(&logged);
+    return restored;
+}
@@ -3,28 +3,54 @@
 
 #include "types.h"
 
-#define HISTORY_SIZE 50
+#include <stdio.h>
 
-typedef struct {
-    char src_path[MAX_PATH];  /* Original path (in source dir) */
-    char dest_path[MAX_PATH]; /* Where it was moved to */
-    int image_index;          /* Index in images list */
-    int direction;            /* -1 for left, 1 for right */
-} MoveEntry;
+#define HISTORY_NAME ".image_swipe_sorter.history"
+
+/* Bits of an entry holding the destination, then a bit set on moves made in the same keypress as the
+ * move below them (a cluster of near-duplicates). The image index uses the rest */
+#define HISTORY_DEST_BITS   4
+#define HISTORY_GROUPED     (1u << HISTORY_DEST_BITS)
+#define HISTORY_INDEX_SHIFT (HISTORY_DEST_BITS + 1)
 
+/* Moves as image index and destination, the paths are derived from the ImageList and Config */
 typedef struct {
-    MoveEntry entries[HISTORY_SIZE];
-    int head;  /* Next write position */
-    int count; /* Number of valid entries */
+    uint32_t *entries; /* image index << HISTORY_INDEX_SHIFT | HISTORY_GROUPED | destination */
+    int count;         /* Valid entries, including undone ones that can be redone */
+    int top;           /* Entries below top are done, the rest can be redone */
+    int capacity;
+    int done[MAX_DESTS]; /* Moves below top per destination */
+    const ImageList *list;
+    FILE *log; /* Every change is appended here with --keep-history */
 } MoveHistory;
 
 /* Initialize history */
 void history_init(MoveHistory *h);
 
-/* Push a move entry to history */
-void history_push(MoveHistory *h, const char *src, const char *dest, int index, int direction);
+/* Free the entries and close the log */
+void history_free(MoveHistory *h);
+
+/* Restore the moves logged by an earlier run that are still in place: their images are added to list
+ * (before the scan fills it) and to the history. Further changes are logged to path */
+int history_open(MoveHistory *h, const char *path, ImageList *list, const Config *config);
+
+/* Push a move, dropping the moves that could be redone. grouped: made in the same keypress as the
+ * previous push. Returns 0 on success, -1 if out of memory */
+int history_push(MoveHistory *h, int index, Destination dest, int grouped);
+
+/* Take back the last move, returns 0 on success, -1 if empty. more (may be NULL) is set when the move
+ * below was made in the same keypress and should be taken back too */
+int history_undo(MoveHistory *h, int *index, Destination *dest, int *more);
+
+/* Apply the last undone move again, returns 0 on success, -1 if nothing was undone. more (may be NULL)
+ * is set when the next undone move was made in the same keypress */
+int history_redo(MoveHistory *h, int *index, Destination *dest, int *more);
+
+/* Remove the newest move of image index (a move that failed), returns 0 on success, -1 if not found */
+int history_remove(MoveHistory *h, int index, Destination *dest);
 
-/* Pop last move entry, returns 0 on success, -1 if empty */
-int history_pop(MoveHistory *h, MoveEntry *out);
+/* Do the undone move of image index again (its undo failed), the rest of the redo list stays in place.
+ * Returns 0 on success, -1 if not found */
+int history_keep(MoveHistory *h, int index, Destination *dest);
 
 #endif /* HISTORY_H */
@@ -0,0 +1,446 @@
+#include "loader.h"
+
+#include "cache.h"
+#include "exif.h"
+#include "files.h"
+#include "trace.h"
+#include "wake.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Images from this size on show their embedded preview while they are decoded */
+#define PREVIEW_MIN_PIXELS (4 * 1024 * 1024)
+
+typedef enum {
+    SLOT_EMPTY,
+    SLOT_QUEUED,
+    SLOT_DECODING,
+    SLOT_READY,
+    SLOT_FAILED,
+} SlotState;
+
+typedef struct {
+    SlotState state;
+    int index;           /* Index in images list */
+    int order;           /* Decode order, from the position in the window */
+    int full;            /* Full resolution decode requested by zooming */
+    int stale;           /* Left the window while a worker was decoding it */
+    char path[MAX_PATH]; /* Copied on queue so workers never touch the list */
+    ImageFormat format;
+    MappedFile input; /* Mapped by the worker that takes the slot, open and mmap may block on the disk */
+    int target_width;    /* Output size at queue time */
+    int target_height;
+    DecodedImage image;
+    DecodedImage preview; /* Embedded preview, until image is ready */
+} Slot;
+
+struct Loader {
+    Slot *slots;
+    int slot_count;
+    int prefetch;
+    int use_mmap;
+    Uint32 pixel_format; /* Decoded surfaces are in it, 0 for the decoders' own */
+    Cache *cache;        /* Keeps the decodes leaving the window, NULL for none */
+    int current;    /* Window center */
+    int full_index; /* Image with a full resolution decode requested, -1 if none */
+    int target_width;
+    int target_height;
+    SDL_Thread **threads;
+    int thread_count;
+    SDL_mutex *lock;
+    SDL_cond *work;
+    int quit;
+    /* Input throughput, updated by workers under lock */
+    int decoded_count;
+    Uint64 decoded_bytes;
+    Uint64 decode_ticks;
+};
+
+/* Decode order: current image first, then its full resolution version if requested,
+ * then the next ones, the previous one right after the next */
+#define ORDER_FULL     1
+#define ORDER_PREVIOUS 3
+
+static Slot *next_queued_slot(Loader *loader)
+{
+    Slot *best = NULL;
+    for (int i = 0; i < loader->slot_count; i++) {
+        Slot *slot = &loader->slots[i];
+        if (slot->state != SLOT_QUEUED)
+            continue;
+        if (!best || slot->order < best->order)
+            best = slot;
+    }
+    return best;
+}
+
+/* Decode the largest JPEG preview embedded in a large JPEG or TIFF, turned like the image */
+static void decode_preview(Loader *loader, Slot *slot)
+{
+    ExifInfo exif;
+    if (exif_parse(slot->input.data, slot->input.size, slot->format, &exif) != 0 || !exif.preview ||
+        (long long)exif.width * exif.height < PREVIEW_MIN_PIXELS)
+        return;
+    /* libtiff applies the mirroring of the orientation but not the turns, the preview would not match */
+    if (slot->format == FORMAT_TIFF && exif.orientation != 1)
+        return;
+
+    MappedFile blob = {exif.preview, exif.preview_size};
+    DecodedImage preview;
+    if (decode_image(slot->path, &blob, FORMAT_JPEG, slot->target_width, slot->target_height, loader->pixel_format,
+            &preview) != 0)
+        return;
+    /* Unless the preview has an orientation of its own, already applied by the decoder */
+    ExifInfo own;
+    exif_parse(blob.data, blob.size, FORMAT_JPEG, &own);
+    if (own.orientation == 1)
+        preview.surface = orient_surface(preview.surface, exif.orientation);
+    preview.full_width = exif.orientation >= 5 ? exif.height : exif.width;
+    preview.full_height = exif.orientation >= 5 ? exif.width : exif.height;
+    preview.reduced = 1;
+
+    SDL_LockMutex(loader->lock);
+    if (slot->stale) {
+        SDL_FreeSurface(preview.surface);
+    } else {
+        slot->preview = preview;
+        wake_main(WAKE_DECODED);
+    }
+    SDL_UnlockMutex(loader->lock);
+}
+
+static int decode_thread(void *data)
+{
+    Loader *loader = data;
+
+    SDL_LockMutex(loader->lock);
+    while (!loader->quit) {
+        Slot *slot = next_queued_slot(loader);
+        if (!slot) {
+            SDL_CondWait(loader->work, loader->lock);
+            continue;
+        }
+        slot->state = SLOT_DECODING;
+        SDL_UnlockMutex(loader->lock);
+
+        /* Slot path, input and target are not modified while the slot is in SLOT_DECODING */
+        Uint64 start = SDL_GetPerformanceCounter();
+        if (loader->use_mmap && map_file(slot->path, &slot->input) != 0)
+            memset(&slot->input, 0, sizeof(MappedFile));
+        if (!slot->full && slot->input.data)
+            decode_preview(loader, slot);
+        DecodedImage image;
+        const MappedFile *input = loader->use_mmap ? &slot->input : NULL;
+        Uint64 decode_start = trace_begin();
+        int width = slot->full ? 0 : slot->target_width;
+        int height = slot->full ? 0 : slot->target_height;
+        int result = decode_image(slot->path, input, slot->format, width, height, loader->pixel_format, &image);
+        trace_end(TRACE_DECODE, decode_start, slot->index);
+        Uint64 ticks = SDL_GetPerformanceCounter() - start;
+        if (result != 0)
+            fprintf(stderr, "Decode error: %s: %s\n", slot->path, SDL_GetError());
+
+        Uint64 bytes = slot->input.size;
+        if (!slot->input.data) {
+            struct stat st;
+            bytes = stat(slot->path, &st) == 0 ? (Uint64)st.st_size : 0;
+        }
+        unmap_file(&slot->input);
+
+        SDL_LockMutex(loader->lock);
+        if (result == 0) {
+            loader->decoded_count++;
+            loader->decoded_bytes += bytes;
+            loader->decode_ticks += ticks;
+        }
+        if (slot->stale) {
+            SDL_FreeSurface(image.surface);
+            SDL_FreeSurface(slot->preview.surface);
+            memset(&slot->preview, 0, sizeof(DecodedImage));
+            slot->stale = 0;
+            slot->state = SLOT_EMPTY;
+        } else {
+            slot->image = image;
+            slot->state = result == 0 ? SLOT_READY : SLOT_FAILED;
+            wake_main(WAKE_DECODED);
+        }
+    }
+    SDL_UnlockMutex(loader->lock);
+    return 0;
+}
+
+Loader *loader_create(int prefetch, int use_mmap, Uint32 pixel_format)
+{
+    Loader *loader = calloc(1, sizeof(Loader));
+    if (!loader)
+        return NULL;
+
+    /* Leave one core to the UI thread, no point in more workers than queued images */
+    int threads = SDL_GetCPUCount() - 1;
+    if (threads > prefetch + 1)
+        threads = prefetch + 1;
+    if (threads < 1)
+        threads = 1;
+
+    /* Window is previous + current + prefetch + full resolution current.
+     * Each worker may additionally hold a stale slot */
+    loader->prefetch = prefetch;
+    loader->use_mmap = use_mmap;
+    loader->pixel_format = pixel_format;
+    loader->full_index = -1;
+    loader->slot_count = prefetch + 3 + threads;
+    loader->slots = calloc(loader->slot_count, sizeof(Slot));
+    loader->threads = calloc(threads, sizeof(SDL_Thread *));
+    loader->lock = SDL_CreateMutex();
+    loader->work = SDL_CreateCond();
+    if (!loader->slots || !loader->threads || !loader->lock || !loader->work) {
+        loader_destroy(loader);
+        return NULL;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        loader->threads[i] = SDL_CreateThread(decode_thread, "decoder", loader);
+        if (!loader->threads[i]) {
+            fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+            break;
+        }
+        loader->thread_count++;
+    }
+    if (loader->thread_count == 0) {
+        loader_destroy(loader);
+        return NULL;
+    }
+    return loader;
+}
+
+void loader_destroy(Loader *loader)
+{
+    if (!loader)
+        return;
+
+    if (loader->lock) {
+        SDL_LockMutex(loader->lock);
+        loader->quit = 1;
+        SDL_CondBroadcast(loader->work);
+        SDL_UnlockMutex(loader->lock);
+    }
+    for (int i = 0; i < loader->thread_count; i++) {
+        SDL_WaitThread(loader->threads[i], NULL);
+    }
+
+    for (int i = 0; loader->slots && i < loader->slot_count; i++) {
+        SDL_FreeSurface(loader->slots[i].image.surface);
+        SDL_FreeSurface(loader->slots[i].preview.surface);
+        unmap_file(&loader->slots[i].input);
+    }
+    SDL_DestroyCond(loader->work);
+    SDL_DestroyMutex(loader->lock);
+    free(loader->threads);
+    free(loader->slots);
+    free(loader);
+}
+
+void loader_set_cache(Loader *loader, Cache *cache)
+{
+    SDL_LockMutex(loader->lock);
+    loader->cache = cache;
+    SDL_UnlockMutex(loader->lock);
+}
+
+void loader_set_target(Loader *loader, int width, int height)
+{
+    SDL_LockMutex(loader->lock);
+    loader->target_width = width;
+    loader->target_height = height;
+    SDL_UnlockMutex(loader->lock);
+}
+
+static void free_slot(Slot *slot)
+{
+    SDL_FreeSurface(slot->image.surface);
+    SDL_FreeSurface(slot->preview.surface);
+    unmap_file(&slot->input);
+    memset(&slot->image, 0, sizeof(DecodedImage));
+    memset(&slot->preview, 0, sizeof(DecodedImage));
+    slot->state = SLOT_EMPTY;
+}
+
+/* Find the slot holding (index, full) or a free one to queue it in */
+static Slot *find_slot(Loader *loader, int index, int full, int *present)
+{
+    Slot *empty = NULL;
+    *present = 0;
+    for (int i = 0; i < loader->slot_count; i++) {
+        Slot *slot = &loader->slots[i];
+        if (slot->state == SLOT_EMPTY) {
+            if (!empty)
+                empty = slot;
+        } else if (slot->index == index && slot->full == full && !slot->stale) {
+            *present = 1;
+            return slot;
+        }
+    }
+    return empty;
+}
+
+/* Queue a decode of index in slot, returns 0 when the cache had it and the slot is ready right away, or when
+ * path is NULL and the slot failed right away */
+static int queue_slot(Loader *loader, Slot *slot, int index, int order, int full, const char *path,
+    ImageFormat format)
+{
+    slot->index = index;
+    slot->order = order;
+    slot->full = full;
+    slot->stale = 0;
+    if (!path) {
+        /* Too long for MAX_PATH */
+        slot->state = SLOT_FAILED;
+        return 0;
+    }
+    snprintf(slot->path, MAX_PATH, "%s", path);
+    slot->format = format;
+    slot->target_width = loader->target_width;
+    slot->target_height = loader->target_height;
+    if (cache_take_surface(loader->cache, index, full ? 0 : slot->target_width, full ? 0 : slot->target_height,
+            &slot->image)) {
+        slot->state = SLOT_READY;
+        return 0;
+    }
+    slot->state = SLOT_QUEUED;
+    return 1;
+}
+
+/* Decode order of index in the window, -1 when it is not in it */
+static int window_order(const int *window, int count, int previous, int index)
+{
+    for (int i = 0; i < count; i++) {
+        if (window[i] == index)
+            return i * 2;
+    }
+    return index == previous ? ORDER_PREVIOUS : -1;
+}
+
+void loader_update(Loader *loader, const ImageList *list, int pass, int scanning)
+{
+    /* The images shown next, in the order seek_image() shows them. Moved, skipped or vanished ones in between
+     * are not decoded */
+    int window[MAX_PREFETCH + 1];
+    int count = 0;
+    int next = list->current;
+    while (next < list->count && count <= loader->prefetch) {
+        window[count++] = next;
+        next = seek_image(list, next + 1, &pass, scanning);
+    }
+    /* The image before, kept for undo. Only decoded while it is still in the source directory */
+    int previous = list->current - 1;
+    while (previous >= 0 && (list->flags[previous] & IMAGE_GONE)) {
+        previous--;
+    }
+
+    SDL_LockMutex(loader->lock);
+    loader->current = list->current;
+    if (loader->full_index != list->current)
+        loader->full_index = -1;
+
+    /* Drop what left the window. In-flight decodes are discarded by their worker */
+    for (int i = 0; i < loader->slot_count; i++) {
+        Slot *slot = &loader->slots[i];
+        if (slot->state == SLOT_EMPTY)
+            continue;
+        int order = slot->full ? (slot->index == loader->full_index ? ORDER_FULL : -1)
+                               : window_order(window, count, previous, slot->index);
+        int in_window = order >= 0;
+        if (in_window)
+            slot->order = order;
+        if (slot->state == SLOT_DECODING) {
+            slot->stale = !in_window;
+        } else if (!in_window) {
+            /* Kept for when it comes back (undo, second pass) */
+            int width = slot->full ? 0 : slot->target_width;
+            int height = slot->full ? 0 : slot->target_height;
+            if (slot->state == SLOT_READY &&
+                cache_put_surface(loader->cache, slot->index, width, height, &slot->image))
+                memset(&slot->image, 0, sizeof(DecodedImage));
+            free_slot(slot);
+        }
+    }
+
+    int queued = 0;
+    for (int i = 0; i <= count; i++) {
+        int index = i < count ? window[i] : previous;
+        int present;
+        Slot *slot = index >= 0 ? find_slot(loader, index, 0, &present) : NULL;
+        if (!slot || present || (i == count && (list->flags[index] & IMAGE_MOVED)))
+            continue;
+        char path[MAX_PATH];
+        int order = i < count ? i * 2 : ORDER_PREVIOUS;
+        queued +=
+            queue_slot(loader, slot, index, order, 0, image_path(list, index, path), image_format(list, index));
+    }
+
+    if (queued)
+        SDL_CondBroadcast(loader->work);
+    SDL_UnlockMutex(loader->lock);
+}
+
+void loader_request_full(Loader *loader, int index)
+{
+    SDL_LockMutex(loader->lock);
+    if (loader->full_index != index && index == loader->current) {
+        /* The reduced slot already holds the path, reuse it */
+        int have_reduced, present;
+        const Slot *reduced = find_slot(loader, index, 0, &have_reduced);
+        Slot *slot = find_slot(loader, index, 1, &present);
+        if (have_reduced && slot && !present) {
+            loader->full_index = index;
+            if (queue_slot(loader, slot, index, ORDER_FULL, 1, reduced->path, reduced->format))
+                SDL_CondBroadcast(loader->work);
+        }
+    }
+    SDL_UnlockMutex(loader->lock);
+}
+
+LoadStatus loader_get(Loader *loader, int index, int full, DecodedImage *out)
+{
+    LoadStatus status = LOAD_PENDING;
+    memset(out, 0, sizeof(DecodedImage));
+
+    SDL_LockMutex(loader->lock);
+    for (int i = 0; i < loader->slot_count; i++) {
+        Slot *slot = &loader->slots[i];
+        if (slot->state == SLOT_EMPTY || slot->index != index || slot->full != full || slot->stale)
+            continue;
+        if (slot->state == SLOT_READY) {
+            /* The caller replaces the preview with it */
+            SDL_FreeSurface(slot->preview.surface);
+            memset(&slot->preview, 0, sizeof(DecodedImage));
+            *out = slot->image;
+            status = LOAD_READY;
+        } else if (slot->state == SLOT_FAILED) {
+            status = LOAD_FAILED;
+        } else if (slot->preview.surface) {
+            *out = slot->preview;
+            status = LOAD_PREVIEW;
+        } else {
+            continue;
+        }
+        break;
+    }
+    SDL_UnlockMutex(loader->lock);
+    return status;
+}
+
+void loader_print_stats(Loader *loader)
+{
+    SDL_LockMutex(loader->lock);
+    double seconds = (double)loader->decode_ticks / SDL_GetPerformanceFrequency();
+    double megabytes = loader->decoded_bytes / (1024.0 * 1024.0);
+    if (loader->decoded_count > 0 && seconds > 0.0) {
+        printf("Decoded %d images: %.1f MB in %.2f s (%.1f MB/s, %s input)\n", loader->decoded_count, megabytes,
+            seconds, megabytes / seconds, loader->use_mmap ? "mmap" : "stdio");
+    }
+    SDL_UnlockMutex(loader->lock);
+}
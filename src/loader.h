@@ -0,0 +1,52 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "cache.h"
+#include "decode.h"
+#include "types.h"
+
+#include <SDL2/SDL.h>
+
+#define DEFAULT_PREFETCH 4
+#define MAX_PREFETCH     64
+
+typedef enum {
+    LOAD_PENDING,
+    LOAD_READY,
+    LOAD_PREVIEW, /* Only the preview embedded in the file is decoded yet */
+    LOAD_FAILED,
+} LoadStatus;
+
+typedef struct Loader Loader;
+
+/* Start decoder threads that keep up to `prefetch` images after the current one decoded.
+ * With use_mmap, the decoder threads map files and read them ahead instead of reading through stdio.
+ * Images are decoded into pixel_format (see decode_image()) */
+Loader *loader_create(int prefetch, int use_mmap, Uint32 pixel_format);
+
+/* Stop decoder threads and free every decoded surface */
+void loader_destroy(Loader *loader);
+
+/* Hand decodes leaving the window to cache and look there before decoding. Until loader_set_cache(loader,
+ * NULL) the cache is only used from the thread calling loader_update() and loader_request_full() */
+void loader_set_cache(Loader *loader, Cache *cache);
+
+/* Set the output size images are decoded for; 0x0 always decodes at full resolution */
+void loader_set_target(Loader *loader, int width, int height);
+
+/* Move the prefetch window to list->current and the images seek_image() shows after it in pass (the previous
+ * image is kept for undo) */
+void loader_update(Loader *loader, const ImageList *list, int pass, int scanning);
+
+/* Queue a full resolution decode of the current image, e.g. when zooming past the reduced one */
+void loader_request_full(Loader *loader, int index);
+
+/* Get the decoded image for index (full: the loader_request_full() one). The surface stays owned
+ * by the loader and is valid until the index leaves the prefetch window on a later loader_update().
+ * A LOAD_PREVIEW surface is only valid until the next call for index */
+LoadStatus loader_get(Loader *loader, int index, int full, DecodedImage *out);
+
+/* Print decoded input bytes per second of decoder time */
+void loader_print_stats(Loader *loader);
+
+#endif /* LOADER_H */
@@ -1,12 +1,199 @@
+#include "analyze.h"
+#include "anim.h"
+#include "cache.h"
+#include "decisions.h"
+#include "dedupe.h"
 #include "files.h"
+#include "grid.h"
 #include "history.h"
+#include "loader.h"
+#include "meta.h"
+#include "mover.h"
 #include "render.h"
+#include "scan.h"
+#include "session.h"
+#include "textures.h"
+#include "tiles.h"
+#include "trace.h"
 #include "types.h"
+#include "wake.h"
+#include "watch.h"
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+
+/* Longest sleep between two looks at the background threads when no event arrives */
+#define IDLE_TIMEOUT_MS 1000
+
+/* Label color of each destination, the first two match their arrows */
+static const SDL_Color dest_colors[MAX_DESTS] = {{200, 100, 100, 255}, {100, 200, 100, 255}, {100, 150, 220, 255},
+    {220, 190, 80, 255}, {190, 110, 210, 255}, {90, 200, 200, 255}, {230, 140, 70, 255}, {220, 120, 160, 255},
+    {170, 170, 170, 255}};
+
+/* Position of index among the images still in the source directory or sorted, the vanished ones left out */
+static int live_position(const ImageList *list, int index)
+{
+    int position = index;
+    for (int i = 0; list->gone > 0 && i < index && i < list->count; i++) {
+        position -= (list->flags[i] & IMAGE_GONE) != 0;
+    }
+    return position;
+}
+
+/* Images of the cluster of index still in the source directory, index included */
+static int count_similar(const Dedupe *dedupe, const ImageList *list, int index)
+{
+    int count = 0;
+    int member = index;
+    do {
+        if (!(list->flags[member] & (IMAGE_MOVED | IMAGE_GONE)))
+            count++;
+        member = dedupe_next(dedupe, member);
+    } while (member != index);
+    return count;
+}
+
+/* Destination labels with their counts along the bottom: with two destinations in the corners next to their
+ * arrow, with more in columns across the window */
+static void render_dests(SDL_Renderer *renderer, const Config *config, const MoveHistory *history, int grid_mode,
+    int win_width, int text_y, int text_scale)
+{
+    for (int i = 0; i < config->dest_count; i++) {
+        char label[MAX_DEST_LABEL + 32];
+        int x;
+        if (config->dest_count > 2) {
+            snprintf(label, sizeof(label), "%d:%s (%d)", i + 1, config->dest_labels[i], history->done[i]);
+            int column = win_width / config->dest_count;
+            x = column * i + (column - (int)strlen(label) * 6 * text_scale) / 2;
+        } else if (i == DEST_LEFT) {
+            snprintf(label, sizeof(label), grid_mode ? "1:%s (%d)" : "<- %s (%d)", config->dest_labels[i],
+                history->done[i]);
+            x = 15;
+        } else {
+            snprintf(label, sizeof(label), grid_mode ? "(%d) %s:2" : "(%d) %s ->", history->done[i],
+                config->dest_labels[i]);
+            x = win_width - 15 - (int)strlen(label) * 6 * text_scale;
+        }
+        SDL_Color color = dest_colors[i];
+        SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
+        render_text(renderer, label, x, text_y, text_scale);
+    }
+}
+
+/* p50/p99 of each traced stage in the top left corner, then the cache hit rates */
+static void render_timings(SDL_Renderer *renderer, const Cache *cache)
+{
+    SDL_Rect background = {10, 20, 6 * 44 + 8, 10 * (TRACE_COUNT + 1) + 6};
+    SDL_SetRenderDrawColor(renderer, 15, 15, 15, 255);
+    SDL_RenderFillRect(renderer, &background);
+    SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255);
+    for (int i = 0; i < TRACE_COUNT; i++) {
+        double p50, p99;
+        int count = trace_percentiles((TraceKind)i, &p50, &p99);
+        char line[64];
+        int len = snprintf(line, sizeof(line), "%-6s P50 %6.1f P99 %6.1f MS (%d)", trace_name((TraceKind)i), p50,
+            p99, count);
+        /* The bitmap font only has capitals */
+        for (int c = 0; c < len && c < (int)sizeof(line); c++) {
+            if (line[c] >= 'a' && line[c] <= 'z')
+                line[c] = (char)(line[c] - 'a' + 'A');
+        }
+        render_text(renderer, line, 14, 24 + i * 10, 1);
+    }
+    CacheStats stats;
+    cache_stats(cache, &stats);
+    char line[64];
+    snprintf(line, sizeof(line), "CACHE  TEX %d/%d DEC %d/%d %.0f MB", stats.texture_hits,
+        stats.texture_hits + stats.texture_misses, stats.surface_hits, stats.surface_hits + stats.surface_misses,
+        stats.bytes / (1024.0 * 1024.0));
+    render_text(renderer, line, 14, 24 + TRACE_COUNT * 10, 1);
+}
+
+/* Histograms of the image on screen in the top right corner, luma filled and the channels as lines, then the
+ * clipped pixels and the sharpness. NULL while the analysis runs, or with failed when there will be none */
+static void render_analysis(SDL_Renderer *renderer, const Analysis *analysis, int failed, int win_width)
+{
+    static const SDL_Color channel_colors[3] = {{220, 80, 80, 255}, {80, 200, 80, 255}, {90, 130, 240, 255}};
+    const int graph_height = 64;
+    int left = win_width - 10 - (256 + 8);
+    int bottom = 24 + graph_height;
+    SDL_Rect background = {left, 20, 256 + 8, graph_height + 2 * 10 + 10};
+    SDL_SetRenderDrawColor(renderer, 15, 15, 15, 255);
+    SDL_RenderFillRect(renderer, &background);
+    SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255);
+    if (!analysis) {
+        render_text(renderer, failed ? "N/A" : "ANALYZING", left + 4, bottom + 4, 1);
+        return;
+    }
+
+    /* Scaled to the tallest bin, the clipped ends left out as a spike there would flatten everything else */
+    uint32_t tallest = 1;
+    for (int c = 0; c < ANALYSIS_CHANNELS; c++) {
+        for (int i = 1; i < 255; i++) {
+            tallest = SDL_max(tallest, analysis->histogram[c][i]);
+        }
+    }
+    SDL_Rect bars[256];
+    SDL_Point lines[256];
+    for (int c = ANALYSIS_CHANNELS - 1; c >= 0; c--) {
+        for (int i = 0; i < 256; i++) {
+            int height = (int)SDL_min((uint64_t)analysis->histogram[c][i] * graph_height / tallest, graph_height);
+            bars[i] = (SDL_Rect){left + 4 + i, bottom - height, 1, height};
+            lines[i] = (SDL_Point){left + 4 + i, bottom - height};
+        }
+        if (c == ANALYSIS_LUMA) {
+            SDL_SetRenderDrawColor(renderer, 90, 90, 90, 255);
+            SDL_RenderFillRects(renderer, bars, 256);
+        } else {
+            SDL_SetRenderDrawColor(renderer, channel_colors[c].r, channel_colors[c].g, channel_colors[c].b, 255);
+            SDL_RenderDrawLines(renderer, lines, 256);
+        }
+    }
+
+    char line[64];
+    double pixels = SDL_max(1.0, (double)analysis->width * analysis->height);
+    snprintf(line, sizeof(line), "CLIP HI %.2f%% LO %.2f%%", analysis->highlights * 100.0 / pixels,
+        analysis->shadows * 100.0 / pixels);
+    SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255);
+    render_text(renderer, line, left + 4, bottom + 4, 1);
+    snprintf(line, sizeof(line), "SHARP %.0f", analysis->sharpness);
+    render_text(renderer, line, left + 4, bottom + 14, 1);
+}
+
+/* Destination a key sorts to: number keys (keypad too), the arrows to the first two. -1 for other keys
+ * and numbers without a destination. Keycodes of the digits follow each other, so no table is needed */
+static int key_dest(const Config *config, SDL_Keycode key)
+{
+    int dest = -1;
+    if (key >= SDLK_1 && key <= SDLK_9)
+        dest = (int)(key - SDLK_1);
+    else if (key >= SDLK_KP_1 && key <= SDLK_KP_9)
+        dest = (int)(key - SDLK_KP_1);
+    else if (key == SDLK_LEFT)
+        dest = DEST_LEFT;
+    else if (key == SDLK_RIGHT)
+        dest = DEST_RIGHT;
+    return dest < config->dest_count ? dest : -1;
+}
+
+/* Queue the move of index to dest and record it, grouped with the moves before it in the same keypress.
+ * Returns 0 on success */
+static int sort_image(Mover *mover, MoveHistory *history, FILE *record, ImageList *list, int index,
+    Destination dest, int grouped)
+{
+    if (list->flags[index] & (IMAGE_MOVED | IMAGE_GONE))
+        return -1;
+    if (mover_queue(mover, image_name(list, index), dest, 0, index) < 0)
+        return -1;
+    decisions_write(record, image_name(list, index), dest);
+    if (history_push(history, index, dest, grouped) != 0)
+        fprintf(stderr, "Warning: Out of memory, this move cannot be undone\n");
+    list->flags[index] |= IMAGE_MOVED;
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -15,26 +202,131 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    /* Batch mode, no window */
+    if (config.apply_path[0] != '\0') {
+        int result = decisions_apply(&config);
+        if (config.trace_path[0] != '\0')
+            trace_write(config.trace_path);
+        return result == 0 ? 0 : 1;
+    }
+
     ImageList images;
-    if (load_image_list(config.source_dir, &images) != 0) {
+    image_list_init(&images, config.source_dir);
+
+    /* Settles moves interrupted by a crash before the source directory is listed */
+    Mover *mover = mover_create(images.dir, &config, 1);
+    if (!mover) {
         return 1;
     }
 
-    if (images.count == 0) {
-        printf("No images found in '%s'\n", config.source_dir);
-        return 0;
+    /* Moves kept from the last run are listed first, already sorted */
+    MoveHistory history;
+    history_init(&history);
+    if (config.keep_history) {
+        char history_path[MAX_PATH];
+        if (snprintf(history_path, MAX_PATH, "%s/%s", images.dir, HISTORY_NAME) < MAX_PATH)
+            history_open(&history, history_path, &images, &config);
+        else
+            fprintf(stderr, "Warning: Source directory path too long to keep the undo history\n");
+    }
+    int restored = images.count;
+
+    /* Images skipped in the last run wait for the second pass */
+    Session *session = NULL;
+    if (config.resume) {
+        char session_path[MAX_PATH];
+        if (snprintf(session_path, MAX_PATH, "%s/%s", images.dir, SESSION_NAME) < MAX_PATH)
+            session = session_open(session_path);
+        else
+            fprintf(stderr, "Warning: Source directory path too long to remember skipped images\n");
+    }
+
+    /* With --watch, images written while the scan runs are reported by the watcher, the list ignores doubles */
+    Watcher *watcher = NULL;
+    if (config.watch && !(watcher = watcher_start(&config))) {
+        fprintf(stderr, "Warning: New images will not show up until the next run\n");
+    }
+
+    /* Destinations inside the source directory hold images already sorted */
+    DirId excluded[MAX_DESTS];
+    int excluded_count = dest_dir_ids(&config, excluded);
+    Scanner *scanner = scanner_start(images.dir, config.recursive, excluded, excluded_count);
+    if (!scanner) {
+        watcher_destroy(watcher);
+        session_close(session);
+        history_free(&history);
+        mover_destroy(mover);
+        return 1;
+    }
+
+    /* Open the window as soon as the first images are found, the rest of the list streams in. Sorting and
+     * filtering need the whole list first */
+    MetaQuery query;
+    meta_query_parse(config.sort, config.filter, &query);
+    if (meta_query_active(&query))
+        scanner_wait(scanner);
+    int scanning;
+    while ((scanning = scanner_poll(scanner, &images)) == 1 && images.count == restored) {
+        SDL_Delay(1);
+    }
+    if (scanning == 0 && meta_query_active(&query)) {
+        /* Restored moves stay where the undo history expects them */
+        Uint64 index_start = SDL_GetPerformanceCounter();
+        int listed = images.count - restored;
+        int kept = meta_apply(&query, &images, restored);
+        if (kept < 0) {
+            scanning = -1;
+        } else {
+            double seconds = (double)(SDL_GetPerformanceCounter() - index_start) / SDL_GetPerformanceFrequency();
+            printf("Indexed %d images in %.2f s, %d to sort\n", listed, seconds, kept);
+        }
+    }
+    session_match(session, &images);
+    int pass = 0;
+    images.current = seek_image(&images, images.current, &pass, scanning == 1);
+
+    if (scanning < 0 || (images.count == 0 && history.top == 0 && !watcher)) {
+        if (scanning < 0)
+            fprintf(stderr, "Error: Out of memory while listing '%s'\n", config.source_dir);
+        else
+            printf("No images found in '%s'\n", config.source_dir);
+        scanner_destroy(scanner);
+        watcher_destroy(watcher);
+        session_close(session);
+        history_free(&history);
+        mover_destroy(mover);
+        free_image_list(&images);
+        return scanning < 0 ? 1 : 0;
+    }
+    if (!scanning && !meta_query_active(&query)) {
+        printf("Found %d images\n", images.count - restored);
     }
 
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
+        scanner_destroy(scanner);
+        watcher_destroy(watcher);
+        session_close(session);
+        history_free(&history);
+        mover_destroy(mover);
         free_image_list(&images);
         return 1;
     }
 
+    /* Background threads wake the main loop instead of it polling them every frame */
+    if (wake_init() != 0) {
+        fprintf(stderr, "Warning: SDL_RegisterEvents Error: %s\n", SDL_GetError());
+    }
+
     int img_flags = IMG_INIT_PNG | IMG_INIT_JPG | IMG_INIT_WEBP | IMG_INIT_TIF;
     if ((IMG_Init(img_flags) & img_flags) != img_flags) {
         fprintf(stderr, "IMG_Init Error: %s\n", IMG_GetError());
         SDL_Quit();
+        scanner_destroy(scanner);
+        watcher_destroy(watcher);
+        session_close(session);
+        history_free(&history);
+        mover_destroy(mover);
         free_image_list(&images);
         return 1;
     }
@@ -46,6 +338,11 @@ int main(int argc, char *argv[])
         fprintf(stderr, "SDL_CreateWindow Error: %s\n", SDL_GetError());
         IMG_Quit();
         SDL_Quit();
+        scanner_destroy(scanner);
+        watcher_destroy(watcher);
+        session_close(session);
+        history_free(&history);
+        mover_destroy(mover);
         free_image_list(&images);
         return 1;
     }
@@ -57,16 +354,84 @@ int main(int argc, char *argv[])
         SDL_DestroyWindow(window);
         IMG_Quit();
         SDL_Quit();
+        scanner_destroy(scanner);
+        watcher_destroy(watcher);
+        session_close(session);
+        history_free(&history);
+        mover_destroy(mover);
+        free_image_list(&images);
+        return 1;
+    }
+
+    /* Images are decoded into the renderer's own format, uploading them is a copy into a reused texture */
+    TexturePool *textures = texture_pool_create(renderer);
+    Loader *loader = NULL;
+    if (textures)
+        loader = loader_create(config.prefetch, config.use_mmap, texture_pool_format(textures));
+    if (!loader) {
+        fprintf(stderr, "Error: Cannot start decoder threads\n");
+        texture_pool_destroy(textures);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        IMG_Quit();
+        SDL_Quit();
+        scanner_destroy(scanner);
+        watcher_destroy(watcher);
+        session_close(session);
+        history_free(&history);
+        mover_destroy(mover);
         free_image_list(&images);
         return 1;
     }
 
+    /* Decodes and textures of images already shown, for undo and the second pass */
+    Cache *cache = cache_create(config.cache_mb, textures);
+    if (config.cache_mb > 0 && !cache) {
+        fprintf(stderr, "Warning: Cannot create the image cache\n");
+    }
+    loader_set_cache(loader, cache);
+
+    if (render_init(renderer) != 0) {
+        fprintf(stderr, "Warning: Cannot create the glyph atlas: %s\n", SDL_GetError());
+    }
+
+    /* Near-duplicates are hashed in the background, clusters fill in while sorting */
+    Dedupe *dedupe = NULL;
+    if (config.dedupe >= 0 && !(dedupe = dedupe_create(images.dir, config.dedupe))) {
+        fprintf(stderr, "Warning: Cannot start the near-duplicate search\n");
+    }
+
+    /* Thumbnail overview, the thumbnail threads start the first time it is shown */
+    Grid grid;
+    grid_init(&grid, images.dir);
+    int grid_mode = 0;
+
+    FILE *record = config.record_path[0] != '\0' ? decisions_open(config.record_path) : NULL;
+
     SDL_Texture *current_texture = NULL;
-    int img_width = 0, img_height = 0;
+    TilePyramid *current_tiles = NULL; /* Used instead of current_texture for very large images */
+    Animation *anim = NULL;            /* Plays the frames of an animated current image */
+    int shown_index = -1;              /* Image current_texture shows, and the size it was decoded for */
+    int shown_target_width = 0, shown_target_height = 0;
+    int img_width = 0, img_height = 0; /* Full resolution size, layout is computed from it */
+    int tex_width = 0;                 /* Texture may be a reduced resolution decode */
+    int img_reduced = 0;
+    int img_preview = 0; /* Showing the preview embedded in the file, the decode replaces it */
     int need_load = 1;
+    int update_title = 0;
+    int dirty = 1; /* Something on screen changed, redraw before sleeping */
+    int show_timings = 0;
+    int show_analysis = 0;
+    Analyzer *analyzer = NULL; /* Started the first time the analysis is shown */
+    Analysis analysis;         /* Of image analysis_index, its mask is analysis_mask */
+    int analysis_index = -1;
+    int analysis_failed = -1; /* Image that cannot be analyzed: undecodable, not 8888 or out of memory */
+    SDL_Texture *analysis_mask = NULL;
+    Uint64 swipe_start = 0; /* A sorting or skipping key was pressed, until the next image is on screen */
 
     /* Zoom and pan state */
     float zoom = 1.0f;
+    float max_zoom = 20.0f; /* Raised for huge images so 1:1 stays reachable */
     float pan_x = 0.0f;
     float pan_y = 0.0f;
     int dragging = 0;
@@ -75,65 +440,450 @@ int main(int argc, char *argv[])
     float drag_start_pan_x = 0.0f;
     float drag_start_pan_y = 0.0f;
 
-    MoveHistory history;
-    history_init(&history);
-
-    int left_count = 0;
-    int right_count = 0;
+    /* Undo in flight: the image is shown once it is back in the source directory */
+    int undo_ticket = -1; /* Last move of the undo, they finish in order */
+    int undo_from = 0;
+    int undo_count = 0; /* Moves taken back, more than one for a cluster */
+    int similar = 1;    /* Size of the cluster of the current image */
 
     int running = 1;
     SDL_Event event;
 
     while (running) {
-        /* Allow undo even when all images processed */
-        if (images.current >= images.count && history.count == 0) {
-            break;
+        /* Pick up images found by the scanner since the last frame */
+        if (scanning == 1) {
+            int previous_count = images.count;
+            scanning = scanner_poll(scanner, &images);
+            if (scanning < 0) {
+                fprintf(stderr, "Error: Out of memory, stopped listing '%s'\n", config.source_dir);
+                scanning = 0;
+            } else if (scanning == 0) {
+                printf("Found %d images\n", images.count - restored);
+            }
+            session_match(session, &images);
+            /* Waiting at the end of the list: show the new image, the second pass or the final state */
+            if (images.current >= previous_count) {
+                images.current = seek_image(&images, images.current, &pass, scanning);
+                if (images.current < images.count || !scanning)
+                    need_load = 1;
+            }
+            if (images.count != previous_count || !scanning) {
+                update_title = 1;
+                dirty = 1;
+            }
+        }
+
+        /* Pick up images other programs wrote into or removed from the source directory */
+        if (watcher) {
+            int previous_count = images.count;
+            int changed = watcher_poll(watcher, &images);
+            if (changed < 0) {
+                fprintf(stderr, "Error: Out of memory, stopped watching '%s'\n", config.source_dir);
+                watcher_destroy(watcher);
+                watcher = NULL;
+            } else if (changed > 0) {
+                session_match(session, &images);
+                /* Waiting at the end of the list: show the new image. Move on from one that vanished */
+                if (images.current >= previous_count) {
+                    images.current = seek_image(&images, images.current, &pass, scanning);
+                    if (images.current < images.count)
+                        need_load = 1;
+                } else if ((images.flags[images.current] & IMAGE_GONE) && undo_ticket < 0) {
+                    images.current = seek_image(&images, images.current + 1, &pass, scanning);
+                    need_load = 1;
+                }
+                update_title = 1;
+                dirty = 1;
+            }
         }
 
-        /* Load current image if needed */
-        if (need_load && images.current < images.count) {
-            if (current_texture) {
-                SDL_DestroyTexture(current_texture);
-                current_texture = NULL;
+        /* Hash what the scanner found and grow the clusters */
+        dedupe_update(dedupe, &images);
+        if (dedupe_poll(dedupe) > 0 && images.current < images.count) {
+            int count = count_similar(dedupe, &images, images.current);
+            if (count != similar) {
+                similar = count;
+                update_title = 1;
+                dirty = 1;
+            }
+        }
+
+        if (grid_mode) {
+            int win_width, win_height;
+            SDL_GetWindowSize(window, &win_width, &win_height);
+            if (grid_update(&grid, renderer, &images, win_width, win_height))
+                dirty = 1;
+        }
+
+        /* A zoom level of a huge image was built, draw it instead of the one standing in */
+        if (current_tiles && tiles_poll(current_tiles))
+            dirty = 1;
+
+        /* Settle moves finished by the move thread */
+        MoveResult moved;
+        while (mover_poll(mover, &moved)) {
+            if (moved.ticket == undo_ticket)
+                undo_ticket = -1;
+            /* Back in the source directory, whatever the watcher saw of the move that took it away */
+            if (moved.undo && moved.result == 0)
+                image_set_gone(&images, moved.tag, 0);
+            if (moved.result == 0)
+                continue;
+            dirty = 1;
+            Destination dest;
+            char src_path[MAX_PATH];
+            struct stat st;
+            if (!moved.undo) {
+                /* The image stays in the source directory, as if skipped */
+                images.flags[moved.tag] &= (uint8_t)~IMAGE_MOVED;
+                history_remove(&history, moved.tag, &dest);
+                decisions_write(record, image_name(&images, moved.tag), DECISION_SKIP);
+            } else if (!image_path(&images, moved.tag, src_path) || lstat(src_path, &st) != 0) {
+                /* Still in the destination: put the move back, the cluster members that did come back
+                 * stay in the redo list. Return to where the undo started if nothing else is shown */
+                images.flags[moved.tag] |= IMAGE_MOVED;
+                if (history_keep(&history, moved.tag, &dest) == 0)
+                    decisions_write(record, image_name(&images, moved.tag), dest);
+                if (undo_count == 1 || images.current == moved.tag) {
+                    images.current = undo_from;
+                    need_load = 1;
+                }
             }
+        }
 
-            SDL_Surface *surface = IMG_Load(images.paths[images.current]);
-            if (surface) {
-                current_texture = SDL_CreateTextureFromSurface(renderer, surface);
-                img_width = surface->w;
-                img_height = surface->h;
-                SDL_FreeSurface(surface);
+        /* Allow undo even when all images processed, and wait for new ones with --watch */
+        if (images.current >= images.count && history.top == 0 && !scanning && !watcher) {
+            break;
+        }
+
+        /* Upload current image once the decoder threads have it, the grid has its own thumbnails. Decode for
+         * the window size, a larger window later re-decodes at full resolution */
+        int output_width, output_height;
+        SDL_GetRendererOutputSize(renderer, &output_width, &output_height);
+        /* An image brought back by undo shows before its file is back when the cache kept its texture */
+        int undo_cached =
+            undo_ticket >= 0 && cache_has_texture(cache, images.current, output_width, output_height);
+        if (need_load && (undo_ticket < 0 || undo_cached) && !grid_mode && current_texture) {
+            /* What was on screen is kept for coming back to it, unless it was a preview or an animation frame */
+            CachedTexture kept = {current_texture, 0, 0, img_width, img_height, img_reduced};
+            SDL_QueryTexture(current_texture, NULL, NULL, &kept.width, &kept.height);
+            if (anim || img_preview ||
+                !cache_put_texture(cache, shown_index, shown_target_width, shown_target_height, &kept))
+                texture_release(textures, current_texture);
+            current_texture = NULL;
+        }
+        if (need_load && (undo_ticket < 0 || undo_cached) && !grid_mode && images.current < images.count) {
+            anim_destroy(anim);
+            anim = NULL;
+            tiles_destroy(current_tiles);
+            current_tiles = NULL;
+
+            /* Neighbours of the image and of the one the next undo brings back stay cached longest */
+            int undo_index = -1;
+            if (history.top > 0)
+                undo_index = (int)(history.entries[history.top - 1] >> HISTORY_INDEX_SHIFT);
+            cache_set_focus(cache, images.current, undo_index);
+            loader_set_target(loader, output_width, output_height);
+            loader_update(loader, &images, pass, scanning == 1);
+
+            CachedTexture cached;
+            DecodedImage decoded;
+            LoadStatus status = LOAD_READY;
+            if (cache_take_texture(cache, images.current, output_width, output_height, &cached)) {
+                current_texture = cached.texture;
+                img_width = cached.full_width;
+                img_height = cached.full_height;
+                tex_width = cached.width;
+                img_reduced = cached.reduced;
+                img_preview = 0;
+            } else if ((status = loader_get(loader, images.current, 0, &decoded)) == LOAD_READY ||
+                       status == LOAD_PREVIEW) {
+                Uint64 upload_start = trace_begin();
+                upload_image(textures, decoded.surface, &current_texture, &current_tiles);
+                trace_end(TRACE_UPLOAD, upload_start, images.current);
+                img_width = decoded.full_width;
+                img_height = decoded.full_height;
+                tex_width = decoded.surface->w;
+                img_reduced = decoded.reduced;
+                img_preview = status == LOAD_PREVIEW;
+            }
+            if (status == LOAD_READY || status == LOAD_PREVIEW) {
+                shown_index = images.current;
+                shown_target_width = output_width;
+                shown_target_height = output_height;
 
                 /* Reset zoom and pan for new image */
                 zoom = 1.0f;
                 pan_x = 0.0f;
                 pan_y = 0.0f;
 
-                char title[MAX_PATH + 64];
-                snprintf(title, sizeof(title), "Image Sorter - %d/%d - %s", images.current + 1, images.count,
-                    strrchr(images.paths[images.current], '/') + 1);
-                SDL_SetWindowTitle(window, title);
-            } else {
-                fprintf(stderr, "Failed to load: %s\n", images.paths[images.current]);
-                images.current++;
+                need_load = 0;
+                update_title = 1;
+                dirty = 1;
+                similar = count_similar(dedupe, &images, images.current);
+
+                /* The decode is the first frame, an animated GIF (or WebP) plays on from a thread of its own */
+                ImageFormat format = image_format(&images, images.current);
+                char path[MAX_PATH];
+                if (current_texture && (format == FORMAT_GIF || format == FORMAT_WEBP) &&
+                    image_path(&images, images.current, path))
+                    anim = anim_create(path, format, texture_pool_format(textures));
+            } else if (status == LOAD_FAILED) {
+                fprintf(stderr, "Failed to load: %s\n", image_name(&images, images.current));
+                images.current = seek_image(&images, images.current + 1, &pass, scanning);
                 continue;
             }
+        } else if (need_load && undo_ticket < 0 && !grid_mode && images.current >= images.count) {
+            anim_destroy(anim);
+            anim = NULL;
+            tiles_destroy(current_tiles);
+            current_tiles = NULL;
+            SDL_SetWindowTitle(window, scanning  ? "Image Sorter - Scanning..."
+                                       : watcher ? "Image Sorter - Done, waiting for new images (SPACE to undo)"
+                                                 : "Image Sorter - Done! (SPACE to undo)");
             need_load = 0;
-        } else if (need_load && images.current >= images.count) {
-            if (current_texture) {
-                SDL_DestroyTexture(current_texture);
-                current_texture = NULL;
+            dirty = 1;
+        }
+
+        if (update_title && grid_mode) {
+            int selected = 0;
+            for (int i = 0; i < images.count; i++) {
+                selected += (images.flags[i] & IMAGE_SELECTED) != 0;
+            }
+            char title[MAX_PATH + 64];
+            snprintf(title, sizeof(title), "Image Sorter - Grid - %d/%d%s - %d selected - %s", grid.cursor + 1,
+                images.count, scanning ? "+" : "", selected, image_name(&images, grid.cursor));
+            SDL_SetWindowTitle(window, title);
+            update_title = 0;
+        } else if (update_title && !need_load && images.current < images.count) {
+            /* A trailing + means the list is still growing */
+            char title[MAX_PATH + 64];
+            char cluster[48] = "";
+            if (similar > 1)
+                snprintf(cluster, sizeof(cluster), " (%d similar)", similar);
+            snprintf(title, sizeof(title), "Image Sorter - %d/%d%s%s - %s%s",
+                live_position(&images, images.current) + 1, images.count - images.gone, scanning ? "+" : "",
+                pass ? " (skipped)" : "", image_name(&images, images.current), cluster);
+            SDL_SetWindowTitle(window, title);
+            update_title = 0;
+        }
+
+        /* Swap in the decode that replaces the embedded preview, then the full resolution one, once ready */
+        if (!need_load && !grid_mode && img_reduced) {
+            DecodedImage decoded;
+            LoadStatus status = loader_get(loader, images.current, !img_preview, &decoded);
+            if (status == LOAD_FAILED && img_preview) {
+                /* Keep showing the preview */
+                img_preview = 0;
+                img_reduced = 0;
+            } else if (status == LOAD_READY) {
+                SDL_Texture *full_texture;
+                TilePyramid *full_tiles;
+                Uint64 upload_start = trace_begin();
+                int uploaded = upload_image(textures, decoded.surface, &full_texture, &full_tiles);
+                trace_end(TRACE_UPLOAD, upload_start, images.current);
+                if (uploaded == 0) {
+                    texture_release(textures, current_texture);
+                    tiles_destroy(current_tiles);
+                    current_texture = full_texture;
+                    current_tiles = full_tiles;
+                    tex_width = decoded.surface->w;
+                    img_reduced = decoded.reduced;
+                    img_preview = 0;
+                    dirty = 1;
+                }
+            }
+        }
+
+        /* Show the next animation frame once it is due, into a texture of the pool rather than a new one */
+        if (anim && !need_load && !grid_mode) {
+            SDL_Surface *frame;
+            AnimStatus status = anim_poll(anim, SDL_GetTicks(), &frame);
+            if (status == ANIM_FRAME) {
+                SDL_Texture *frame_texture;
+                TilePyramid *frame_tiles;
+                Uint64 upload_start = trace_begin();
+                int uploaded = upload_image(textures, frame, &frame_texture, &frame_tiles);
+                trace_end(TRACE_UPLOAD, upload_start, images.current);
+                if (uploaded == 0 && frame_texture) {
+                    texture_release(textures, current_texture);
+                    current_texture = frame_texture;
+                    tex_width = frame->w;
+                    img_reduced = 0;
+                    dirty = 1;
+                } else {
+                    /* Too large for one texture after all */
+                    if (uploaded == 0)
+                        tiles_destroy(frame_tiles);
+                    status = ANIM_STILL;
+                }
+            }
+            if (status == ANIM_STILL) {
+                anim_destroy(anim);
+                anim = NULL;
+            }
+        }
+
+        /* With the analysis shown, analyze the decode the loader holds for the image on screen */
+        if (show_analysis && !need_load && !grid_mode && images.current < images.count &&
+            analysis_index != images.current) {
+            const Analysis *done = analyzer_get(analyzer, images.current);
+            DecodedImage decoded;
+            if (done) {
+                analysis = *done;
+                analysis.mask = NULL;
+                if (analysis_mask)
+                    SDL_DestroyTexture(analysis_mask);
+                analysis_mask = done->mask ? SDL_CreateTextureFromSurface(renderer, done->mask) : NULL;
+                analysis_index = images.current;
+                dirty = 1;
+            } else {
+                LoadStatus status = loader_get(loader, images.current, 0, &decoded);
+                int failed = status == LOAD_FAILED ||
+                    (status == LOAD_READY && analyzer_request(analyzer, images.current, decoded.surface) != 0);
+                if (failed != (analysis_failed == images.current)) {
+                    analysis_failed = failed ? images.current : -1;
+                    dirty = 1;
+                }
+            }
+        }
+
+        /* Render only when something changed */
+        if (dirty) {
+            Uint64 render_start = trace_begin();
+            int win_width, win_height;
+            SDL_GetWindowSize(window, &win_width, &win_height);
+
+            SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
+            SDL_RenderClear(renderer);
+
+            /* Draw image centered and scaled to fit, with zoom and pan */
+            if (grid_mode) {
+                grid_render(&grid, renderer, &images, win_width);
+            } else if (current_texture || current_tiles) {
+                int margin = 80;
+                int available_width = win_width - margin * 2;
+                int available_height = win_height - margin;
+
+                /* Base scale to fit image in window */
+                float scale_x = (float)available_width / img_width;
+                float scale_y = (float)available_height / img_height;
+                float base_scale = (scale_x < scale_y) ? scale_x : scale_y;
+                if (base_scale > 1.0f)
+                    base_scale = 1.0f;
+                max_zoom = (base_scale < 8.0f / 20.0f) ? 8.0f / base_scale : 20.0f;
+
+                /* Apply zoom */
+                float final_scale = base_scale * zoom;
+
+                int render_width = (int)(img_width * final_scale);
+                int render_height = (int)(img_height * final_scale);
+                int render_x = (int)((win_width - render_width) / 2.0f + pan_x);
+                int render_y = (int)((win_height - render_height) / 2.0f + pan_y);
+
+                SDL_Rect dest = {render_x, render_y, render_width, render_height};
+                if (current_tiles) {
+                    SDL_Rect viewport = {0, 0, win_width, win_height};
+                    tiles_render(current_tiles, renderer, &dest, &viewport);
+                } else {
+                    SDL_RenderCopy(renderer, current_texture, NULL, &dest);
+                }
+
+                /* Clipped highlights and shadows over the image */
+                if (show_analysis && analysis_mask && analysis_index == images.current)
+                    SDL_RenderCopy(renderer, analysis_mask, NULL, &dest);
+
+                /* Zoomed (or resized) past the reduced decode */
+                if (img_reduced && render_width > tex_width)
+                    loader_request_full(loader, images.current);
+            } else if (need_load) {
+                SDL_SetRenderDrawColor(renderer, 150, 150, 150, 255);
+                render_text(renderer, "LOADING", win_width / 2 - 42, win_height / 2 - 7, 2);
+            }
+
+            /* Draw UI indicators, the arrow keys sort to the first two destinations */
+            if (!grid_mode) {
+                int arrow_size = 60;
+                int arrow_y = win_height / 2;
+
+                SDL_SetRenderDrawColor(renderer, 200, 100, 100, 255);
+                render_arrow(renderer, 20, arrow_y, arrow_size, -1);
+
+                if (config.dest_count > DEST_RIGHT) {
+                    SDL_SetRenderDrawColor(renderer, 100, 200, 100, 255);
+                    render_arrow(renderer, win_width - 20 - arrow_size, arrow_y, arrow_size, 1);
+                }
+            }
+
+            /* Bottom instructions, above the destinations when they take the whole line */
+            int text_y = win_height - 25;
+            int text_scale = 2;
+            render_dests(renderer, &config, &history, grid_mode, win_width, text_y, text_scale);
+
+            SDL_SetRenderDrawColor(renderer, 150, 150, 150, 255);
+            const char *help = grid_mode ? "ENTER:VIEW  G:BACK  SPACE:UNDO" : "DOWN:SKIP  SPACE:UNDO  G:GRID";
+            int help_scale = config.dest_count > 2 ? 1 : text_scale;
+            int help_y = config.dest_count > 2 ? text_y - 13 : text_y;
+            render_text(renderer, help, win_width / 2 - (int)strlen(help) * 3 * help_scale, help_y, help_scale);
+
+            /* Progress bar */
+            int progress_width = win_width - 20;
+            int progress_height = 4;
+            SDL_Rect progress_bg = {10, 10, progress_width, progress_height};
+            SDL_SetRenderDrawColor(renderer, 60, 60, 60, 255);
+            SDL_RenderFillRect(renderer, &progress_bg);
+
+            int live = images.count - images.gone;
+            int filled = 0;
+            if (live > 0)
+                filled = (int)((float)live_position(&images, images.current) / live * progress_width);
+            SDL_Rect progress_fill = {10, 10, filled, progress_height};
+            SDL_SetRenderDrawColor(renderer, 100, 150, 200, 255);
+            SDL_RenderFillRect(renderer, &progress_fill);
+
+            if (show_timings)
+                render_timings(renderer, cache);
+            if (show_analysis && !grid_mode)
+                render_analysis(renderer, analysis_index == images.current ? &analysis : NULL,
+                    analysis_failed == images.current, win_width);
+
+            SDL_RenderPresent(renderer);
+            dirty = 0;
+            trace_end(TRACE_RENDER, render_start, images.current);
+            if (swipe_start && !need_load) {
+                trace_end(TRACE_SWIPE, swipe_start, images.current);
+                swipe_start = 0;
             }
-            SDL_SetWindowTitle(window, "Image Sorter - Done! (SPACE to undo)");
-            need_load = 0;
         }
 
-        while (SDL_PollEvent(&event)) {
+        /* Sleep until input, a background thread or the window system has something new, or an animation
+         * frame is due */
+        int timeout = IDLE_TIMEOUT_MS;
+        if (anim && !need_load && !grid_mode) {
+            int wait = anim_wait_ms(anim, SDL_GetTicks());
+            if (wait >= 0 && wait < timeout)
+                timeout = wait;
+        }
+        int have_event = SDL_WaitEventTimeout(&event, timeout);
+        while (have_event) {
             if (event.type == SDL_QUIT) {
                 running = 0;
+            } else if (event.type == wake_event_type()) {
+                /* What woke us is picked up at the top of the loop */
+                wake_ack(&event);
+            } else if (event.type == SDL_WINDOWEVENT) {
+                dirty = 1;
+            } else if (event.type == SDL_MOUSEWHEEL && grid_mode) {
+                /* Scroll a row per notch, with ctrl change the thumbnail size */
+                dirty = 1;
+                if (SDL_GetModState() & KMOD_CTRL)
+                    grid_zoom(&grid, event.wheel.y);
+                else
+                    grid_scroll(&grid, -event.wheel.y * grid.cell);
             } else if (event.type == SDL_MOUSEWHEEL) {
                 /* Zoom with mouse wheel */
-                if (current_texture) {
+                if (current_texture || current_tiles) {
+                    dirty = 1;
                     float old_zoom = zoom;
                     if (event.wheel.y > 0) {
                         zoom *= 1.2f;
@@ -143,8 +893,8 @@ int main(int argc, char *argv[])
                     /* Clamp zoom level */
                     if (zoom < 0.1f)
                         zoom = 0.1f;
-                    if (zoom > 20.0f)
-                        zoom = 20.0f;
+                    if (zoom > max_zoom)
+                        zoom = max_zoom;
 
                     /* Zoom towards mouse cursor */
                     int mouse_x, mouse_y;
@@ -160,6 +910,24 @@ int main(int argc, char *argv[])
                     pan_x += dx * (1.0f - zoom / old_zoom);
                     pan_y += dy * (1.0f - zoom / old_zoom);
                 }
+            } else if (event.type == SDL_MOUSEBUTTONDOWN && grid_mode) {
+                /* Click picks one image, ctrl adds to the selection, shift a range. Double click views it */
+                int index = grid_index_at(&grid, &images, event.button.x, event.button.y);
+                if (event.button.button == SDL_BUTTON_LEFT && index >= 0) {
+                    SDL_Keymod mod = SDL_GetModState();
+                    GridSelect how = (mod & KMOD_CTRL)    ? GRID_SELECT_TOGGLE
+                                     : (mod & KMOD_SHIFT) ? GRID_SELECT_RANGE
+                                                          : GRID_SELECT_ONE;
+                    grid_select(&grid, &images, index, how);
+                    if (event.button.clicks == 2 && how == GRID_SELECT_ONE &&
+                        !(images.flags[index] & (IMAGE_MOVED | IMAGE_GONE))) {
+                        grid_mode = 0;
+                        images.current = index;
+                        need_load = 1;
+                    }
+                    update_title = 1;
+                    dirty = 1;
+                }
             } else if (event.type == SDL_MOUSEBUTTONDOWN) {
                 if (event.button.button == SDL_BUTTON_LEFT) {
                     dragging = 1;
@@ -169,6 +937,7 @@ int main(int argc, char *argv[])
                     drag_start_pan_y = pan_y;
                 } else if (event.button.button == SDL_BUTTON_MIDDLE) {
                     /* Middle click to reset zoom/pan */
+                    dirty = 1;
                     zoom = 1.0f;
                     pan_x = 0.0f;
                     pan_y = 0.0f;
@@ -179,148 +948,238 @@ int main(int argc, char *argv[])
                 }
             } else if (event.type == SDL_MOUSEMOTION) {
                 if (dragging) {
+                    dirty = 1;
                     pan_x = drag_start_pan_x + (event.motion.x - drag_start_x);
                     pan_y = drag_start_pan_y + (event.motion.y - drag_start_y);
                 }
+            } else if (event.type == SDL_KEYDOWN && grid_mode && event.key.keysym.sym != SDLK_SPACE &&
+                       event.key.keysym.sym != SDLK_r) {
+                /* Undo and redo are the same as in the viewer, below */
+                dirty = 1;
+                update_title = 1;
+                SDL_Keycode key = event.key.keysym.sym;
+                GridSelect how = (event.key.keysym.mod & KMOD_SHIFT) ? GRID_SELECT_RANGE : GRID_SELECT_ONE;
+                int page = grid.view_height / grid.cell * grid.columns;
+                switch (key) {
+                    case SDLK_q:
+                        running = 0;
+                        break;
+                    case SDLK_t:
+                        show_timings = !show_timings;
+                        break;
+                    case SDLK_ESCAPE:
+                    case SDLK_g:
+                    case SDLK_RETURN:
+                    case SDLK_KP_ENTER:
+                        /* Back to the image the viewer was on, or to the one under the cursor */
+                        if (key == SDLK_RETURN || key == SDLK_KP_ENTER) {
+                            if (images.flags[grid.cursor] & (IMAGE_MOVED | IMAGE_GONE))
+                                break;
+                            images.current = grid.cursor;
+                        } else if (images.current < images.count &&
+                            (images.flags[images.current] & (IMAGE_MOVED | IMAGE_GONE))) {
+                            images.current = seek_image(&images, images.current + 1, &pass, scanning);
+                        }
+                        grid_mode = 0;
+                        need_load = 1;
+                        grid_clear_selection(&images);
+                        break;
+                    case SDLK_LEFT:
+                        grid_select(&grid, &images, grid.cursor - 1, how);
+                        break;
+                    case SDLK_RIGHT:
+                        grid_select(&grid, &images, grid.cursor + 1, how);
+                        break;
+                    case SDLK_UP:
+                        grid_select(&grid, &images, SDL_max(grid.cursor - grid.columns, 0), how);
+                        break;
+                    case SDLK_DOWN:
+                        grid_select(&grid, &images, SDL_min(grid.cursor + grid.columns, images.count - 1), how);
+                        break;
+                    case SDLK_PAGEUP:
+                        grid_select(&grid, &images, SDL_max(grid.cursor - page, 0), how);
+                        break;
+                    case SDLK_PAGEDOWN:
+                        grid_select(&grid, &images, SDL_min(grid.cursor + page, images.count - 1), how);
+                        break;
+                    case SDLK_HOME:
+                        grid_select(&grid, &images, 0, how);
+                        break;
+                    case SDLK_END:
+                        grid_select(&grid, &images, images.count - 1, how);
+                        break;
+                    case SDLK_a:
+                        if (event.key.keysym.mod & KMOD_CTRL) {
+                            for (int i = 0; i < images.count; i++) {
+                                if (!(images.flags[i] & (IMAGE_MOVED | IMAGE_GONE)))
+                                    images.flags[i] |= IMAGE_SELECTED;
+                            }
+                        }
+                        break;
+                    case SDLK_PLUS:
+                    case SDLK_EQUALS:
+                    case SDLK_KP_PLUS:
+                        grid_zoom(&grid, 1);
+                        break;
+                    case SDLK_MINUS:
+                    case SDLK_KP_MINUS:
+                        grid_zoom(&grid, -1);
+                        break;
+                    default: {
+                        /* The selected images, or the one under the cursor, go in one undoable batch */
+                        int dest = key_dest(&config, key);
+                        if (dest < 0)
+                            break;
+                        int selected = grid_clear_selection(&images);
+                        int grouped = 0;
+                        for (int i = 0; i < images.count; i++) {
+                            int picked = selected ? (images.flags[i] & IMAGE_SELECTED) != 0 : i == grid.cursor;
+                            if (picked && sort_image(mover, &history, record, &images, i, dest, grouped) == 0)
+                                grouped = 1;
+                        }
+                        break;
+                    }
+                }
             } else if (event.type == SDL_KEYDOWN) {
+                dirty = 1;
                 switch (event.key.keysym.sym) {
                     case SDLK_ESCAPE:
                     case SDLK_q:
                         running = 0;
                         break;
-                    case SDLK_LEFT: {
-                        if (images.current < images.count) {
-                            char dest_path[MAX_PATH];
-                            if (move_file(images.paths[images.current], config.left_dir, dest_path) == 0) {
-                                history_push(
-                                    &history, images.paths[images.current], dest_path, images.current, -1);
-                                images.current++;
-                                left_count++;
-                                need_load = 1;
+                    case SDLK_t:
+                        show_timings = !show_timings;
+                        break;
+                    case SDLK_h:
+                        if (analyzer || (analyzer = analyzer_create()))
+                            show_analysis = !show_analysis;
+                        else
+                            fprintf(stderr, "Warning: Cannot start the analysis threads\n");
+                        break;
+                    case SDLK_g:
+                        if (images.count > 0 && grid_open(&grid, SDL_min(images.current, images.count - 1)) == 0) {
+                            grid_mode = 1;
+                            update_title = 1;
+                        } else {
+                            fprintf(stderr, "Warning: Cannot start the thumbnail threads\n");
+                        }
+                        break;
+                    case SDLK_DOWN:
+                        if (images.current < images.count && !need_load) {
+                            if (!(images.flags[images.current] & IMAGE_SKIPPED)) {
+                                session_skip(session, &images, images.current);
+                                images.flags[images.current] |= IMAGE_SKIPPED;
                             }
+                            decisions_write(record, image_name(&images, images.current), DECISION_SKIP);
+                            images.current = seek_image(&images, images.current + 1, &pass, scanning);
+                            need_load = 1;
+                            swipe_start = trace_begin();
                         }
                         break;
-                    }
-                    case SDLK_RIGHT: {
-                        if (images.current < images.count) {
-                            char dest_path[MAX_PATH];
-                            if (move_file(images.paths[images.current], config.right_dir, dest_path) == 0) {
-                                history_push(&history, images.paths[images.current], dest_path, images.current, 1);
-                                images.current++;
-                                right_count++;
-                                need_load = 1;
+                    case SDLK_SPACE: {
+                        /* Everything moved in the last keypress comes back, the image shown first */
+                        int index, more = 1;
+                        Destination dest;
+                        if (undo_ticket >= 0)
+                            break;
+                        undo_from = images.current;
+                        undo_count = 0;
+                        while (more && history_undo(&history, &index, &dest, &more) == 0) {
+                            int ticket = mover_queue(mover, image_name(&images, index), dest, 1, index);
+                            if (ticket < 0) {
+                                history_redo(&history, &index, &dest, NULL);
+                                break;
                             }
+                            decisions_write(record, image_name(&images, index), DECISION_SKIP);
+                            undo_ticket = ticket;
+                            undo_count++;
+                            images.flags[index] &= (uint8_t)~IMAGE_MOVED;
+                            images.current = index;
+                            need_load = 1;
+                        }
+                        if (grid_mode && undo_count > 0) {
+                            grid.cursor = images.current;
+                            grid.reveal = 1;
+                            update_title = 1;
                         }
                         break;
                     }
-                    case SDLK_DOWN:
-                        if (images.current < images.count) {
-                            images.current++;
+                    case SDLK_r: {
+                        int index, more = 1;
+                        Destination dest;
+                        if (undo_ticket >= 0)
+                            break;
+                        while (more && history_redo(&history, &index, &dest, &more) == 0) {
+                            if (mover_queue(mover, image_name(&images, index), dest, 0, index) < 0) {
+                                history_undo(&history, &index, &dest, NULL);
+                                break;
+                            }
+                            decisions_write(record, image_name(&images, index), dest);
+                            images.flags[index] |= IMAGE_MOVED;
+                            if (images.current <= index)
+                                images.current = seek_image(&images, index + 1, &pass, scanning);
                             need_load = 1;
                         }
                         break;
-                    case SDLK_SPACE: {
-                        MoveEntry entry;
-                        if (history_pop(&history, &entry) == 0) {
-                            if (undo_move_file(entry.dest_path, entry.src_path) == 0) {
-                                images.current = entry.image_index;
-                                if (entry.direction < 0)
-                                    left_count--;
-                                else
-                                    right_count--;
+                    }
+                    default: {
+                        /* Never sort an image that has not been shown yet, with shift its near-duplicates go
+                         * along in the same keypress */
+                        int dest = key_dest(&config, event.key.keysym.sym);
+                        if (dest >= 0 && images.current < images.count && !need_load) {
+                            int whole_cluster = (event.key.keysym.mod & KMOD_SHIFT) != 0;
+                            int grouped = 0;
+                            int index = images.current;
+                            do {
+                                if (sort_image(mover, &history, record, &images, index, dest, grouped) == 0)
+                                    grouped = 1;
+                                index = whole_cluster ? dedupe_next(dedupe, index) : images.current;
+                            } while (index != images.current);
+                            if (grouped) {
+                                images.current = seek_image(&images, images.current + 1, &pass, scanning);
                                 need_load = 1;
+                                swipe_start = trace_begin();
                             }
                         }
                         break;
                     }
                 }
             }
+            have_event = running && SDL_PollEvent(&event);
         }
-
-        /* Render */
-        int win_width, win_height;
-        SDL_GetWindowSize(window, &win_width, &win_height);
-
-        SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
-        SDL_RenderClear(renderer);
-
-        /* Draw image centered and scaled to fit, with zoom and pan */
-        if (current_texture) {
-            int margin = 80;
-            int available_width = win_width - margin * 2;
-            int available_height = win_height - margin;
-
-            /* Base scale to fit image in window */
-            float scale_x = (float)available_width / img_width;
-            float scale_y = (float)available_height / img_height;
-            float base_scale = (scale_x < scale_y) ? scale_x : scale_y;
-            if (base_scale > 1.0f)
-                base_scale = 1.0f;
-
-            /* Apply zoom */
-            float final_scale = base_scale * zoom;
-
-            int render_width = (int)(img_width * final_scale);
-            int render_height = (int)(img_height * final_scale);
-            int render_x = (int)((win_width - render_width) / 2.0f + pan_x);
-            int render_y = (int)((win_height - render_height) / 2.0f + pan_y);
-
-            SDL_Rect dest = {render_x, render_y, render_width, render_height};
-            SDL_RenderCopy(renderer, current_texture, NULL, &dest);
-        }
-
-        /* Draw UI indicators */
-        int arrow_size = 60;
-        int arrow_y = win_height / 2;
-
-        SDL_SetRenderDrawColor(renderer, 200, 100, 100, 255);
-        render_arrow(renderer, 20, arrow_y, arrow_size, -1);
-
-        SDL_SetRenderDrawColor(renderer, 100, 200, 100, 255);
-        render_arrow(renderer, win_width - 20 - arrow_size, arrow_y, arrow_size, 1);
-
-        /* Bottom instructions */
-        int text_y = win_height - 25;
-        int text_scale = 2;
-
-        char left_label[32];
-        snprintf(left_label, sizeof(left_label), "<- LEFT (%d)", left_count);
-        SDL_SetRenderDrawColor(renderer, 200, 100, 100, 255);
-        render_text(renderer, left_label, 15, text_y, text_scale);
-
-        SDL_SetRenderDrawColor(renderer, 150, 150, 150, 255);
-        render_text(renderer, "DOWN:SKIP  SPACE:UNDO", win_width / 2 - 120, text_y, text_scale);
-
-        char right_label[32];
-        snprintf(right_label, sizeof(right_label), "(%d) RIGHT ->", right_count);
-        int right_label_width = strlen(right_label) * 6 * text_scale;
-        SDL_SetRenderDrawColor(renderer, 100, 200, 100, 255);
-        render_text(renderer, right_label, win_width - 15 - right_label_width, text_y, text_scale);
-
-        /* Progress bar */
-        int progress_width = win_width - 20;
-        int progress_height = 4;
-        SDL_Rect progress_bg = {10, 10, progress_width, progress_height};
-        SDL_SetRenderDrawColor(renderer, 60, 60, 60, 255);
-        SDL_RenderFillRect(renderer, &progress_bg);
-
-        int filled = (int)((float)images.current / images.count * progress_width);
-        SDL_Rect progress_fill = {10, 10, filled, progress_height};
-        SDL_SetRenderDrawColor(renderer, 100, 150, 200, 255);
-        SDL_RenderFillRect(renderer, &progress_fill);
-
-        SDL_RenderPresent(renderer);
-        SDL_Delay(16);
     }
 
     if (images.current >= images.count) {
         printf("All images have been processed!\n");
     }
 
-    if (current_texture) {
-        SDL_DestroyTexture(current_texture);
-    }
+    anim_destroy(anim);
+    anim_shutdown();
+    analyzer_destroy(analyzer);
+    if (analysis_mask)
+        SDL_DestroyTexture(analysis_mask);
+    texture_release(textures, current_texture);
+    tiles_destroy(current_tiles);
+    loader_set_cache(loader, NULL);
+    cache_print_stats(cache);
+    cache_destroy(cache);
+    texture_pool_destroy(textures);
 
+    grid_free(&grid); /* Adds the new thumbnails to the cache */
+    render_shutdown();
+    dedupe_destroy(dedupe);
+    loader_print_stats(loader);
+    loader_destroy(loader);
+    scanner_destroy(scanner);
+    watcher_destroy(watcher);
+    mover_destroy(mover); /* Finishes the queued moves */
+    if (config.trace_path[0] != '\0') {
+        trace_write(config.trace_path);
+    }
+    session_save(session, &images, !scanning);
+    session_close(session);
+    decisions_close(record);
+    history_free(&history);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     IMG_Quit();
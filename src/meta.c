@@ -0,0 +1,664 @@
+/* statx() */
+#define _GNU_SOURCE
+
+#include "meta.h"
+
+#include "files.h"
+
+#include <SDL2/SDL.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_INDEX_THREADS 16
+#define INDEX_CHUNK       256         /* Images claimed at once by an index thread */
+#define HEADER_WINDOW     (16 * 1024) /* Bytes read at once, EXIF and frame headers take one or two reads */
+#define MAX_CAMERAS       UINT16_MAX
+
+static const char *const key_names[META_KEY_COUNT] = {
+    "name", "size", "mtime", "date", "width", "height", "pixels", "camera"};
+
+/* Seconds since 1970-01-01 of a date and time, no time zone involved */
+static int64_t civil_seconds(int year, int month, int day, int hour, int minute, int second)
+{
+    /* Days from civil, proleptic Gregorian calendar */
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = era * 146097 + day_of_era - 719468;
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+/* "YYYY-MM-DD", optionally followed by " HH:MM[:SS]" or "THH:MM[:SS]". separator is '-' for --filter and ':'
+ * for EXIF. Returns 0 on success */
+static int parse_date(const char *text, char separator, int64_t *out)
+{
+    int year, month, day, hour = 0, minute = 0, second = 0, used = 0;
+    char format[32];
+    snprintf(format, sizeof(format), "%%4d%c%%2d%c%%2d%%n", separator, separator);
+    if (sscanf(text, format, &year, &month, &day, &used) != 3)
+        return -1;
+    text += used;
+    if (*text == ' ' || *text == 'T') {
+        used = 0;
+        if (sscanf(text + 1, "%2d:%2d%n", &hour, &minute, &used) != 2)
+            return -1;
+        text += 1 + used;
+        if (*text == ':') {
+            used = 0;
+            if (sscanf(text + 1, "%2d%n", &second, &used) != 1)
+                return -1;
+            text += 1 + used;
+        }
+    }
+    if (*text != '\0' || year < 1 || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 ||
+        second > 60)
+        return -1;
+    *out = civil_seconds(year, month, day, hour, minute, second);
+    return 0;
+}
+
+static unsigned key_fields(MetaKey key)
+{
+    switch (key) {
+        case META_NAME:
+            return 0;
+        case META_SIZE:
+        case META_MTIME:
+            return META_FIELD_STAT;
+        case META_DATE:
+            return META_FIELD_STAT | META_FIELD_IMAGE;
+        default:
+            return META_FIELD_IMAGE;
+    }
+}
+
+static int parse_key(const char *text, size_t len, MetaKey *out)
+{
+    for (int i = 0; i < META_KEY_COUNT; i++) {
+        if (strlen(key_names[i]) == len && strncmp(text, key_names[i], len) == 0) {
+            *out = (MetaKey)i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: Unknown key '%.*s'\n", (int)len, text);
+    fprintf(stderr, "Keys are name, size, mtime, date, width, height, pixels and camera\n");
+    return -1;
+}
+
+/* A number with an optional K, M or G suffix, powers of base */
+static int parse_number(const char *text, double base, int64_t *out)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0)
+        return -1;
+    static const char suffixes[] = "KMG";
+    const char *suffix = *end ? strchr(suffixes, toupper((unsigned char)*end)) : NULL;
+    if (suffix) {
+        for (const char *s = suffixes; s <= suffix; s++) {
+            value *= base;
+        }
+        end++;
+        if (*end == 'i')
+            end++; /* KiB */
+    }
+    if (*end == 'B' || *end == 'b')
+        end++;
+    if (*end != '\0' || value > 9e18)
+        return -1;
+    *out = (int64_t)value;
+    return 0;
+}
+
+/* key, operator and value of one condition, in place of the text between two commas */
+static int parse_condition(char *text, MetaCondition *out)
+{
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+    size_t key_len = strcspn(text, "<>=!");
+    if (text[key_len] == '\0') {
+        fprintf(stderr, "Error: Filter '%s' has no operator, expected <, <=, >, >=, = or !=\n", text);
+        return -1;
+    }
+    char *op = text + key_len;
+    size_t trimmed = key_len;
+    while (trimmed > 0 && isspace((unsigned char)text[trimmed - 1])) {
+        trimmed--;
+    }
+    if (parse_key(text, trimmed, &out->key) != 0)
+        return -1;
+
+    char *value = op + 1;
+    if (op[0] == '<')
+        out->op = op[1] == '=' ? META_LE : META_LT;
+    else if (op[0] == '>')
+        out->op = op[1] == '=' ? META_GE : META_GT;
+    else if (op[0] == '!' && op[1] == '=')
+        out->op = META_NE;
+    else if (op[0] == '=')
+        out->op = META_EQ;
+    else {
+        fprintf(stderr, "Error: Unknown operator in filter '%s'\n", text);
+        return -1;
+    }
+    if (out->op == META_LE || out->op == META_GE || out->op == META_NE)
+        value++;
+    if (*value == '=')
+        value++; /* "==" */
+    while (isspace((unsigned char)*value)) {
+        value++;
+    }
+    size_t len = strlen(value);
+    while (len > 0 && isspace((unsigned char)value[len - 1])) {
+        value[--len] = '\0';
+    }
+
+    int failed = 0;
+    switch (out->key) {
+        case META_NAME:
+        case META_CAMERA:
+            failed = out->op != META_EQ && out->op != META_NE;
+            snprintf(out->text, sizeof(out->text), "%s", value);
+            break;
+        case META_DATE:
+        case META_MTIME:
+            failed = parse_date(value, '-', &out->number) != 0;
+            break;
+        case META_SIZE:
+            failed = parse_number(value, 1024, &out->number) != 0;
+            break;
+        default:
+            failed = parse_number(value, 1000, &out->number) != 0;
+            break;
+    }
+    if (failed) {
+        fprintf(stderr, "Error: Invalid filter '%s' (dates are YYYY-MM-DD[ HH:MM[:SS]], names and cameras only "
+                        "take = and !=)\n", text);
+        return -1;
+    }
+    return 0;
+}
+
+int meta_query_parse(const char *sort, const char *filter, MetaQuery *out)
+{
+    memset(out, 0, sizeof(MetaQuery));
+    if (sort[0] != '\0') {
+        out->sorted = 1;
+        out->descending = sort[0] == '-';
+        const char *key = sort + (sort[0] == '-' || sort[0] == '+');
+        if (parse_key(key, strlen(key), &out->sort) != 0)
+            return -1;
+    }
+
+    char conditions[MAX_PATH];
+    if (snprintf(conditions, sizeof(conditions), "%s", filter) >= (int)sizeof(conditions)) {
+        fprintf(stderr, "Error: --filter is too long\n");
+        return -1;
+    }
+    char *save = NULL;
+    for (char *text = strtok_r(conditions, ",", &save); text; text = strtok_r(NULL, ",", &save)) {
+        if (out->condition_count == MAX_CONDITIONS) {
+            fprintf(stderr, "Error: More than %d filters\n", MAX_CONDITIONS);
+            return -1;
+        }
+        if (parse_condition(text, &out->conditions[out->condition_count++]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int meta_query_active(const MetaQuery *query)
+{
+    return query->sorted || query->condition_count > 0;
+}
+
+/* Window of a file read with pread(), so a header spread over the first segments costs one or two reads */
+typedef struct {
+    int fd;
+    unsigned char *buf; /* HEADER_WINDOW bytes */
+    uint64_t start;
+    size_t length;
+} Reader;
+
+/* len bytes of the file at offset, NULL past its end. len is at most HEADER_WINDOW */
+static const unsigned char *read_at(Reader *reader, uint64_t offset, size_t len)
+{
+    if (offset >= reader->start && offset + len <= reader->start + reader->length)
+        return reader->buf + (offset - reader->start);
+    ssize_t n = pread(reader->fd, reader->buf, HEADER_WINDOW, (off_t)offset);
+    reader->start = offset;
+    reader->length = n > 0 ? (size_t)n : 0;
+    return len <= reader->length ? reader->buf : NULL;
+}
+
+static uint32_t le16(const unsigned char *p)
+{
+    return (uint32_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t le24(const unsigned char *p)
+{
+    return (uint32_t)(p[0] | p[1] << 8 | p[2] << 16);
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Marker segments up to the frame header: EXIF from APP1, the size from SOFn */
+static void read_jpeg(Reader *reader, ExifInfo *exif)
+{
+    uint64_t pos = 2;
+    const unsigned char *p;
+    while ((p = read_at(reader, pos, 4)) != NULL && p[0] == 0xFF) {
+        unsigned char marker = p[1];
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        if (marker == 0xD9 || marker == 0xDA)
+            break;
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            pos += 2;
+            continue;
+        }
+        size_t length = (size_t)p[2] << 8 | p[3];
+        if (length < 2)
+            break;
+        if (marker == 0xE1 && length > 8) {
+            /* The tags come first, a thumbnail past the window is not needed */
+            size_t body_size = SDL_min(length - 2, HEADER_WINDOW);
+            const unsigned char *body = read_at(reader, pos + 4, body_size);
+            if (body && memcmp(body, "Exif\0\0", 6) == 0)
+                exif_parse_tiff(body + 6, body_size - 6, exif);
+        } else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            const unsigned char *body = read_at(reader, pos + 4, 5);
+            if (body) {
+                exif->height = body[1] << 8 | body[2];
+                exif->width = body[3] << 8 | body[4];
+            }
+            break;
+        }
+        pos += 2 + length;
+    }
+}
+
+/* Size and EXIF of an image from its header, the pixel data is never read */
+static void read_header(Reader *reader, ImageFormat format, ExifInfo *exif)
+{
+    const unsigned char *p;
+    switch (format) {
+        case FORMAT_JPEG:
+            read_jpeg(reader, exif);
+            break;
+        case FORMAT_PNG:
+            /* IHDR is the first chunk */
+            if ((p = read_at(reader, 16, 8)) != NULL) {
+                exif->width = (int)be32(p);
+                exif->height = (int)be32(p + 4);
+            }
+            break;
+        case FORMAT_GIF:
+            if ((p = read_at(reader, 6, 4)) != NULL) {
+                exif->width = (int)le16(p);
+                exif->height = (int)le16(p + 2);
+            }
+            break;
+        case FORMAT_BMP:
+            /* The DIB header follows the 14-byte file header. OS/2 BITMAPCOREHEADER (12 bytes) has 16-bit sizes,
+             * the later ones 32-bit, with negative heights for top-down bitmaps */
+            if ((p = read_at(reader, 14, 12)) == NULL)
+                break;
+            if (le32(p) == 12) {
+                exif->width = (int)le16(p + 4);
+                exif->height = (int)le16(p + 6);
+            } else {
+                exif->width = (int)le32(p + 4);
+                exif->height = abs((int32_t)le32(p + 8));
+            }
+            break;
+        case FORMAT_WEBP:
+            /* First chunk after "RIFF" size "WEBP" */
+            if ((p = read_at(reader, 12, 18)) == NULL)
+                break;
+            if (memcmp(p, "VP8 ", 4) == 0 && p[11] == 0x9D && p[12] == 0x01 && p[13] == 0x2A) {
+                exif->width = (int)(le16(p + 14) & 0x3FFF);
+                exif->height = (int)(le16(p + 16) & 0x3FFF);
+            } else if (memcmp(p, "VP8L", 4) == 0 && p[8] == 0x2F) {
+                uint32_t bits = le32(p + 9);
+                exif->width = (int)(bits & 0x3FFF) + 1;
+                exif->height = (int)(bits >> 14 & 0x3FFF) + 1;
+            } else if (memcmp(p, "VP8X", 4) == 0) {
+                exif->width = (int)le24(p + 12) + 1;
+                exif->height = (int)le24(p + 15) + 1;
+            }
+            break;
+        case FORMAT_TIFF:
+            /* IFD0 is almost always right after the header, a TIFF written with it at the end has no size here */
+            if (read_at(reader, 0, 8) != NULL)
+                exif_parse_tiff(reader->buf, reader->length, exif);
+            break;
+        default:
+            break;
+    }
+}
+
+typedef struct {
+    MetaIndex *index;
+    const ImageList *list;
+    int root_fd;
+    SDL_atomic_t next; /* Next row to claim */
+    SDL_mutex *lock;   /* Protects the camera names */
+} IndexJob;
+
+static int64_t local_seconds(time_t t)
+{
+    struct tm tm;
+    if (!localtime_r(&t, &tm))
+        return (int64_t)t;
+    return civil_seconds(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+static uint16_t camera_id(IndexJob *job, const char *camera)
+{
+    MetaIndex *index = job->index;
+    uint16_t id = 0;
+    SDL_LockMutex(job->lock);
+    for (int i = 0; i < index->camera_count && !id; i++) {
+        if (strcmp(index->cameras[i], camera) == 0)
+            id = (uint16_t)(i + 1);
+    }
+    if (!id && index->camera_count == index->camera_capacity && index->camera_capacity < MAX_CAMERAS) {
+        int capacity = SDL_min(index->camera_capacity ? index->camera_capacity * 2 : 16, MAX_CAMERAS);
+        char(*cameras)[EXIF_CAMERA_SIZE] = realloc(index->cameras, sizeof(*cameras) * capacity);
+        if (cameras) {
+            index->cameras = cameras;
+            index->camera_capacity = capacity;
+        }
+    }
+    if (!id && index->camera_count < index->camera_capacity) {
+        memcpy(index->cameras[index->camera_count], camera, EXIF_CAMERA_SIZE);
+        id = (uint16_t)++index->camera_count;
+    }
+    SDL_UnlockMutex(job->lock);
+    return id;
+}
+
+static void index_image(IndexJob *job, unsigned char *buf, int row)
+{
+    MetaIndex *index = job->index;
+    int image = index->first + row;
+    const char *name = image_name(job->list, image);
+
+#if defined(__linux__) && defined(STATX_SIZE)
+    /* Size and time alone do not need the file opened */
+    if (!(index->fields & META_FIELD_IMAGE)) {
+        struct statx stx;
+        if (statx(job->root_fd, name, 0, STATX_SIZE | STATX_MTIME, &stx) == 0) {
+            index->size[row] = stx.stx_size;
+            index->mtime[row] = local_seconds((time_t)stx.stx_mtime.tv_sec);
+        }
+        return;
+    }
+#endif
+    int fd = openat(job->root_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if ((index->fields & META_FIELD_STAT) && fstat(fd, &st) == 0) {
+        index->size[row] = (uint64_t)st.st_size;
+        index->mtime[row] = local_seconds(st.st_mtime);
+    }
+    if ((index->fields & META_FIELD_IMAGE) && buf) {
+        Reader reader = {fd, buf, 0, 0};
+        ExifInfo exif;
+        memset(&exif, 0, sizeof(ExifInfo));
+        read_header(&reader, image_format(job->list, image), &exif);
+        /* Orientations 5 to 8 turn the image a quarter */
+        int turned = exif.orientation >= 5 && exif.orientation <= 8;
+        if (exif.width > 0 && exif.height > 0) {
+            index->width[row] = (uint32_t)(turned ? exif.height : exif.width);
+            index->height[row] = (uint32_t)(turned ? exif.width : exif.height);
+        }
+        int64_t date;
+        if (exif.date[0] && parse_date(exif.date, ':', &date) == 0)
+            index->date[row] = date;
+        if (exif.camera[0])
+            index->camera[row] = camera_id(job, exif.camera);
+    }
+    close(fd);
+}
+
+static int index_thread(void *data)
+{
+    IndexJob *job = data;
+    int count = job->index->count;
+    unsigned char *buf = (job->index->fields & META_FIELD_IMAGE) ? malloc(HEADER_WINDOW) : NULL;
+    for (;;) {
+        int row = SDL_AtomicAdd(&job->next, INDEX_CHUNK);
+        if (row >= count)
+            break;
+        for (int end = SDL_min(row + INDEX_CHUNK, count); row < end; row++) {
+            index_image(job, buf, row);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+int meta_index_build(MetaIndex *index, const ImageList *list, int first, unsigned fields)
+{
+    memset(index, 0, sizeof(MetaIndex));
+    index->first = first;
+    index->count = list->count > first ? list->count - first : 0;
+    index->fields = fields;
+    size_t n = (size_t)index->count + 1;
+    index->size = calloc(n, sizeof(uint64_t));
+    index->mtime = calloc(n, sizeof(int64_t));
+    index->date = calloc(n, sizeof(int64_t));
+    index->width = calloc(n, sizeof(uint32_t));
+    index->height = calloc(n, sizeof(uint32_t));
+    index->camera = calloc(n, sizeof(uint16_t));
+    if (!index->size || !index->mtime || !index->date || !index->width || !index->height || !index->camera) {
+        meta_index_free(index);
+        return -1;
+    }
+    if (index->count == 0 || !(fields & (META_FIELD_STAT | META_FIELD_IMAGE)))
+        return 0;
+
+    IndexJob job;
+    memset(&job, 0, sizeof(IndexJob));
+    job.index = index;
+    job.list = list;
+    job.root_fd = open(list->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    job.lock = SDL_CreateMutex();
+    if (job.root_fd < 0 || !job.lock) {
+        fprintf(stderr, "Error: Cannot open directory '%s'\n", list->dir);
+        if (job.root_fd >= 0)
+            close(job.root_fd);
+        if (job.lock)
+            SDL_DestroyMutex(job.lock);
+        meta_index_free(index);
+        return -1;
+    }
+
+    /* Mostly waiting on the disk, the calling thread takes its share too */
+    int threads = SDL_GetCPUCount();
+    threads = SDL_max(1, SDL_min(threads, MAX_INDEX_THREADS));
+    threads = SDL_min(threads, (index->count + INDEX_CHUNK - 1) / INDEX_CHUNK);
+    SDL_Thread *workers[MAX_INDEX_THREADS];
+    for (int i = 1; i < threads; i++) {
+        workers[i] = SDL_CreateThread(index_thread, "metadata", &job);
+    }
+    index_thread(&job);
+    for (int i = 1; i < threads; i++) {
+        if (workers[i])
+            SDL_WaitThread(workers[i], NULL);
+    }
+    SDL_DestroyMutex(job.lock);
+    close(job.root_fd);
+    return 0;
+}
+
+void meta_index_free(MetaIndex *index)
+{
+    free(index->size);
+    free(index->mtime);
+    free(index->date);
+    free(index->width);
+    free(index->height);
+    free(index->camera);
+    free(index->cameras);
+    memset(index, 0, sizeof(MetaIndex));
+}
+
+static int64_t row_number(const MetaIndex *index, int row, MetaKey key)
+{
+    switch (key) {
+        case META_SIZE:
+            return (int64_t)index->size[row];
+        case META_MTIME:
+            return index->mtime[row];
+        case META_DATE:
+            return index->date[row] ? index->date[row] : index->mtime[row];
+        case META_WIDTH:
+            return index->width[row];
+        case META_HEIGHT:
+            return index->height[row];
+        case META_PIXELS:
+            return (int64_t)index->width[row] * index->height[row];
+        default:
+            return 0;
+    }
+}
+
+static const char *row_text(const MetaIndex *index, const ImageList *list, int row, MetaKey key)
+{
+    if (key == META_NAME)
+        return image_name(list, index->first + row);
+    if (key == META_CAMERA && index->camera[row])
+        return index->cameras[index->camera[row] - 1];
+    return NULL;
+}
+
+static int contains_nocase(const char *text, const char *part)
+{
+    size_t len = strlen(part);
+    for (; *text; text++) {
+        if (strncasecmp(text, part, len) == 0)
+            return 1;
+    }
+    return len == 0;
+}
+
+static int row_matches(const MetaIndex *index, const ImageList *list, int row, const MetaCondition *condition)
+{
+    if (condition->key == META_NAME || condition->key == META_CAMERA) {
+        const char *text = row_text(index, list, row, condition->key);
+        int found = text && contains_nocase(text, condition->text);
+        return condition->op == META_EQ ? found : !found;
+    }
+    int64_t value = row_number(index, row, condition->key);
+    switch (condition->op) {
+        case META_EQ:
+            return value == condition->number;
+        case META_NE:
+            return value != condition->number;
+        case META_LT:
+            return value < condition->number;
+        case META_LE:
+            return value <= condition->number;
+        case META_GT:
+            return value > condition->number;
+        default:
+            return value >= condition->number;
+    }
+}
+
+/* Sort key of an image kept by the filter */
+typedef struct {
+    int64_t number;
+    const char *text; /* Name and camera keys, NULL sorts first */
+    int image;
+} SortItem;
+
+static int compare_keys(const SortItem *x, const SortItem *y)
+{
+    if (x->text || y->text)
+        return !x->text ? -1 : !y->text ? 1 : strcmp(x->text, y->text);
+    return x->number < y->number ? -1 : x->number > y->number;
+}
+
+/* Equal keys keep the scan order, in both directions */
+static int compare_items(const void *a, const void *b)
+{
+    const SortItem *x = a, *y = b;
+    int order = compare_keys(x, y);
+    return order ? order : x->image - y->image;
+}
+
+static int compare_items_descending(const void *a, const void *b)
+{
+    const SortItem *x = a, *y = b;
+    int order = compare_keys(y, x);
+    return order ? order : x->image - y->image;
+}
+
+int meta_apply(const MetaQuery *query, ImageList *list, int first)
+{
+    unsigned fields = query->sorted ? key_fields(query->sort) : 0;
+    for (int i = 0; i < query->condition_count; i++) {
+        fields |= key_fields(query->conditions[i].key);
+    }
+    MetaIndex index;
+    if (meta_index_build(&index, list, first, fields) != 0)
+        return -1;
+
+    SortItem *items = malloc(sizeof(SortItem) * ((size_t)index.count + 1));
+    int *order = malloc(sizeof(int) * ((size_t)index.count + 1));
+    if (!items || !order) {
+        free(items);
+        free(order);
+        meta_index_free(&index);
+        return -1;
+    }
+    int kept = 0;
+    for (int row = 0; row < index.count; row++) {
+        int keep = 1;
+        for (int i = 0; i < query->condition_count && keep; i++) {
+            keep = row_matches(&index, list, row, &query->conditions[i]);
+        }
+        if (!keep)
+            continue;
+        SortItem *item = &items[kept++];
+        item->number = query->sorted ? row_number(&index, row, query->sort) : 0;
+        item->text = query->sorted ? row_text(&index, list, row, query->sort) : NULL;
+        item->image = first + row;
+    }
+    if (query->sorted)
+        qsort(items, (size_t)kept, sizeof(SortItem), query->descending ? compare_items_descending : compare_items);
+    for (int i = 0; i < kept; i++) {
+        order[i] = items[i].image;
+    }
+
+    int result = image_list_keep(list, first, order, kept) == 0 ? kept : -1;
+    free(items);
+    free(order);
+    meta_index_free(&index);
+    return result;
+}
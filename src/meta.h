@@ -0,0 +1,89 @@
+#ifndef META_H
+#define META_H
+
+#include "exif.h"
+#include "types.h"
+
+#include <stdint.h>
+
+/* Conditions of a --filter, all of them must hold */
+#define MAX_CONDITIONS 16
+
+/* What an image can be sorted and filtered by */
+typedef enum {
+    META_NAME = 0, /* Name relative to the source directory */
+    META_SIZE,     /* File size in bytes, K, M and G suffixes are powers of 1024 */
+    META_MTIME,    /* Last modification, local time */
+    META_DATE,     /* EXIF capture time, the modification time when the image has none */
+    META_WIDTH,    /* Pixels as shown, after the EXIF orientation */
+    META_HEIGHT,
+    META_PIXELS, /* Width times height, K and M suffixes are thousands and millions */
+    META_CAMERA, /* EXIF camera model */
+    META_KEY_COUNT,
+} MetaKey;
+
+typedef enum {
+    META_EQ = 0, /* A name or camera contains the text, case-insensitively */
+    META_NE,
+    META_LT,
+    META_LE,
+    META_GT,
+    META_GE,
+} MetaOp;
+
+typedef struct {
+    MetaKey key;
+    MetaOp op;
+    int64_t number; /* Dates are seconds of local time since 1970-01-01 */
+    char text[EXIF_CAMERA_SIZE];
+} MetaCondition;
+
+/* A parsed --sort and --filter */
+typedef struct {
+    int sorted; /* --sort given */
+    MetaKey sort;
+    int descending;
+    MetaCondition conditions[MAX_CONDITIONS];
+    int condition_count;
+} MetaQuery;
+
+/* Columns of the index, fields asks for a set of them */
+#define META_FIELD_STAT  0x01 /* size and mtime, from statx without opening the file */
+#define META_FIELD_IMAGE 0x02 /* width, height, date and camera, from the file header */
+
+/* Metadata of the images of a list from index first on, one array per column. Row i is image first + i */
+typedef struct {
+    int first;
+    int count;
+    unsigned fields;
+    uint64_t *size;
+    int64_t *mtime;   /* Seconds of local time since 1970-01-01 */
+    int64_t *date;    /* Same, 0 without an EXIF capture time */
+    uint32_t *width;  /* As shown, 0 when the header could not be read */
+    uint32_t *height;
+    uint16_t *camera; /* 1 + index in cameras, 0 for none */
+    char (*cameras)[EXIF_CAMERA_SIZE];
+    int camera_count;
+    int camera_capacity;
+} MetaIndex;
+
+/* Parse --sort (a key, with a leading '-' for descending) and --filter (comma separated key, operator and value
+ * such as width>3000 or date>=2026-01-01). Either may be empty. Prints what is wrong and returns -1 */
+int meta_query_parse(const char *sort, const char *filter, MetaQuery *out);
+
+/* Whether the query sorts or filters at all */
+int meta_query_active(const MetaQuery *query);
+
+/* Read the fields of images first to list->count on all cores. Only headers are read, never pixels.
+ * Returns 0 on success, -1 on allocation failure */
+int meta_index_build(MetaIndex *index, const ImageList *list, int first, unsigned fields);
+
+/* Free the columns of index */
+void meta_index_free(MetaIndex *index);
+
+/* Index the images from first on, drop those the filter rejects and sort the others in place. Images before
+ * first (restored moves the undo history points at) are left alone. Returns the number of images kept from
+ * first on, -1 on failure */
+int meta_apply(const MetaQuery *query, ImageList *list, int first);
+
+#endif /* META_H */
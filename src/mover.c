@@ -0,0 +1,398 @@
+#include "mover.h"
+
+#include "files.h"
+#include "trace.h"
+#include "wake.h"
+
+#include <SDL2/SDL.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_MOVE_THREADS 16
+
+typedef struct MoveOp {
+    struct MoveOp *next;
+    int ticket;
+    int tag;
+    int undo;
+    int src_dir; /* Directory fds the names below are relative to */
+    int dest_dir;
+    const char *src_name; /* In src and dest */
+    const char *dest_name;
+    char src[MAX_PATH]; /* Full paths, for the journal */
+    char dest[MAX_PATH];
+} MoveOp;
+
+struct Mover {
+    char journal_path[MAX_PATH];
+    int journal_fd;
+    /* Opened once, moves do not resolve the directory paths again */
+    char source_dir[MAX_PATH];
+    int source_fd;
+    char dest_dirs[MAX_DESTS][MAX_PATH];
+    int dest_fds[MAX_DESTS];
+    int dest_count;
+    SDL_Thread *threads[MAX_MOVE_THREADS];
+    int thread_count;
+    SDL_mutex *lock;
+    SDL_cond *work;
+    SDL_cond *finished; /* A result was pushed, for mover_wait() */
+    MoveOp *head;       /* FIFO of queued moves */
+    MoveOp *tail;
+    MoveResult *results;
+    int result_count;
+    int result_capacity;
+    int in_flight; /* Queued or moving, without a result yet */
+    int next_ticket;
+    int quit;
+};
+
+/* Journal records, appended by the move threads:
+ *   "M <ticket> <src length> <dest length>\n<src><dest>\n"  synced before the move starts
+ *   "D <ticket>\n"                                          written once it finished
+ * A move without its D record was interrupted and is settled by recover_journal(), which only ever removes the
+ * partial_path() copy of the move. Each record is a single write() to the O_APPEND journal, so the records of
+ * parallel moves do not interleave */
+static void journal_begin(Mover *mover, const MoveOp *op)
+{
+    if (mover->journal_fd < 0)
+        return;
+    char record[MAX_PATH * 2 + 64];
+    int len = snprintf(record, sizeof(record), "M %d %zu %zu\n%s%s\n", op->ticket, strlen(op->src),
+        strlen(op->dest), op->src, op->dest);
+    int ok = write(mover->journal_fd, record, len) == len && fdatasync(mover->journal_fd) == 0;
+    if (!ok)
+        fprintf(stderr, "Warning: Cannot write move journal '%s'\n", mover->journal_path);
+}
+
+static void journal_end(Mover *mover, const MoveOp *op)
+{
+    if (mover->journal_fd < 0)
+        return;
+    char record[32];
+    int len = snprintf(record, sizeof(record), "D %d\n", op->ticket);
+    if (write(mover->journal_fd, record, len) != len)
+        fprintf(stderr, "Warning: Cannot write move journal '%s'\n", mover->journal_path);
+}
+
+/* Settle one interrupted move. A destination next to its source is not ours to remove: the move refused to
+ * replace it, or the copy was complete and the source was not removed yet. Only an unfinished copy is */
+static void recover_move(const char *src, const char *dest)
+{
+    struct stat st;
+    int have_src = lstat(src, &st) == 0;
+    int have_dest = lstat(dest, &st) == 0;
+
+    char partial[MAX_PATH];
+    if (have_src && partial_path(dest, partial) == 0 && unlink(partial) == 0)
+        printf("Recovered: removed partial copy %s\n", partial);
+    if (!have_src && have_dest) {
+        printf("Recovered: %s was moved to %s\n", src, dest);
+    } else if (!have_src && !have_dest) {
+        fprintf(stderr, "Warning: '%s' was being moved to '%s' and is now in neither place\n", src, dest);
+    }
+}
+
+static void recover_journal(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = size > 0 ? malloc((size_t)size + 1) : NULL;
+    if (!data || fread(data, 1, (size_t)size, f) != (size_t)size) {
+        free(data);
+        fclose(f);
+        return;
+    }
+    fclose(f);
+    data[size] = '\0';
+
+    /* Collect started moves, then cross out the finished ones */
+    typedef struct {
+        int ticket;
+        char *src;
+        char *dest;
+    } Started;
+    Started *started = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    char *pos = data;
+    char *end = data + size;
+    while (pos < end) {
+        int ticket, consumed;
+        size_t src_len, dest_len;
+        if (sscanf(pos, "M %d %zu %zu\n%n", &ticket, &src_len, &dest_len, &consumed) == 3) {
+            pos += consumed;
+            /* A torn last record was never synced, its move never started */
+            if (src_len >= MAX_PATH || dest_len >= MAX_PATH || (size_t)(end - pos) < src_len + dest_len + 1)
+                break;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                Started *grown = realloc(started, sizeof(Started) * capacity);
+                if (!grown)
+                    break;
+                started = grown;
+            }
+            started[count].ticket = ticket;
+            started[count].src = strndup(pos, src_len);
+            started[count].dest = strndup(pos + src_len, dest_len);
+            count++;
+            pos += src_len + dest_len + 1;
+        } else if (sscanf(pos, "D %d\n%n", &ticket, &consumed) == 1) {
+            pos += consumed;
+            for (int i = count - 1; i >= 0; i--) {
+                if (started[i].ticket == ticket) {
+                    started[i].ticket = -1;
+                    break;
+                }
+            }
+        } else {
+            break;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (started[i].ticket >= 0 && started[i].src && started[i].dest)
+            recover_move(started[i].src, started[i].dest);
+        free(started[i].src);
+        free(started[i].dest);
+    }
+    free(started);
+    free(data);
+}
+
+/* Room for the results of every move in flight was made by mover_queue() */
+static void push_result(Mover *mover, const MoveOp *op, int result)
+{
+    mover->in_flight--;
+    SDL_CondSignal(mover->finished);
+    MoveResult *out = &mover->results[mover->result_count++];
+    out->ticket = op->ticket;
+    out->tag = op->tag;
+    out->undo = op->undo;
+    out->result = result;
+}
+
+static int move_thread(void *data)
+{
+    Mover *mover = data;
+
+    SDL_LockMutex(mover->lock);
+    for (;;) {
+        while (!mover->head && !mover->quit) {
+            SDL_CondWait(mover->work, mover->lock);
+        }
+        /* Quit only once the queue is drained */
+        MoveOp *op = mover->head;
+        if (!op)
+            break;
+        mover->head = op->next;
+        if (!mover->head)
+            mover->tail = NULL;
+        SDL_UnlockMutex(mover->lock);
+
+        Uint64 start = trace_begin();
+        journal_begin(mover, op);
+        int result = move_at(op->src_dir, op->src_name, op->dest_dir, op->dest_name);
+        trace_end(TRACE_MOVE, start, op->tag);
+        /* Parallel batches report their throughput instead */
+        if (result == 0 && op->undo)
+            printf("Undo: restored %s\n", op->dest);
+        else if (result == 0 && mover->thread_count == 1)
+            printf("Moved: %s -> %s\n", strrchr(op->src, '/') + 1, op->dest);
+        else if (op->undo)
+            fprintf(stderr, "Error: Failed to undo move '%s'\n", op->src);
+        journal_end(mover, op);
+
+        SDL_LockMutex(mover->lock);
+        push_result(mover, op, result);
+        free(op);
+        wake_main(WAKE_MOVED);
+    }
+    SDL_UnlockMutex(mover->lock);
+    return 0;
+}
+
+static int open_dir(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        fprintf(stderr, "Error: Cannot open directory '%s': %s\n", path, strerror(errno));
+    return fd;
+}
+
+Mover *mover_create(const char *source_dir, const Config *config, int threads)
+{
+    Mover *mover = calloc(1, sizeof(Mover));
+    if (!mover)
+        return NULL;
+
+    mover->journal_fd = -1;
+    snprintf(mover->source_dir, MAX_PATH, "%s", source_dir);
+    mover->source_fd = open_dir(source_dir);
+    int opened = mover->source_fd >= 0;
+    mover->dest_count = config->dest_count;
+    for (int i = 0; i < mover->dest_count; i++) {
+        snprintf(mover->dest_dirs[i], MAX_PATH, "%s", config->dest_dirs[i]);
+        mover->dest_fds[i] = open_dir(config->dest_dirs[i]);
+        opened &= mover->dest_fds[i] >= 0;
+    }
+    if (!opened) {
+        mover_destroy(mover);
+        return NULL;
+    }
+
+    snprintf(mover->journal_path, MAX_PATH, "%s/%s", source_dir, JOURNAL_NAME);
+    recover_journal(mover->journal_path);
+    mover->journal_fd = open(mover->journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (mover->journal_fd < 0)
+        fprintf(stderr, "Warning: Cannot create move journal '%s', moves are not crash safe\n",
+            mover->journal_path);
+
+    mover->lock = SDL_CreateMutex();
+    mover->work = SDL_CreateCond();
+    mover->finished = SDL_CreateCond();
+    if (!mover->lock || !mover->work || !mover->finished) {
+        fprintf(stderr, "SDL_CreateMutex Error: %s\n", SDL_GetError());
+        mover_destroy(mover);
+        return NULL;
+    }
+    threads = SDL_max(1, SDL_min(threads, MAX_MOVE_THREADS));
+    for (int i = 0; i < threads; i++) {
+        if (!(mover->threads[mover->thread_count] = SDL_CreateThread(move_thread, "mover", mover)))
+            break;
+        mover->thread_count++;
+    }
+    if (mover->thread_count == 0) {
+        fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+        mover_destroy(mover);
+        return NULL;
+    }
+    return mover;
+}
+
+int mover_queue(Mover *mover, const char *name, Destination dest, int undo, int tag)
+{
+    if ((int)dest < 0 || (int)dest >= mover->dest_count)
+        return -1;
+
+    /* The file keeps its name in the destination, without the subdirectories of a recursive source */
+    char source_path[MAX_PATH], dest_path[MAX_PATH];
+    if (snprintf(source_path, MAX_PATH, "%s/%s", mover->source_dir, name) >= MAX_PATH)
+        return -1;
+    dest_path_for(source_path, mover->dest_dirs[dest], dest_path);
+    size_t name_len = strlen(name);
+    size_t file_len = strlen(strrchr(source_path, '/') + 1);
+    if (strlen(mover->dest_dirs[dest]) + 1 + file_len >= MAX_PATH)
+        return -1;
+
+    MoveOp *op = calloc(1, sizeof(MoveOp));
+    if (!op)
+        return -1;
+    snprintf(op->src, MAX_PATH, "%s", undo ? dest_path : source_path);
+    snprintf(op->dest, MAX_PATH, "%s", undo ? source_path : dest_path);
+    op->src_dir = undo ? mover->dest_fds[dest] : mover->source_fd;
+    op->dest_dir = undo ? mover->source_fd : mover->dest_fds[dest];
+    op->src_name = op->src + strlen(op->src) - (undo ? file_len : name_len);
+    op->dest_name = op->dest + strlen(op->dest) - (undo ? name_len : file_len);
+    op->undo = undo;
+    op->tag = tag;
+
+    SDL_LockMutex(mover->lock);
+    /* Grown here, where running out of memory can be returned, so a finished move always has its result */
+    if (mover->result_count + mover->in_flight == mover->result_capacity) {
+        int capacity = mover->result_capacity ? mover->result_capacity * 2 : 16;
+        MoveResult *results = realloc(mover->results, sizeof(MoveResult) * capacity);
+        if (!results) {
+            SDL_UnlockMutex(mover->lock);
+            free(op);
+            return -1;
+        }
+        mover->results = results;
+        mover->result_capacity = capacity;
+    }
+    int ticket = op->ticket = mover->next_ticket++;
+    mover->in_flight++;
+    if (mover->tail)
+        mover->tail->next = op;
+    else
+        mover->head = op;
+    mover->tail = op;
+    SDL_CondSignal(mover->work);
+    SDL_UnlockMutex(mover->lock);
+    /* op belongs to the move threads once unlocked */
+    return ticket;
+}
+
+int mover_poll(Mover *mover, MoveResult *out)
+{
+    int found = 0;
+    SDL_LockMutex(mover->lock);
+    if (mover->result_count > 0) {
+        *out = mover->results[0];
+        mover->result_count--;
+        memmove(mover->results, mover->results + 1, sizeof(MoveResult) * mover->result_count);
+        found = 1;
+    }
+    SDL_UnlockMutex(mover->lock);
+    return found;
+}
+
+int mover_wait(Mover *mover, MoveResult *out)
+{
+    SDL_LockMutex(mover->lock);
+    while (mover->result_count == 0 && mover->in_flight > 0) {
+        SDL_CondWait(mover->finished, mover->lock);
+    }
+    SDL_UnlockMutex(mover->lock);
+    return mover_poll(mover, out);
+}
+
+void mover_destroy(Mover *mover)
+{
+    if (!mover)
+        return;
+
+    if (mover->thread_count > 0) {
+        SDL_LockMutex(mover->lock);
+        mover->quit = 1;
+        SDL_CondBroadcast(mover->work);
+        SDL_UnlockMutex(mover->lock);
+        for (int i = 0; i < mover->thread_count; i++) {
+            SDL_WaitThread(mover->threads[i], NULL);
+        }
+    }
+
+    /* Every move finished: nothing left to recover */
+    if (mover->journal_fd >= 0) {
+        close(mover->journal_fd);
+        if (!mover->head)
+            unlink(mover->journal_path);
+    }
+    while (mover->head) {
+        MoveOp *next = mover->head->next;
+        free(mover->head);
+        mover->head = next;
+    }
+    SDL_DestroyCond(mover->work);
+    SDL_DestroyCond(mover->finished);
+    SDL_DestroyMutex(mover->lock);
+    if (mover->source_fd >= 0)
+        close(mover->source_fd);
+    for (int i = 0; i < mover->dest_count; i++) {
+        if (mover->dest_fds[i] >= 0)
+            close(mover->dest_fds[i]);
+    }
+    free(mover->results);
+    free(mover);
+}
@@ -0,0 +1,35 @@
+#ifndef MOVER_H
+#define MOVER_H
+
+#include "types.h"
+
+#define JOURNAL_NAME ".image_swipe_sorter.journal"
+
+typedef struct {
+    int ticket; /* Returned by mover_queue() */
+    int tag;    /* Caller data, e.g. the image index */
+    int undo;
+    int result; /* 0 on success */
+} MoveResult;
+
+typedef struct Mover Mover;
+
+/* Recover moves interrupted by a crash from the journal in source_dir, open source_dir and the destination
+ * directories of config, then start the move threads. With one thread moves run in queue order, with more
+ * (batch mode) they run in parallel in any order and are not printed one by one */
+Mover *mover_create(const char *source_dir, const Config *config, int threads);
+
+/* Queue moving name (relative to the source directory) to dest (undo: back from dest).
+ * Returns a ticket identifying the result, -1 on error */
+int mover_queue(Mover *mover, const char *name, Destination dest, int undo, int tag);
+
+/* Pop one finished move, returns 1 if out was filled */
+int mover_poll(Mover *mover, MoveResult *out);
+
+/* mover_poll(), waiting for a move to finish. Returns 0 when no move is left in flight */
+int mover_wait(Mover *mover, MoveResult *out);
+
+/* Finish the queued moves, stop the move thread and remove the journal */
+void mover_destroy(Mover *mover);
+
+#endif /* MOVER_H */
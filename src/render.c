@@ -1,5 +1,19 @@
 #include "render.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+/* Glyph cells in the atlas: 5x7 plus a transparent border so scaled glyphs do not bleed */
+#define CELL_WIDTH    6
+#define CELL_HEIGHT   8
+#define ATLAS_COLUMNS 16
+#define ATLAS_WIDTH   (CELL_WIDTH * ATLAS_COLUMNS)
+#define ATLAS_HEIGHT  (CELL_HEIGHT * 128 / ATLAS_COLUMNS)
+
+/* Strings drawn twice in a row are kept as textures, one copy per draw from then on */
+#define TEXT_CACHE_SIZE 16
+#define TEXT_CACHE_LEN  64
+
 /* 5x7 bitmap font for basic characters */
 static const unsigned char font_5x7[128][7] = {
     ['<'] = {0x04, 0x08, 0x10, 0x08, 0x04, 0x00, 0x00},
@@ -14,19 +28,29 @@ static const unsigned char font_5x7[128][7] = {
     ['G'] = {0x0E, 0x11, 0x10, 0x17, 0x11, 0x0E, 0x00},
     ['H'] = {0x11, 0x11, 0x1F, 0x11, 0x11, 0x11, 0x00},
     ['I'] = {0x0E, 0x04, 0x04, 0x04, 0x04, 0x0E, 0x00},
+    ['J'] = {0x07, 0x02, 0x02, 0x02, 0x12, 0x0C, 0x00},
     ['K'] = {0x11, 0x12, 0x1C, 0x12, 0x11, 0x11, 0x00},
     ['L'] = {0x10, 0x10, 0x10, 0x10, 0x10, 0x1F, 0x00},
+    ['M'] = {0x11, 0x1B, 0x15, 0x11, 0x11, 0x11, 0x00},
     ['N'] = {0x11, 0x19, 0x15, 0x13, 0x11, 0x11, 0x00},
     ['O'] = {0x0E, 0x11, 0x11, 0x11, 0x11, 0x0E, 0x00},
     ['P'] = {0x1E, 0x11, 0x1E, 0x10, 0x10, 0x10, 0x00},
+    ['Q'] = {0x0E, 0x11, 0x11, 0x15, 0x12, 0x0D, 0x00},
     ['R'] = {0x1E, 0x11, 0x1E, 0x14, 0x12, 0x11, 0x00},
     ['S'] = {0x0E, 0x10, 0x0E, 0x01, 0x01, 0x0E, 0x00},
     ['T'] = {0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x00},
     ['U'] = {0x11, 0x11, 0x11, 0x11, 0x11, 0x0E, 0x00},
+    ['V'] = {0x11, 0x11, 0x11, 0x11, 0x0A, 0x04, 0x00},
     ['W'] = {0x11, 0x11, 0x11, 0x15, 0x15, 0x0A, 0x00},
+    ['X'] = {0x11, 0x0A, 0x04, 0x04, 0x0A, 0x11, 0x00},
+    ['Y'] = {0x11, 0x11, 0x0A, 0x04, 0x04, 0x04, 0x00},
+    ['Z'] = {0x1F, 0x02, 0x04, 0x08, 0x10, 0x1F, 0x00},
     ['('] = {0x02, 0x04, 0x04, 0x04, 0x04, 0x02, 0x00},
     [')'] = {0x08, 0x04, 0x04, 0x04, 0x04, 0x08, 0x00},
     ['/'] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x00, 0x00},
+    ['.'] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00},
+    ['_'] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x1F, 0x00},
+    ['%'] = {0x19, 0x1A, 0x04, 0x0B, 0x13, 0x00, 0x00},
     [':'] = {0x00, 0x04, 0x00, 0x00, 0x04, 0x00, 0x00},
     ['0'] = {0x0E, 0x13, 0x15, 0x19, 0x11, 0x0E, 0x00},
     ['1'] = {0x04, 0x0C, 0x04, 0x04, 0x04, 0x0E, 0x00},
@@ -40,7 +64,87 @@ static const unsigned char font_5x7[128][7] = {
     ['9'] = {0x0E, 0x11, 0x0F, 0x01, 0x11, 0x0E, 0x00},
 };
 
-void render_text(SDL_Renderer *renderer, const char *text, int x, int y, int scale)
+typedef struct {
+    char text[TEXT_CACHE_LEN];
+    SDL_Texture *texture; /* White at scale 1, tinted and scaled when drawn */
+    Uint32 last_used;
+} CachedText;
+
+static struct {
+    SDL_Renderer *renderer;
+    SDL_Texture *atlas;
+    SDL_Vertex *vertices; /* Quads of the string being drawn */
+    int *indices;
+    int capacity; /* Glyphs vertices and indices have room for */
+    CachedText texts[TEXT_CACHE_SIZE];
+    Uint32 uses;
+    SDL_Texture *arrows[2]; /* Left and right, at arrow_size */
+    int arrow_size;
+} cache;
+
+/* Paint the glyphs of text at scale 1 into a white RGBA surface at (x, y) */
+static void paint_text(SDL_Surface *surface, const char *text, int x, int y)
+{
+    Uint32 white = SDL_MapRGBA(surface->format, 255, 255, 255, 255);
+    for (int i = 0; text[i]; i++, x += 6) {
+        unsigned char c = (unsigned char)text[i];
+        if (c >= 128)
+            continue;
+        for (int row = 0; row < 7; row++) {
+            Uint32 *pixels = (Uint32 *)((Uint8 *)surface->pixels + (y + row) * surface->pitch);
+            for (int col = 0; col < 5; col++) {
+                if (font_5x7[c][row] & (0x10 >> col))
+                    pixels[x + col] = white;
+            }
+        }
+    }
+}
+
+static SDL_Texture *create_texture(SDL_Renderer *renderer, SDL_Surface *surface)
+{
+    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+    if (texture)
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    return texture;
+}
+
+int render_init(SDL_Renderer *renderer)
+{
+    cache.renderer = renderer;
+
+    SDL_Surface *surface =
+        SDL_CreateRGBSurfaceWithFormat(0, ATLAS_WIDTH, ATLAS_HEIGHT, 32, SDL_PIXELFORMAT_RGBA32);
+    if (!surface)
+        return -1;
+    SDL_FillRect(surface, NULL, SDL_MapRGBA(surface->format, 0, 0, 0, 0));
+    for (int c = 0; c < 128; c++) {
+        char glyph[2] = {(char)c, '\0'};
+        paint_text(surface, glyph, c % ATLAS_COLUMNS * CELL_WIDTH, c / ATLAS_COLUMNS * CELL_HEIGHT);
+    }
+    cache.atlas = create_texture(renderer, surface);
+    SDL_FreeSurface(surface);
+    return cache.atlas ? 0 : -1;
+}
+
+void render_shutdown(void)
+{
+    if (cache.atlas)
+        SDL_DestroyTexture(cache.atlas);
+    for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+        if (cache.texts[i].texture)
+            SDL_DestroyTexture(cache.texts[i].texture);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (cache.arrows[i])
+            SDL_DestroyTexture(cache.arrows[i]);
+    }
+    free(cache.vertices);
+    free(cache.indices);
+    memset(&cache, 0, sizeof(cache));
+}
+
+/* Fallback without an atlas: one rectangle per lit pixel */
+static void fill_text(SDL_Renderer *renderer, const char *text, int x, int y, int scale)
 {
     int cursor_x = x;
     for (int i = 0; text[i]; i++) {
@@ -64,7 +168,115 @@ void render_text(SDL_Renderer *renderer, const char *text, int x, int y, int sca
     }
 }
 
-void render_arrow(SDL_Renderer *renderer, int x, int y, int size, int direction)
+/* One textured quad per glyph from the atlas, all in a single draw call */
+static int draw_glyphs(SDL_Renderer *renderer, const char *text, int x, int y, int scale, SDL_Color color)
+{
+    int len = (int)strlen(text);
+    if (len > cache.capacity) {
+        SDL_Vertex *vertices = realloc(cache.vertices, sizeof(SDL_Vertex) * 4 * len);
+        if (vertices)
+            cache.vertices = vertices;
+        int *indices = realloc(cache.indices, sizeof(int) * 6 * len);
+        if (indices)
+            cache.indices = indices;
+        if (!vertices || !indices)
+            return -1;
+        cache.capacity = len;
+    }
+
+    int quads = 0;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == ' ' || c >= 128)
+            continue;
+        float x0 = (float)(x + i * 6 * scale);
+        float y0 = (float)y;
+        float x1 = x0 + 5 * scale;
+        float y1 = y0 + 7 * scale;
+        float u0 = (float)(c % ATLAS_COLUMNS * CELL_WIDTH) / ATLAS_WIDTH;
+        float v0 = (float)(c / ATLAS_COLUMNS * CELL_HEIGHT) / ATLAS_HEIGHT;
+        float u1 = u0 + 5.0f / ATLAS_WIDTH;
+        float v1 = v0 + 7.0f / ATLAS_HEIGHT;
+
+        SDL_Vertex *v = cache.vertices + quads * 4;
+        v[0] = (SDL_Vertex){{x0, y0}, color, {u0, v0}};
+        v[1] = (SDL_Vertex){{x1, y0}, color, {u1, v0}};
+        v[2] = (SDL_Vertex){{x1, y1}, color, {u1, v1}};
+        v[3] = (SDL_Vertex){{x0, y1}, color, {u0, v1}};
+        int *index = cache.indices + quads * 6;
+        int base = quads * 4;
+        index[0] = base;
+        index[1] = base + 1;
+        index[2] = base + 2;
+        index[3] = base;
+        index[4] = base + 2;
+        index[5] = base + 3;
+        quads++;
+    }
+    if (quads == 0)
+        return 0;
+    return SDL_RenderGeometry(renderer, cache.atlas, cache.vertices, quads * 4, cache.indices, quads * 6);
+}
+
+/* Texture of a string seen in the previous draw, NULL the first time it is drawn */
+static SDL_Texture *cached_text(SDL_Renderer *renderer, const char *text)
+{
+    size_t len = strlen(text);
+    if (len == 0 || len >= TEXT_CACHE_LEN)
+        return NULL;
+
+    CachedText *oldest = &cache.texts[0];
+    for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+        CachedText *entry = &cache.texts[i];
+        if (strcmp(entry->text, text) == 0) {
+            entry->last_used = ++cache.uses;
+            if (!entry->texture) {
+                SDL_Surface *surface =
+                    SDL_CreateRGBSurfaceWithFormat(0, (int)len * 6 - 1, 7, 32, SDL_PIXELFORMAT_RGBA32);
+                if (!surface)
+                    return NULL;
+                SDL_FillRect(surface, NULL, SDL_MapRGBA(surface->format, 0, 0, 0, 0));
+                paint_text(surface, text, 0, 0);
+                entry->texture = create_texture(renderer, surface);
+                SDL_FreeSurface(surface);
+            }
+            return entry->texture;
+        }
+        if (entry->last_used < oldest->last_used)
+            oldest = entry;
+    }
+
+    /* Counters change on every move, only keep a texture for strings that come back */
+    if (oldest->texture)
+        SDL_DestroyTexture(oldest->texture);
+    oldest->texture = NULL;
+    memcpy(oldest->text, text, len + 1);
+    oldest->last_used = ++cache.uses;
+    return NULL;
+}
+
+void render_text(SDL_Renderer *renderer, const char *text, int x, int y, int scale)
+{
+    if (!cache.atlas || renderer != cache.renderer) {
+        fill_text(renderer, text, x, y, scale);
+        return;
+    }
+
+    SDL_Color color;
+    SDL_GetRenderDrawColor(renderer, &color.r, &color.g, &color.b, &color.a);
+
+    SDL_Texture *texture = cached_text(renderer, text);
+    if (texture) {
+        SDL_Rect dest = {x, y, ((int)strlen(text) * 6 - 1) * scale, 7 * scale};
+        SDL_SetTextureColorMod(texture, color.r, color.g, color.b);
+        SDL_SetTextureAlphaMod(texture, color.a);
+        SDL_RenderCopy(renderer, texture, NULL, &dest);
+    } else if (draw_glyphs(renderer, text, x, y, scale, color) != 0) {
+        fill_text(renderer, text, x, y, scale);
+    }
+}
+
+static void draw_arrow(SDL_Renderer *renderer, int x, int y, int size, int direction)
 {
     int half = size / 2;
     int shaft_height = size / 3;
@@ -91,3 +303,54 @@ void render_arrow(SDL_Renderer *renderer, int x, int y, int size, int direction)
         }
     }
 }
+
+/* Both arrows drawn once per size into textures */
+static int cache_arrows(SDL_Renderer *renderer, int size)
+{
+    for (int i = 0; i < 2; i++) {
+        if (cache.arrows[i])
+            SDL_DestroyTexture(cache.arrows[i]);
+        cache.arrows[i] = NULL;
+    }
+    cache.arrow_size = size;
+
+    for (int i = 0; i < 2; i++) {
+        SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, size + 1, size + 1, 32, SDL_PIXELFORMAT_RGBA32);
+        if (!surface)
+            return -1;
+        SDL_FillRect(surface, NULL, SDL_MapRGBA(surface->format, 0, 0, 0, 0));
+        SDL_Renderer *software = SDL_CreateSoftwareRenderer(surface);
+        if (software) {
+            SDL_SetRenderDrawColor(software, 255, 255, 255, 255);
+            draw_arrow(software, 0, size / 2, size, i == 0 ? -1 : 1);
+            SDL_RenderPresent(software);
+            SDL_DestroyRenderer(software);
+            cache.arrows[i] = create_texture(renderer, surface);
+        }
+        SDL_FreeSurface(surface);
+        if (!cache.arrows[i])
+            return -1;
+    }
+    return 0;
+}
+
+void render_arrow(SDL_Renderer *renderer, int x, int y, int size, int direction)
+{
+    SDL_Texture *texture = NULL;
+    if (renderer == cache.renderer) {
+        if (size != cache.arrow_size)
+            cache_arrows(renderer, size);
+        texture = cache.arrows[direction < 0 ? 0 : 1];
+    }
+    if (!texture) {
+        draw_arrow(renderer, x, y, size, direction);
+        return;
+    }
+
+    Uint8 r, g, b, a;
+    SDL_GetRenderDrawColor(renderer, &r, &g, &b, &a);
+    SDL_Rect dest = {x, y - size / 2, size + 1, size + 1};
+    SDL_SetTextureColorMod(texture, r, g, b);
+    SDL_SetTextureAlphaMod(texture, a);
+    SDL_RenderCopy(renderer, texture, NULL, &dest);
+}
@@ -3,10 +3,16 @@
 
 #include <SDL2/SDL.h>
 
-/* Render text using bitmap font */
+/* Build the glyph atlas for renderer, text and arrows fall back to plain rectangles without it */
+int render_init(SDL_Renderer *renderer);
+
+/* Free the atlas and the cached textures, before destroying the renderer */
+void render_shutdown(void);
+
+/* Render text using bitmap font, in the current draw color */
 void render_text(SDL_Renderer *renderer, const char *text, int x, int y, int scale);
 
-/* Render arrow indicator. direction: -1 = left, 1 = right */
+/* Render arrow indicator in the current draw color. direction: -1 = left, 1 = right */
 void render_arrow(SDL_Renderer *renderer, int x, int y, int size, int direction);
 
 #endif /* RENDER_H */
@@ -0,0 +1,482 @@
+#include "scan.h"
+
+#include "files.h"
+#include "sniff.h"
+#include "wake.h"
+
+#include <SDL2/SDL.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+    #include <sys/syscall.h>
+#endif
+
+#define MAX_SCAN_THREADS 16
+#define BATCH_FLUSH_SIZE (64 * 1024)
+#define SNIFF_CHUNK      256 /* File names per sniff job */
+#define SNIFF_INLINE     32  /* Smaller leftovers are sniffed by the thread that read the directory */
+
+/* Records are a format byte followed by a NUL-terminated name, back to back */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    int count;
+} NameBuffer;
+
+/* Work item: read a directory, or sniff a chunk of the file names found in one */
+typedef struct {
+    char *rel;        /* Directory relative to the root, "" for the root */
+    NameBuffer files; /* Empty for a directory job */
+} ScanJob;
+
+/* Jobs waiting to be run. The owner pushes and pops at the tail (depth first), idle threads
+ * steal from the head, which holds the oldest, largest subtrees */
+typedef struct {
+    SDL_SpinLock lock;
+    ScanJob *jobs;
+    int head;
+    int tail;
+    int capacity;
+} JobQueue;
+
+typedef struct {
+    struct Scanner *scanner;
+    int id;
+    NameBuffer batch; /* Images found since the last publish */
+} ScanWorker;
+
+struct Scanner {
+    int root_fd;
+    int recursive;
+    DirId excluded[MAX_DESTS];
+    int excluded_count;
+    JobQueue queues[MAX_SCAN_THREADS];
+    ScanWorker workers[MAX_SCAN_THREADS];
+    SDL_Thread *threads[MAX_SCAN_THREADS];
+    int thread_count;
+    SDL_atomic_t pending;  /* Jobs queued or running */
+    SDL_atomic_t finished; /* Threads that ran out of work */
+    SDL_atomic_t quit;
+    SDL_atomic_t failed; /* Names were dropped for lack of memory */
+    SDL_mutex *lock;     /* Protects found */
+    NameBuffer found;
+    int joined;
+};
+
+static int buffer_append(NameBuffer *buf, ImageFormat format, const char *prefix, const char *name)
+{
+    size_t prefix_len = prefix ? strlen(prefix) + 1 : 0;
+    size_t len = strlen(name);
+    size_t needed = buf->size + 1 + prefix_len + len + 1;
+    if (needed > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 16 * 1024;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *data = realloc(buf->data, capacity);
+        if (!data)
+            return -1;
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    char *out = buf->data + buf->size;
+    *out++ = (char)format;
+    if (prefix) {
+        memcpy(out, prefix, prefix_len - 1);
+        out[prefix_len - 1] = '/';
+    }
+    memcpy(out + prefix_len, name, len + 1);
+    buf->size = needed;
+    buf->count++;
+    return 0;
+}
+
+/* Returns -1 if out of memory, the job is freed then */
+static int queue_push(JobQueue *queue, ScanJob job)
+{
+    SDL_AtomicLock(&queue->lock);
+    if (queue->tail == queue->capacity) {
+        if (queue->head > 0) {
+            memmove(queue->jobs, queue->jobs + queue->head, sizeof(ScanJob) * (queue->tail - queue->head));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        } else {
+            int capacity = queue->capacity ? queue->capacity * 2 : 64;
+            ScanJob *jobs = realloc(queue->jobs, sizeof(ScanJob) * capacity);
+            if (!jobs) {
+                SDL_AtomicUnlock(&queue->lock);
+                fprintf(stderr, "Error: Out of memory, skipping '%s'\n", job.rel);
+                free(job.rel);
+                free(job.files.data);
+                return -1;
+            }
+            queue->jobs = jobs;
+            queue->capacity = capacity;
+        }
+    }
+    queue->jobs[queue->tail++] = job;
+    SDL_AtomicUnlock(&queue->lock);
+    return 0;
+}
+
+static int queue_pop(JobQueue *queue, int steal, ScanJob *out)
+{
+    int found = 0;
+    SDL_AtomicLock(&queue->lock);
+    if (queue->tail > queue->head) {
+        *out = steal ? queue->jobs[queue->head++] : queue->jobs[--queue->tail];
+        found = 1;
+    }
+    SDL_AtomicUnlock(&queue->lock);
+    return found;
+}
+
+/* Append to buf, or remember that the scan lost names */
+static void append_name(ScanWorker *worker, NameBuffer *buf, ImageFormat format, const char *prefix,
+    const char *name)
+{
+    if (buffer_append(buf, format, prefix, name) != 0)
+        SDL_AtomicSet(&worker->scanner->failed, 1);
+}
+
+/* Queue a job on the worker's own queue, idle threads will steal it */
+static void spawn(ScanWorker *worker, const char *rel, NameBuffer *files)
+{
+    ScanJob job = {strdup(rel), {0}};
+    if (!job.rel) {
+        SDL_AtomicSet(&worker->scanner->failed, 1);
+        return;
+    }
+    if (files) {
+        job.files = *files;
+        memset(files, 0, sizeof(NameBuffer));
+    }
+    SDL_AtomicAdd(&worker->scanner->pending, 1);
+    if (queue_push(&worker->scanner->queues[worker->id], job) != 0) {
+        SDL_AtomicAdd(&worker->scanner->pending, -1);
+        SDL_AtomicSet(&worker->scanner->failed, 1);
+    }
+}
+
+static void sniff_files(ScanWorker *worker, int dir_fd, const char *rel, const NameBuffer *files)
+{
+    for (size_t pos = 0; pos < files->size;) {
+        const char *name = files->data + pos + 1;
+        pos += strlen(name) + 2;
+        ImageFormat format = sniff_file(dir_fd, name);
+        if (format != FORMAT_UNKNOWN)
+            append_name(worker, &worker->batch, format, rel[0] ? rel : NULL, name);
+    }
+}
+
+/* Handle one directory entry: subdirectories become jobs, other files wait to be sniffed */
+static void scan_entry(ScanWorker *worker, int dir_fd, const char *rel, const char *name, unsigned char type,
+    NameBuffer *files)
+{
+    const struct Scanner *scanner = worker->scanner;
+    if (name[0] == '.')
+        return;
+
+    if (type == DT_UNKNOWN && scanner->recursive) {
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            return;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+    }
+
+    if (type == DT_DIR) {
+        if (!scanner->recursive)
+            return;
+        char sub[MAX_PATH];
+        int length;
+        if (rel[0])
+            length = snprintf(sub, sizeof(sub), "%s/%s", rel, name);
+        else
+            length = snprintf(sub, sizeof(sub), "%s", name);
+        if (length >= (int)sizeof(sub)) {
+            fprintf(stderr, "Warning: Path too long, skipping '%s/%s'\n", rel, name);
+            return;
+        }
+        spawn(worker, sub, NULL);
+    } else if (type == DT_REG || type == DT_LNK || type == DT_UNKNOWN) {
+        /* Content decides what is an image, extensions are ignored */
+        append_name(worker, files, FORMAT_UNKNOWN, NULL, name);
+        if (files->count >= SNIFF_CHUNK)
+            spawn(worker, rel, files);
+    }
+}
+
+static void publish(ScanWorker *worker)
+{
+    struct Scanner *scanner = worker->scanner;
+    if (worker->batch.size == 0)
+        return;
+
+    SDL_LockMutex(scanner->lock);
+    if (scanner->found.size == 0) {
+        /* Hand the whole batch over instead of copying it */
+        NameBuffer empty = scanner->found;
+        scanner->found = worker->batch;
+        worker->batch = empty;
+    } else {
+        NameBuffer *found = &scanner->found;
+        if (found->size + worker->batch.size > found->capacity) {
+            size_t capacity = (found->size + worker->batch.size) * 2;
+            char *data = realloc(found->data, capacity);
+            if (data) {
+                found->data = data;
+                found->capacity = capacity;
+            }
+        }
+        if (found->size + worker->batch.size <= found->capacity) {
+            memcpy(found->data + found->size, worker->batch.data, worker->batch.size);
+            found->size += worker->batch.size;
+        } else {
+            SDL_AtomicSet(&scanner->failed, 1);
+        }
+    }
+    SDL_UnlockMutex(scanner->lock);
+    worker->batch.size = 0;
+    worker->batch.count = 0;
+    wake_main(WAKE_SCANNED);
+}
+
+#ifdef __linux__
+/* Layout returned by the getdents64 syscall, glibc does not export it */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Read entries in large batches straight from the kernel, one syscall per 256 KB of entries */
+static void read_directory(ScanWorker *worker, int dir_fd, const char *rel, NameBuffer *files)
+{
+    static const size_t buf_size = 256 * 1024;
+    char *buf = malloc(buf_size);
+    if (!buf) {
+        SDL_AtomicSet(&worker->scanner->failed, 1);
+        return;
+    }
+
+    long n;
+    while ((n = syscall(SYS_getdents64, dir_fd, buf, buf_size)) > 0) {
+        for (long pos = 0; pos < n;) {
+            const struct linux_dirent64 *entry = (const struct linux_dirent64 *)(buf + pos);
+            pos += entry->d_reclen;
+            scan_entry(worker, dir_fd, rel, entry->d_name, entry->d_type, files);
+        }
+    }
+    free(buf);
+}
+#else
+static void read_directory(ScanWorker *worker, int dir_fd, const char *rel, NameBuffer *files)
+{
+    DIR *dir = fdopendir(dup(dir_fd));
+    if (!dir)
+        return;
+
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        scan_entry(worker, dir_fd, rel, entry->d_name, entry->d_type, files);
+    }
+    closedir(dir);
+}
+#endif
+
+static int next_job(ScanWorker *worker, ScanJob *job)
+{
+    struct Scanner *scanner = worker->scanner;
+    if (queue_pop(&scanner->queues[worker->id], 0, job))
+        return 1;
+    for (int i = 1; i < scanner->thread_count; i++) {
+        if (queue_pop(&scanner->queues[(worker->id + i) % scanner->thread_count], 1, job))
+            return 1;
+    }
+    return 0;
+}
+
+static void run_job(ScanWorker *worker, ScanJob *job)
+{
+    const struct Scanner *scanner = worker->scanner;
+
+    int dir_fd = job->rel[0] ? openat(scanner->root_fd, job->rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                             : dup(scanner->root_fd);
+    if (dir_fd < 0) {
+        fprintf(stderr, "Warning: Cannot open directory '%s'\n", job->rel);
+        return;
+    }
+    /* A destination inside the source directory, its images are sorted already */
+    struct stat st;
+    if (job->files.size == 0 && scanner->excluded_count > 0 && fstat(dir_fd, &st) == 0 &&
+        dir_id_match(scanner->excluded, scanner->excluded_count, &st)) {
+        close(dir_fd);
+        return;
+    }
+
+    if (job->files.size > 0) {
+        sniff_files(worker, dir_fd, job->rel, &job->files);
+    } else {
+        /* Full chunks were spawned while reading, sniff the leftover here unless it is large */
+        NameBuffer files = {0};
+        read_directory(worker, dir_fd, job->rel, &files);
+        if (files.count > SNIFF_INLINE) {
+            spawn(worker, job->rel, &files);
+        } else {
+            sniff_files(worker, dir_fd, job->rel, &files);
+        }
+        free(files.data);
+    }
+    close(dir_fd);
+}
+
+static int scan_thread(void *data)
+{
+    ScanWorker *worker = data;
+    struct Scanner *scanner = worker->scanner;
+
+    while (!SDL_AtomicGet(&scanner->quit)) {
+        ScanJob job;
+        if (!next_job(worker, &job)) {
+            /* Nothing to steal: done once no job is queued or running anywhere */
+            if (SDL_AtomicGet(&scanner->pending) == 0)
+                break;
+            SDL_Delay(1);
+            continue;
+        }
+
+        run_job(worker, &job);
+        /* Publish after each directory so the first images show up early */
+        if (worker->batch.size >= BATCH_FLUSH_SIZE || job.files.size == 0)
+            publish(worker);
+        free(job.rel);
+        free(job.files.data);
+        SDL_AtomicAdd(&scanner->pending, -1);
+    }
+
+    publish(worker);
+    SDL_AtomicAdd(&scanner->finished, 1);
+    wake_main(WAKE_SCANNED);
+    return 0;
+}
+
+Scanner *scanner_start(const char *root, int recursive, const DirId *excluded, int excluded_count)
+{
+    Scanner *scanner = calloc(1, sizeof(Scanner));
+    if (!scanner)
+        return NULL;
+
+    scanner->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scanner->root_fd < 0) {
+        fprintf(stderr, "Error: Cannot open directory '%s'\n", root);
+        free(scanner);
+        return NULL;
+    }
+    scanner->recursive = recursive;
+    scanner->excluded_count = SDL_min(excluded_count, MAX_DESTS);
+    if (scanner->excluded_count > 0)
+        memcpy(scanner->excluded, excluded, sizeof(DirId) * scanner->excluded_count);
+    scanner->lock = SDL_CreateMutex();
+
+    /* Even a flat directory is read by one thread but sniffed by all of them */
+    int threads = SDL_GetCPUCount();
+    if (threads > MAX_SCAN_THREADS)
+        threads = MAX_SCAN_THREADS;
+    if (threads < 2)
+        threads = 2;
+
+    /* Without the root job the threads find nothing to do and scanner_poll() reports the failure */
+    ScanJob root_job = {strdup(""), {0}};
+    if (root_job.rel) {
+        SDL_AtomicSet(&scanner->pending, 1);
+        if (queue_push(&scanner->queues[0], root_job) != 0) {
+            SDL_AtomicSet(&scanner->pending, 0);
+            SDL_AtomicSet(&scanner->failed, 1);
+        }
+    } else {
+        SDL_AtomicSet(&scanner->failed, 1);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        scanner->workers[i].scanner = scanner;
+        scanner->workers[i].id = i;
+    }
+    /* thread_count bounds stealing, set it before any thread runs */
+    scanner->thread_count = threads;
+    for (int i = 0; i < threads; i++) {
+        scanner->threads[i] = SDL_CreateThread(scan_thread, "scanner", &scanner->workers[i]);
+        if (!scanner->threads[i]) {
+            /* Work left in this queue is stolen by the threads that did start */
+            fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+            SDL_AtomicAdd(&scanner->finished, 1);
+        }
+    }
+    return scanner;
+}
+
+int scanner_poll(Scanner *scanner, ImageList *list)
+{
+    /* Read before draining: anything published by a finished thread is drained below */
+    int done = SDL_AtomicGet(&scanner->finished) == scanner->thread_count;
+
+    SDL_LockMutex(scanner->lock);
+    NameBuffer found = scanner->found;
+    memset(&scanner->found, 0, sizeof(NameBuffer));
+    SDL_UnlockMutex(scanner->lock);
+
+    int result = done ? 0 : 1;
+    if (SDL_AtomicGet(&scanner->failed))
+        result = -1;
+    for (size_t pos = 0; pos < found.size;) {
+        ImageFormat format = (ImageFormat)found.data[pos];
+        const char *name = found.data + pos + 1;
+        size_t len = strlen(name);
+        if (image_list_add(list, name, len, format) != 0) {
+            result = -1;
+            break;
+        }
+        pos += len + 2;
+    }
+    free(found.data);
+    return result;
+}
+
+void scanner_wait(Scanner *scanner)
+{
+    if (scanner->joined)
+        return;
+    for (int i = 0; i < scanner->thread_count; i++) {
+        SDL_WaitThread(scanner->threads[i], NULL);
+    }
+    scanner->joined = 1;
+}
+
+void scanner_destroy(Scanner *scanner)
+{
+    if (!scanner)
+        return;
+    SDL_AtomicSet(&scanner->quit, 1);
+    scanner_wait(scanner);
+
+    for (int i = 0; i < scanner->thread_count; i++) {
+        JobQueue *queue = &scanner->queues[i];
+        for (int j = queue->head; j < queue->tail; j++) {
+            free(queue->jobs[j].rel);
+            free(queue->jobs[j].files.data);
+        }
+        free(queue->jobs);
+        free(scanner->workers[i].batch.data);
+    }
+    free(scanner->found.data);
+    SDL_DestroyMutex(scanner->lock);
+    close(scanner->root_fd);
+    free(scanner);
+}
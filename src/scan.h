@@ -0,0 +1,23 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include "types.h"
+
+typedef struct Scanner Scanner;
+
+/* Start scanning root for images on background threads. With recursive, subdirectories are
+ * walked in parallel by work-stealing threads, except the excluded ones (destinations inside root).
+ * Returns NULL if root cannot be opened */
+Scanner *scanner_start(const char *root, int recursive, const DirId *excluded, int excluded_count);
+
+/* Append the images found since the last call to list. Returns 1 while the scan is running,
+ * 0 once it is complete and everything was appended, -1 on allocation failure here or in the scan threads */
+int scanner_poll(Scanner *scanner, ImageList *list);
+
+/* Block until every directory has been read */
+void scanner_wait(Scanner *scanner);
+
+/* Stop scanning threads (early if still running) and free the scanner */
+void scanner_destroy(Scanner *scanner);
+
+#endif /* SCAN_H */
@@ -0,0 +1,240 @@
+#include "session.h"
+
+#include "files.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SESSION_MAGIC   "ISSINDEX"
+#define SESSION_VERSION 1
+
+/* File layout: a header, then records sorted by name hash so a lookup is a binary search
+ * in the mapping. Native byte order, the file never leaves the machine */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} SessionHeader;
+
+/* An image is identified by its name, and by inode and mtime so a different file under the same
+ * name is not mistaken for it */
+typedef struct {
+    uint64_t inode;
+    int64_t mtime_ns;
+    uint32_t name_hash;
+    uint32_t reserved;
+} SessionRecord;
+
+/* Key of an image of this run */
+typedef struct {
+    SessionRecord record;
+    int index;
+} SessionMark;
+
+struct Session {
+    char path[MAX_PATH];
+    void *map;
+    size_t map_size;
+    const SessionRecord *records; /* Last run, in the mapping */
+    uint32_t count;
+    uint8_t *used; /* Records matched by an image of this run */
+    SessionMark *marks;
+    int mark_count;
+    int mark_capacity;
+    int matched; /* Images of the list already looked up */
+};
+
+/* FNV-1a */
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    }
+    return hash;
+}
+
+static int image_key(const ImageList *list, int index, SessionRecord *out)
+{
+    char path[MAX_PATH];
+    struct stat st;
+    if (!image_path(list, index, path) || lstat(path, &st) != 0)
+        return -1;
+    memset(out, 0, sizeof(SessionRecord));
+    out->inode = (uint64_t)st.st_ino;
+#ifdef __APPLE__
+    out->mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    out->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    out->name_hash = name_hash(image_name(list, index));
+    return 0;
+}
+
+static int add_mark(Session *session, const SessionRecord *record, int index)
+{
+    if (session->mark_count == session->mark_capacity) {
+        int capacity = session->mark_capacity ? session->mark_capacity * 2 : 256;
+        SessionMark *marks = realloc(session->marks, sizeof(SessionMark) * capacity);
+        if (!marks)
+            return -1;
+        session->marks = marks;
+        session->mark_capacity = capacity;
+    }
+    session->marks[session->mark_count].record = *record;
+    session->marks[session->mark_count++].index = index;
+    return 0;
+}
+
+Session *session_open(const char *path)
+{
+    Session *session = calloc(1, sizeof(Session));
+    if (!session)
+        return NULL;
+    snprintf(session->path, MAX_PATH, "%s", path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return session;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SessionHeader)) {
+        session->map_size = (size_t)st.st_size;
+        session->map = mmap(NULL, session->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (session->map == MAP_FAILED)
+            session->map = NULL;
+    }
+    close(fd);
+    if (!session->map)
+        return session;
+
+    const SessionHeader *header = session->map;
+    if (memcmp(header->magic, SESSION_MAGIC, 8) != 0 || header->version != SESSION_VERSION ||
+        header->count > (session->map_size - sizeof(SessionHeader)) / sizeof(SessionRecord)) {
+        fprintf(stderr, "Warning: Ignoring invalid session file '%s'\n", path);
+        return session;
+    }
+    session->records = (const SessionRecord *)(header + 1);
+    session->count = header->count;
+    session->used = calloc(session->count ? session->count : 1, 1);
+    if (!session->used)
+        session->count = 0;
+    return session;
+}
+
+void session_match(Session *session, ImageList *list)
+{
+    if (!session)
+        return;
+
+    for (; session->matched < list->count; session->matched++) {
+        int index = session->matched;
+        if (session->count == 0 || (list->flags[index] & IMAGE_MOVED))
+            continue;
+
+        /* First record with the hash of the name */
+        uint32_t hash = name_hash(image_name(list, index));
+        uint32_t low = 0, high = session->count;
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+            if (session->records[mid].name_hash < hash)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if (low == session->count || session->records[low].name_hash != hash)
+            continue;
+
+        /* Only names skipped last time cost a stat */
+        SessionRecord key;
+        if (image_key(list, index, &key) != 0)
+            continue;
+        for (uint32_t i = low; i < session->count && session->records[i].name_hash == hash; i++) {
+            if (session->records[i].inode == key.inode && session->records[i].mtime_ns == key.mtime_ns) {
+                session->used[i] = 1;
+                if (add_mark(session, &key, index) == 0)
+                    list->flags[index] |= IMAGE_SKIPPED;
+                break;
+            }
+        }
+    }
+}
+
+void session_skip(Session *session, const ImageList *list, int index)
+{
+    SessionRecord key;
+    if (session && image_key(list, index, &key) == 0)
+        add_mark(session, &key, index);
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    uint32_t ha = ((const SessionRecord *)a)->name_hash;
+    uint32_t hb = ((const SessionRecord *)b)->name_hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+int session_save(Session *session, const ImageList *list, int complete)
+{
+    if (!session)
+        return 0;
+
+    size_t capacity = (size_t)session->mark_count + (complete ? 0 : session->count);
+    SessionRecord *records = malloc(sizeof(SessionRecord) * (capacity ? capacity : 1));
+    if (!records)
+        return -1;
+
+    uint32_t count = 0;
+    for (int i = 0; i < session->mark_count; i++) {
+        int index = session->marks[i].index;
+        if ((list->flags[index] & (IMAGE_MOVED | IMAGE_SKIPPED)) == IMAGE_SKIPPED)
+            records[count++] = session->marks[i].record;
+    }
+    for (uint32_t i = 0; !complete && i < session->count; i++) {
+        if (!session->used[i])
+            records[count++] = session->records[i];
+    }
+    qsort(records, count, sizeof(SessionRecord), compare_records);
+
+    /* Write a new file and rename it over the old one, a crash leaves either complete */
+    char tmp_path[MAX_PATH + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", session->path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) {
+        fprintf(stderr, "Warning: Cannot write session file '%s'\n", tmp_path);
+        free(records);
+        return -1;
+    }
+    SessionHeader header;
+    memcpy(header.magic, SESSION_MAGIC, 8);
+    header.version = SESSION_VERSION;
+    header.count = count;
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(records, sizeof(SessionRecord), count, f) == count && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    free(records);
+
+    if (!ok || rename(tmp_path, session->path) != 0) {
+        fprintf(stderr, "Warning: Cannot write session file '%s'\n", session->path);
+        unlink(tmp_path);
+        return -1;
+    }
+    if (count > 0)
+        printf("Saved %u skipped images for the next run\n", count);
+    return 0;
+}
+
+void session_close(Session *session)
+{
+    if (!session)
+        return;
+    if (session->map)
+        munmap(session->map, session->map_size);
+    free(session->used);
+    free(session->marks);
+    free(session);
+}
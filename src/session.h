@@ -0,0 +1,26 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "types.h"
+
+#define SESSION_NAME ".image_swipe_sorter.session"
+
+typedef struct Session Session;
+
+/* Map the index saved by the last run at path, an empty session if there is none */
+Session *session_open(const char *path);
+
+/* Flag the images added to list since the last call that were skipped in the last run */
+void session_match(Session *session, ImageList *list);
+
+/* Remember an image skipped in this run, call before setting IMAGE_SKIPPED */
+void session_skip(Session *session, const ImageList *list, int index);
+
+/* Replace the index with the images of list still skipped. Entries of the last run that were not
+ * matched are kept unless the scan was complete. Returns 0 on success */
+int session_save(Session *session, const ImageList *list, int complete);
+
+/* Unmap and free the session */
+void session_close(Session *session);
+
+#endif /* SESSION_H */
@@ -0,0 +1,64 @@
+#include "sniff.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+static int is_bmp(const unsigned char *data, size_t len)
+{
+    if (len < 18 || data[0] != 'B' || data[1] != 'M')
+        return 0;
+    /* "BM" alone is too weak, also require a known DIB header size */
+    unsigned int header = data[14] | data[15] << 8 | data[16] << 16 | (unsigned int)data[17] << 24;
+    return header == 12 || header == 40 || header == 52 || header == 56 || header == 64 || header == 108 ||
+           header == 124;
+}
+
+ImageFormat sniff_format(const unsigned char *data, size_t len)
+{
+    if (len >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+        return FORMAT_JPEG;
+    if (len >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0)
+        return FORMAT_PNG;
+    if (len >= 6 && (memcmp(data, "GIF87a", 6) == 0 || memcmp(data, "GIF89a", 6) == 0))
+        return FORMAT_GIF;
+    if (len >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0)
+        return FORMAT_WEBP;
+    if (len >= 4 && (memcmp(data, "II*\0", 4) == 0 || memcmp(data, "MM\0*", 4) == 0))
+        return FORMAT_TIFF;
+    if (is_bmp(data, len))
+        return FORMAT_BMP;
+    return FORMAT_UNKNOWN;
+}
+
+ImageFormat sniff_file(int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+        return FORMAT_UNKNOWN;
+
+    unsigned char data[SNIFF_SIZE];
+    ssize_t n = pread(fd, data, sizeof(data), 0);
+    close(fd);
+    return n > 0 ? sniff_format(data, (size_t)n) : FORMAT_UNKNOWN;
+}
+
+const char *format_type(ImageFormat format)
+{
+    switch (format) {
+        case FORMAT_JPEG:
+            return "JPG";
+        case FORMAT_PNG:
+            return "PNG";
+        case FORMAT_GIF:
+            return "GIF";
+        case FORMAT_BMP:
+            return "BMP";
+        case FORMAT_WEBP:
+            return "WEBP";
+        case FORMAT_TIFF:
+            return "TIF";
+        default:
+            return NULL;
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef SNIFF_H
+#define SNIFF_H
+
+#include "types.h"
+
+/* Bytes needed from the start of a file to classify it */
+#define SNIFF_SIZE 32
+
+/* Classify a file from its first bytes, FORMAT_UNKNOWN if it is not a supported image */
+ImageFormat sniff_format(const unsigned char *data, size_t len);
+
+/* Read the first bytes of the file name in dir_fd and classify it */
+ImageFormat sniff_file(int dir_fd, const char *name);
+
+/* SDL_image type string used to skip its format probing ("JPG", "PNG", ...) */
+const char *format_type(ImageFormat format);
+
+#endif /* SNIFF_H */
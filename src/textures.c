@@ -0,0 +1,163 @@
+#include "textures.h"
+
+#include "decode.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    SDL_Texture *texture; /* NULL for an unused entry */
+    int width;
+    int height;
+    int in_use;
+    Uint32 last_used; /* Release count when it was given back */
+} PooledTexture;
+
+struct TexturePool {
+    SDL_Renderer *renderer;
+    SDL_RendererInfo info;
+    Uint32 format;
+    PooledTexture entries[TEXTURE_POOL_SIZE];
+    Uint32 releases;
+};
+
+/* First 8-bit format with alpha the renderer lists (transparent PNGs and GIFs keep it), it comes first when
+ * it is the native one. ARGB8888 is accepted by every renderer otherwise */
+static Uint32 preferred_format(const SDL_RendererInfo *info)
+{
+    for (Uint32 i = 0; i < info->num_texture_formats; i++) {
+        Uint32 format = info->texture_formats[i];
+        if (IS_PIXELFORMAT_8888(format) && SDL_ISPIXELFORMAT_ALPHA(format))
+            return format;
+    }
+    return SDL_PIXELFORMAT_ARGB8888;
+}
+
+TexturePool *texture_pool_create(SDL_Renderer *renderer)
+{
+    TexturePool *pool = calloc(1, sizeof(TexturePool));
+    if (!pool)
+        return NULL;
+    pool->renderer = renderer;
+    if (SDL_GetRendererInfo(renderer, &pool->info) != 0)
+        memset(&pool->info, 0, sizeof(SDL_RendererInfo));
+    pool->format = preferred_format(&pool->info);
+    return pool;
+}
+
+void texture_pool_destroy(TexturePool *pool)
+{
+    if (!pool)
+        return;
+    for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+        if (pool->entries[i].texture)
+            SDL_DestroyTexture(pool->entries[i].texture);
+    }
+    free(pool);
+}
+
+Uint32 texture_pool_format(const TexturePool *pool)
+{
+    return pool->format;
+}
+
+/* A free texture of exactly width x height, made in place of the least recently used free one when there is
+ * none. NULL when every entry is in use or the texture cannot be made */
+static SDL_Texture *acquire(TexturePool *pool, int width, int height)
+{
+    PooledTexture *victim = NULL;
+    for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+        PooledTexture *entry = &pool->entries[i];
+        if (entry->in_use)
+            continue;
+        if (entry->texture && entry->width == width && entry->height == height) {
+            entry->in_use = 1;
+            return entry->texture;
+        }
+        if (!victim || !entry->texture || (victim->texture && entry->last_used < victim->last_used))
+            victim = entry;
+    }
+    if (!victim)
+        return NULL;
+
+    if (victim->texture)
+        SDL_DestroyTexture(victim->texture);
+    victim->texture = SDL_CreateTexture(pool->renderer, pool->format, SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (!victim->texture)
+        return NULL;
+    victim->width = width;
+    victim->height = height;
+    victim->in_use = 1;
+    return victim->texture;
+}
+
+int upload_image(TexturePool *pool, SDL_Surface *surface, SDL_Texture **texture, TilePyramid **tiles)
+{
+    /* Tiled above what the renderer can hold in one texture, or large enough that only the visible part
+     * should live in VRAM */
+    int max_width = pool->info.max_texture_width > 0 ? pool->info.max_texture_width : TILED_MIN_SIZE;
+    int max_height = pool->info.max_texture_height > 0 ? pool->info.max_texture_height : TILED_MIN_SIZE;
+    if (surface->w > SDL_min(max_width, TILED_MIN_SIZE) || surface->h > SDL_min(max_height, TILED_MIN_SIZE)) {
+        *tiles = tiles_create(surface);
+        *texture = NULL;
+        return *tiles ? 0 : -1;
+    }
+    *tiles = NULL;
+
+    /* Copied straight from the surface pixels, locking would add a copy into the staging buffer */
+    int pooled = surface->format->format == pool->format && surface->w * surface->h <= TEXTURE_POOL_MAX_PIXELS;
+    *texture = pooled ? acquire(pool, surface->w, surface->h) : NULL;
+    if (*texture && SDL_UpdateTexture(*texture, NULL, surface->pixels, surface->pitch) != 0) {
+        texture_release(pool, *texture);
+        *texture = NULL;
+    }
+    if (*texture) {
+        SDL_BlendMode blend;
+        SDL_GetSurfaceBlendMode(surface, &blend);
+        SDL_SetTextureBlendMode(*texture, blend);
+        return 0;
+    }
+    *texture = SDL_CreateTextureFromSurface(pool->renderer, surface);
+    return *texture ? 0 : -1;
+}
+
+void texture_release(TexturePool *pool, SDL_Texture *texture)
+{
+    if (!texture)
+        return;
+    PooledTexture *empty = NULL;
+    for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+        PooledTexture *entry = &pool->entries[i];
+        if (entry->texture == texture) {
+            entry->in_use = 0;
+            entry->last_used = ++pool->releases;
+            return;
+        }
+        if (!entry->texture && !empty)
+            empty = entry;
+    }
+
+    /* A streaming texture of the pool format (one detached earlier) fills an empty entry */
+    Uint32 format;
+    int access, width, height;
+    if (empty && SDL_QueryTexture(texture, &format, &access, &width, &height) == 0 && format == pool->format &&
+        access == SDL_TEXTUREACCESS_STREAMING && width * height <= TEXTURE_POOL_MAX_PIXELS) {
+        empty->texture = texture;
+        empty->width = width;
+        empty->height = height;
+        empty->in_use = 0;
+        empty->last_used = ++pool->releases;
+        return;
+    }
+    SDL_DestroyTexture(texture);
+}
+
+void texture_detach(TexturePool *pool, SDL_Texture *texture)
+{
+    for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+        if (pool->entries[i].texture == texture) {
+            memset(&pool->entries[i], 0, sizeof(PooledTexture));
+            return;
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef TEXTURES_H
+#define TEXTURES_H
+
+#include "tiles.h"
+
+#include <SDL2/SDL.h>
+
+/* Streaming textures kept for reuse: the shown image, the one replacing it and a few sizes seen recently */
+#define TEXTURE_POOL_SIZE 4
+
+/* Larger images (full resolution decodes) get a texture of their own instead of holding VRAM in the pool */
+#define TEXTURE_POOL_MAX_PIXELS (3840 * 2160)
+
+typedef struct TexturePool TexturePool;
+
+/* Pool of textures of renderer, in the 8-bit RGBA format it takes natively */
+TexturePool *texture_pool_create(SDL_Renderer *renderer);
+
+/* Destroy the pooled textures, before destroying the renderer */
+void texture_pool_destroy(TexturePool *pool);
+
+/* Format to decode images into so that uploading them is a plain copy */
+Uint32 texture_pool_format(const TexturePool *pool);
+
+/* Upload a decoded surface as one texture, or as a tile pyramid when it is too large for one. Exactly one of
+ * texture and tiles is set on success, returns 0 on success. A surface in the pool format is copied into a
+ * pooled texture of its size, any other is converted by SDL */
+int upload_image(TexturePool *pool, SDL_Surface *surface, SDL_Texture **texture, TilePyramid **tiles);
+
+/* Give back a texture from upload_image() for the next image of its size. NULL is ignored */
+void texture_release(TexturePool *pool, SDL_Texture *texture);
+
+/* Take a texture from upload_image() out of the pool while it is kept for longer (cached), the pool makes
+ * another one meanwhile. texture_release() brings it back into the pool if there is room */
+void texture_detach(TexturePool *pool, SDL_Texture *texture);
+
+#endif /* TEXTURES_H */
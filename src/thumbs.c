@@ -0,0 +1,527 @@
+#include "thumbs.h"
+
+#include "decode.h"
+#include "files.h"
+#include "wake.h"
+
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+/* jpeglib.h needs FILE and size_t declared first */
+#include <jpeglib.h>
+
+#define MAX_THUMB_THREADS 8
+
+#define THUMB_QUALITY 85
+
+#define PACK_MAGIC   "ISSTHMB1"
+#define PACK_VERSION 2
+
+/* Pack layout: a header, the JPEG encoded thumbnails back to back, then an index of records sorted by
+ * inode at index_offset. Thumbnails made in a later run are appended after the old index and followed
+ * by a new one, the old index becomes dead space until the pack is compacted */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t index_offset;
+    uint64_t dead_bytes; /* Old indexes and replaced thumbnails */
+} PackHeader;
+
+typedef struct {
+    uint64_t inode;
+    int64_t mtime_ns;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+} PackRecord;
+
+/* A record with its data, in the mapping or made in this run */
+typedef struct {
+    PackRecord record;
+    const unsigned char *data;
+    int fresh;
+} SaveRecord;
+
+/* Per image */
+#define THUMB_NONE   0
+#define THUMB_QUEUED 1
+#define THUMB_DONE   2
+
+typedef struct {
+    int index;
+    ImageFormat format;
+    char *path;
+} ThumbJob;
+
+typedef struct {
+    int index;
+    SDL_Surface *surface;
+} ThumbResult;
+
+typedef struct {
+    PackRecord record;
+    unsigned char *data;
+} FreshThumb;
+
+struct Thumbs {
+    char pack_path[MAX_PATH];
+    void *pack_map;
+    size_t pack_map_size;
+    const PackHeader *header; /* NULL without a valid pack */
+    const PackRecord *packed; /* Index of the pack, in the mapping */
+
+    SDL_Thread *threads[MAX_THUMB_THREADS];
+    int thread_count;
+    SDL_mutex *lock;
+    SDL_cond *work;
+    int quit;
+    uint8_t *state; /* THUMB_* of each image */
+    int state_capacity;
+    ThumbJob *jobs;
+    int job_count;
+    int job_capacity;
+    int next_job;
+    ThumbResult *results;
+    int result_count;
+    int result_capacity;
+    FreshThumb *fresh; /* Made in this run, added to the pack on exit */
+    int fresh_count;
+    int fresh_capacity;
+};
+
+/* Compress an RGB24 surface, the buffer is allocated with malloc. Returns 0 on success */
+static int encode_jpeg(SDL_Surface *surface, unsigned char **data, unsigned long *size)
+{
+    struct jpeg_compress_struct cinfo;
+    JpegError err;
+    *data = NULL;
+    *size = 0;
+
+    cinfo.err = quiet_jpeg_errors(&err);
+    if (setjmp(err.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(*data);
+        *data = NULL;
+        return -1;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, data, size);
+    cinfo.image_width = surface->w;
+    cinfo.image_height = surface->h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, THUMB_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW)surface->pixels + (size_t)cinfo.next_scanline * surface->pitch;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+}
+
+/* Decode path at about thumbnail size and scale it down to THUMB_SIZE, transparency over the background */
+static SDL_Surface *make_thumb(const char *path, ImageFormat format)
+{
+    DecodedImage image;
+    if (decode_image(path, NULL, format, THUMB_SIZE, THUMB_SIZE, 0, &image) != 0)
+        return NULL;
+
+    int width = image.surface->w;
+    int height = image.surface->h;
+    if (width > THUMB_SIZE || height > THUMB_SIZE) {
+        if (width >= height) {
+            height = SDL_max(1, height * THUMB_SIZE / width);
+            width = THUMB_SIZE;
+        } else {
+            width = SDL_max(1, width * THUMB_SIZE / height);
+            height = THUMB_SIZE;
+        }
+    }
+
+    SDL_Surface *thumb = SDL_CreateRGBSurfaceWithFormat(0, width, height, 24, SDL_PIXELFORMAT_RGB24);
+    if (thumb) {
+        SDL_FillRect(thumb, NULL, SDL_MapRGB(thumb->format, 30, 30, 30));
+        if (SDL_BlitScaled(image.surface, NULL, thumb, NULL) != 0) {
+            SDL_FreeSurface(thumb);
+            thumb = NULL;
+        }
+    }
+    SDL_FreeSurface(image.surface);
+    return thumb;
+}
+
+static const PackRecord *find_packed(const Thumbs *thumbs, uint64_t inode, int64_t mtime_ns)
+{
+    if (!thumbs->header)
+        return NULL;
+    uint32_t low = 0, high = thumbs->header->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (thumbs->packed[mid].inode < inode)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low >= thumbs->header->count)
+        return NULL;
+    const PackRecord *record = &thumbs->packed[low];
+    if (record->inode != inode || record->mtime_ns != mtime_ns || record->offset < sizeof(PackHeader) ||
+        record->offset + record->size > thumbs->header->index_offset)
+        return NULL;
+    return record;
+}
+
+static int thumb_thread(void *data)
+{
+    Thumbs *thumbs = data;
+
+    SDL_LockMutex(thumbs->lock);
+    for (;;) {
+        while (thumbs->next_job == thumbs->job_count && !thumbs->quit) {
+            SDL_CondWait(thumbs->work, thumbs->lock);
+        }
+        if (thumbs->quit)
+            break;
+        ThumbJob job = thumbs->jobs[thumbs->next_job++];
+        SDL_UnlockMutex(thumbs->lock);
+
+        struct stat st;
+        FreshThumb fresh = {{0, 0, 0, 0, 0}, NULL};
+        SDL_Surface *surface = NULL;
+        if (stat(job.path, &st) == 0) {
+            fresh.record.inode = (uint64_t)st.st_ino;
+#ifdef __APPLE__
+            fresh.record.mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+            fresh.record.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+            const PackRecord *packed = find_packed(thumbs, fresh.record.inode, fresh.record.mtime_ns);
+            DecodedImage image;
+            MappedFile blob = {NULL, 0};
+            if (packed) {
+                blob.data = (const unsigned char *)thumbs->pack_map + packed->offset;
+                blob.size = packed->size;
+            }
+            if (packed &&
+                decode_image(thumbs->pack_path, &blob, FORMAT_JPEG, 0, 0, 0, &image) == 0) {
+                surface = image.surface;
+            } else if ((surface = make_thumb(job.path, job.format)) != NULL) {
+                unsigned long size;
+                if (encode_jpeg(surface, &fresh.data, &size) == 0)
+                    fresh.record.size = (uint32_t)size;
+            }
+        }
+        free(job.path);
+
+        SDL_LockMutex(thumbs->lock);
+        if (array_grow((void **)&thumbs->results, &thumbs->result_capacity, thumbs->result_count + 1,
+                sizeof(ThumbResult)) == 0) {
+            thumbs->results[thumbs->result_count].index = job.index;
+            thumbs->results[thumbs->result_count++].surface = surface;
+            thumbs->state[job.index] = THUMB_DONE;
+            wake_main(WAKE_THUMBS);
+        } else {
+            SDL_FreeSurface(surface);
+            thumbs->state[job.index] = THUMB_NONE;
+        }
+        if (fresh.data && array_grow((void **)&thumbs->fresh, &thumbs->fresh_capacity, thumbs->fresh_count + 1,
+                              sizeof(FreshThumb)) == 0)
+            thumbs->fresh[thumbs->fresh_count++] = fresh;
+        else
+            free(fresh.data);
+    }
+    SDL_UnlockMutex(thumbs->lock);
+    return 0;
+}
+
+static void load_pack(Thumbs *thumbs)
+{
+    int fd = open(thumbs->pack_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(PackHeader)) {
+        thumbs->pack_map_size = (size_t)st.st_size;
+        thumbs->pack_map = mmap(NULL, thumbs->pack_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (thumbs->pack_map == MAP_FAILED)
+            thumbs->pack_map = NULL;
+    }
+    close(fd);
+    if (!thumbs->pack_map)
+        return;
+
+    const PackHeader *header = thumbs->pack_map;
+    if (memcmp(header->magic, PACK_MAGIC, 8) != 0 || header->version != PACK_VERSION ||
+        header->index_offset < sizeof(PackHeader) || header->index_offset > thumbs->pack_map_size ||
+        header->index_offset % 8 != 0 ||
+        header->count > (thumbs->pack_map_size - header->index_offset) / sizeof(PackRecord)) {
+        fprintf(stderr, "Warning: Ignoring invalid thumbnail cache '%s'\n", thumbs->pack_path);
+        return;
+    }
+    thumbs->header = header;
+    thumbs->packed = (const PackRecord *)((const char *)thumbs->pack_map + header->index_offset);
+}
+
+static int write_at(int fd, const void *data, size_t size, uint64_t offset)
+{
+    const char *bytes = data;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, (off_t)offset);
+        if (written <= 0)
+            return -1;
+        bytes += written;
+        size -= (size_t)written;
+        offset += (uint64_t)written;
+    }
+    return 0;
+}
+
+/* Write the data of records from offset on (only the fresh ones when appending), then the index and
+ * the header. Returns 0 on success */
+static int write_pack(int fd, SaveRecord *records, uint32_t count, uint64_t offset, int append,
+    uint64_t dead_bytes)
+{
+    PackRecord *index = malloc(sizeof(PackRecord) * (count ? count : 1));
+    if (!index)
+        return -1;
+    int ok = 1;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        if (!append || records[i].fresh) {
+            ok = write_at(fd, records[i].data, records[i].record.size, offset) == 0;
+            records[i].record.offset = offset;
+            offset += records[i].record.size;
+        }
+        index[i] = records[i].record;
+    }
+    /* The index is read in place from the mapping */
+    offset = (offset + 7) & ~(uint64_t)7;
+    ok = ok && write_at(fd, index, sizeof(PackRecord) * count, offset) == 0;
+    free(index);
+
+    /* The header goes last: until it is written the old one still points at a complete index */
+    PackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, 8);
+    header.version = PACK_VERSION;
+    header.count = count;
+    header.index_offset = offset;
+    header.dead_bytes = dead_bytes;
+    ok = ok && fsync(fd) == 0 && write_at(fd, &header, sizeof(header), 0) == 0 && fsync(fd) == 0;
+    return ok ? 0 : -1;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const SaveRecord *sa = a;
+    const SaveRecord *sb = b;
+    if (sa->record.inode != sb->record.inode)
+        return sa->record.inode < sb->record.inode ? -1 : 1;
+    /* Made in this run first, duplicates are dropped after sorting */
+    return sb->fresh - sa->fresh;
+}
+
+/* Append the fresh thumbnails to the pack, or rewrite it without dead space once that is more than half */
+static void save_pack(Thumbs *thumbs)
+{
+    if (thumbs->fresh_count == 0)
+        return;
+
+    uint32_t packed_count = thumbs->header ? thumbs->header->count : 0;
+    size_t total = (size_t)packed_count + thumbs->fresh_count;
+    SaveRecord *records = malloc(sizeof(SaveRecord) * total);
+    if (!records)
+        return;
+    size_t n = 0;
+    for (uint32_t i = 0; i < packed_count; i++) {
+        const PackRecord *record = &thumbs->packed[i];
+        if (record->offset >= sizeof(PackHeader) &&
+            record->offset + record->size <= thumbs->header->index_offset) {
+            records[n].record = *record;
+            records[n].data = (const unsigned char *)thumbs->pack_map + record->offset;
+            records[n++].fresh = 0;
+        }
+    }
+    for (int i = 0; i < thumbs->fresh_count; i++) {
+        records[n].record = thumbs->fresh[i].record;
+        records[n].data = thumbs->fresh[i].data;
+        records[n++].fresh = 1;
+    }
+    qsort(records, n, sizeof(SaveRecord), compare_records);
+
+    /* One record per inode: a thumbnail made in this run replaces the one of the old content */
+    uint64_t live_bytes = 0;
+    uint64_t dead_bytes = 0;
+    uint32_t count = 0;
+    if (thumbs->header)
+        dead_bytes = thumbs->header->dead_bytes + (uint64_t)packed_count * sizeof(PackRecord);
+    for (size_t i = 0; i < n; i++) {
+        if (count > 0 && records[count - 1].record.inode == records[i].record.inode) {
+            if (!records[i].fresh)
+                dead_bytes += records[i].record.size;
+            continue;
+        }
+        live_bytes += records[i].record.size;
+        records[count++] = records[i];
+    }
+
+    int written = 0;
+    if (thumbs->header && dead_bytes <= live_bytes) {
+        int fd = open(thumbs->pack_path, O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            struct stat st;
+            written =
+                fstat(fd, &st) == 0 && write_pack(fd, records, count, (uint64_t)st.st_size, 1, dead_bytes) == 0;
+            close(fd);
+        }
+    } else {
+        char tmp_path[MAX_PATH + 8];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", thumbs->pack_path);
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            written = write_pack(fd, records, count, sizeof(PackHeader), 0, 0) == 0;
+            written = close(fd) == 0 && written && rename(tmp_path, thumbs->pack_path) == 0;
+            if (!written)
+                unlink(tmp_path);
+        }
+    }
+    if (!written)
+        fprintf(stderr, "Warning: Cannot write thumbnail cache '%s'\n", thumbs->pack_path);
+    free(records);
+}
+
+Thumbs *thumbs_create(const char *dir)
+{
+    Thumbs *thumbs = calloc(1, sizeof(Thumbs));
+    if (!thumbs)
+        return NULL;
+    snprintf(thumbs->pack_path, MAX_PATH, "%s/%s", dir, THUMBS_CACHE_NAME);
+    load_pack(thumbs);
+
+    thumbs->lock = SDL_CreateMutex();
+    thumbs->work = SDL_CreateCond();
+    if (!thumbs->lock || !thumbs->work) {
+        thumbs_destroy(thumbs);
+        return NULL;
+    }
+
+    int threads = SDL_GetCPUCount();
+    if (threads > MAX_THUMB_THREADS)
+        threads = MAX_THUMB_THREADS;
+    if (threads < 1)
+        threads = 1;
+    for (int i = 0; i < threads; i++) {
+        thumbs->threads[thumbs->thread_count] = SDL_CreateThread(thumb_thread, "thumbs", thumbs);
+        if (thumbs->threads[thumbs->thread_count])
+            thumbs->thread_count++;
+    }
+    if (thumbs->thread_count == 0) {
+        fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+        thumbs_destroy(thumbs);
+        return NULL;
+    }
+    return thumbs;
+}
+
+void thumbs_want(Thumbs *thumbs, const ImageList *list, int first, int last)
+{
+    if (last >= list->count)
+        last = list->count - 1;
+
+    SDL_LockMutex(thumbs->lock);
+    for (int i = thumbs->next_job; i < thumbs->job_count; i++) {
+        thumbs->state[thumbs->jobs[i].index] = THUMB_NONE;
+        free(thumbs->jobs[i].path);
+    }
+    thumbs->next_job = 0;
+    thumbs->job_count = 0;
+
+    int old_capacity = thumbs->state_capacity;
+    if (array_grow((void **)&thumbs->state, &thumbs->state_capacity, list->count, sizeof(uint8_t)) == 0)
+        memset(thumbs->state + old_capacity, THUMB_NONE, thumbs->state_capacity - old_capacity);
+    if (last >= first && thumbs->state_capacity >= list->count &&
+        array_grow((void **)&thumbs->jobs, &thumbs->job_capacity, last - first + 1, sizeof(ThumbJob)) == 0) {
+        for (int index = first; index <= last; index++) {
+            /* Moved images are not in the source directory anymore */
+            if (thumbs->state[index] != THUMB_NONE || (list->flags[index] & IMAGE_MOVED))
+                continue;
+            char path[MAX_PATH];
+            ThumbJob *job = &thumbs->jobs[thumbs->job_count];
+            job->index = index;
+            job->format = image_format(list, index);
+            job->path = image_path(list, index, path) ? strdup(path) : NULL;
+            if (job->path) {
+                thumbs->state[index] = THUMB_QUEUED;
+                thumbs->job_count++;
+            }
+        }
+        SDL_CondBroadcast(thumbs->work);
+    }
+    SDL_UnlockMutex(thumbs->lock);
+}
+
+int thumbs_poll(Thumbs *thumbs, int *index, SDL_Surface **surface)
+{
+    SDL_LockMutex(thumbs->lock);
+    int found = thumbs->result_count > 0;
+    if (found) {
+        ThumbResult result = thumbs->results[--thumbs->result_count];
+        *index = result.index;
+        *surface = result.surface;
+    }
+    SDL_UnlockMutex(thumbs->lock);
+    return found;
+}
+
+void thumbs_release(Thumbs *thumbs, int index)
+{
+    SDL_LockMutex(thumbs->lock);
+    if (index < thumbs->state_capacity && thumbs->state[index] == THUMB_DONE)
+        thumbs->state[index] = THUMB_NONE;
+    SDL_UnlockMutex(thumbs->lock);
+}
+
+void thumbs_destroy(Thumbs *thumbs)
+{
+    if (!thumbs)
+        return;
+
+    if (thumbs->lock) {
+        SDL_LockMutex(thumbs->lock);
+        thumbs->quit = 1;
+        SDL_CondBroadcast(thumbs->work);
+        SDL_UnlockMutex(thumbs->lock);
+    }
+    for (int i = 0; i < thumbs->thread_count; i++) {
+        SDL_WaitThread(thumbs->threads[i], NULL);
+    }
+    save_pack(thumbs);
+
+    for (int i = thumbs->next_job; i < thumbs->job_count; i++) {
+        free(thumbs->jobs[i].path);
+    }
+    for (int i = 0; i < thumbs->result_count; i++) {
+        SDL_FreeSurface(thumbs->results[i].surface);
+    }
+    for (int i = 0; i < thumbs->fresh_count; i++) {
+        free(thumbs->fresh[i].data);
+    }
+    if (thumbs->pack_map)
+        munmap(thumbs->pack_map, thumbs->pack_map_size);
+    SDL_DestroyCond(thumbs->work);
+    SDL_DestroyMutex(thumbs->lock);
+    free(thumbs->state);
+    free(thumbs->jobs);
+    free(thumbs->results);
+    free(thumbs->fresh);
+    free(thumbs);
+}
@@ -0,0 +1,32 @@
+#ifndef THUMBS_H
+#define THUMBS_H
+
+#include "types.h"
+
+#include <SDL2/SDL.h>
+
+#define THUMBS_CACHE_NAME ".image_swipe_sorter.thumbs"
+
+/* Longest side of a thumbnail in pixels */
+#define THUMB_SIZE 128
+
+typedef struct Thumbs Thumbs;
+
+/* Start the thumbnail threads, reading the thumbnails cached in dir by earlier runs */
+Thumbs *thumbs_create(const char *dir);
+
+/* Make the images from first to last the ones to produce, in that order. Requests for other images
+ * that were not started yet are dropped */
+void thumbs_want(Thumbs *thumbs, const ImageList *list, int first, int last);
+
+/* Take a finished thumbnail. Returns 1 with index and a surface owned by the caller (NULL when the image
+ * cannot be read), 0 when none is ready */
+int thumbs_poll(Thumbs *thumbs, int *index, SDL_Surface **surface);
+
+/* Forget the thumbnail of index was delivered, so it can be wanted again */
+void thumbs_release(Thumbs *thumbs, int index);
+
+/* Stop the threads and add the thumbnails made in this run to the cache */
+void thumbs_destroy(Thumbs *thumbs);
+
+#endif /* THUMBS_H */
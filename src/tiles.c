@@ -0,0 +1,290 @@
+#include "tiles.h"
+
+#include "decode.h"
+#include "wake.h"
+
+#include <stdlib.h>
+
+/* Resident tile textures across all levels, 1 MB each at TILE_SIZE 512 */
+#define TILE_BUDGET 160
+
+typedef struct {
+    SDL_Surface *surface; /* Set by the builder thread, NULL until the level is first needed and built */
+    int columns;
+    int rows;
+    SDL_Texture **textures;
+    Uint32 *last_used; /* Frame number a tile was last drawn in */
+} TileLevel;
+
+struct TilePyramid {
+    TileLevel levels[TILE_MAX_LEVEL];
+    int level_count;
+    int resident; /* Uploaded tile textures */
+    Uint32 frame;
+
+    /* Mip levels are box-downsampled on a thread of their own, a gigapixel base takes seconds */
+    SDL_Thread *builder;
+    SDL_mutex *lock;
+    SDL_cond *wanted;
+    unsigned requested; /* Bit per level asked for and not built yet */
+    unsigned ready;     /* Bit per level whose surface is set */
+    unsigned failed;    /* Out of memory, not asked again */
+    int stop;
+    SDL_atomic_t built; /* A level was built since tiles_poll() */
+};
+
+static int init_level(TileLevel *level, int width, int height)
+{
+    level->columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+    level->rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+    level->textures = calloc((size_t)level->columns * level->rows, sizeof(SDL_Texture *));
+    level->last_used = calloc((size_t)level->columns * level->rows, sizeof(Uint32));
+    return level->textures && level->last_used ? 0 : -1;
+}
+
+/* Build the finest level asked for first, from the finest level built below it, so that coarser ones asked
+ * for with it read the new level instead of the base */
+static int build_levels(void *data)
+{
+    TilePyramid *pyramid = data;
+    SDL_LockMutex(pyramid->lock);
+    while (!pyramid->stop) {
+        if (!pyramid->requested) {
+            SDL_CondWait(pyramid->wanted, pyramid->lock);
+            continue;
+        }
+        int l = 0;
+        while (!(pyramid->requested & (1u << l)))
+            l++;
+        int from = l - 1;
+        while (!(pyramid->ready & (1u << from)))
+            from--;
+        SDL_Surface *source = pyramid->levels[from].surface;
+        SDL_UnlockMutex(pyramid->lock);
+
+        SDL_Surface *surface = box_downsample(source, 1 << (l - from));
+
+        SDL_LockMutex(pyramid->lock);
+        pyramid->requested &= ~(1u << l);
+        if (surface) {
+            pyramid->levels[l].surface = surface;
+            pyramid->ready |= 1u << l;
+        } else {
+            pyramid->failed |= 1u << l;
+        }
+        SDL_AtomicSet(&pyramid->built, 1);
+        wake_main(WAKE_TILES);
+    }
+    SDL_UnlockMutex(pyramid->lock);
+    return 0;
+}
+
+TilePyramid *tiles_create(SDL_Surface *surface)
+{
+    TilePyramid *pyramid = calloc(1, sizeof(TilePyramid));
+    if (!pyramid)
+        return NULL;
+
+    SDL_Surface *base;
+    if (IS_PIXELFORMAT_8888(surface->format->format)) {
+        base = surface;
+        base->refcount++;
+    } else {
+        base = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+        if (!base) {
+            free(pyramid);
+            return NULL;
+        }
+    }
+
+    /* Halve until the whole level fits in a single tile */
+    int width = base->w;
+    int height = base->h;
+    while (pyramid->level_count < TILE_MAX_LEVEL) {
+        if (init_level(&pyramid->levels[pyramid->level_count], width, height) != 0) {
+            pyramid->level_count++;
+            tiles_destroy(pyramid);
+            SDL_FreeSurface(base);
+            return NULL;
+        }
+        pyramid->level_count++;
+        if ((width <= TILE_SIZE && height <= TILE_SIZE) || width < 2 || height < 2)
+            break;
+        width /= 2;
+        height /= 2;
+    }
+    pyramid->levels[0].surface = base;
+    pyramid->ready = 1;
+
+    pyramid->lock = SDL_CreateMutex();
+    pyramid->wanted = SDL_CreateCond();
+    if (pyramid->lock && pyramid->wanted)
+        pyramid->builder = SDL_CreateThread(build_levels, "tiles", pyramid);
+    if (!pyramid->builder) {
+        tiles_destroy(pyramid);
+        return NULL;
+    }
+    return pyramid;
+}
+
+void tiles_destroy(TilePyramid *pyramid)
+{
+    if (!pyramid)
+        return;
+    if (pyramid->builder) {
+        /* A level being built finishes first */
+        SDL_LockMutex(pyramid->lock);
+        pyramid->stop = 1;
+        SDL_CondSignal(pyramid->wanted);
+        SDL_UnlockMutex(pyramid->lock);
+        SDL_WaitThread(pyramid->builder, NULL);
+    }
+    if (pyramid->wanted)
+        SDL_DestroyCond(pyramid->wanted);
+    if (pyramid->lock)
+        SDL_DestroyMutex(pyramid->lock);
+    for (int l = 0; l < pyramid->level_count; l++) {
+        TileLevel *level = &pyramid->levels[l];
+        for (int i = 0; level->textures && i < level->columns * level->rows; i++) {
+            if (level->textures[i])
+                SDL_DestroyTexture(level->textures[i]);
+        }
+        SDL_FreeSurface(level->surface);
+        free(level->textures);
+        free(level->last_used);
+    }
+    free(pyramid);
+}
+
+int tiles_poll(TilePyramid *pyramid)
+{
+    return SDL_AtomicSet(&pyramid->built, 0);
+}
+
+/* Drop the least recently drawn tile that is not part of the current frame */
+static void evict_tile(TilePyramid *pyramid)
+{
+    SDL_Texture **oldest = NULL;
+    Uint32 oldest_frame = pyramid->frame;
+    for (int l = 0; l < pyramid->level_count; l++) {
+        TileLevel *level = &pyramid->levels[l];
+        for (int i = 0; i < level->columns * level->rows; i++) {
+            if (level->textures[i] && level->last_used[i] < oldest_frame) {
+                oldest = &level->textures[i];
+                oldest_frame = level->last_used[i];
+            }
+        }
+    }
+    if (oldest) {
+        SDL_DestroyTexture(*oldest);
+        *oldest = NULL;
+        pyramid->resident--;
+    }
+}
+
+static SDL_Texture *tile_texture(TilePyramid *pyramid, SDL_Renderer *renderer, int l, int column, int row)
+{
+    TileLevel *level = &pyramid->levels[l];
+    int i = row * level->columns + column;
+    level->last_used[i] = pyramid->frame;
+    if (level->textures[i])
+        return level->textures[i];
+
+    SDL_Surface *surface = level->surface;
+    if (pyramid->resident >= TILE_BUDGET)
+        evict_tile(pyramid);
+
+    int x = column * TILE_SIZE;
+    int y = row * TILE_SIZE;
+    int width = SDL_min(TILE_SIZE, surface->w - x);
+    int height = SDL_min(TILE_SIZE, surface->h - y);
+    SDL_Texture *texture =
+        SDL_CreateTexture(renderer, surface->format->format, SDL_TEXTUREACCESS_STATIC, width, height);
+    if (!texture)
+        return NULL;
+    const Uint8 *pixels = (const Uint8 *)surface->pixels + (size_t)y * surface->pitch + (size_t)x * 4;
+    SDL_UpdateTexture(texture, NULL, pixels, surface->pitch);
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+
+    level->textures[i] = texture;
+    pyramid->resident++;
+    return texture;
+}
+
+/* Tiles of level l intersecting the viewport, as the first and last column and row */
+static int visible_tiles(const TilePyramid *pyramid, int l, float scale, const SDL_Rect *dest,
+    const SDL_Rect *viewport, int range[4])
+{
+    const TileLevel *level = &pyramid->levels[l];
+    float tile_screen = TILE_SIZE * (float)(1 << l) * scale;
+    range[0] = SDL_max(0, (int)((viewport->x - dest->x) / tile_screen));
+    range[1] = SDL_max(0, (int)((viewport->y - dest->y) / tile_screen));
+    range[2] = SDL_min(level->columns - 1, (int)((viewport->x + viewport->w - dest->x) / tile_screen));
+    range[3] = SDL_min(level->rows - 1, (int)((viewport->y + viewport->h - dest->y) / tile_screen));
+    return SDL_max(0, range[2] - range[0] + 1) * SDL_max(0, range[3] - range[1] + 1);
+}
+
+void tiles_render(TilePyramid *pyramid, SDL_Renderer *renderer, const SDL_Rect *dest, const SDL_Rect *viewport)
+{
+    pyramid->frame++;
+
+    /* Finest level not denser than the screen: screen pixels per level-0 pixel */
+    const SDL_Surface *base = pyramid->levels[0].surface;
+    float scale = (float)dest->w / base->w;
+    int l = 0;
+    while (l + 1 < pyramid->level_count && scale * (1 << (l + 1)) <= 1.0f) {
+        l++;
+    }
+
+    /* Ask for a missing level, with the coarsest one to stand in for any level later on */
+    SDL_LockMutex(pyramid->lock);
+    unsigned ready = pyramid->ready;
+    if (!(ready & (1u << l))) {
+        unsigned missing = ~(ready | pyramid->failed);
+        pyramid->requested |= missing & ((1u << l) | (1u << (pyramid->level_count - 1)));
+        if (pyramid->requested)
+            SDL_CondSignal(pyramid->wanted);
+    }
+    SDL_UnlockMutex(pyramid->lock);
+
+    /* Until it is built, the nearest coarser level is drawn scaled up, or a finer one if its tiles stay within
+     * the budget. Level 0 of a gigapixel image would have thousands */
+    int range[4];
+    if (!(ready & (1u << l))) {
+        int wanted = l;
+        while (l < pyramid->level_count && !(ready & (1u << l))) {
+            l++;
+        }
+        if (l == pyramid->level_count) {
+            l = wanted;
+            while (!(ready & (1u << l))) {
+                l--;
+            }
+            if (visible_tiles(pyramid, l, scale, dest, viewport, range) > TILE_BUDGET / 2)
+                return;
+        }
+    }
+    visible_tiles(pyramid, l, scale, dest, viewport, range);
+    int first_column = range[0], first_row = range[1], last_column = range[2], last_row = range[3];
+
+    /* Screen size of one tile at this level, tiles are placed from exact fractional edges
+     * so that neighbours meet without gaps */
+    float tile_screen = TILE_SIZE * (float)(1 << l) * scale;
+
+    for (int row = first_row; row <= last_row; row++) {
+        for (int column = first_column; column <= last_column; column++) {
+            SDL_Texture *texture = tile_texture(pyramid, renderer, l, column, row);
+            if (!texture)
+                continue;
+            int width, height;
+            SDL_QueryTexture(texture, NULL, NULL, &width, &height);
+
+            int x0 = dest->x + (int)(column * tile_screen);
+            int y0 = dest->y + (int)(row * tile_screen);
+            int x1 = dest->x + (int)(column * tile_screen + width * (1 << l) * scale);
+            int y1 = dest->y + (int)(row * tile_screen + height * (1 << l) * scale);
+            SDL_Rect rect = {x0, y0, x1 - x0, y1 - y0};
+            SDL_RenderCopy(renderer, texture, NULL, &rect);
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <SDL2/SDL.h>
+
+#define TILE_SIZE      512
+#define TILE_MAX_LEVEL 12
+
+/* Images with a side above this are drawn from tiles instead of a single texture */
+#define TILED_MIN_SIZE 4096
+
+typedef struct TilePyramid TilePyramid;
+
+/* Build a tile pyramid over surface. The surface is referenced, not copied, when it is IS_PIXELFORMAT_8888 */
+TilePyramid *tiles_create(SDL_Surface *surface);
+
+/* Free tile textures, mip levels and the surface reference */
+void tiles_destroy(TilePyramid *pyramid);
+
+/* Draw the tiles intersecting the viewport, dest is where the whole image is placed.
+ * Picks the mip level from the on-screen scale and uploads missing tiles on demand. A level not built yet is
+ * asked of the builder thread and the nearest one built is drawn meanwhile */
+void tiles_render(TilePyramid *pyramid, SDL_Renderer *renderer, const SDL_Rect *dest, const SDL_Rect *viewport);
+
+/* Whether a level was built since the last call, the next tiles_render() draws it. Wakes with WAKE_TILES */
+int tiles_poll(TilePyramid *pyramid);
+
+#endif /* TILES_H */
@@ -0,0 +1,129 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Spans looked at for the percentiles, the newest ones of the ring */
+#define STATS_WINDOW 4096
+
+typedef struct {
+    SDL_atomic_t sequence; /* Ticket + 1 once the span is written, 0 while it is */
+    Uint32 kind;
+    Uint32 thread;
+    Sint32 arg;
+    Uint64 start;
+    Uint64 ticks;
+} Span;
+
+/* Lock-free ring: a writer takes a ticket with one atomic add and owns its slot until it publishes the
+ * sequence. Readers skip slots whose sequence is not the ticket they expect (being written or lapped) */
+static Span ring[TRACE_CAPACITY];
+static SDL_atomic_t next_ticket;
+
+static const char *names[TRACE_COUNT] = {"swipe", "decode", "upload", "move", "render"};
+
+Uint64 trace_begin(void)
+{
+    return SDL_GetPerformanceCounter();
+}
+
+void trace_end(TraceKind kind, Uint64 start, int arg)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    int ticket = SDL_AtomicAdd(&next_ticket, 1);
+    Span *span = &ring[(unsigned)ticket % TRACE_CAPACITY];
+    SDL_AtomicSet(&span->sequence, 0);
+    span->kind = kind;
+    span->thread = (Uint32)SDL_ThreadID();
+    span->arg = arg;
+    span->start = start;
+    span->ticks = now - start;
+    SDL_AtomicSet(&span->sequence, ticket + 1);
+}
+
+const char *trace_name(TraceKind kind)
+{
+    return kind < TRACE_COUNT ? names[kind] : "?";
+}
+
+/* Copy of the span of ticket, 0 when it is being written or was overwritten */
+static int read_span(int ticket, Span *out)
+{
+    const Span *span = &ring[(unsigned)ticket % TRACE_CAPACITY];
+    if (SDL_AtomicGet((SDL_atomic_t *)&span->sequence) != ticket + 1)
+        return 0;
+    out->kind = span->kind;
+    out->thread = span->thread;
+    out->arg = span->arg;
+    out->start = span->start;
+    out->ticks = span->ticks;
+    return SDL_AtomicGet((SDL_atomic_t *)&span->sequence) == ticket + 1;
+}
+
+static int compare_ticks(const void *a, const void *b)
+{
+    Uint64 x = *(const Uint64 *)a;
+    Uint64 y = *(const Uint64 *)b;
+    return (x > y) - (x < y);
+}
+
+int trace_percentiles(TraceKind kind, double *p50, double *p99)
+{
+    static Uint64 samples[STATS_WINDOW];
+    int count = 0;
+    int last = SDL_AtomicGet(&next_ticket);
+    for (int ticket = last - 1; ticket >= 0 && ticket >= last - STATS_WINDOW; ticket--) {
+        Span span;
+        if (read_span(ticket, &span) && span.kind == (Uint32)kind)
+            samples[count++] = span.ticks;
+    }
+    *p50 = 0.0;
+    *p99 = 0.0;
+    if (count == 0)
+        return 0;
+
+    qsort(samples, count, sizeof(Uint64), compare_ticks);
+    double ms = 1000.0 / (double)SDL_GetPerformanceFrequency();
+    *p50 = samples[(count - 1) * 50 / 100] * ms;
+    *p99 = samples[(count - 1) * 99 / 100] * ms;
+    return count;
+}
+
+int trace_write(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot write trace '%s'\n", path);
+        return -1;
+    }
+
+    /* Timestamps in microseconds from the first span kept */
+    double us = 1000000.0 / (double)SDL_GetPerformanceFrequency();
+    int last = SDL_AtomicGet(&next_ticket);
+    int first = last > TRACE_CAPACITY ? last - TRACE_CAPACITY : 0;
+    Uint64 origin = 0;
+    int written = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int ticket = first; ticket < last; ticket++) {
+        Span span;
+        if (!read_span(ticket, &span))
+            continue;
+        if (written == 0)
+            origin = span.start;
+        /* Spans of other threads may have started a little before the first one kept */
+        double start = span.start >= origin ? (span.start - origin) * us : -((origin - span.start) * us);
+        fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,", written ? ",\n" : "",
+            trace_name((TraceKind)span.kind), span.thread);
+        fprintf(f, "\"ts\":%.1f,\"dur\":%.1f,\"args\":{\"index\":%d}}", start, span.ticks * us, span.arg);
+        written++;
+    }
+    fprintf(f, "\n]}\n");
+    int result = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0)
+        result = -1;
+    if (result == 0)
+        printf("Wrote %d trace spans to %s\n", written, path);
+    else
+        fprintf(stderr, "Error: Cannot write trace '%s'\n", path);
+    return result;
+}
@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <SDL2/SDL.h>
+
+/* Timed stages of the hot path */
+typedef enum {
+    TRACE_SWIPE = 0, /* Sorting or skipping key to the next image on screen */
+    TRACE_DECODE,    /* decode_image() on a loader thread */
+    TRACE_UPLOAD,    /* Surface to texture (or tiles) */
+    TRACE_MOVE,      /* One file move on a move thread */
+    TRACE_RENDER,    /* Drawing and presenting a frame */
+    TRACE_COUNT,
+} TraceKind;
+
+/* Spans kept for the trace file, older ones are overwritten */
+#define TRACE_CAPACITY (1 << 16)
+
+/* Start of a span, from the monotonic performance counter */
+Uint64 trace_begin(void);
+
+/* Record a span of kind from start to now, from any thread. arg is shown in the trace (an image index) */
+void trace_end(TraceKind kind, Uint64 start, int arg);
+
+/* Percentiles in milliseconds of the recent spans of kind, from the main thread. Returns how many spans
+ * they are from */
+int trace_percentiles(TraceKind kind, double *p50, double *p99);
+
+/* Name of kind in the HUD and the trace file */
+const char *trace_name(TraceKind kind);
+
+/* Write the recorded spans as Chrome trace JSON (chrome://tracing, Perfetto). Returns 0 on success */
+int trace_write(const char *path);
+
+#endif /* TRACE_H */
@@ -1,19 +1,80 @@
 #ifndef TYPES_H
 #define TYPES_H
 
-#define MAX_IMAGES 10000
-#define MAX_PATH   4096
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
+#define MAX_PATH 4096
+
+/* Detected from file content, not from the extension */
+typedef enum {
+    FORMAT_UNKNOWN = 0,
+    FORMAT_JPEG,
+    FORMAT_PNG,
+    FORMAT_GIF,
+    FORMAT_BMP,
+    FORMAT_WEBP,
+    FORMAT_TIFF,
+} ImageFormat;
+
+/* Where a sorted image went, number key dest + 1 sorts to it. The arrows sort to the first two */
+typedef enum {
+    DEST_LEFT = 0,
+    DEST_RIGHT,
+} Destination;
+
+/* Number keys 1 to 9 */
+#define MAX_DESTS 9
+
+/* Directory identity, to leave destinations inside the source directory alone */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} DirId;
+
+/* Longest destination label shown on screen */
+#define MAX_DEST_LABEL 16
+
+/* Sorting state of an image in the list */
+#define IMAGE_MOVED    0x01 /* In a destination directory */
+#define IMAGE_SKIPPED  0x02 /* Skipped, offered again in the second pass */
+#define IMAGE_SELECTED 0x04 /* Picked in the grid for the next batch move */
+#define IMAGE_GONE     0x08 /* Deleted or moved away by another program (--watch) */
+
+/* Image names live in one growable arena; the directory prefix is stored once */
 typedef struct {
-    char **paths;
+    char dir[MAX_PATH];
+    char *names;       /* NUL-terminated names relative to dir, back to back */
+    size_t names_size; /* Bytes used in names */
+    size_t names_capacity;
+    uint32_t *offsets; /* Start of each name in names */
+    uint8_t *formats;  /* ImageFormat of each image */
+    uint8_t *flags;    /* IMAGE_* state of each image */
     int count;
+    int capacity;
     int current;
+    int gone; /* Images flagged IMAGE_GONE, still counted in count */
 } ImageList;
 
 typedef struct {
     char source_dir[MAX_PATH];
-    char left_dir[MAX_PATH];
-    char right_dir[MAX_PATH];
+    char dest_dirs[MAX_DESTS][MAX_PATH];
+    char dest_labels[MAX_DESTS][MAX_DEST_LABEL];
+    int dest_count; /* Destinations 0 to dest_count - 1 are set */
+    int prefetch;  /* Images decoded ahead of the current one */
+    int cache_mb;  /* Decoded images kept for coming back to them, 0 for none */
+    int recursive; /* Also scan subdirectories of source_dir */
+    int watch;     /* Follow images added to and removed from source_dir while sorting */
+    int use_mmap;  /* Decode from mmapped files instead of stdio */
+    int keep_history; /* Save the undo history in source_dir across runs */
+    int resume;       /* Also remember skipped images for the next run */
+    int dedupe;       /* Max Hamming distance between near-duplicates, -1 without --dedupe */
+    char sort[16];              /* --sort key, '-' first for descending, empty for the scan order */
+    char filter[MAX_PATH];      /* --filter conditions joined by commas, empty for none */
+    char apply_path[MAX_PATH];  /* Decisions file to apply without a window, empty for the interactive mode */
+    char record_path[MAX_PATH]; /* Decisions file the interactive mode appends to, empty for none */
+    char trace_path[MAX_PATH];  /* Chrome trace JSON written on exit, empty for none */
 } Config;
 
 #endif /* TYPES_H */
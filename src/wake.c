@@ -0,0 +1,38 @@
+#include "wake.h"
+
+static SDL_atomic_t event_type;
+static SDL_atomic_t pending[WAKE_COUNT];
+
+int wake_init(void)
+{
+    Uint32 type = SDL_RegisterEvents(1);
+    if (type == (Uint32)-1)
+        return -1;
+    SDL_AtomicSet(&event_type, (int)type);
+    return 0;
+}
+
+Uint32 wake_event_type(void)
+{
+    return (Uint32)SDL_AtomicGet(&event_type);
+}
+
+void wake_main(WakeReason reason)
+{
+    Uint32 type = wake_event_type();
+    if (type == 0 || !SDL_AtomicCAS(&pending[reason], 0, 1))
+        return;
+
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = type;
+    event.user.code = (Sint32)reason;
+    if (SDL_PushEvent(&event) != 1)
+        SDL_AtomicSet(&pending[reason], 0);
+}
+
+void wake_ack(const SDL_Event *event)
+{
+    if (event->user.code >= 0 && event->user.code < WAKE_COUNT)
+        SDL_AtomicSet(&pending[event->user.code], 0);
+}
@@ -0,0 +1,32 @@
+#ifndef WAKE_H
+#define WAKE_H
+
+#include <SDL2/SDL.h>
+
+/* Why a background thread woke the main loop, the code of the SDL user event */
+typedef enum {
+    WAKE_DECODED = 0, /* A decode finished */
+    WAKE_SCANNED,     /* The scanner found images or finished */
+    WAKE_MOVED,       /* A file move finished */
+    WAKE_HASHED,      /* Near-duplicate hashes are ready to be clustered */
+    WAKE_THUMBS,      /* Thumbnails are ready for the grid */
+    WAKE_FRAME,       /* An animation frame is decoded, or the animation stopped */
+    WAKE_WATCHED,     /* Images were added to or removed from the source directory */
+    WAKE_ANALYZED,    /* The exposure and sharpness analysis of an image is done */
+    WAKE_TILES,       /* A mip level of a tiled image is built */
+    WAKE_COUNT,
+} WakeReason;
+
+/* Register the wake event, after SDL_Init. Earlier wakes are dropped */
+int wake_init(void);
+
+/* Type of the wake event, 0 before wake_init() */
+Uint32 wake_event_type(void);
+
+/* Wake the main loop from any thread. A reason is posted once until the main loop takes it */
+void wake_main(WakeReason reason);
+
+/* Take a wake event, before looking at what the background threads produced */
+void wake_ack(const SDL_Event *event);
+
+#endif /* WAKE_H */
@@ -0,0 +1,468 @@
+#include "watch.h"
+
+#include "files.h"
+#include "meta.h"
+#include "sniff.h"
+#include "wake.h"
+
+#include <SDL2/SDL.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+    #include <errno.h>
+    #include <poll.h>
+    #include <sys/inotify.h>
+#endif
+
+#define WATCH_POLL_MS    200 /* Longest wait before the thread notices it should stop */
+#define WATCH_READ_SIZE  (64 * 1024)
+#define WATCH_TABLE_SIZE 4096 /* Initial slots of the name table, a power of two */
+
+/* Records are a ChangeType byte, an ImageFormat byte and a NUL-terminated name relative to the root */
+typedef enum {
+    CHANGE_ADDED = 1, /* Written or moved in */
+    CHANGE_GONE,      /* Deleted or moved away */
+    CHANGE_GONE_DIR,  /* A subdirectory moved away, with every image below it */
+} ChangeType;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} ChangeBuffer;
+
+struct Watcher {
+    char root[MAX_PATH];
+    int root_fd;
+    int fd; /* inotify instance */
+    int recursive;
+    DirId excluded[MAX_DESTS];
+    int excluded_count;
+    MetaQuery filter; /* --filter, without the --sort */
+    char **dirs; /* Directory of each watch descriptor relative to the root, NULL when unused. Watch thread only */
+    int dir_capacity;
+    SDL_Thread *thread;
+    SDL_atomic_t quit;
+    SDL_mutex *lock; /* Protects changes */
+    ChangeBuffer changes;
+    /* Main thread: images of the list by name, to tell a new image from one the list already has */
+    int *table; /* Index + 1, 0 for an empty slot */
+    int table_size;
+    int indexed; /* Images of the list in table */
+};
+
+#ifdef __linux__
+static int change_append(ChangeBuffer *buf, ChangeType type, ImageFormat format, const char *name)
+{
+    size_t len = strlen(name);
+    size_t needed = buf->size + 2 + len + 1;
+    if (needed > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 4096;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *data = realloc(buf->data, capacity);
+        if (!data)
+            return -1;
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    char *out = buf->data + buf->size;
+    out[0] = (char)type;
+    out[1] = (char)format;
+    memcpy(out + 2, name, len + 1);
+    buf->size = needed;
+    return 0;
+}
+
+/* Hand a batch over to the main thread */
+static void publish(Watcher *watcher, ChangeBuffer *batch)
+{
+    if (batch->size == 0)
+        return;
+
+    SDL_LockMutex(watcher->lock);
+    ChangeBuffer *changes = &watcher->changes;
+    if (changes->size == 0) {
+        ChangeBuffer empty = *changes;
+        *changes = *batch;
+        *batch = empty;
+    } else {
+        if (changes->size + batch->size > changes->capacity) {
+            size_t capacity = (changes->size + batch->size) * 2;
+            char *data = realloc(changes->data, capacity);
+            if (data) {
+                changes->data = data;
+                changes->capacity = capacity;
+            }
+        }
+        if (changes->size + batch->size <= changes->capacity) {
+            memcpy(changes->data + changes->size, batch->data, batch->size);
+            changes->size += batch->size;
+        } else {
+            fprintf(stderr, "Warning: Out of memory, missed changes in '%s'\n", watcher->root);
+        }
+    }
+    SDL_UnlockMutex(watcher->lock);
+    batch->size = 0;
+    wake_main(WAKE_WATCHED);
+}
+
+/* Returns -1 if the joined name does not fit in MAX_PATH */
+static int join_name(const char *rel, const char *name, char *out)
+{
+    int length = rel[0] ? snprintf(out, MAX_PATH, "%s/%s", rel, name) : snprintf(out, MAX_PATH, "%s", name);
+    return length < MAX_PATH ? 0 : -1;
+}
+
+/* Files are reported once written and closed or renamed into place, IN_CREATE only matters for directories */
+    #define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE)
+
+/* Watch the directory rel (open as dir_fd) and remember its name for the events of the watch */
+static int add_watch(Watcher *watcher, const char *rel, int dir_fd)
+{
+    struct stat st;
+    if (fstat(dir_fd, &st) != 0 || dir_id_match(watcher->excluded, watcher->excluded_count, &st))
+        return -1;
+
+    char path[MAX_PATH];
+    if (join_name(rel[0] ? watcher->root : "", rel[0] ? rel : watcher->root, path) != 0)
+        return -1;
+    int wd = inotify_add_watch(watcher->fd, path, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK);
+    if (wd < 0) {
+        if (errno == ENOSPC)
+            fprintf(stderr, "Warning: Not watching '%s', raise fs.inotify.max_user_watches\n", path);
+        return -1;
+    }
+
+    if (wd >= watcher->dir_capacity) {
+        int capacity = watcher->dir_capacity ? watcher->dir_capacity : 64;
+        while (capacity <= wd) {
+            capacity *= 2;
+        }
+        char **dirs = realloc(watcher->dirs, sizeof(char *) * capacity);
+        if (!dirs) {
+            inotify_rm_watch(watcher->fd, wd);
+            return -1;
+        }
+        memset(dirs + watcher->dir_capacity, 0, sizeof(char *) * (capacity - watcher->dir_capacity));
+        watcher->dirs = dirs;
+        watcher->dir_capacity = capacity;
+    }
+    free(watcher->dirs[wd]);
+    watcher->dirs[wd] = strdup(rel);
+    return 0;
+}
+
+/* Watch rel and, with recursive, every directory below it. With report, the images already in them are
+ * reported: a new directory may have been filled before its watch was in place */
+static void watch_tree(Watcher *watcher, const char *rel, int report, ChangeBuffer *batch)
+{
+    int dir_fd = rel[0] ? openat(watcher->root_fd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+                        : dup(watcher->root_fd);
+    if (dir_fd < 0)
+        return;
+    if ((rel[0] && add_watch(watcher, rel, dir_fd) != 0) || (!watcher->recursive && !report)) {
+        close(dir_fd);
+        return;
+    }
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return;
+    }
+
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        char sub[MAX_PATH];
+        if (join_name(rel, entry->d_name, sub) != 0)
+            continue;
+        if (type == DT_DIR) {
+            if (watcher->recursive)
+                watch_tree(watcher, sub, report, batch);
+        } else if (report) {
+            ImageFormat format = sniff_file(dir_fd, entry->d_name);
+            if (format != FORMAT_UNKNOWN)
+                change_append(batch, CHANGE_ADDED, format, sub);
+        }
+    }
+    closedir(dir);
+}
+
+/* Stop watching rel and the directories below it, their watches would report under the old name */
+static void unwatch_tree(Watcher *watcher, const char *rel)
+{
+    size_t len = strlen(rel);
+    for (int wd = 0; wd < watcher->dir_capacity; wd++) {
+        const char *dir = watcher->dirs[wd];
+        if (dir && strncmp(dir, rel, len) == 0 && (dir[len] == '\0' || dir[len] == '/'))
+            inotify_rm_watch(watcher->fd, wd);
+    }
+}
+
+static void handle_event(Watcher *watcher, const struct inotify_event *event, ChangeBuffer *batch)
+{
+    if (event->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "Warning: Too many changes at once in '%s', some images were missed\n", watcher->root);
+        return;
+    }
+    if (event->wd < 0 || event->wd >= watcher->dir_capacity || !watcher->dirs[event->wd])
+        return;
+    if (event->mask & IN_IGNORED) {
+        /* Watch removed, by us or because the directory is gone */
+        free(watcher->dirs[event->wd]);
+        watcher->dirs[event->wd] = NULL;
+        return;
+    }
+    if (event->len == 0 || event->name[0] == '.')
+        return;
+
+    char name[MAX_PATH];
+    if (join_name(watcher->dirs[event->wd], event->name, name) != 0)
+        return;
+    if (event->mask & IN_ISDIR) {
+        if (!watcher->recursive)
+            return;
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            watch_tree(watcher, name, 1, batch);
+        } else if (event->mask & IN_MOVED_FROM) {
+            unwatch_tree(watcher, name);
+            change_append(batch, CHANGE_GONE_DIR, FORMAT_UNKNOWN, name);
+        }
+    } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        ImageFormat format = sniff_file(watcher->root_fd, name);
+        if (format != FORMAT_UNKNOWN)
+            change_append(batch, CHANGE_ADDED, format, name);
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        change_append(batch, CHANGE_GONE, FORMAT_UNKNOWN, name);
+    }
+}
+
+static int watch_thread(void *data)
+{
+    Watcher *watcher = data;
+    ChangeBuffer batch = {0};
+    char *buf = malloc(WATCH_READ_SIZE);
+    if (!buf)
+        return 0;
+
+    /* The root is watched already, its subdirectories are watched here so a deep tree does not delay the start */
+    if (watcher->recursive)
+        watch_tree(watcher, "", 0, &batch);
+
+    while (!SDL_AtomicGet(&watcher->quit)) {
+        struct pollfd pfd = {watcher->fd, POLLIN, 0};
+        if (poll(&pfd, 1, WATCH_POLL_MS) <= 0)
+            continue;
+        ssize_t n = read(watcher->fd, buf, WATCH_READ_SIZE);
+        for (ssize_t pos = 0; pos < n;) {
+            const struct inotify_event *event = (const struct inotify_event *)(buf + pos);
+            pos += (ssize_t)(sizeof(struct inotify_event) + event->len);
+            handle_event(watcher, event, &batch);
+        }
+        publish(watcher, &batch);
+    }
+    free(batch.data);
+    free(buf);
+    return 0;
+}
+
+Watcher *watcher_start(const Config *config)
+{
+    Watcher *watcher = calloc(1, sizeof(Watcher));
+    if (!watcher)
+        return NULL;
+    watcher->root_fd = -1;
+    watcher->fd = -1;
+    snprintf(watcher->root, MAX_PATH, "%s", config->source_dir);
+    watcher->recursive = config->recursive;
+    watcher->excluded_count = dest_dir_ids(config, watcher->excluded);
+    if (meta_query_parse("", config->filter, &watcher->filter) != 0) {
+        watcher_destroy(watcher);
+        return NULL;
+    }
+
+    watcher->root_fd = open(watcher->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->root_fd < 0 || watcher->fd < 0 || add_watch(watcher, "", watcher->root_fd) != 0) {
+        fprintf(stderr, "Error: Cannot watch '%s'\n", watcher->root);
+        watcher_destroy(watcher);
+        return NULL;
+    }
+    watcher->lock = SDL_CreateMutex();
+    watcher->thread = SDL_CreateThread(watch_thread, "watcher", watcher);
+    if (!watcher->lock || !watcher->thread) {
+        fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+        watcher_destroy(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+#else
+Watcher *watcher_start(const Config *config)
+{
+    fprintf(stderr, "Error: Cannot watch '%s', --watch needs inotify (Linux)\n", config->source_dir);
+    return NULL;
+}
+#endif
+
+/* FNV-1a */
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    }
+    return hash;
+}
+
+static void table_insert(Watcher *watcher, const ImageList *list, int index)
+{
+    int mask = watcher->table_size - 1;
+    int slot = (int)(name_hash(image_name(list, index)) & (uint32_t)mask);
+    while (watcher->table[slot]) {
+        slot = (slot + 1) & mask;
+    }
+    watcher->table[slot] = index + 1;
+}
+
+/* Add the images appended to the list since the last call, at most half of the slots are used */
+static int index_list(Watcher *watcher, const ImageList *list)
+{
+    if (list->count * 2 > watcher->table_size) {
+        int size = watcher->table_size ? watcher->table_size : WATCH_TABLE_SIZE;
+        while (list->count * 2 > size) {
+            size *= 2;
+        }
+        int *table = calloc((size_t)size, sizeof(int));
+        if (!table)
+            return -1;
+        free(watcher->table);
+        watcher->table = table;
+        watcher->table_size = size;
+        watcher->indexed = 0;
+    }
+    for (; watcher->indexed < list->count; watcher->indexed++) {
+        table_insert(watcher, list, watcher->indexed);
+    }
+    return 0;
+}
+
+static int find_image(const Watcher *watcher, const ImageList *list, const char *name)
+{
+    int mask = watcher->table_size - 1;
+    for (int slot = (int)(name_hash(name) & (uint32_t)mask); watcher->table[slot]; slot = (slot + 1) & mask) {
+        int index = watcher->table[slot] - 1;
+        if (strcmp(image_name(list, index), name) == 0)
+            return index;
+    }
+    return -1;
+}
+
+/* Flag index as gone unless it is in a destination or its file is still there (back from an undo). A path too
+ * long to check is left alone */
+static int mark_gone(ImageList *list, int index)
+{
+    char path[MAX_PATH];
+    struct stat st;
+    if ((list->flags[index] & (IMAGE_MOVED | IMAGE_GONE)) || !image_path(list, index, path) ||
+        lstat(path, &st) == 0)
+        return 0;
+    image_set_gone(list, index, 1);
+    return 1;
+}
+
+int watcher_poll(Watcher *watcher, ImageList *list)
+{
+    SDL_LockMutex(watcher->lock);
+    ChangeBuffer changes = watcher->changes;
+    memset(&watcher->changes, 0, sizeof(ChangeBuffer));
+    SDL_UnlockMutex(watcher->lock);
+    if (changes.size == 0)
+        return 0;
+
+    int first = list->count;
+    int result = 0;
+    for (size_t pos = 0; pos < changes.size && result >= 0;) {
+        ChangeType type = (ChangeType)changes.data[pos];
+        ImageFormat format = (ImageFormat)changes.data[pos + 1];
+        const char *name = changes.data + pos + 2;
+        size_t len = strlen(name);
+        pos += len + 3;
+        if (index_list(watcher, list) != 0) {
+            result = -1;
+            break;
+        }
+
+        int index = type == CHANGE_GONE_DIR ? -1 : find_image(watcher, list, name);
+        if (type == CHANGE_ADDED && index < 0) {
+            if (image_list_add(list, name, len, format) != 0)
+                result = -1;
+            else
+                result++;
+        } else if (type == CHANGE_ADDED && (list->flags[index] & IMAGE_GONE)) {
+            /* Written again under the same name */
+            list->formats[index] = (uint8_t)format;
+            image_set_gone(list, index, 0);
+            result++;
+        } else if (type == CHANGE_GONE && index >= 0) {
+            result += mark_gone(list, index);
+        } else if (type == CHANGE_GONE_DIR) {
+            for (int i = 0; i < list->count; i++) {
+                const char *image = image_name(list, i);
+                if (strncmp(image, name, len) == 0 && image[len] == '/')
+                    result += mark_gone(list, i);
+            }
+        }
+    }
+    free(changes.data);
+
+    /* New images go through --filter as the listed ones did, they stay at the end unsorted */
+    if (result > 0 && watcher->filter.condition_count > 0 && list->count > first) {
+        int kept = meta_apply(&watcher->filter, list, first);
+        if (kept < 0) {
+            result = -1;
+        } else if (first + kept < watcher->indexed) {
+            /* The table has the dropped images, index the list again */
+            memset(watcher->table, 0, sizeof(int) * (size_t)watcher->table_size);
+            watcher->indexed = 0;
+        }
+    }
+    return result;
+}
+
+void watcher_destroy(Watcher *watcher)
+{
+    if (!watcher)
+        return;
+    SDL_AtomicSet(&watcher->quit, 1);
+    if (watcher->thread)
+        SDL_WaitThread(watcher->thread, NULL);
+    for (int i = 0; i < watcher->dir_capacity; i++) {
+        free(watcher->dirs[i]);
+    }
+    free(watcher->dirs);
+    free(watcher->changes.data);
+    free(watcher->table);
+    if (watcher->lock)
+        SDL_DestroyMutex(watcher->lock);
+    if (watcher->fd >= 0)
+        close(watcher->fd);
+    if (watcher->root_fd >= 0)
+        close(watcher->root_fd);
+    free(watcher);
+}
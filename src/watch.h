@@ -0,0 +1,22 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "types.h"
+
+typedef struct Watcher Watcher;
+
+/* Follow config->source_dir (and its subdirectories with --recursive, destinations excluded) with inotify on a
+ * thread of its own: images written or moved in by other programs, and images removed. Start it before the
+ * scanner so nothing written during the scan is missed. NULL where inotify is not available */
+Watcher *watcher_start(const Config *config);
+
+/* Apply the changes seen since the last call to list: new images are appended, removed ones are flagged
+ * IMAGE_GONE so indices, the current image and the undo history stay valid. Images the list already has (found
+ * by the scanner too, or brought back by an undo) are not added twice. New images --filter rejects are dropped
+ * again. Returns the number of images added, flagged or back, -1 on allocation failure */
+int watcher_poll(Watcher *watcher, ImageList *list);
+
+/* Stop watching and free the watcher */
+void watcher_destroy(Watcher *watcher);
+
+#endif /* WATCH_H */